@@ -0,0 +1,981 @@
+#include "VnaArchive.h"
+
+//----------------------------------------
+// Varints and bit streams
+//----------------------------------------
+
+/**
+ * Bytes of a payload being written, which stops writing (and remembers
+ * that it did) rather than run past the end
+ */
+struct byte_writer {
+    uint8_t *out;
+    size_t size;
+    size_t pos;
+    bool overflow;
+};
+
+/**
+ * Bytes of a payload being read, which reads zeros (and remembers that it
+ * did) rather than run past the end
+ */
+struct byte_reader {
+    const uint8_t *in;
+    size_t size;
+    size_t pos;
+    bool truncated;
+};
+
+static void put_byte(struct byte_writer *w, uint8_t value) {
+    if (w->pos < w->size)
+        w->out[w->pos++] = value;
+    else
+        w->overflow = true;
+}
+
+static void put_varint(struct byte_writer *w, uint64_t value) {
+    while (value >= 0x80) {
+        put_byte(w, (value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    put_byte(w, value);
+}
+
+static uint8_t get_byte(struct byte_reader *r) {
+    if (r->pos < r->size)
+        return r->in[r->pos++];
+    r->truncated = true;
+    return 0;
+}
+
+static uint64_t get_varint(struct byte_reader *r) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = get_byte(r);
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+    r->truncated = true;
+    return 0;
+}
+
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/**
+ * Bits are packed most significant first, through a 64 bit accumulator
+ * holding fewer than 8 bits between calls
+ */
+struct bit_writer {
+    struct byte_writer *bytes;
+    uint64_t acc;
+    int bits;
+};
+
+struct bit_reader {
+    struct byte_reader *bytes;
+    uint64_t acc;
+    int bits;
+};
+
+static void put_bits(struct bit_writer *w, uint32_t value, int n) {
+    w->acc = (w->acc << n) | (value & (((uint64_t)1 << n) - 1));
+    w->bits += n;
+    while (w->bits >= 8) {
+        w->bits -= 8;
+        put_byte(w->bytes, w->acc >> w->bits);
+    }
+}
+
+static void flush_bits(struct bit_writer *w) {
+    if (w->bits > 0)
+        put_byte(w->bytes, w->acc << (8 - w->bits));
+    w->bits = 0;
+}
+
+static uint32_t get_bits(struct bit_reader *r, int n) {
+    while (r->bits < n) {
+        r->acc = (r->acc << 8) | get_byte(r->bytes);
+        r->bits += 8;
+    }
+    r->bits -= n;
+    return (r->acc >> r->bits) & (((uint64_t)1 << n) - 1);
+}
+
+/**
+ * Leading and trailing zero counts of the last XOR written with its own
+ * window, which following XORs reuse while their bits fit inside
+ */
+struct xor_window {
+    int lead;
+    int trail;
+    bool valid;
+};
+
+static void put_xor(struct bit_writer *w, struct xor_window *win, uint32_t x) {
+    if (!x) {
+        put_bits(w, 0, 1);
+        return;
+    }
+    int lead = __builtin_clz(x);
+    int trail = __builtin_ctz(x);
+    if (win->valid && lead >= win->lead && trail >= win->trail) {
+        put_bits(w, 2, 2);
+        put_bits(w, x >> win->trail, 32 - win->lead - win->trail);
+        return;
+    }
+    int len = 32 - lead - trail;
+    put_bits(w, 3, 2);
+    put_bits(w, lead, 5);
+    put_bits(w, len - 1, 5);
+    put_bits(w, x >> trail, len);
+    win->lead = lead;
+    win->trail = trail;
+    win->valid = true;
+}
+
+static uint32_t get_xor(struct bit_reader *r, struct xor_window *win) {
+    if (!get_bits(r, 1))
+        return 0;
+    if (!get_bits(r, 1)) {
+        if (!win->valid) {
+            r->bytes->truncated = true;
+            return 0;
+        }
+        return get_bits(r, 32 - win->lead - win->trail) << win->trail;
+    }
+    int lead = get_bits(r, 5);
+    int len = get_bits(r, 5) + 1;
+    if (lead + len > 32) {
+        r->bytes->truncated = true;
+        return 0;
+    }
+    win->lead = lead;
+    win->trail = 32 - lead - len;
+    win->valid = true;
+    return get_bits(r, len) << win->trail;
+}
+
+//----------------------------------------
+// Codec
+//----------------------------------------
+
+/**
+ * The float bits of a point's readings, in the order they're encoded
+ */
+static void point_bits(const struct nanovna_raw_datapoint *p, uint32_t bits[4]) {
+    memcpy(&bits[0], &p->s11.re, sizeof(uint32_t));
+    memcpy(&bits[1], &p->s11.im, sizeof(uint32_t));
+    memcpy(&bits[2], &p->s21.re, sizeof(uint32_t));
+    memcpy(&bits[3], &p->s21.im, sizeof(uint32_t));
+}
+
+static void set_point_bits(struct nanovna_raw_datapoint *p, const uint32_t bits[4]) {
+    memcpy(&p->s11.re, &bits[0], sizeof(uint32_t));
+    memcpy(&p->s11.im, &bits[1], sizeof(uint32_t));
+    memcpy(&p->s21.re, &bits[2], sizeof(uint32_t));
+    memcpy(&p->s21.im, &bits[3], sizeof(uint32_t));
+}
+
+void init_archive_codec(struct archive_codec *codec) {
+    memset(codec, 0, sizeof(*codec));
+}
+
+void destroy_archive_codec(struct archive_codec *codec) {
+    for (int v = 0; v < MAXIMUM_VNA_PORTS; v++) {
+        for (int i = 0; i < codec->nbr_refs[v]; i++)
+            free(codec->refs[v][i]);
+        free(codec->refs[v]);
+        free(codec->ref_pps[v]);
+        free(codec->ref_sweep[v]);
+    }
+    init_archive_codec(codec);
+}
+
+/**
+ * Finds the reference of a block, if there is one with the same number of
+ * points
+ *
+ * @return the 4 * pps float bits, or NULL
+ */
+static const uint32_t* find_ref(const struct archive_codec *codec, int vna_id, int scan_index, int pps) {
+    if (scan_index >= codec->nbr_refs[vna_id] || codec->ref_pps[vna_id][scan_index] != pps)
+        return NULL;
+    return codec->refs[vna_id][scan_index];
+}
+
+/**
+ * Makes room for a block's reference, growing the tables as needed
+ *
+ * @return space for 4 * pps float bits, or NULL on failed allocation
+ */
+static uint32_t* make_ref(struct archive_codec *codec, int vna_id, int scan_index, int pps, int sweep) {
+    if (scan_index >= codec->nbr_refs[vna_id]) {
+        int n = codec->nbr_refs[vna_id] ? codec->nbr_refs[vna_id] : 4;
+        while (n <= scan_index)
+            n *= 2;
+        uint32_t **refs = realloc(codec->refs[vna_id], n * sizeof(*refs));
+        if (refs)
+            codec->refs[vna_id] = refs;
+        int *ref_pps = realloc(codec->ref_pps[vna_id], n * sizeof(*ref_pps));
+        if (ref_pps)
+            codec->ref_pps[vna_id] = ref_pps;
+        int *ref_sweep = realloc(codec->ref_sweep[vna_id], n * sizeof(*ref_sweep));
+        if (ref_sweep)
+            codec->ref_sweep[vna_id] = ref_sweep;
+        if (!refs || !ref_pps || !ref_sweep)
+            return NULL;
+        for (int i = codec->nbr_refs[vna_id]; i < n; i++) {
+            refs[i] = NULL;
+            ref_pps[i] = 0;
+            ref_sweep[i] = 0;
+        }
+        codec->nbr_refs[vna_id] = n;
+    }
+    if (codec->ref_pps[vna_id][scan_index] != pps) {
+        uint32_t *ref = realloc(codec->refs[vna_id][scan_index], (size_t)pps * 4 * sizeof(uint32_t));
+        if (!ref)
+            return NULL;
+        codec->refs[vna_id][scan_index] = ref;
+        codec->ref_pps[vna_id][scan_index] = pps;
+    }
+    codec->ref_sweep[vna_id][scan_index] = sweep;
+    return codec->refs[vna_id][scan_index];
+}
+
+size_t archive_scan_bound(int pps) {
+    // 10 varints of at most 10 bytes, at most 5 bytes of residual and
+    // 4 * 44 bits of readings per point
+    return 128 + (size_t)pps * 27;
+}
+
+ssize_t encode_archive_scan(struct archive_codec *codec, const struct datapoint_nanoVNA_H *data, uint64_t start_ns, uint8_t *out, size_t size) {
+    if (data->vna_id < 0 || data->vna_id >= MAXIMUM_VNA_PORTS || data->scan_index < 0
+            || data->sweep < 0 || data->pps < 1 || data->send_ns < start_ns)
+        return -1;
+    int pps = data->pps;
+    const struct nanovna_raw_datapoint *p = data->point;
+
+    const uint32_t *ref = find_ref(codec, data->vna_id, data->scan_index, pps);
+    uint8_t flags = 0;
+    if (!ref || data->sweep / ARCHIVE_KEY_SWEEPS != codec->ref_sweep[data->vna_id][data->scan_index] / ARCHIVE_KEY_SWEEPS)
+        flags |= ARCHIVE_FLAG_KEY;
+    int64_t step = pps > 1 ? (int64_t)p[1].frequency - p[0].frequency : 0;
+    for (int i = 0; i < pps; i++) {
+        if (p[i].frequency != (uint32_t)(p[0].frequency + step * i)) {
+            flags |= ARCHIVE_FLAG_FREQS;
+            break;
+        }
+    }
+
+    struct byte_writer w = {out, size, 0, false};
+    put_byte(&w, flags);
+    put_varint(&w, data->vna_id);
+    put_varint(&w, data->scan_id);
+    put_varint(&w, data->sweep);
+    put_varint(&w, data->scan_index);
+    put_varint(&w, pps);
+    put_varint(&w, data->send_ns - start_ns);
+    put_varint(&w, data->header_ns ? data->header_ns - data->send_ns + 1 : 0);
+    put_varint(&w, data->receive_ns - data->send_ns);
+    put_varint(&w, llround(data->sweep_ns_per_point * 1000.0));
+    put_varint(&w, p[0].frequency);
+    put_varint(&w, zigzag(step));
+    if (flags & ARCHIVE_FLAG_FREQS)
+        for (int i = 0; i < pps; i++)
+            put_varint(&w, zigzag((int64_t)p[i].frequency - (p[0].frequency + step * i)));
+
+    struct bit_writer bits = {&w, 0, 0};
+    for (int c = 0; c < 4; c++) {
+        struct xor_window win = {0, 0, false};
+        uint32_t prev = 0;
+        for (int i = 0; i < pps; i++) {
+            uint32_t v[4];
+            point_bits(&p[i], v);
+            uint32_t against = (flags & ARCHIVE_FLAG_KEY) ? prev : ref[4 * i + c];
+            put_xor(&bits, &win, v[c] ^ against);
+            prev = v[c];
+        }
+    }
+    flush_bits(&bits);
+    if (w.overflow)
+        return -1;
+
+    uint32_t *next = make_ref(codec, data->vna_id, data->scan_index, pps, data->sweep);
+    if (!next) {
+        fprintf(stderr, "Failed to allocate memory for archive reference\n");
+        return -1;
+    }
+    for (int i = 0; i < pps; i++)
+        point_bits(&p[i], &next[4 * i]);
+    return w.pos;
+}
+
+/**
+ * The fields at the start of a scan payload, which say where it belongs
+ */
+struct block_info {
+    uint8_t flags;
+    int vna_id;
+    int scan_id;
+    int sweep;
+    int scan_index;
+    uint64_t pps;
+    uint64_t time_ns;       // send_ns since the start
+};
+
+/**
+ * Reads the fields at the start of a scan payload
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if they're truncated or out of range
+ */
+static int get_block_info(struct byte_reader *r, struct block_info *info) {
+    info->flags = get_byte(r);
+    uint64_t vna_id = get_varint(r);
+    uint64_t scan_id = get_varint(r);
+    uint64_t sweep = get_varint(r);
+    uint64_t scan_index = get_varint(r);
+    info->pps = get_varint(r);
+    info->time_ns = get_varint(r);
+    if (r->truncated || vna_id >= MAXIMUM_VNA_PORTS || scan_id > INT32_MAX || sweep > INT32_MAX
+            || scan_index > INT32_MAX || info->pps < 1)
+        return EXIT_FAILURE;
+    info->vna_id = vna_id;
+    info->scan_id = scan_id;
+    info->sweep = sweep;
+    info->scan_index = scan_index;
+    return EXIT_SUCCESS;
+}
+
+int decode_archive_scan(struct archive_codec *codec, const uint8_t *in, size_t length, uint64_t start_ns, struct datapoint_nanoVNA_H *data) {
+    struct byte_reader r = {in, length, 0, false};
+    struct block_info info;
+    data->point = NULL;
+    data->pps = 0;
+    if (get_block_info(&r, &info) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    uint8_t flags = info.flags;
+    int vna_id = info.vna_id;
+    int scan_index = info.scan_index;
+    uint64_t pps = info.pps;
+    data->scan_id = info.scan_id;
+    data->sweep = info.sweep;
+    data->send_ns = start_ns + info.time_ns;
+    uint64_t header = get_varint(&r);
+    data->header_ns = header ? data->send_ns + header - 1 : 0;
+    data->receive_ns = data->send_ns + get_varint(&r);
+    data->sweep_ns_per_point = get_varint(&r) / 1000.0;
+    uint32_t f0 = get_varint(&r);
+    int64_t step = unzigzag(get_varint(&r));
+    // every point takes at least 4 bits, which bounds pps for a valid payload
+    if (r.truncated || pps > 2 * (length - r.pos))
+        return EXIT_FAILURE;
+    data->vna_id = vna_id;
+    data->scan_index = scan_index;
+
+    const uint32_t *ref = NULL;
+    if (!(flags & ARCHIVE_FLAG_KEY)) {
+        ref = find_ref(codec, vna_id, scan_index, pps);
+        if (!ref)
+            return EXIT_FAILURE;
+    }
+    struct nanovna_raw_datapoint *p = malloc(pps * sizeof(struct nanovna_raw_datapoint));
+    if (!p) {
+        fprintf(stderr, "Failed to allocate memory for %" PRIu64 " archived points\n", pps);
+        return EXIT_FAILURE;
+    }
+    for (uint64_t i = 0; i < pps; i++) {
+        int64_t residual = (flags & ARCHIVE_FLAG_FREQS) ? unzigzag(get_varint(&r)) : 0;
+        p[i].frequency = f0 + step * (int64_t)i + residual;
+    }
+
+    struct bit_reader bits = {&r, 0, 0};
+    uint32_t *v = malloc(pps * 4 * sizeof(uint32_t));
+    if (!v) {
+        free(p);
+        return EXIT_FAILURE;
+    }
+    for (int c = 0; c < 4; c++) {
+        struct xor_window win = {0, 0, false};
+        uint32_t prev = 0;
+        for (uint64_t i = 0; i < pps; i++) {
+            uint32_t against = ref ? ref[4 * i + c] : prev;
+            v[4 * i + c] = get_xor(&bits, &win) ^ against;
+            prev = v[4 * i + c];
+        }
+    }
+    uint32_t *next = r.truncated ? NULL : make_ref(codec, vna_id, scan_index, pps, data->sweep);
+    if (!next) {
+        free(v);
+        free(p);
+        return EXIT_FAILURE;
+    }
+    for (uint64_t i = 0; i < pps; i++)
+        set_point_bits(&p[i], &v[4 * i]);
+    memcpy(next, v, pps * 4 * sizeof(uint32_t));
+    free(v);
+    data->pps = pps;
+    data->point = p;
+    return EXIT_SUCCESS;
+}
+
+//----------------------------------------
+// Archive files
+//----------------------------------------
+
+static uint8_t* put_u16(uint8_t *out, uint16_t value) {
+    out[0] = value & 0xff;
+    out[1] = value >> 8;
+    return out + 2;
+}
+
+static uint8_t* put_u32(uint8_t *out, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        out[i] = (value >> (8 * i)) & 0xff;
+    return out + 4;
+}
+
+static uint8_t* put_u64(uint8_t *out, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        out[i] = (value >> (8 * i)) & 0xff;
+    return out + 8;
+}
+
+static uint64_t get_le(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= (uint64_t)in[i] << (8 * i);
+    return value;
+}
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Makes sure a buffer can hold at least size bytes
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on failed allocation (the buffer
+ *         is left as it was)
+ */
+static int reserve_block(uint8_t **block, size_t *block_size, size_t size) {
+    if (size <= *block_size)
+        return EXIT_SUCCESS;
+    uint8_t *grown = realloc(*block, size);
+    if (!grown) {
+        fprintf(stderr, "Failed to allocate %zu bytes for archive block\n", size);
+        return EXIT_FAILURE;
+    }
+    *block = grown;
+    *block_size = size;
+    return EXIT_SUCCESS;
+}
+
+//----------------------------------------
+// Index
+//----------------------------------------
+
+static void init_index(struct archive_index *index) {
+    index->entries = NULL;
+    index->nbr_entries = 0;
+    index->size = 0;
+    for (int v = 0; v < MAXIMUM_VNA_PORTS; v++)
+        index->last[v] = -1;
+}
+
+static void destroy_index(struct archive_index *index) {
+    free(index->entries);
+    init_index(index);
+}
+
+/**
+ * Adds an entry for a block if it starts a new sweep of its VNA
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on failed allocation
+ */
+static int index_block(struct archive_index *index, const struct block_info *info, uint64_t offset) {
+    long last = index->last[info->vna_id];
+    if (last >= 0 && index->entries[last].sweep == info->sweep)
+        return EXIT_SUCCESS;
+    if (index->nbr_entries == index->size) {
+        long size = index->size ? index->size * 2 : 256;
+        struct archive_index_entry *entries = realloc(index->entries, size * sizeof(*entries));
+        if (!entries) {
+            fprintf(stderr, "Failed to allocate memory for archive index\n");
+            return EXIT_FAILURE;
+        }
+        index->entries = entries;
+        index->size = size;
+    }
+    index->entries[index->nbr_entries] = (struct archive_index_entry){info->vna_id, info->sweep, info->time_ns, offset};
+    index->last[info->vna_id] = index->nbr_entries++;
+    return EXIT_SUCCESS;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const struct archive_index_entry *x = a, *y = b;
+    if (x->vna_id != y->vna_id)
+        return x->vna_id < y->vna_id ? -1 : 1;
+    if (x->sweep != y->sweep)
+        return x->sweep < y->sweep ? -1 : 1;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/**
+ * Sorts an index and writes it, then the trailer, at the current end of
+ * an archive
+ *
+ * @param index_block file offset the index block starts at
+ * @return bytes written, or 0 on failure
+ */
+static uint64_t write_index(FILE *file, struct archive_index *index, uint64_t index_block) {
+    uint64_t length = (uint64_t)index->nbr_entries * ARCHIVE_INDEX_ENTRY_SIZE;
+    if (length > UINT32_MAX) {
+        fprintf(stderr, "Archive index of %ld sweeps is too big to write\n", index->nbr_entries);
+        return 0;
+    }
+    qsort(index->entries, index->nbr_entries, sizeof(struct archive_index_entry), compare_entries);
+
+    uint8_t head[ARCHIVE_BLOCK_HEADER_SIZE] = {ARCHIVE_BLOCK_INDEX};
+    put_u32(head + 1, length);
+    bool ok = fwrite(head, sizeof(head), 1, file) == 1;
+    for (long i = 0; ok && i < index->nbr_entries; i++) {
+        const struct archive_index_entry *e = &index->entries[i];
+        uint8_t entry[ARCHIVE_INDEX_ENTRY_SIZE];
+        uint8_t *p = put_u16(entry, e->vna_id);
+        p = put_u16(p, 0);
+        p = put_u32(p, e->sweep);
+        p = put_u64(p, e->time_ns);
+        put_u64(p, e->offset);
+        ok = fwrite(entry, sizeof(entry), 1, file) == 1;
+    }
+    uint8_t trailer[ARCHIVE_TRAILER_SIZE] = {ARCHIVE_BLOCK_TRAILER};
+    uint8_t *p = put_u32(trailer + 1, ARCHIVE_TRAILER_SIZE - ARCHIVE_BLOCK_HEADER_SIZE);
+    p = put_u64(p, index_block);
+    memcpy(p, ARCHIVE_TRAILER_MAGIC, 4);
+    if (!ok || fwrite(trailer, sizeof(trailer), 1, file) != 1) {
+        fprintf(stderr, "Failed to write archive index: %s\n", strerror(errno));
+        return 0;
+    }
+    return ARCHIVE_BLOCK_HEADER_SIZE + length + ARCHIVE_TRAILER_SIZE;
+}
+
+//----------------------------------------
+// Writing
+//----------------------------------------
+
+int open_archive_writer(struct archive_writer *writer, const char *path, const char *label, uint64_t start_ns) {
+    memset(writer, 0, sizeof(*writer));
+    init_index(&writer->index);
+    writer->file = fopen(path, "wb");
+    if (!writer->file) {
+        fprintf(stderr, "Failed to open %s for writing: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    init_archive_codec(&writer->codec);
+    writer->start_ns = start_ns;
+
+    // the wall clock time start_ns was at
+    uint64_t start_unix_ns = clock_ns(CLOCK_REALTIME) - (clock_ns(CLOCK_MONOTONIC) - start_ns);
+    size_t label_len = label ? strnlen(label, ARCHIVE_LABEL_SIZE - 1) : 0;
+    uint8_t header[ARCHIVE_HEADER_SIZE];
+    memcpy(header, ARCHIVE_MAGIC, 4);
+    uint8_t *p = put_u16(header + 4, ARCHIVE_VERSION);
+    p = put_u16(p, 0);
+    p = put_u64(p, start_unix_ns);
+    put_u16(p, label_len);
+    if (fwrite(header, ARCHIVE_HEADER_SIZE, 1, writer->file) != 1
+            || (label_len && fwrite(label, label_len, 1, writer->file) != 1)) {
+        fprintf(stderr, "Failed to write archive header to %s: %s\n", path, strerror(errno));
+        fclose(writer->file);
+        writer->file = NULL;
+        return EXIT_FAILURE;
+    }
+    writer->archive_bytes = ARCHIVE_HEADER_SIZE + label_len;
+    return EXIT_SUCCESS;
+}
+
+int write_archive_scan(struct archive_writer *writer, const struct datapoint_nanoVNA_H *data) {
+    size_t bound = ARCHIVE_BLOCK_HEADER_SIZE + archive_scan_bound(data->pps);
+    if (reserve_block(&writer->block, &writer->block_size, bound) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    ssize_t length = encode_archive_scan(&writer->codec, data, writer->start_ns,
+            writer->block + ARCHIVE_BLOCK_HEADER_SIZE, bound - ARCHIVE_BLOCK_HEADER_SIZE);
+    if (length < 0) {
+        fprintf(stderr, "Failed to encode scan %d of sweep %d for the archive\n", data->scan_index, data->sweep);
+        return EXIT_FAILURE;
+    }
+    writer->block[0] = ARCHIVE_BLOCK_SCAN;
+    put_u32(writer->block + 1, length);
+    if (fwrite(writer->block, ARCHIVE_BLOCK_HEADER_SIZE + length, 1, writer->file) != 1) {
+        fprintf(stderr, "Failed to write to archive: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct block_info info = {0, data->vna_id, data->scan_id, data->sweep, data->scan_index,
+                              data->pps, data->send_ns - writer->start_ns};
+    if (index_block(&writer->index, &info, writer->archive_bytes) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    writer->scans++;
+    writer->raw_bytes += (uint64_t)data->pps * ARCHIVE_RAW_POINT_SIZE;
+    writer->archive_bytes += ARCHIVE_BLOCK_HEADER_SIZE + length;
+    return EXIT_SUCCESS;
+}
+
+int close_archive_writer(struct archive_writer *writer) {
+    int result = EXIT_SUCCESS;
+    if (writer->file) {
+        off_t end = ftello(writer->file);
+        uint64_t written = end < 0 ? 0 : write_index(writer->file, &writer->index, end);
+        if (!written)
+            result = EXIT_FAILURE;
+        writer->archive_bytes += written;
+        if (fclose(writer->file) != 0) {
+            fprintf(stderr, "Failed to close archive: %s\n", strerror(errno));
+            result = EXIT_FAILURE;
+        }
+    }
+    writer->file = NULL;
+    destroy_archive_codec(&writer->codec);
+    destroy_index(&writer->index);
+    free(writer->block);
+    writer->block = NULL;
+    writer->block_size = 0;
+    return result;
+}
+
+//----------------------------------------
+// Reading
+//----------------------------------------
+
+/**
+ * Looks for the trailer at the end of an archive, and if it points at a
+ * whole index block, notes where the index is
+ */
+static void find_index(struct archive_reader *reader) {
+    uint8_t trailer[ARCHIVE_TRAILER_SIZE];
+    uint8_t head[ARCHIVE_BLOCK_HEADER_SIZE];
+    if (fseeko(reader->file, -ARCHIVE_TRAILER_SIZE, SEEK_END) != 0)
+        return;
+    off_t end = ftello(reader->file) + ARCHIVE_TRAILER_SIZE;
+    if (fread(trailer, sizeof(trailer), 1, reader->file) != 1 || trailer[0] != ARCHIVE_BLOCK_TRAILER
+            || get_le(trailer + 1, 4) != ARCHIVE_TRAILER_SIZE - ARCHIVE_BLOCK_HEADER_SIZE
+            || memcmp(trailer + 13, ARCHIVE_TRAILER_MAGIC, 4) != 0)
+        return;
+    uint64_t index_block = get_le(trailer + 5, 8);
+    if (index_block < reader->data_offset || fseeko(reader->file, index_block, SEEK_SET) != 0
+            || fread(head, sizeof(head), 1, reader->file) != 1 || head[0] != ARCHIVE_BLOCK_INDEX)
+        return;
+    uint64_t length = get_le(head + 1, 4);
+    if (length % ARCHIVE_INDEX_ENTRY_SIZE != 0
+            || index_block + ARCHIVE_BLOCK_HEADER_SIZE + length + ARCHIVE_TRAILER_SIZE != (uint64_t)end)
+        return;
+    reader->index_offset = index_block + ARCHIVE_BLOCK_HEADER_SIZE;
+    reader->nbr_index = length / ARCHIVE_INDEX_ENTRY_SIZE;
+}
+
+/**
+ * Starts reading again from a block, with no references and only returning
+ * scans that pass the given filter
+ */
+static int restart_reader(struct archive_reader *reader, uint64_t offset, int only_vna, int from_sweep, uint64_t from_time_ns) {
+    destroy_archive_codec(&reader->codec);
+    reader->only_vna = only_vna;
+    reader->from_sweep = from_sweep;
+    reader->from_time_ns = from_time_ns;
+    if (fseeko(reader->file, offset, SEEK_SET) != 0) {
+        fprintf(stderr, "Failed to seek in archive: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int open_archive_reader(struct archive_reader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    reader->only_vna = -1;
+    reader->file = fopen(path, "rb");
+    if (!reader->file) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    init_archive_codec(&reader->codec);
+    uint8_t header[ARCHIVE_HEADER_SIZE];
+    if (fread(header, ARCHIVE_HEADER_SIZE, 1, reader->file) != 1
+            || memcmp(header, ARCHIVE_MAGIC, 4) != 0 || get_le(header + 4, 2) != ARCHIVE_VERSION) {
+        fprintf(stderr, "%s is not a version %d scan archive\n", path, ARCHIVE_VERSION);
+        close_archive_reader(reader);
+        return EXIT_FAILURE;
+    }
+    reader->start_unix_ns = get_le(header + 8, 8);
+    size_t label_len = get_le(header + 16, 2);
+    size_t kept = label_len < ARCHIVE_LABEL_SIZE ? label_len : ARCHIVE_LABEL_SIZE - 1;
+    if ((kept && fread(reader->label, kept, 1, reader->file) != 1)
+            || fseeko(reader->file, label_len - kept, SEEK_CUR) != 0) {
+        fprintf(stderr, "%s is truncated\n", path);
+        close_archive_reader(reader);
+        return EXIT_FAILURE;
+    }
+    reader->label[kept] = '\0';
+    reader->data_offset = ARCHIVE_HEADER_SIZE + label_len;
+    find_index(reader);
+    return restart_reader(reader, reader->data_offset, -1, 0, 0);
+}
+
+/**
+ * Reads the next block of any type
+ *
+ * @param type set to the block's type
+ * @param length set to the length of its payload
+ * @return 1 with the payload of a scan block in reader->block (other blocks
+ *         are skipped over), 0 at the end of the archive, or -1 if the
+ *         block is cut short
+ */
+static int next_block(struct archive_reader *reader, uint8_t *type, size_t *length) {
+    uint8_t head[ARCHIVE_BLOCK_HEADER_SIZE];
+    size_t got = fread(head, 1, ARCHIVE_BLOCK_HEADER_SIZE, reader->file);
+    if (got == 0 && feof(reader->file))
+        return 0;
+    if (got != ARCHIVE_BLOCK_HEADER_SIZE)
+        return -1;
+    *type = head[0];
+    *length = get_le(head + 1, 4);
+    if (*type != ARCHIVE_BLOCK_SCAN)
+        return fseeko(reader->file, *length, SEEK_CUR) == 0 ? 1 : -1;
+    if (reserve_block(&reader->block, &reader->block_size, *length) != EXIT_SUCCESS)
+        return -1;
+    if (*length && fread(reader->block, *length, 1, reader->file) != 1)
+        return -1;
+    return 1;
+}
+
+int read_archive_scan(struct archive_reader *reader, struct datapoint_nanoVNA_H *data) {
+    while (true) {
+        uint8_t type;
+        size_t length;
+        int got = next_block(reader, &type, &length);
+        if (got <= 0)
+            return got;
+        if (type != ARCHIVE_BLOCK_SCAN)
+            continue;
+        struct byte_reader r = {reader->block, length, 0, false};
+        struct block_info info;
+        if (get_block_info(&r, &info) != EXIT_SUCCESS)
+            return -1;
+        if (reader->only_vna >= 0 && info.vna_id != reader->only_vna)
+            continue;
+        bool wanted = info.sweep >= reader->from_sweep && info.time_ns >= reader->from_time_ns;
+        // before the place sought, blocks whose references are further back still are skipped
+        if (!wanted && !(info.flags & ARCHIVE_FLAG_KEY)
+                && !find_ref(&reader->codec, info.vna_id, info.scan_index, info.pps))
+            continue;
+        if (decode_archive_scan(&reader->codec, reader->block, length, 0, data) != EXIT_SUCCESS)
+            return -1;
+        if (wanted)
+            return 1;
+        free(data->point);
+    }
+}
+
+int read_archive_index(struct archive_reader *reader, long i, struct archive_index_entry *entry) {
+    if (!reader->index_offset || i < 0 || i >= reader->nbr_index)
+        return EXIT_FAILURE;
+    // pread leaves the stream where it was
+    uint8_t bytes[ARCHIVE_INDEX_ENTRY_SIZE];
+    off_t offset = reader->index_offset + (uint64_t)i * ARCHIVE_INDEX_ENTRY_SIZE;
+    if (pread(fileno(reader->file), bytes, sizeof(bytes), offset) != sizeof(bytes)) {
+        fprintf(stderr, "Failed to read archive index: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    entry->vna_id = get_le(bytes, 2);
+    entry->sweep = get_le(bytes + 4, 4);
+    entry->time_ns = get_le(bytes + 8, 8);
+    entry->offset = get_le(bytes + 16, 8);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Binary search for the first index entry at or after (vna_id, sweep)
+ *
+ * @return the entry (nbr_index if there's none), or -1 if the index can't be read
+ */
+static long lower_bound_sweep(struct archive_reader *reader, int vna_id, int sweep) {
+    long lo = 0, hi = reader->nbr_index;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        struct archive_index_entry e;
+        if (read_archive_index(reader, mid, &e) != EXIT_SUCCESS)
+            return -1;
+        if (e.vna_id < vna_id || (e.vna_id == vna_id && e.sweep < sweep))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Binary search for the first entry from first to end (one VNA's entries)
+ * of a sweep starting at or after time_ns
+ *
+ * @return the entry (end if there's none), or -1 if the index can't be read
+ */
+static long lower_bound_time(struct archive_reader *reader, long first, long end, uint64_t time_ns) {
+    long lo = first, hi = end;
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        struct archive_index_entry e;
+        if (read_archive_index(reader, mid, &e) != EXIT_SUCCESS)
+            return -1;
+        if (e.time_ns < time_ns)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Finds where decoding must start for a VNA's blocks from a sweep on to
+ * have their references: its first block at or after the last multiple of
+ * ARCHIVE_KEY_SWEEPS
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the index can't be read
+ */
+static int key_offset(struct archive_reader *reader, int vna_id, int sweep, uint64_t *offset) {
+    long k = lower_bound_sweep(reader, vna_id, sweep / ARCHIVE_KEY_SWEEPS * ARCHIVE_KEY_SWEEPS);
+    struct archive_index_entry e;
+    if (k < 0 || read_archive_index(reader, k, &e) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    *offset = e.offset;
+    return EXIT_SUCCESS;
+}
+
+long find_archive_sweep(struct archive_reader *reader, int vna_id, int sweep) {
+    long i = lower_bound_sweep(reader, vna_id, sweep);
+    struct archive_index_entry e;
+    if (i < 0 || read_archive_index(reader, i, &e) != EXIT_SUCCESS || e.vna_id != vna_id)
+        return -1;
+    return i;
+}
+
+long find_archive_time(struct archive_reader *reader, int vna_id, uint64_t time_ns) {
+    long first = lower_bound_sweep(reader, vna_id, 0);
+    long end = lower_bound_sweep(reader, vna_id + 1, 0);
+    if (first < 0 || end < 0)
+        return -1;
+    long i = lower_bound_time(reader, first, end, time_ns);
+    return i < end ? i : -1;
+}
+
+int seek_archive_sweep(struct archive_reader *reader, int vna_id, int sweep) {
+    if (!reader->index_offset) {
+        fprintf(stderr, "Archive has no index\n");
+        return EXIT_FAILURE;
+    }
+    long i = find_archive_sweep(reader, vna_id, sweep);
+    struct archive_index_entry e;
+    uint64_t offset;
+    if (i < 0 || read_archive_index(reader, i, &e) != EXIT_SUCCESS
+            || key_offset(reader, vna_id, e.sweep, &offset) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    return restart_reader(reader, offset, vna_id, sweep, 0);
+}
+
+int seek_archive_time(struct archive_reader *reader, int vna_id, uint64_t time_ns) {
+    if (!reader->index_offset) {
+        fprintf(stderr, "Archive has no index\n");
+        return EXIT_FAILURE;
+    }
+    bool found = false;
+    uint64_t start = UINT64_MAX;
+    for (int v = vna_id < 0 ? 0 : vna_id; v < (vna_id < 0 ? MAXIMUM_VNA_PORTS : vna_id + 1); v++) {
+        long first = lower_bound_sweep(reader, v, 0);
+        long end = lower_bound_sweep(reader, v + 1, 0);
+        if (first < 0 || end < 0)
+            return EXIT_FAILURE;
+        if (first == end)
+            continue;
+        // the sweep before the first to start at time_ns may still have scans sent after it
+        long i = lower_bound_time(reader, first, end, time_ns);
+        if (i < 0)
+            return EXIT_FAILURE;
+        struct archive_index_entry e;
+        uint64_t offset;
+        if (read_archive_index(reader, i > first ? i - 1 : first, &e) != EXIT_SUCCESS
+                || key_offset(reader, v, e.sweep, &offset) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        if (offset < start)
+            start = offset;
+        found = true;
+    }
+    if (!found)
+        return EXIT_FAILURE;
+    return restart_reader(reader, start, vna_id, 0, time_ns);
+}
+
+int index_archive(const char *path) {
+    struct archive_reader reader;
+    if (open_archive_reader(&reader, path) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    if (reader.index_offset) {
+        close_archive_reader(&reader);
+        return EXIT_SUCCESS;
+    }
+
+    struct archive_index index;
+    init_index(&index);
+    uint64_t end = reader.data_offset;      // end of the last whole block
+    int got;
+    uint8_t type;
+    size_t length;
+    while ((got = next_block(&reader, &type, &length)) > 0) {
+        if (type == ARCHIVE_BLOCK_SCAN) {
+            struct byte_reader r = {reader.block, length, 0, false};
+            struct block_info info;
+            if (get_block_info(&r, &info) != EXIT_SUCCESS)
+                break;
+            if (index_block(&index, &info, end) != EXIT_SUCCESS) {
+                destroy_index(&index);
+                close_archive_reader(&reader);
+                return EXIT_FAILURE;
+            }
+        }
+        end += ARCHIVE_BLOCK_HEADER_SIZE + length;
+    }
+    close_archive_reader(&reader);
+
+    FILE *file = fopen(path, "r+b");
+    int result = EXIT_FAILURE;
+    if (!file) {
+        fprintf(stderr, "Failed to open %s for writing: %s\n", path, strerror(errno));
+    } else {
+        if (fseeko(file, 0, SEEK_END) == 0 && (uint64_t)ftello(file) > end)
+            fprintf(stderr, "Cutting off %" PRIu64 " bytes of half written block at the end of %s\n",
+                (uint64_t)ftello(file) - end, path);
+        if (ftruncate(fileno(file), end) != 0 || fseeko(file, end, SEEK_SET) != 0)
+            fprintf(stderr, "Failed to cut %s short: %s\n", path, strerror(errno));
+        else if (write_index(file, &index, end))
+            result = EXIT_SUCCESS;
+        if (fclose(file) != 0)
+            result = EXIT_FAILURE;
+    }
+    destroy_index(&index);
+    return result;
+}
+
+void close_archive_reader(struct archive_reader *reader) {
+    if (reader->file)
+        fclose(reader->file);
+    reader->file = NULL;
+    destroy_archive_codec(&reader->codec);
+    free(reader->block);
+    reader->block = NULL;
+    reader->block_size = 0;
+}
@@ -0,0 +1,341 @@
+#ifndef VNAARCHIVE_H_
+#define VNAARCHIVE_H_
+
+#include "VnaScanMultithreaded.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+
+/**
+ * Layout of a compressed scan archive, all fixed size integers little endian
+ *
+ * The file starts with a header:
+ *     0  magic         "VNAR"
+ *     4  version       uint16, ARCHIVE_VERSION
+ *     6  flags         uint16, 0
+ *     8  start         uint64, wall clock time (ns since the epoch) that
+ *                      the scan times are relative to
+ *     16 label length  uint16, then that many bytes of label (not terminated)
+ *
+ * Then a block per scan, in the order the consumer took them:
+ *     0  type          uint8, ARCHIVE_BLOCK_SCAN
+ *     1  length        uint32, bytes of payload following
+ *     5  the payload (see encode_archive_scan)
+ * Blocks of any other type are skipped by readers, so later versions can
+ * add them without breaking old readers.
+ *
+ * When the writer is closed it adds an ARCHIVE_BLOCK_INDEX block, with an
+ * ARCHIVE_INDEX_ENTRY_SIZE byte entry for each sweep of each VNA, sorted
+ * by vna_id then sweep:
+ *     0  vna_id        uint16
+ *     2  reserved      uint16, 0
+ *     4  sweep         uint32
+ *     8  time          uint64, send_ns of the sweep's first scan, since start
+ *     16 offset        uint64, file offset of the sweep's first block
+ * and last an ARCHIVE_BLOCK_TRAILER block, ARCHIVE_TRAILER_SIZE bytes with
+ * its header, whose payload is the uint64 file offset of the index block
+ * then ARCHIVE_TRAILER_MAGIC. An archive whose writer never closed has no
+ * index, and can be given one with index_archive.
+ *
+ * A scan payload is a flags byte then unsigned LEB128 varints:
+ *     flags, vna_id, scan_id, sweep, scan_index, pps,
+ *     send_ns - start, header_ns - send_ns + 1 (0 if header_ns is 0),
+ *     receive_ns - send_ns, sweep_ns_per_point in ps
+ * followed by the frequencies as the first frequency and the zigzag step
+ * to the next, plus (with ARCHIVE_FLAG_FREQS) a zigzag residual per point
+ * where they aren't an arithmetic progression.
+ *
+ * Last come the readings as a bit stream, s11 re, s11 im, s21 re, s21 im
+ * one after the other, each as the XOR of its float bits with a reference:
+ * the same point of the last (vna_id, scan_index) block, or with
+ * ARCHIVE_FLAG_KEY the previous point of this block. A
+ * zero XOR costs one bit; otherwise the meaningful bits are written inside
+ * the previous window of leading and trailing zeros if they fit, or after
+ * a new 5 bit leading count and 5 bit length (Gorilla style).
+ */
+#define ARCHIVE_MAGIC "VNAR"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HEADER_SIZE 18
+#define ARCHIVE_LABEL_SIZE 256
+#define ARCHIVE_BLOCK_HEADER_SIZE 5
+#define ARCHIVE_BLOCK_SCAN 'S'
+#define ARCHIVE_BLOCK_INDEX 'I'
+#define ARCHIVE_BLOCK_TRAILER 'T'
+#define ARCHIVE_INDEX_ENTRY_SIZE 24
+#define ARCHIVE_TRAILER_MAGIC "VNAX"
+#define ARCHIVE_TRAILER_SIZE 17
+#define ARCHIVE_FLAG_KEY 1
+#define ARCHIVE_FLAG_FREQS 2
+
+/**
+ * A block is never encoded against one from before the last multiple of
+ * ARCHIVE_KEY_SWEEPS sweeps, so a VNA's blocks can be decoded starting from
+ * its first block at or after any such multiple
+ */
+#define ARCHIVE_KEY_SWEEPS 64
+
+/**
+ * Size in bytes of the readings of one point as the NanoVNA sends them,
+ * which the compression is measured against
+ */
+#define ARCHIVE_RAW_POINT_SIZE 20
+
+/**
+ * Float bits of the last block seen for each (vna_id, scan_index), which
+ * the next sweep's blocks are encoded against
+ *
+ * An encoder and the decoder reading its output must see the same blocks
+ * in the same order to keep the same references.
+ */
+struct archive_codec {
+    int nbr_refs[MAXIMUM_VNA_PORTS];        // scan_index entries allocated per VNA
+    int *ref_pps[MAXIMUM_VNA_PORTS];        // points in each reference, 0 if none yet
+    int *ref_sweep[MAXIMUM_VNA_PORTS];      // sweep each reference came from
+    uint32_t **refs[MAXIMUM_VNA_PORTS];     // 4 * pps float bits per reference
+};
+
+/**
+ * Where one sweep of one VNA starts in an archive
+ */
+struct archive_index_entry {
+    int vna_id;
+    int sweep;
+    uint64_t time_ns;       // send_ns of the sweep's first scan, since the archive's start
+    uint64_t offset;        // file offset of the sweep's first block
+};
+
+/**
+ * Index entries collected as blocks are written, in file order
+ */
+struct archive_index {
+    struct archive_index_entry *entries;
+    long nbr_entries;
+    long size;                          // entries allocated
+    long last[MAXIMUM_VNA_PORTS];       // entry of each VNA's latest sweep, -1 if none
+};
+
+/**
+ * Writes scans to an archive file
+ */
+struct archive_writer {
+    FILE *file;
+    struct archive_codec codec;
+    struct archive_index index;
+    uint64_t start_ns;          // monotonic_ns() the scan times are stored relative to
+    uint8_t *block;             // space for encoding one block
+    size_t block_size;
+    long scans;                 // scans written so far
+    uint64_t raw_bytes;         // bytes those scans' points take as the NanoVNA sends them
+    uint64_t archive_bytes;     // bytes written to the file, header included
+};
+
+/**
+ * Reads the scans of an archive file one at a time
+ *
+ * After a seek, only scans at or after the place sought (and of the VNA
+ * sought, if one was given) are returned.
+ */
+struct archive_reader {
+    FILE *file;
+    struct archive_codec codec;
+    uint64_t start_unix_ns;             // the start field of the header
+    char label[ARCHIVE_LABEL_SIZE];
+    uint8_t *block;                     // last block read
+    size_t block_size;
+    uint64_t data_offset;               // file offset of the first block
+    uint64_t index_offset;              // file offset of the first index entry, 0 if there's no index
+    long nbr_index;                     // entries in the index
+    int only_vna;                       // VNA whose scans are returned, -1 for every VNA
+    int from_sweep;                     // scans of earlier sweeps are skipped
+    uint64_t from_time_ns;              // scans sent earlier than this are skipped
+};
+
+/**
+ * Sets up a codec with no references
+ *
+ * @param codec pointer to the space reserved for this struct (uninitialised)
+ */
+void init_archive_codec(struct archive_codec *codec);
+
+/**
+ * Frees the references of a codec (but not the struct itself), leaving it
+ * as init_archive_codec does
+ *
+ * @param codec pointer to the codec to clean up
+ */
+void destroy_archive_codec(struct archive_codec *codec);
+
+/**
+ * Largest payload encode_archive_scan can produce for a scan
+ *
+ * @param pps number of points in the scan
+ * @return size in bytes
+ */
+size_t archive_scan_bound(int pps);
+
+/**
+ * Encodes one scan as a block payload, then makes it the reference for the
+ * next sweep's block with the same vna_id and scan_index
+ *
+ * @param codec the encoder's references
+ * @param data the scan to encode
+ * @param start_ns time the scan's times are stored relative to, no later
+ *        than data->send_ns
+ * @param out space for the payload
+ * @param size bytes available at out, at least archive_scan_bound(data->pps)
+ * @return bytes of payload written, or -1 on bad arguments or failed allocation
+ */
+ssize_t encode_archive_scan(struct archive_codec *codec, const struct datapoint_nanoVNA_H *data, uint64_t start_ns, uint8_t *out, size_t size);
+
+/**
+ * Decodes a block payload written by encode_archive_scan, then makes it the
+ * reference for the next sweep's block as the encoder did
+ *
+ * @param codec the decoder's references
+ * @param in the payload
+ * @param length bytes of payload
+ * @param start_ns added to the stored times (the encoder's start_ns to get
+ *        them back exactly, or 0 for times since the start)
+ * @param data set to the scan, with data->point allocated with malloc (the
+ *        caller frees it)
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the payload is malformed, refers
+ *         to a block the codec hasn't seen, or allocation failed
+ */
+int decode_archive_scan(struct archive_codec *codec, const uint8_t *in, size_t length, uint64_t start_ns, struct datapoint_nanoVNA_H *data);
+
+/**
+ * Creates an archive file and writes its header
+ *
+ * @param writer pointer to the space reserved for this struct (uninitialised)
+ * @param path the file to create or overwrite
+ * @param label text stored in the header (may be NULL), cut short to
+ *        ARCHIVE_LABEL_SIZE - 1 bytes
+ * @param start_ns monotonic_ns() the scan times are stored relative to
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the file can't be created
+ */
+int open_archive_writer(struct archive_writer *writer, const char *path, const char *label, uint64_t start_ns);
+
+/**
+ * Compresses a scan and appends it to the archive
+ *
+ * @param writer the archive to write to
+ * @param data the scan, which must have been sent after the writer's start_ns
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if it couldn't be encoded or written
+ */
+int write_archive_scan(struct archive_writer *writer, const struct datapoint_nanoVNA_H *data);
+
+/**
+ * Writes the index, then flushes and closes an archive file, freeing the
+ * writer's buffers (but not the struct itself)
+ *
+ * @param writer the archive to close
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the index or the last writes failed
+ */
+int close_archive_writer(struct archive_writer *writer);
+
+/**
+ * Opens an archive file and reads its header
+ *
+ * @param reader pointer to the space reserved for this struct (uninitialised)
+ * @param path the file to read
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the file can't be opened or
+ *         isn't an archive
+ */
+int open_archive_reader(struct archive_reader *reader, const char *path);
+
+/**
+ * Reads and decodes the next scan in an archive, skipping blocks of other
+ * types
+ *
+ * @param reader the archive to read
+ * @param data set to the scan, with times since the archive's start and
+ *        data->point allocated with malloc (the caller frees it)
+ * @return 1 if a scan was read, 0 at the end of the archive, or -1 if the
+ *         archive is truncated or malformed
+ */
+int read_archive_scan(struct archive_reader *reader, struct datapoint_nanoVNA_H *data);
+
+/**
+ * Reads one entry of an archive's index
+ *
+ * @param reader an archive with an index
+ * @param i the entry, from 0 to reader->nbr_index - 1
+ * @param entry set to the entry
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if there is no such entry or it
+ *         can't be read
+ */
+int read_archive_index(struct archive_reader *reader, long i, struct archive_index_entry *entry);
+
+/**
+ * Finds the first sweep of a VNA at or after a given sweep, with a binary
+ * search of the index
+ *
+ * @param reader an archive with an index
+ * @param vna_id the VNA
+ * @param sweep the sweep number
+ * @return the index entry, or -1 if the VNA has no such sweep
+ */
+long find_archive_sweep(struct archive_reader *reader, int vna_id, int sweep);
+
+/**
+ * Finds the first sweep of a VNA that started at or after a given time,
+ * with a binary search of the index
+ *
+ * @param reader an archive with an index
+ * @param vna_id the VNA
+ * @param time_ns time since the archive's start
+ * @return the index entry, or -1 if the VNA has no such sweep
+ */
+long find_archive_time(struct archive_reader *reader, int vna_id, uint64_t time_ns);
+
+/**
+ * Moves a reader to a sweep of a VNA, so the next read_archive_scan returns
+ * its first scan (or that of the next sweep of the VNA in the archive)
+ *
+ * Takes O(log n) reads of the index, then the reader decodes at most
+ * ARCHIVE_KEY_SWEEPS sweeps of the VNA to build up its references.
+ *
+ * @param reader an archive with an index
+ * @param vna_id the VNA
+ * @param sweep the sweep number
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if there's no index, the VNA has
+ *         no sweeps from there on or the file can't be read
+ */
+int seek_archive_sweep(struct archive_reader *reader, int vna_id, int sweep);
+
+/**
+ * Moves a reader to a time, so read_archive_scan returns the scans sent
+ * from then on
+ *
+ * @param reader an archive with an index
+ * @param vna_id the VNA, or -1 for every VNA
+ * @param time_ns time since the archive's start
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if there's no index, the archive
+ *         has no sweeps of the VNA (of any VNA for -1) or the file can't be read
+ */
+int seek_archive_time(struct archive_reader *reader, int vna_id, uint64_t time_ns);
+
+/**
+ * Adds an index to an archive whose writer never closed it (if the
+ * program was killed, say), cutting off any block left half written
+ *
+ * @param path the archive
+ * @return EXIT_SUCCESS (also if it already has an index), or EXIT_FAILURE
+ *         if it isn't an archive or can't be written
+ */
+int index_archive(const char *path);
+
+/**
+ * Closes an archive file, freeing the reader's buffers (but not the struct
+ * itself)
+ *
+ * @param reader the archive to close
+ */
+void close_archive_reader(struct archive_reader *reader);
+
+#endif
@@ -0,0 +1,192 @@
+#include "VnaArchive.h"
+
+/*
+ * Reads scan archives written by the scanner (see VnaArchive.h)
+ *
+ * Sweeps and times are found with the archive's index, so slicing a few
+ * sweeps out of an overnight run doesn't mean reading all of it. Scans are
+ * printed in the same format as the scanner's touchstone files, each after
+ * a comment line saying where it came from.
+ */
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s <command> <archive> [arguments]\n"
+        "    info <archive>                     - label, start time, VNAs and their sweeps\n"
+        "    index <archive>                    - adds an index to an archive that wasn't closed\n"
+        "    sweeps <archive>                   - lists the index: where each sweep of each VNA starts\n"
+        "    sweep <archive> <vna> <sweep> [n]  - prints n sweeps (default 1) of a VNA from a sweep on\n"
+        "    time <archive> <from> [to] [vna]   - prints scans sent from 'from' up to 'to' seconds after\n"
+        "                                         the start, of every VNA or just one\n"
+        "    dump <archive>                     - prints every scan\n", name);
+}
+
+static void print_header(const char *path) {
+    printf("! Touchstone file generated from scan archive %s\n", path);
+    printf("# Hz S RI R 50\n");
+}
+
+static void print_scan(const struct datapoint_nanoVNA_H *data) {
+    printf("! vna %d sweep %d scan %d sent %.9f s received %.9f s\n", data->vna_id, data->sweep,
+        data->scan_index, data->send_ns / 1e9, data->receive_ns / 1e9);
+    for (int i = 0; i < data->pps; i++) {
+        const struct nanovna_raw_datapoint *p = &data->point[i];
+        printf("%u %.10e %.10e %.10e %.10e 0 0 0 0\n",
+            p->frequency, p->s11.re, p->s11.im, p->s21.re, p->s21.im);
+    }
+}
+
+static bool parse_int(const char *text, int *value) {
+    char *end;
+    long v = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || v < 0 || v > INT32_MAX)
+        return false;
+    *value = v;
+    return true;
+}
+
+static bool parse_secs(const char *text, uint64_t *ns) {
+    char *end;
+    double secs = strtod(text, &end);
+    if (*text == '\0' || *end != '\0' || !(secs >= 0) || secs > 1e9)
+        return false;
+    *ns = (uint64_t)(secs * 1e9);
+    return true;
+}
+
+static int info(struct archive_reader *reader, const char *path) {
+    time_t start = reader->start_unix_ns / 1000000000ULL;
+    char when[64];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&start));
+    printf("Archive %s\n    Label: %s\n    Started: %s\n", path, reader->label, when);
+    if (!reader->index_offset) {
+        long scans = 0;
+        int got;
+        struct datapoint_nanoVNA_H data;
+        while ((got = read_archive_scan(reader, &data)) == 1) {
+            scans++;
+            free(data.point);
+        }
+        printf("    %ld scans%s, no index (add one with 'index')\n", scans, got < 0 ? " before a damaged block" : "");
+        return EXIT_SUCCESS;
+    }
+    printf("    Index: %ld sweeps\n", reader->nbr_index);
+    long first = 0;
+    while (first < reader->nbr_index) {
+        struct archive_index_entry a, b;
+        if (read_archive_index(reader, first, &a) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        long end = first + 1;
+        while (end < reader->nbr_index && read_archive_index(reader, end, &b) == EXIT_SUCCESS && b.vna_id == a.vna_id)
+            end++;
+        if (read_archive_index(reader, end - 1, &b) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        printf("    VNA %d: %ld sweeps, %d to %d, started from %.3f s to %.3f s\n",
+            a.vna_id, end - first, a.sweep, b.sweep, a.time_ns / 1e9, b.time_ns / 1e9);
+        first = end;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int list_sweeps(struct archive_reader *reader) {
+    if (!reader->index_offset) {
+        fprintf(stderr, "Archive has no index (add one with 'index')\n");
+        return EXIT_FAILURE;
+    }
+    printf("VNA Sweep Time Offset\n");
+    for (long i = 0; i < reader->nbr_index; i++) {
+        struct archive_index_entry e;
+        if (read_archive_index(reader, i, &e) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+        printf("%d %d %.9f %" PRIu64 "\n", e.vna_id, e.sweep, e.time_ns / 1e9, e.offset);
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Prints scans until the end of the archive, or until the VNA (or every
+ * VNA, for -1) has passed last_sweep or to_ns
+ */
+static int print_scans(struct archive_reader *reader, const char *path, int vna_id, int last_sweep, uint64_t to_ns) {
+    // VNAs with sweeps after last_sweep or started after to_ns are sure to
+    // pass them, and scans of the others may still turn up until the end
+    bool waiting[MAXIMUM_VNA_PORTS] = {false};
+    int nbr_waiting = 0;
+    for (int v = 0; v < MAXIMUM_VNA_PORTS; v++) {
+        if (vna_id >= 0 && v != vna_id)
+            continue;
+        waiting[v] = (last_sweep < INT32_MAX && find_archive_sweep(reader, v, last_sweep + 1) >= 0)
+                  || (to_ns < UINT64_MAX && find_archive_time(reader, v, to_ns) >= 0);
+        nbr_waiting += waiting[v];
+    }
+    print_header(path);
+    int got;
+    struct datapoint_nanoVNA_H data;
+    while ((got = read_archive_scan(reader, &data)) == 1) {
+        bool past = data.sweep > last_sweep || data.send_ns >= to_ns;
+        if (!past)
+            print_scan(&data);
+        free(data.point);
+        if (past && waiting[data.vna_id]) {
+            waiting[data.vna_id] = false;
+            if (--nbr_waiting == 0)
+                break;
+        }
+    }
+    if (got < 0) {
+        fprintf(stderr, "%s is damaged or cut short\n", path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *command = argv[1];
+    const char *path = argv[2];
+
+    if (strcmp(command, "index") == 0)
+        return index_archive(path);
+
+    struct archive_reader reader;
+    if (open_archive_reader(&reader, path) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    int result = EXIT_FAILURE;
+
+    if (strcmp(command, "info") == 0) {
+        result = info(&reader, path);
+    } else if (strcmp(command, "sweeps") == 0) {
+        result = list_sweeps(&reader);
+    } else if (strcmp(command, "dump") == 0) {
+        result = print_scans(&reader, path, -1, INT32_MAX, UINT64_MAX);
+    } else if (strcmp(command, "sweep") == 0) {
+        int vna_id, sweep, count = 1;
+        if (argc < 5 || !parse_int(argv[3], &vna_id) || vna_id >= MAXIMUM_VNA_PORTS || !parse_int(argv[4], &sweep)
+                || (argc > 5 && (!parse_int(argv[5], &count) || count < 1))) {
+            usage(argv[0]);
+        } else if (seek_archive_sweep(&reader, vna_id, sweep) != EXIT_SUCCESS) {
+            fprintf(stderr, "VNA %d has no sweep %d or later in %s\n", vna_id, sweep, path);
+        } else {
+            int last = sweep > INT32_MAX - count ? INT32_MAX : sweep + count - 1;
+            result = print_scans(&reader, path, vna_id, last, UINT64_MAX);
+        }
+    } else if (strcmp(command, "time") == 0) {
+        uint64_t from_ns, to_ns = UINT64_MAX;
+        int vna_id = -1;
+        if (argc < 4 || !parse_secs(argv[3], &from_ns) || (argc > 4 && !parse_secs(argv[4], &to_ns))
+                || (argc > 5 && (!parse_int(argv[5], &vna_id) || vna_id >= MAXIMUM_VNA_PORTS))) {
+            usage(argv[0]);
+        } else if (seek_archive_time(&reader, vna_id, from_ns) != EXIT_SUCCESS) {
+            fprintf(stderr, "No scans from %s s on in %s\n", argv[3], path);
+        } else {
+            result = print_scans(&reader, path, vna_id, INT32_MAX, to_ns);
+        }
+    } else {
+        usage(argv[0]);
+    }
+    close_archive_reader(&reader);
+    return result;
+}
@@ -0,0 +1,468 @@
+#include "VnaCalibration.h"
+
+//----------------------------------------
+// Error terms
+//----------------------------------------
+
+int create_calibration(struct calibration *cal, int nbr_points, bool thru) {
+    if (nbr_points < 1)
+        return EXIT_FAILURE;
+    cal->nbr_points = nbr_points;
+    cal->thru = thru;
+    cal->freqs = calloc(nbr_points, sizeof(uint64_t));
+    // one block for every term, so each array is a contiguous run of floats
+    float *terms = calloc((size_t)nbr_points * 2 * CAL_TERMS, sizeof(float));
+    if (!cal->freqs || !terms) {
+        fprintf(stderr, "Failed to allocate memory for calibration of %d points\n", nbr_points);
+        free(cal->freqs);
+        free(terms);
+        cal->freqs = NULL;
+        return EXIT_FAILURE;
+    }
+    for (int t = 0; t < CAL_TERMS; t++) {
+        cal->re[t] = terms + (size_t)nbr_points * 2 * t;
+        cal->im[t] = terms + (size_t)nbr_points * (2 * t + 1);
+    }
+    return EXIT_SUCCESS;
+}
+
+void destroy_calibration(struct calibration *cal) {
+    free(cal->freqs);
+    free(cal->re[0]);
+    cal->freqs = NULL;
+    cal->nbr_points = 0;
+}
+
+/**
+ * Complex arithmetic in double precision, for solving
+ */
+struct cvalue {
+    double re;
+    double im;
+};
+
+static struct cvalue cv(struct complex c) {
+    return (struct cvalue){c.re, c.im};
+}
+
+static struct cvalue cadd(struct cvalue a, struct cvalue b) {
+    return (struct cvalue){a.re + b.re, a.im + b.im};
+}
+
+static struct cvalue csub(struct cvalue a, struct cvalue b) {
+    return (struct cvalue){a.re - b.re, a.im - b.im};
+}
+
+static struct cvalue cmul(struct cvalue a, struct cvalue b) {
+    return (struct cvalue){a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re};
+}
+
+static struct cvalue cdiv(struct cvalue a, struct cvalue b) {
+    double d = b.re * b.re + b.im * b.im;
+    return (struct cvalue){(a.re * b.re + a.im * b.im) / d, (a.im * b.re - a.re * b.im) / d};
+}
+
+static bool czero(struct cvalue a) {
+    return a.re * a.re + a.im * a.im < 1e-24;
+}
+
+static void set_term(struct calibration *cal, CalTerm term, int k, struct cvalue value) {
+    cal->re[term][k] = value.re;
+    cal->im[term][k] = value.im;
+}
+
+//----------------------------------------
+// Capturing standards
+//----------------------------------------
+
+int create_cal_capture(struct cal_capture *cap, struct sweep_plan *plan) {
+    cap->plan = *plan;
+    bool failed = false;
+    for (int s = 0; s < CAL_STANDARDS; s++) {
+        cap->measured[s] = false;
+        cap->s11[s] = calloc(plan->nbr_points, sizeof(struct complex));
+        cap->s21[s] = calloc(plan->nbr_points, sizeof(struct complex));
+        failed |= !cap->s11[s] || !cap->s21[s];
+    }
+    if (failed) {
+        fprintf(stderr, "Failed to allocate memory for calibration capture\n");
+        destroy_cal_capture(cap);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void destroy_cal_capture(struct cal_capture *cap) {
+    for (int s = 0; s < CAL_STANDARDS; s++) {
+        free(cap->s11[s]);
+        free(cap->s21[s]);
+        cap->s11[s] = NULL;
+        cap->s21[s] = NULL;
+    }
+    destroy_sweep_plan(&cap->plan);
+}
+
+int record_standard(struct cal_capture *cap, CalStandard standard, int scan, const struct datapoint_nanoVNA_H *data) {
+    const struct scan_range *range = sweep_plan_scan(&cap->plan, scan);
+    if (standard < 0 || standard >= CAL_STANDARDS || !range || data->pps != range->pps)
+        return EXIT_FAILURE;
+    for (int i = 0; i < range->pps; i++) {
+        cap->s11[standard][range->first_bin + i] = data->point[i].s11;
+        cap->s21[standard][range->first_bin + i] = data->point[i].s21;
+    }
+    return EXIT_SUCCESS;
+}
+
+int measure_standard(struct cal_capture *cap, CalStandard standard, int vna_id, int retries) {
+    cap->measured[standard] = false;
+    for (int s = 0; s < cap->plan.nbr_scans; s++) {
+        const struct scan_range *range = sweep_plan_scan(&cap->plan, s);
+        struct datapoint_nanoVNA_H *data = pull_scan_retry(vna_id, range->start, range->stop, range->pps, retries, true);
+        if (!data)
+            return EXIT_FAILURE;
+        int error = record_standard(cap, standard, s, data);
+        free(data->point);
+        free(data);
+        if (error != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+    cap->measured[standard] = true;
+    return EXIT_SUCCESS;
+}
+
+int solve_calibration(const struct cal_capture *cap, struct calibration *cal) {
+    if (!cap->measured[CAL_SHORT] || !cap->measured[CAL_OPEN] || !cap->measured[CAL_LOAD]) {
+        fprintf(stderr, "Short, open and load must all be measured to calibrate\n");
+        return EXIT_FAILURE;
+    }
+    bool thru = cap->measured[CAL_THRU];
+    if (create_calibration(cal, cap->plan.nbr_points, thru) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    memcpy(cal->freqs, cap->plan.freqs, sizeof(uint64_t) * cap->plan.nbr_points);
+
+    const struct cvalue one = {1.0, 0.0};
+    for (int k = 0; k < cal->nbr_points; k++) {
+        // with ideal standards (short -1, open +1, load 0) the model gives
+        // e00 = load, e11 = (a + b) / (b - a), e10e01 = b (1 - e11)
+        // where a and b are the short and open less the load
+        struct cvalue e00 = cv(cap->s11[CAL_LOAD][k]);
+        struct cvalue a = csub(cv(cap->s11[CAL_SHORT][k]), e00);
+        struct cvalue b = csub(cv(cap->s11[CAL_OPEN][k]), e00);
+        if (czero(csub(b, a)) || czero(b)) {
+            fprintf(stderr, "Standards measured the same at %" PRIu64 " Hz, check they were connected\n", cal->freqs[k]);
+            destroy_calibration(cal);
+            return EXIT_FAILURE;
+        }
+        struct cvalue e11 = cdiv(cadd(a, b), csub(b, a));
+        struct cvalue e10e01 = cmul(b, csub(one, e11));
+        set_term(cal, CAL_E00, k, e00);
+        set_term(cal, CAL_E11, k, e11);
+        set_term(cal, CAL_E10E01, k, e10e01);
+        if (!thru)
+            continue;
+
+        // the thru shows port 2's match on port 1, and its S21 the tracking
+        struct cvalue d = csub(cv(cap->s11[CAL_THRU][k]), e00);
+        struct cvalue e22 = cdiv(d, cadd(e10e01, cmul(e11, d)));
+        struct cvalue e30 = cv(cap->s21[CAL_LOAD][k]);
+        struct cvalue e10e32 = cmul(csub(cv(cap->s21[CAL_THRU][k]), e30), csub(one, cmul(e11, e22)));
+        if (czero(e10e32)) {
+            fprintf(stderr, "Thru measured the same as isolation at %" PRIu64 " Hz, check it was connected\n", cal->freqs[k]);
+            destroy_calibration(cal);
+            return EXIT_FAILURE;
+        }
+        set_term(cal, CAL_E30, k, e30);
+        set_term(cal, CAL_E22, k, e22);
+        set_term(cal, CAL_E10E32, k, e10e32);
+    }
+    return EXIT_SUCCESS;
+}
+
+int resample_calibration(const struct calibration *cal, const uint64_t *freqs, int nbr_points, struct calibration *out) {
+    uint64_t first = cal->freqs[0];
+    uint64_t last = cal->freqs[cal->nbr_points - 1];
+    if (nbr_points < 1 || freqs[0] + 1 < first || freqs[nbr_points - 1] > last + 1)
+        return EXIT_FAILURE;
+    if (create_calibration(out, nbr_points, cal->thru) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    memcpy(out->freqs, freqs, sizeof(uint64_t) * nbr_points);
+
+    // both grids increase, so the interval only ever moves forward
+    int j = 0;
+    for (int k = 0; k < nbr_points; k++) {
+        uint64_t f = freqs[k] < first ? first : (freqs[k] > last ? last : freqs[k]);
+        while (j < cal->nbr_points - 2 && cal->freqs[j + 1] <= f)
+            j++;
+        float w = 0.0f;
+        if (cal->nbr_points > 1)
+            w = (float)((double)(f - cal->freqs[j]) / (double)(cal->freqs[j + 1] - cal->freqs[j]));
+        int next = cal->nbr_points > 1 ? j + 1 : j;
+        for (int t = 0; t < CAL_TERMS; t++) {
+            out->re[t][k] = cal->re[t][j] + w * (cal->re[t][next] - cal->re[t][j]);
+            out->im[t][k] = cal->im[t][j] + w * (cal->im[t][next] - cal->im[t][j]);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+//----------------------------------------
+// Correction
+//----------------------------------------
+
+/**
+ * Corrects S11 in place: S11 = (S11m - e00) / (e10e01 + e11 (S11m - e00))
+ *
+ * Every array is separate and contiguous, so the loop is compiled into
+ * vector instructions (asked for with omp simd, built with -fopenmp-simd),
+ * correcting several points at once.
+ */
+static void correct_reflection(int n, float *restrict re, float *restrict im,
+                               const float *restrict e00_re, const float *restrict e00_im,
+                               const float *restrict e11_re, const float *restrict e11_im,
+                               const float *restrict tr_re, const float *restrict tr_im) {
+    #pragma omp simd
+    for (int i = 0; i < n; i++) {
+        float d_re = re[i] - e00_re[i];
+        float d_im = im[i] - e00_im[i];
+        float c_re = tr_re[i] + e11_re[i] * d_re - e11_im[i] * d_im;
+        float c_im = tr_im[i] + e11_re[i] * d_im + e11_im[i] * d_re;
+        float mag = c_re * c_re + c_im * c_im;
+        re[i] = (d_re * c_re + d_im * c_im) / mag;
+        im[i] = (d_im * c_re - d_re * c_im) / mag;
+    }
+}
+
+/**
+ * Corrects S21 in place, given the corrected S11:
+ * S21 = (S21m - e30) (1 - e11 S11) / e10e32
+ */
+static void correct_transmission(int n, float *restrict re, float *restrict im,
+                                 const float *restrict s11_re, const float *restrict s11_im,
+                                 const float *restrict e30_re, const float *restrict e30_im,
+                                 const float *restrict e11_re, const float *restrict e11_im,
+                                 const float *restrict tt_re, const float *restrict tt_im) {
+    #pragma omp simd
+    for (int i = 0; i < n; i++) {
+        float d_re = re[i] - e30_re[i];
+        float d_im = im[i] - e30_im[i];
+        float m_re = 1.0f - (e11_re[i] * s11_re[i] - e11_im[i] * s11_im[i]);
+        float m_im = -(e11_re[i] * s11_im[i] + e11_im[i] * s11_re[i]);
+        float p_re = d_re * m_re - d_im * m_im;
+        float p_im = d_re * m_im + d_im * m_re;
+        float mag = tt_re[i] * tt_re[i] + tt_im[i] * tt_im[i];
+        re[i] = (p_re * tt_re[i] + p_im * tt_im[i]) / mag;
+        im[i] = (p_im * tt_re[i] - p_re * tt_im[i]) / mag;
+    }
+}
+
+void apply_calibration(const struct calibration *cal, int first_bin, struct nanovna_raw_datapoint *points, int nbr_points) {
+    float s11_re[nbr_points], s11_im[nbr_points], s21_re[nbr_points], s21_im[nbr_points];
+    for (int i = 0; i < nbr_points; i++) {
+        s11_re[i] = points[i].s11.re;
+        s11_im[i] = points[i].s11.im;
+        s21_re[i] = points[i].s21.re;
+        s21_im[i] = points[i].s21.im;
+    }
+
+    int k = first_bin;
+    correct_reflection(nbr_points, s11_re, s11_im,
+                       cal->re[CAL_E00] + k, cal->im[CAL_E00] + k,
+                       cal->re[CAL_E11] + k, cal->im[CAL_E11] + k,
+                       cal->re[CAL_E10E01] + k, cal->im[CAL_E10E01] + k);
+    if (cal->thru) {
+        correct_transmission(nbr_points, s21_re, s21_im, s11_re, s11_im,
+                             cal->re[CAL_E30] + k, cal->im[CAL_E30] + k,
+                             cal->re[CAL_E11] + k, cal->im[CAL_E11] + k,
+                             cal->re[CAL_E10E32] + k, cal->im[CAL_E10E32] + k);
+    }
+
+    for (int i = 0; i < nbr_points; i++) {
+        points[i].s11 = (struct complex){s11_re[i], s11_im[i]};
+        points[i].s21 = (struct complex){s21_re[i], s21_im[i]};
+    }
+}
+
+//----------------------------------------
+// Calibration files
+//----------------------------------------
+
+static uint8_t* put_u16(uint8_t *out, uint16_t value) {
+    out[0] = value & 0xff;
+    out[1] = value >> 8;
+    return out + 2;
+}
+
+static uint8_t* put_u32(uint8_t *out, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        out[i] = (value >> (8 * i)) & 0xff;
+    return out + 4;
+}
+
+static uint8_t* put_u64(uint8_t *out, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        out[i] = (value >> (8 * i)) & 0xff;
+    return out + 8;
+}
+
+static uint8_t* put_f32(uint8_t *out, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return put_u32(out, bits);
+}
+
+static uint64_t get_le(const uint8_t *in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++)
+        value |= (uint64_t)in[i] << (8 * i);
+    return value;
+}
+
+static float get_f32(const uint8_t *in) {
+    uint32_t bits = get_le(in, 4);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+int save_calibration(const struct calibration *cal, const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s for writing: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    uint8_t header[CAL_FILE_HEADER_SIZE];
+    memcpy(header, CAL_FILE_MAGIC, 4);
+    uint8_t *p = put_u16(header + 4, CAL_FILE_VERSION);
+    p = put_u16(p, cal->thru ? CAL_FLAG_THRU : 0);
+    put_u32(p, cal->nbr_points);
+    bool failed = fwrite(header, sizeof(header), 1, f) != 1;
+
+    for (int k = 0; k < cal->nbr_points && !failed; k++) {
+        uint8_t point[CAL_FILE_POINT_SIZE];
+        p = put_u64(point, cal->freqs[k]);
+        for (int t = 0; t < CAL_TERMS; t++) {
+            p = put_f32(p, cal->re[t][k]);
+            p = put_f32(p, cal->im[t][k]);
+        }
+        failed = fwrite(point, sizeof(point), 1, f) != 1;
+    }
+    if (fclose(f) != 0)
+        failed = true;
+    if (failed) {
+        fprintf(stderr, "Failed to write calibration to %s\n", path);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int load_calibration(struct calibration *cal, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    uint8_t header[CAL_FILE_HEADER_SIZE];
+    if (fread(header, sizeof(header), 1, f) != 1 || memcmp(header, CAL_FILE_MAGIC, 4) != 0
+        || get_le(header + 4, 2) != CAL_FILE_VERSION) {
+        fprintf(stderr, "%s is not a calibration file\n", path);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+    uint32_t nbr_points = get_le(header + 8, 4);
+    if (nbr_points < 1 || nbr_points > INT32_MAX / CAL_FILE_POINT_SIZE
+        || create_calibration(cal, nbr_points, get_le(header + 6, 2) & CAL_FLAG_THRU) != EXIT_SUCCESS) {
+        fprintf(stderr, "%s has an invalid number of points\n", path);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+
+    for (int k = 0; k < cal->nbr_points; k++) {
+        uint8_t point[CAL_FILE_POINT_SIZE];
+        if (fread(point, sizeof(point), 1, f) != 1
+            || (cal->freqs[k] = get_le(point, 8)) <= (k > 0 ? cal->freqs[k - 1] : 0)) {
+            fprintf(stderr, "%s is truncated or its frequencies are out of order\n", path);
+            destroy_calibration(cal);
+            fclose(f);
+            return EXIT_FAILURE;
+        }
+        for (int t = 0; t < CAL_TERMS; t++) {
+            cal->re[t][k] = get_f32(point + 8 + 8 * t);
+            cal->im[t][k] = get_f32(point + 12 + 8 * t);
+        }
+    }
+    fclose(f);
+    return EXIT_SUCCESS;
+}
+
+//----------------------------------------
+// Calibrations in use
+//----------------------------------------
+
+static struct calibration *vna_calibrations[MAXIMUM_VNA_PORTS];
+static pthread_mutex_t calibration_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int set_vna_calibration(int vna_id, struct calibration *cal) {
+    if (vna_id < 0 || vna_id >= MAXIMUM_VNA_PORTS) {
+        if (cal) {
+            destroy_calibration(cal);
+            free(cal);
+        }
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_lock(&calibration_lock);
+    struct calibration *old = vna_calibrations[vna_id];
+    vna_calibrations[vna_id] = cal;
+    pthread_mutex_unlock(&calibration_lock);
+    if (old) {
+        destroy_calibration(old);
+        free(old);
+    }
+    return EXIT_SUCCESS;
+}
+
+int get_vna_calibration(int vna_id, int *nbr_points, uint64_t *start, uint64_t *stop, bool *thru) {
+    if (vna_id < 0 || vna_id >= MAXIMUM_VNA_PORTS)
+        return EXIT_FAILURE;
+    int error = EXIT_FAILURE;
+    pthread_mutex_lock(&calibration_lock);
+    struct calibration *cal = vna_calibrations[vna_id];
+    if (cal) {
+        *nbr_points = cal->nbr_points;
+        *start = cal->freqs[0];
+        *stop = cal->freqs[cal->nbr_points - 1];
+        *thru = cal->thru;
+        error = EXIT_SUCCESS;
+    }
+    pthread_mutex_unlock(&calibration_lock);
+    return error;
+}
+
+int save_vna_calibration(int vna_id, const char *path) {
+    if (vna_id < 0 || vna_id >= MAXIMUM_VNA_PORTS)
+        return EXIT_FAILURE;
+    int error = EXIT_FAILURE;
+    pthread_mutex_lock(&calibration_lock);
+    if (vna_calibrations[vna_id])
+        error = save_calibration(vna_calibrations[vna_id], path);
+    pthread_mutex_unlock(&calibration_lock);
+    return error;
+}
+
+struct calibration* plan_vna_calibration(int vna_id, const struct sweep_plan *plan) {
+    if (vna_id < 0 || vna_id >= MAXIMUM_VNA_PORTS)
+        return NULL;
+    struct calibration *out = NULL;
+    pthread_mutex_lock(&calibration_lock);
+    struct calibration *cal = vna_calibrations[vna_id];
+    if (cal) {
+        out = malloc(sizeof(struct calibration));
+        if (!out || resample_calibration(cal, plan->freqs, plan->nbr_points, out) != EXIT_SUCCESS) {
+            fprintf(stderr, "Calibration of vna %d (%" PRIu64 "-%" PRIu64 " Hz) doesn't cover this sweep, its scans are not corrected\n",
+                vna_id, cal->freqs[0], cal->freqs[cal->nbr_points - 1]);
+            free(out);
+            out = NULL;
+        }
+    }
+    pthread_mutex_unlock(&calibration_lock);
+    return out;
+}
@@ -0,0 +1,258 @@
+#ifndef VNACALIBRATION_H_
+#define VNACALIBRATION_H_
+
+#include "VnaScanMultithreaded.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * Binary layout of a calibration file, all integers little endian:
+ *     0  magic       "VNAC"
+ *     4  version     uint16, CAL_FILE_VERSION
+ *     6  flags       uint16, CAL_FLAG_THRU if the S21 terms were solved
+ *     8  nbr_points  uint32
+ *     12 the points, CAL_FILE_POINT_SIZE bytes each: frequency uint64, then
+ *        the real and imaginary parts of each CalTerm in order, as float32
+ */
+#define CAL_FILE_MAGIC "VNAC"
+#define CAL_FILE_VERSION 1
+#define CAL_FILE_HEADER_SIZE 12
+#define CAL_FILE_POINT_SIZE 56
+#define CAL_FLAG_THRU 1
+
+/**
+ * Calibration standards, measured on port 1 (and port 2 for CAL_THRU)
+ *
+ * CAL_SHORT - short circuit on port 1
+ * CAL_OPEN  - open circuit on port 1
+ * CAL_LOAD  - 50 ohm load on port 1, and on port 2 so its S21 gives the
+ *             isolation between the ports
+ * CAL_THRU  - port 1 connected straight to port 2
+ */
+typedef enum {
+    CAL_SHORT,
+    CAL_OPEN,
+    CAL_LOAD,
+    CAL_THRU,
+    CAL_STANDARDS
+} CalStandard;
+
+/**
+ * Error terms of the forward (port 1 driving) error model, per frequency
+ *
+ * CAL_E00    - directivity
+ * CAL_E11    - source match
+ * CAL_E10E01 - reflection tracking
+ * CAL_E30    - isolation
+ * CAL_E22    - load match
+ * CAL_E10E32 - transmission tracking
+ *
+ * A measured S11m is related to the real S11 by
+ *     S11m = e00 + e10e01 S11 / (1 - e11 S11)
+ * and S21 is corrected for tracking, isolation and source mismatch with
+ *     S21 = (S21m - e30) (1 - e11 S11) / e10e32
+ */
+typedef enum {
+    CAL_E00,
+    CAL_E11,
+    CAL_E10E01,
+    CAL_E30,
+    CAL_E22,
+    CAL_E10E32,
+    CAL_TERMS
+} CalTerm;
+
+/**
+ * Solved error terms on a frequency grid
+ *
+ * The terms are stored as separate arrays of real and imaginary parts, so
+ * apply_calibration works through each as a contiguous run of floats.
+ */
+struct calibration {
+    int nbr_points;
+    bool thru;                  // S21 terms solved, otherwise S21 is left alone
+    uint64_t *freqs;            // nbr_points frequencies, strictly increasing
+    float *re[CAL_TERMS];       // nbr_points real parts of each term
+    float *im[CAL_TERMS];       // nbr_points imaginary parts of each term
+};
+
+/**
+ * Measurements of the standards on one sweep plan, ready to solve
+ */
+struct cal_capture {
+    struct sweep_plan plan;                 // grid the standards are measured on
+    bool measured[CAL_STANDARDS];
+    struct complex *s11[CAL_STANDARDS];     // plan.nbr_points readings of each standard
+    struct complex *s21[CAL_STANDARDS];
+};
+
+/**
+ * Sets up a calibration with every term zero
+ *
+ * @param cal pointer to the space reserved for this struct (uninitialised)
+ * @param nbr_points number of frequencies, at least 1
+ * @param thru if the S21 terms are used
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on bad arguments or failed allocation
+ */
+int create_calibration(struct calibration *cal, int nbr_points, bool thru);
+
+/**
+ * Frees the arrays of a calibration (but not the struct itself)
+ *
+ * @param cal pointer to the calibration to clean up
+ */
+void destroy_calibration(struct calibration *cal);
+
+/**
+ * Sets up a capture of the standards over a sweep plan
+ *
+ * @param cap pointer to the space reserved for this struct (uninitialised)
+ * @param plan the plan to measure the standards on, which the capture takes
+ *        over: destroy the capture rather than the plan
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on failed allocation (the plan is
+ *         destroyed either way)
+ */
+int create_cal_capture(struct cal_capture *cap, struct sweep_plan *plan);
+
+/**
+ * Frees a capture and its plan (but not the struct itself)
+ *
+ * @param cap pointer to the capture to clean up
+ */
+void destroy_cal_capture(struct cal_capture *cap);
+
+/**
+ * Stores one scan of a standard in a capture
+ *
+ * @param cap the capture to store in
+ * @param standard which standard is connected
+ * @param scan index of the scan in the capture's plan
+ * @param data the scan pulled from the VNA, with the plan's points for that scan
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the scan doesn't match the plan
+ */
+int record_standard(struct cal_capture *cap, CalStandard standard, int scan, const struct datapoint_nanoVNA_H *data);
+
+/**
+ * Measures a standard over the capture's whole plan, pulling each scan
+ * from the VNA with pull_scan_retry as a sweep would
+ *
+ * The VNA must not be in use by a running sweep.
+ *
+ * @param cap the capture to store in
+ * @param standard which standard is connected
+ * @param vna_id the VnaCommunication ID of the VNA
+ * @param retries extra attempts allowed per failed scan
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any scan could not be pulled
+ *         (the standard is then not marked as measured)
+ */
+int measure_standard(struct cal_capture *cap, CalStandard standard, int vna_id, int retries);
+
+/**
+ * Solves the error terms at every point of a capture
+ *
+ * Short, open and load must have been measured, and are taken to be ideal.
+ * If the thru has been measured too, the S21 terms are solved as well.
+ *
+ * @param cap the capture to solve
+ * @param cal pointer to the space reserved for the result (uninitialised)
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if a standard is missing, two
+ *         standards measured the same at some frequency, or allocation failed
+ */
+int solve_calibration(const struct cal_capture *cap, struct calibration *cal);
+
+/**
+ * Works out a calibration's terms on another grid, interpolating linearly
+ * between its points where the grids differ
+ *
+ * @param cal the calibration to resample
+ * @param freqs frequencies to resample onto, strictly increasing
+ * @param nbr_points number of frequencies
+ * @param out pointer to the space reserved for the result (uninitialised)
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if some frequency is outside the
+ *         calibrated band (by more than 1 Hz) or allocation failed
+ */
+int resample_calibration(const struct calibration *cal, const uint64_t *freqs, int nbr_points, struct calibration *out);
+
+/**
+ * Corrects the readings of one scan in place
+ *
+ * @param cal calibration on the sweep's grid (see resample_calibration)
+ * @param first_bin index into cal of the scan's first point
+ * @param points the scan's readings
+ * @param nbr_points number of readings, which must all be within cal
+ */
+void apply_calibration(const struct calibration *cal, int first_bin, struct nanovna_raw_datapoint *points, int nbr_points);
+
+/**
+ * Writes a calibration to a file in the format described above
+ *
+ * @param cal the calibration to save
+ * @param path the file to create or overwrite
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the file can't be written
+ */
+int save_calibration(const struct calibration *cal, const char *path);
+
+/**
+ * Reads a calibration written by save_calibration
+ *
+ * @param cal pointer to the space reserved for the result (uninitialised)
+ * @param path the file to read
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the file can't be read or
+ *         isn't a valid calibration file
+ */
+int load_calibration(struct calibration *cal, const char *path);
+
+//----------------------------------------
+// Calibrations in use
+//----------------------------------------
+
+/**
+ * Sets the calibration applied to every sweep started on a VNA from now on
+ *
+ * @param vna_id the VnaCommunication ID of the VNA
+ * @param cal a calibration allocated with malloc, which is freed when
+ *        replaced, or NULL to turn calibration off for the VNA
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on id out of bounds (cal is freed)
+ */
+int set_vna_calibration(int vna_id, struct calibration *cal);
+
+/**
+ * Describes the calibration in use on a VNA
+ *
+ * @param vna_id the VnaCommunication ID of the VNA
+ * @param nbr_points set to the number of calibrated frequencies
+ * @param start set to the first calibrated frequency
+ * @param stop set to the last calibrated frequency
+ * @param thru set to whether S21 is corrected too
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the VNA is not calibrated
+ */
+int get_vna_calibration(int vna_id, int *nbr_points, uint64_t *start, uint64_t *stop, bool *thru);
+
+/**
+ * Saves the calibration in use on a VNA
+ *
+ * @param vna_id the VnaCommunication ID of the VNA
+ * @param path the file to create or overwrite
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the VNA is not calibrated or
+ *         the file can't be written
+ */
+int save_vna_calibration(int vna_id, const char *path);
+
+/**
+ * Makes a copy of the calibration in use on a VNA for a sweep, on the
+ * sweep's grid
+ *
+ * @param vna_id the VnaCommunication ID of the VNA
+ * @param plan the sweep's plan
+ * @return the calibration (free with destroy_calibration and free), or
+ *         NULL if the VNA isn't calibrated or its calibration doesn't
+ *         cover the sweep
+ */
+struct calibration* plan_vna_calibration(int vna_id, const struct sweep_plan *plan);
+
+#endif
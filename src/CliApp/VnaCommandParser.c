@@ -56,18 +56,82 @@ int is_valid_long(const char* tok) {
     return 1;
 }
 
+int tokenise_command(struct command *cmd, const char *line) {
+    cmd->nbr_tokens = 0;
+    cmd->next = 0;
+    if (strlen(line) >= MAX_COMMAND_LENGTH)
+        return EXIT_FAILURE;
+    strcpy(cmd->line, line);
+
+    char *c = cmd->line;
+    while (*c != '\0') {
+        while (*c != '\0' && isspace((unsigned char)*c))
+            *c++ = '\0';
+        if (*c == '\0' || *c == '#')
+            break;
+        if (cmd->nbr_tokens == MAX_COMMAND_TOKENS)
+            return EXIT_FAILURE;
+        cmd->tokens[cmd->nbr_tokens++] = c;
+        while (*c != '\0' && !isspace((unsigned char)*c))
+            c++;
+    }
+    // anything after a comment is not a token
+    *c = '\0';
+    return EXIT_SUCCESS;
+}
+
+char* next_token(struct command *cmd) {
+    if (cmd->next >= cmd->nbr_tokens)
+        return NULL;
+    return cmd->tokens[cmd->next++];
+}
+
+char* peek_token(struct command *cmd) {
+    if (cmd->next >= cmd->nbr_tokens)
+        return NULL;
+    return cmd->tokens[cmd->next];
+}
+
 // settings
 long start;
 long stop;
 int resolution;
 int nbr_scans;
+bool plan_points;
 int pps;
 int sweeps;
 int time_to_sweep;
+int sweep_period_ms;
+int sweep_at;       // seconds after midnight (local time) of the first sweep, or -1 for straight away
+uint64_t producer_cpus;
+uint64_t consumer_cpus;
+int rt_priority;
 bool verbose;
+bool share_bands;
+int scan_retries;
+bool resync;
+int buffer_capacity;
+BufferPolicy buffer_policy;
+int buffer_mb;
+SweepOutput sweep_output;
+TdrMode tdr_mode;
+TdrWindow tdr_window;
+PeakMode peak_mode;
+int peak_window;
+struct sweep_segment segments[MAX_SWEEP_SEGMENTS];
+int nbr_segments;
 
-void help() {
-    char* tok = strtok(NULL, " \n");
+static const char *output_names[] = {"touchstone", "archive", "both", "none"};
+
+/**
+ * Guards the settings, segments and calibration captures, as background
+ * jobs run commands on their own threads. Held for the whole of any
+ * command that reads or changes them (see uses_settings).
+ */
+static pthread_mutex_t settings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void help(struct command *cmd) {
+    char* tok = next_token(cmd);
     if (tok == NULL) {
         printf("\
     exit: safely exits the program\n\
@@ -77,10 +141,20 @@ void help() {
     scan <command>: scan commands (see 'help scan' for details)\n\
     sweep <command>: sweep commands (see 'help sweep' for details)\n\
     set: sets a parameter to a new value\n\
-    vna: executes specified vna command (see 'help vna' for details)\n"
+    vna: executes specified vna command (see 'help vna' for details)\n\
+    stream <command>: serves scans over the network (see 'help stream')\n\
+    segment <command>: sweeps several bands, each with its own\n\
+                       density of points (see 'help segment')\n\
+    plan [vna ids]: predicts how long a 'scan num' would take\n\
+    cal <command>: calibrates VNAs with short, open, load and\n\
+                   thru standards (see 'help cal')\n\
+    jobs: lists commands running in the background (see 'help jobs')\n\
+    wait [job id]: waits for background commands to finish\n\
+    sleep <seconds>: pauses, e.g. to let a sweep run in a script\n\
+    Ending any command with '&' runs it in the background.\n"
         );
     } else if (strcmp(tok,"scan") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             printf("\
     Starts a scan with current settings. Options:\n\
@@ -99,7 +173,7 @@ void help() {
         } else if (strcmp(tok,"time") == 0) {
             printf("\
     Starts a scan with current settings that runs for the given amount of\n\
-    time in seconds (time_to_sweep).\n\
+    time in seconds (see 'set time').\n\
     Uses the specified vna ids, or all connected vnas if no vna ids given.\n\
     Usage example:\n\
         scan time 2 3 5\n\
@@ -114,7 +188,7 @@ void help() {
             );
         }
     } else if (strcmp(tok,"sweep") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             printf("\
     Options:\n\
@@ -122,8 +196,12 @@ void help() {
                                 uses specified VNAs, or all connected\n\
                                 VNAs if no VNA IDs specific.\n\
         sweep stop [scan id] -  stops specified sweep, or all sweeps if\n\
-                                no scan id specified\n\
-        sweep list - lists the status of all available scan IDs\n"
+                                no scan id specified, once the sub-scans\n\
+                                in progress are done\n\
+        sweep wait [scan id] [timeout] - waits for the specified sweep,\n\
+                                or all sweeps, to finish by themselves\n\
+        sweep list - lists the status of all available scan IDs\n\
+                     and the buffer counters of running sweeps\n"
             );
         } else if (strcmp(tok,"start") == 0) {
             printf("\
@@ -139,19 +217,37 @@ void help() {
     returning control to the user.\n\
     To discover active sweeps, use 'sweep list'.\n"
             );
+        } else if (strcmp(tok,"wait") == 0) {
+            printf("\
+    Waits until the specified sweep (or every sweep, with 'all' or no\n\
+    scan id) has finished by itself, then frees its scan id. Sweeps\n\
+    started by 'scan num' finish after their last sweep, and 'scan time'\n\
+    ones when their time is up. 'sweep start' sweeps only finish when\n\
+    stopped, so they are skipped unless a timeout in seconds is given.\n\
+    Returns as soon as the sweep is done, so scripts can start the next\n\
+    one straight away:\n\
+        scan num\n\
+        sweep wait\n\
+        scan num 0 1\n\
+        sweep wait all 60\n"
+            );
         } else if (strcmp(tok,"list") == 0) {
             printf("\
     Lists all scan ids, and their current states. Possible states:\n\
         'vacant' - no scan is currently assigned to this id\n\
         'idle' - a scan is assigned to this id, but is not currently\n\
         active. You can free the id with 'sweep stop'.\n\
-        'busy' - an active scan is using this id.\n"
+        'busy' - an active scan is using this id.\n\
+    Running sweeps also show their buffer: scans waiting (and the most\n\
+    ever waiting), how often and how long the VNAs waited for room,\n\
+    and scans dropped or spilled to disk (see 'help set').\n"
             );
         } else {
             printf("\
     command not recognised. sweep subcommands:\n\
         sweep start\n\
         sweep stop\n\
+        sweep wait\n\
         sweep list\n\
     see 'help sweep' for more.\n"
             );
@@ -163,15 +259,52 @@ void help() {
     Paramters you can set:\n\
         start - starting frequency\n\
         stop - stopping frequency\n\
+        res - total points per sweep, split into as few scans as\n\
+              possible (or, for a 'scan num' shared between VNAs, into\n\
+              enough scans to keep every VNA busy)\n\
         scans - number of scans to compute\n\
         sweeps - number of sweeps to perform\n\
+        time - seconds a 'scan time' runs for\n\
+        period - milliseconds from the start of one sweep to the start\n\
+                 of the next, so sweeps keep a steady cadence (0 to\n\
+                 start each as soon as the last is done)\n\
+        at - time of day the first sweep starts, as HH:MM or HH:MM:SS\n\
+             (the next time it comes round), or 'now'\n\
         points - number of points per scan\n\
         verbose - if readings should be printed to stdout\n\
-    For example: set start 100000000\n");
+        share - if VNAs should split each sweep's scans between them,\n\
+                with idle VNAs taking scans from busy ones\n\
+        retries - times a failed scan is retried before it is dropped\n\
+        resync - if a sync command is sent to the VNA before a retry\n\
+        buffer - scans held between the VNAs and output (1 to %d)\n\
+        buffer_mb - size the buffer to fit in this many MiB instead,\n\
+                    whatever the points per scan (0 to use 'buffer')\n\
+        backpressure - what happens when output falls behind and the\n\
+                       buffer is full:\n\
+            block - VNAs wait for room (default)\n\
+            oldest - the oldest waiting scan is dropped\n\
+            newest - the new scan is dropped\n\
+            spill - scans overflow to a temporary file on disk\n\
+        cpus - CPUs the VNA threads are pinned to, one each in turn,\n\
+               such as 2,3 or 2-5 ('any' to leave them unpinned)\n\
+        consumer_cpus - CPUs the thread writing out scans may use\n\
+        priority - real-time (SCHED_FIFO) priority of the VNA threads,\n\
+                   1 to 99, needs root or CAP_SYS_NICE (0 for normal)\n\
+        output - files scans are saved to: touchstone (default),\n\
+                 archive (compressed .vnar), both or none\n\
+        tdr - time domain response of S11 worked out as each sweep\n\
+              completes, saved to a .tdr file: off (default), impulse\n\
+              or step, then optionally the window: rectangular,\n\
+              hann (default) or blackman. Needs evenly spaced points.\n\
+        peak - resonance tracked through each VNA's sweeps, saved to a\n\
+               .peaks.csv file of f0, Q and depth: off (default),\n\
+               s21peak, s21dip or s11dip, then optionally the points\n\
+               either side of the last one to search (0 for 5%% of them)\n\
+    For example: set start 100000000\n", MAX_BUFFER_CAPACITY);
     } else if (strcmp(tok,"list") == 0) {
         printf("Lists the current settings used for the scan.\n");
     } else if (strcmp(tok,"vna") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             printf("\
     Family of commands to manage VNA connections.\n\
@@ -182,6 +315,8 @@ void help() {
         for devices of the format ttyACM*\n\
         vna ping - pings all connected VNAs and checks for a response\n\
         vna id - prints board and version of all connected VNAs\n\
+        vna stats [reset] - prints scan reliability stats of connected VNAs\n\
+        vna capture <id> <file/stop> - records a VNA's serial traffic\n\
         vna reset - restarts all vnas, closing connections\n");
         } else if (strcmp(tok,"add") == 0) {
             printf("\
@@ -189,8 +324,17 @@ void help() {
     that it is reachable and that it represents a NanoVNA-H device.\n\
     If no port name is given, attempts to connect to any USB-serial\n\
     device connected to your device and check if it is a NanoVNA-H\n\
+    A capture file made with 'vna capture' can be added as a VNA by\n\
+    prefixing its path with replay: - it answers every scan with the\n\
+    recorded data, as fast as it can be read.\n\
+    A VNA shared over the network (e.g. with ser2net) can be added\n\
+    with tcp:<host>:<port>, and memory:<name> adds an emulated VNA\n\
+    for trying the app out without any hardware.\n\
     Usage example:\n\
-        vna add /dev/ttyACM0\n");
+        vna add /dev/ttyACM0\n\
+        vna add replay:capture0.bin\n\
+        vna add tcp:192.168.1.20:3001\n\
+        vna add memory:0\n");
         } else if (strcmp(tok,"remove") == 0) {
             printf("\
     Attempts to disconnect the specified VNA device, if it can\n\
@@ -212,6 +356,21 @@ void help() {
     Prints the board and firmware version of every connected VNA\n\
     in the format:\n\
         <num>. <serial_port> <board> version <version>\n");
+        } else if (strcmp(tok,"stats") == 0) {
+            printf("\
+    Prints, for every connected VNA, how many scans were pulled, how\n\
+    many pulls failed, how many retries and resyncs were needed, how\n\
+    many scans were dropped, the mean and worst recovery time, and\n\
+    the estimated time the VNA takes to measure each point.\n\
+    'vna stats reset' sets all the counters back to zero.\n");
+        } else if (strcmp(tok,"capture") == 0) {
+            printf("\
+    Records everything sent to and received from a VNA in a file,\n\
+    which can later be replayed with 'vna add replay:<file>'.\n\
+    'vna capture <id> stop' finishes the recording.\n\
+    Usage example:\n\
+        vna capture 0 capture0.bin\n\
+        vna capture 0 stop\n");
         } else if (strcmp(tok,"reset") == 0) {
             printf("\
     Sends the rest command to every VNA and closes their connection\n\
@@ -224,9 +383,118 @@ void help() {
         vna list\n\
         vna ping\n\
         vna id\n\
+        vna stats\n\
+        vna capture\n\
         vna reset\n\
     see 'help vna' for more.\n");
         }
+    } else if (strcmp(tok,"stream") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("\
+    Options:\n\
+        stream start <port> [drop/disconnect] - starts serving scans\n\
+        stream stop - disconnects all clients and stops serving\n\
+        stream list - lists connected clients\n");
+        } else if (strcmp(tok,"start") == 0) {
+            printf("\
+    Serves every scan to programs connecting to the given TCP port,\n\
+    in the binary format described in VnaStreamServer.h. The next\n\
+    port up takes commands, one per line, as typed here, and sends\n\
+    back everything this program prints. 'exit' disconnects.\n\
+    Each client has its own queue, so a slow client never holds up\n\
+    scanning. When a queue is full the client either misses scans\n\
+    (drop, the default) or is disconnected (disconnect).\n\
+    Usage example:\n\
+        stream start 5025\n\
+        stream start 5025 disconnect\n");
+        } else if (strcmp(tok,"stop") == 0) {
+            printf("\
+    Disconnects every client and stops serving scans.\n");
+        } else if (strcmp(tok,"list") == 0) {
+            printf("\
+    Lists connected clients, with how many scans (or, for control\n\
+    clients, chunks of output) have been sent or dropped, and how\n\
+    many bytes are waiting to be sent.\n");
+        } else {
+            printf("\
+    command not recognised. stream subcommands:\n\
+        stream start\n\
+        stream stop\n\
+        stream list\n\
+    see 'help stream' for more.\n");
+        }
+    } else if (strcmp(tok,"plan") == 0) {
+        printf("\
+    Predicts how long 'scan num' would take with the current settings,\n\
+    without starting it, on the given VNAs (or all connected VNAs).\n\
+    The prediction comes from each VNA's recent scans, fitted to a fixed\n\
+    time per scan command plus a time per point ('vna stats' shows\n\
+    both). VNAs that have not scanned yet use typical NanoVNA-H figures.\n\
+    'sweep list' shows the same prediction for sweeps that are running.\n");
+    } else if (strcmp(tok,"segment") == 0) {
+        printf("\
+    Instead of one band from start to stop, sweeps can be made of\n\
+    segments, each with its own number of points, spaced linearly or\n\
+    logarithmically. For example, points every 10kHz across a filter's\n\
+    passband, and every 5MHz either side of it. The segments are\n\
+    covered with as few scan commands as possible (each of up to\n\
+    'points' points), which is much quicker than sweeping the whole band\n\
+    at the finest spacing.\n\
+        segment add <start> <stop> <points> [linear/log] - adds a segment\n\
+        segment list - lists the segments and the scans they need\n\
+        segment clear - removes all segments, going back to start/stop\n\
+    Segments must be added in order of frequency and not overlap, but\n\
+    one may start where the last stopped.\n\
+    Usage example:\n\
+        segment add 50000000 100000000 11\n\
+        segment add 100000000 110000000 1001\n\
+        segment add 110000000 900000000 161 log\n");
+    } else if (strcmp(tok,"cal") == 0) {
+        printf("\
+    Corrects each VNA's readings for its own cables and imperfections.\n\
+    Connect each standard to the end of the cables in turn and measure\n\
+    it, over the band the sweeps will cover (the current settings):\n\
+        cal measure short <vna id> - short circuit on port 1\n\
+        cal measure open <vna id> - open circuit on port 1\n\
+        cal measure load <vna id> - 50 ohm loads on ports 1 and 2\n\
+        cal measure thru <vna id> - port 1 connected to port 2 (optional,\n\
+                                    without it only S11 is corrected)\n\
+        cal solve <vna id> - works out the corrections and uses them\n\
+        cal save <vna id> <file> - saves the corrections\n\
+        cal load <vna id> <file> - loads saved corrections and uses them\n\
+        cal off <vna id> - stops correcting the VNA's readings\n\
+        cal list - shows which VNAs are calibrated\n\
+    Sweeps started afterwards have every scan corrected before it is\n\
+    printed, saved or streamed. Sweeps over a different grid are\n\
+    corrected by interpolating between the calibrated points, but must\n\
+    stay within the calibrated band.\n\
+    Usage example:\n\
+        cal measure short 0\n\
+        cal measure open 0\n\
+        cal measure load 0\n\
+        cal solve 0\n\
+        cal save 0 vna0.cal\n");
+    } else if (strcmp(tok,"jobs") == 0 || strcmp(tok,"wait") == 0 || strcmp(tok,"sleep") == 0) {
+        printf("\
+    Ending a command with '&' runs it in the background as a job, so\n\
+    slow commands such as 'sweep stop' or 'vna add' don't hold up the\n\
+    next one. Each job is given an id when it starts, and prints when\n\
+    it is done. Sweeps always run in the background: 'sweep list'\n\
+    shows their status. Commands that read or change the settings\n\
+    (set, segment, cal, plan, list, stream, scan and sweep start) take\n\
+    turns, so one never sees another's changes half made.\n\
+        jobs - lists running and finished jobs\n\
+        wait [job id] - waits for the given job, or all jobs, to finish\n\
+        sleep <seconds> - pauses for the given time\n\
+    Commands can also be given when the program starts, and it exits\n\
+    once they have run (or carries on reading commands with -i):\n\
+        ./VnaCommandParser -c \"vna add memory:0; sweep start; sleep 5; sweep stop\"\n\
+        ./VnaCommandParser script.txt\n\
+    Scripts have one command per line, and '#' starts a comment.\n\
+    Usage example:\n\
+        sweep stop 0 &\n\
+        wait 1\n");
     } else if (strcmp(tok,"help") == 0) {
         printf("\
     prints a user guide for the specified command,\n\
@@ -238,8 +506,9 @@ void help() {
     }
 }
 
-int get_vna_list_from_args(char* tok, int* vnas) {
+int get_vna_list_from_args(struct command *cmd, int* vnas) {
     int count = 0;
+    char* tok = next_token(cmd);
     while (tok != NULL && count < MAXIMUM_VNA_PORTS) {
         if (!is_valid_int(tok)) {
             printf("ERROR: vna ids must be valid integers.\n");
@@ -258,17 +527,72 @@ int get_vna_list_from_args(char* tok, int* vnas) {
         } else {
             printf("vna %d not connected\n",vna_id);
         }
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
     }
     return count;
 }
 
-void scan() {
+/**
+ * @return the most points per scan a segmented sweep may use: as many as a
+ *         scan can take, unless 'points' was set directly
+ */
+static int segment_pps() {
+    return plan_points ? MAX_POINTS_PER_SCAN : pps;
+}
+
+/**
+ * Works out when a time of day next comes round
+ * 
+ * @param secs seconds after midnight, local time, or -1
+ * @return the wall clock time, today's if it is still to come and
+ *         otherwise tomorrow's, or 0 if secs is -1
+ */
+static time_t next_time_of_day(int secs) {
+    if (secs < 0)
+        return 0;
+    time_t now = time(NULL);
+    struct tm day;
+    localtime_r(&now, &day);
+    day.tm_hour = secs / 3600;
+    day.tm_min = secs / 60 % 60;
+    day.tm_sec = secs % 60;
+    day.tm_isdst = -1;
+    time_t at = mktime(&day);
+    if (at <= now) {
+        day.tm_mday++;
+        day.tm_isdst = -1;
+        at = mktime(&day);
+    }
+    return at;
+}
+
+/**
+ * Fills in the sweep options from the current settings, re-planning the
+ * scans from the latest scan timings if the resolution was set directly
+ * 
+ * @param options the options to fill in
+ * @param nbr_vnas number of VNAs the sweep will use
+ * @param nbr_sweeps number of sweeps to run, or 0 if running until stopped
+ * @param sweep_scans set to the number of scans per sweep
+ * @param sweep_pps set to the (most) points per scan
+ */
+static void sweep_settings(struct sweep_options *options, int nbr_vnas, int nbr_sweeps, int *sweep_scans, int *sweep_pps) {
+    *options = (struct sweep_options){share_bands, scan_retries, resync, buffer_capacity, buffer_policy, buffer_mb,
+                                      segments, nbr_segments, resolution, sweep_period_ms, next_time_of_day(sweep_at),
+                                      producer_cpus, consumer_cpus, rt_priority, sweep_output,
+                                      tdr_mode, tdr_window, peak_mode, peak_window};
+    *sweep_scans = nbr_scans;
+    *sweep_pps = segment_pps();
+    if (plan_points && nbr_segments == 0)
+        calculate_shared_resolution(resolution, share_bands ? nbr_vnas : 1, nbr_sweeps, sweep_scans, sweep_pps);
+}
+
+void scan(struct command *cmd) {
     const char *interactive_label = "InteractiveMode";
     SweepMode sweep_mode;
     int nbr_sweeps;
 
-    char* tok = strtok(NULL, " \n");
+    char* tok = next_token(cmd);
     if (tok == NULL) {
         printf("Usage: scan <sweep_mode> [vna_ids]\nSee 'help scan' for more info.\n");
         return;
@@ -289,25 +613,160 @@ void scan() {
         return;
     }
 
-    tok = strtok(NULL, " \n");
-    int nbr_vnas = (tok == NULL ? get_connected_vnas(vna_list) : get_vna_list_from_args(tok,vna_list));
+    int nbr_vnas = (peek_token(cmd) == NULL ? get_connected_vnas(vna_list) : get_vna_list_from_args(cmd,vna_list));
     if (nbr_vnas < 1) {
         printf("%d vnas not enough", nbr_vnas);
         return;
     }
 
-    start_sweep(nbr_vnas, vna_list, nbr_scans, start, stop, sweep_mode, nbr_sweeps, pps, interactive_label, verbose);
+    struct sweep_options options;
+    int sweep_scans, sweep_pps;
+    sweep_settings(&options, nbr_vnas, sweep_mode == NUM_SWEEPS ? nbr_sweeps : 0, &sweep_scans, &sweep_pps);
+    int scan_id = start_sweep(nbr_vnas, vna_list, sweep_scans, start, stop, sweep_mode, nbr_sweeps, sweep_pps, interactive_label, verbose, &options);
+    if (scan_id >= 0)
+        printf("Started sweep %d\n", scan_id);
 }
 
-void sweep() {
-    char* tok = strtok(NULL, " \n");
+/**
+ * Prints how long from now a prediction is, and the time of day it falls at
+ */
+static void print_prediction(double remaining_ns) {
+    time_t done = time(NULL) + (time_t)(remaining_ns / 1e9 + 0.5);
+    char clock[16];
+    strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&done));
+    printf("%.1f s, finishing at %s", remaining_ns / 1e9, clock);
+}
+
+void print_scan_progress(const struct scan_progress *progress) {
+    uint64_t now_ns = monotonic_ns();
+    double elapsed = (now_ns - progress->start_ns) / 1e9;
+    printf("        %ld scans, %ld points in %.1f s (%.0f points/s), ",
+        progress->scans_done, progress->points_done, elapsed,
+        elapsed > 0 ? progress->points_done / elapsed : 0.0);
+    double remaining_ns;
+    if (predict_scan_remaining(progress, now_ns, &remaining_ns) == EXIT_SUCCESS) {
+        printf("ETA ");
+        print_prediction(remaining_ns);
+        printf("\n");
+    } else {
+        printf("runs until stopped\n");
+    }
+}
+
+/**
+ * Builds the plan a sweep started now would follow
+ * 
+ * @param plan pointer to the space reserved for the plan (uninitialised)
+ * @param nbr_vnas number of VNAs the sweep will use
+ * @param nbr_sweeps number of sweeps to run, or 0 if running until stopped
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the settings don't make a valid sweep
+ */
+static int current_sweep_plan(struct sweep_plan *plan, int nbr_vnas, int nbr_sweeps) {
+    struct sweep_options options;
+    int sweep_scans, sweep_pps;
+    sweep_settings(&options, nbr_vnas, nbr_sweeps, &sweep_scans, &sweep_pps);
+    if (nbr_segments > 0)
+        return create_segmented_sweep_plan(plan, segments, nbr_segments, sweep_pps);
+    return create_sweep_plan_points(plan, start, stop, resolution, sweep_pps);
+}
+
+void plan_sweeps(struct command *cmd) {
+    int vna_list[MAXIMUM_VNA_PORTS];
+    int nbr_vnas = (peek_token(cmd) == NULL ? get_connected_vnas(vna_list) : get_vna_list_from_args(cmd,vna_list));
+    if (nbr_vnas < 0)
+        return;
+    if (nbr_vnas == 0) {
+        printf("    No VNAs connected, planning for one with every VNA's timings\n");
+        vna_list[0] = -1;
+        nbr_vnas = 1;
+    }
+
+    struct sweep_plan plan;
+    if (current_sweep_plan(&plan, nbr_vnas, sweeps) != EXIT_SUCCESS) {
+        printf("ERROR: these settings do not make a valid sweep.\n");
+        return;
+    }
+
+    printf("    %d sweep%s of %d points, in %d scans of up to %d points, ", sweeps, sweeps == 1 ? "" : "s",
+        plan.nbr_points, plan.nbr_scans, plan.pps);
+    if (nbr_vnas == 1)
+        printf("on one VNA\n");
+    else
+        printf(share_bands ? "shared between %d VNAs\n" : "on each of %d VNAs\n", nbr_vnas);
+    for (int i = 0; i < nbr_vnas; i++) {
+        struct scan_cost_model model;
+        get_scan_cost_model(vna_list[i], &model);
+        if (vna_list[i] >= 0)
+            printf("    VNA %d: ", vna_list[i]);
+        else
+            printf("    ");
+        printf("%.1f ms per scan + %.3f ms per point (%s)\n", model.command_ns / 1e6, model.point_ns / 1e6,
+            model.weight > 0 ? "from recent scans" : "typical for a NanoVNA-H");
+    }
+    double run_ns = predict_sweeps_ns(&plan, vna_list, nbr_vnas, share_bands, sweeps);
+    printf("    Expected to take ");
+    print_prediction(run_ns);
+    printf(" if started now ('scan num')\n");
+    destroy_sweep_plan(&plan);
+}
+
+void sweep_wait(struct command *cmd) {
+    char* id_tok = next_token(cmd);
+    char* timeout_tok = next_token(cmd);
+    double timeout = -1;
+    if (timeout_tok != NULL) {
+        char* end = NULL;
+        timeout = strtod(timeout_tok, &end);
+        if (*end != '\0' || !(timeout >= 0 && timeout <= 86400)) {
+            printf("Usage: sweep wait [scan id/all] [timeout seconds]\n");
+            return;
+        }
+    }
+    int first = 0, last = MAX_ONGOING_SCANS - 1;
+    if (id_tok != NULL && strcmp(id_tok, "all") != 0) {
+        if (!is_valid_int(id_tok) || atoi(id_tok) < 0 || atoi(id_tok) >= MAX_ONGOING_SCANS) {
+            printf("ERROR: scan id must be between 0 and %d.\n", MAX_ONGOING_SCANS - 1);
+            return;
+        }
+        first = last = atoi(id_tok);
+        if (!is_running(first)) {
+            printf("ERROR: scan %d is not currently running.\n", first);
+            return;
+        }
+    }
+
+    uint64_t deadline_ns = monotonic_ns() + (uint64_t)(timeout * 1e9);
+    for (int i = first; i <= last; i++) {
+        if (!is_running(i))
+            continue;
+        struct scan_progress progress;
+        if (get_scan_progress(i, &progress) == EXIT_SUCCESS && progress.mode == ONGOING && timeout < 0) {
+            printf("Sweep %d runs until stopped, not waiting for it\n", i);
+            continue;
+        }
+        double remaining = -1;
+        if (timeout >= 0) {
+            uint64_t now_ns = monotonic_ns();
+            remaining = now_ns < deadline_ns ? (deadline_ns - now_ns) / 1e9 : 0;
+        }
+        int err = collect_sweep(i, remaining);
+        if (err == ETIMEDOUT) {
+            printf("Sweep %d still running after %g s\n", i, timeout);
+        } else if (err == EXIT_SUCCESS) {
+            printf("Sweep %d finished\n", i);
+        }
+    }
+}
+
+void sweep(struct command *cmd) {
+    char* tok = next_token(cmd);
     const char *interactive_label = "InteractiveMode";
 
     if (tok == NULL) {
         printf("Usage: sweep <command>\nSee 'help sweep' for more info.\n");
         return;
     } else if (strcmp(tok, "stop") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             for (int i = 0; i < MAX_ONGOING_SCANS; i++) {
                 if (is_running(i)) {
@@ -321,8 +780,8 @@ void sweep() {
                 return;
             }
             int scan_id = atoi(tok);
-            if (scan_id < 0 || scan_id > MAX_ONGOING_SCANS) {
-                printf("ERROR: scan id must be between 0 and %d.\n", MAX_ONGOING_SCANS);
+            if (scan_id < 0 || scan_id >= MAX_ONGOING_SCANS) {
+                printf("ERROR: scan id must be between 0 and %d.\n", MAX_ONGOING_SCANS - 1);
                 return;
             } else if (!is_running(scan_id)) {
                 printf("ERROR: scan %d is not currently running.\n", scan_id);
@@ -334,6 +793,8 @@ void sweep() {
                 return;
             }
         }
+    } else if (strcmp(tok, "wait") == 0) {
+        sweep_wait(cmd);
     } else if (strcmp(tok, "list") == 0) {
         char* status = calloc(sizeof(char),8);
         if (!status) {
@@ -346,6 +807,17 @@ void sweep() {
                 printf("    %d - %s\n", i, status);
             else
                 printf("    error fetching %d\n", i);
+            struct buffer_stats stats;
+            if (get_sweep_buffer_stats(i, &stats) == EXIT_SUCCESS) {
+                printf("        buffer %d/%d scans (peak %d, %.1f MiB, %s): %ld added, %ld waits (%.3f s), %ld dropped oldest, %ld dropped newest, %ld spilled (%d waiting, %ld lost)\n",
+                    stats.queued, stats.capacity, stats.peak, stats.peak * stats.scan_bytes / 1048576.0,
+                    buffer_policy_name(stats.policy), stats.added,
+                    stats.blocked, stats.blocked_ns / 1e9, stats.dropped_oldest, stats.dropped_newest,
+                    stats.spilled, stats.spill_queued, stats.spill_lost);
+            }
+            struct scan_progress progress;
+            if (get_scan_progress(i, &progress) == EXIT_SUCCESS)
+                print_scan_progress(&progress);
         }
         free(status);
     } else if (strcmp(tok, "start") == 0) {
@@ -354,13 +826,17 @@ void sweep() {
             fprintf(stderr, "couldn't assign space for vna ids");
             return;
         }
-        tok = strtok(NULL, " \n");
-        int nbr_vnas = (tok == NULL ? get_connected_vnas(vna_list) : get_vna_list_from_args(tok,vna_list));
+        int nbr_vnas = (peek_token(cmd) == NULL ? get_connected_vnas(vna_list) : get_vna_list_from_args(cmd,vna_list));
         if (nbr_vnas < 1) {
             printf("%d vnas not enough", nbr_vnas);
             return;
         }
-        start_sweep(nbr_vnas, vna_list, nbr_scans, start, stop, ONGOING, sweeps, pps, interactive_label, verbose);
+        struct sweep_options options;
+        int sweep_scans, sweep_pps;
+        sweep_settings(&options, nbr_vnas, 0, &sweep_scans, &sweep_pps);
+        int scan_id = start_sweep(nbr_vnas, vna_list, sweep_scans, start, stop, ONGOING, sweeps, sweep_pps, interactive_label, verbose, &options);
+        if (scan_id >= 0)
+            printf("Started sweep %d\n", scan_id);
     } 
     else {
         printf("Usage: sweep <command>\nSee 'help sweep' for more info.\n");
@@ -368,27 +844,24 @@ void sweep() {
 }
 
 int calculate_resolution(int res, int* nbr_scans, int* points_per_scan) {
-    if (res <= 0) {
-        return EXIT_FAILURE;
-    } else if (res <= 101) {
-        *nbr_scans = 1;
-        *points_per_scan = res;
-        return EXIT_SUCCESS;
-    } else {
-        *nbr_scans = (int)round(res / 101);
-        *points_per_scan = 101;
-        return EXIT_SUCCESS;
-    }
+    return calculate_shared_resolution(res, 1, 0, nbr_scans, points_per_scan);
+}
+
+int calculate_shared_resolution(int res, int nbr_vnas, int nbr_sweeps, int* nbr_scans, int* points_per_scan) {
+    struct scan_cost_model model;
+    get_scan_cost_model(-1, &model);
+    return plan_resolution(res, MAX_POINTS_PER_SCAN, nbr_vnas, nbr_sweeps, model.command_ns, model.point_ns,
+                           nbr_scans, points_per_scan);
 }
 
-void set() {
-    char* tok = strtok(NULL, " \n");
+void set(struct command *cmd) {
+    char* tok = next_token(cmd);
     if (tok == NULL) {
         printf("Usage: set [parameter] [value]\n");
         return;
     }
     if (strcmp(tok,"start") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             fprintf(stderr,"ERROR: No value provided for start frequency.\n");
             return;
@@ -414,7 +887,7 @@ void set() {
 
         start = val;
     } else if (strcmp(tok,"stop") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             printf("ERROR: No value provided for stop frequency.\n");
             return;
@@ -440,7 +913,7 @@ void set() {
 
         stop = val;
     } else if (strcmp(tok, "resolution") == 0 || strcmp(tok, "res") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             printf("ERROR: No value provided for resolution.\n");
             return;
@@ -457,9 +930,10 @@ void set() {
         }
 
         resolution = val;
+        plan_points = true;
         calculate_resolution(resolution, &nbr_scans, &pps);
     } else if (strcmp(tok, "scans") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             printf("ERROR: No value provided for number of scans.\n");
             return;
@@ -477,8 +951,9 @@ void set() {
 
         nbr_scans = val;
         resolution = nbr_scans * pps;
+        plan_points = false;
     } else if (strcmp(tok, "points") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             printf("ERROR: No value provided for points per scan.\n");
             return;
@@ -489,15 +964,16 @@ void set() {
         }
 
         int val = atoi(tok);
-        if (val < 1 || val > 101) {
-            printf("ERROR: Points per scan must be between 1 and 101.\n");
+        if (val < 1 || val > MAX_POINTS_PER_SCAN) {
+            printf("ERROR: Points per scan must be between 1 and %d.\n", MAX_POINTS_PER_SCAN);
             return;
         }
 
         pps = val;
         resolution = nbr_scans * pps;
+        plan_points = false;
     } else if (strcmp(tok, "sweeps") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             printf("ERROR: No value provided for number of sweeps.\n");
             return;
@@ -514,8 +990,64 @@ void set() {
         }
 
         sweeps = val;
+    } else if (strcmp(tok, "time") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for time.\n");
+            return;
+        }
+        if (!is_valid_int(tok)) {
+            printf("ERROR: Time must be a valid integer.\n");
+            return;
+        }
+
+        int val = atoi(tok);
+        if (val <= 0) {
+            printf("ERROR: Time must be a positive number of seconds.\n");
+            return;
+        }
+
+        time_to_sweep = val;
+    } else if (strcmp(tok, "period") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for period.\n");
+            return;
+        }
+        if (!is_valid_int(tok)) {
+            printf("ERROR: Period must be a valid integer.\n");
+            return;
+        }
+
+        int val = atoi(tok);
+        if (val < 0) {
+            printf("ERROR: Period cannot be negative.\n");
+            return;
+        }
+
+        sweep_period_ms = val;
+    } else if (strcmp(tok, "at") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for start time.\n");
+            return;
+        }
+        if (strcmp(tok, "now") == 0) {
+            sweep_at = -1;
+            return;
+        }
+        int hours, minutes, seconds = 0;
+        char end;
+        int fields = sscanf(tok, "%d:%d:%d%c", &hours, &minutes, &seconds, &end);
+        if ((fields != 2 && fields != 3) || hours < 0 || hours > 23 || minutes < 0 || minutes > 59 ||
+            seconds < 0 || seconds > 59) {
+            printf("ERROR: Start time must be HH:MM, HH:MM:SS or 'now'.\n");
+            return;
+        }
+
+        sweep_at = hours * 3600 + minutes * 60 + seconds;
     } else if (strcmp(tok, "verbose") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             printf("ERROR: No value provided for verbosity.\n");
             return;
@@ -528,23 +1060,255 @@ void set() {
             printf("ERROR: verbose must be 'true' or 'false'\n");
             return;
         }
+    } else if (strcmp(tok, "share") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for share.\n");
+            return;
+        }
+        if (strcmp(tok, "true") == 0) {
+            share_bands = true;
+        } else if (strcmp(tok, "false") == 0) {
+            share_bands = false;
+        } else {
+            printf("ERROR: share must be 'true' or 'false'\n");
+            return;
+        }
+    } else if (strcmp(tok, "retries") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for number of retries.\n");
+            return;
+        }
+        if (!is_valid_int(tok)) {
+            printf("ERROR: Number of retries must be a valid integer.\n");
+            return;
+        }
+
+        int val = atoi(tok);
+        if (val < 0) {
+            printf("ERROR: Number of retries cannot be negative.\n");
+            return;
+        }
+
+        scan_retries = val;
+    } else if (strcmp(tok, "resync") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for resync.\n");
+            return;
+        }
+        if (strcmp(tok, "true") == 0) {
+            resync = true;
+        } else if (strcmp(tok, "false") == 0) {
+            resync = false;
+        } else {
+            printf("ERROR: resync must be 'true' or 'false'\n");
+            return;
+        }
+    } else if (strcmp(tok, "buffer") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for buffer size.\n");
+            return;
+        }
+        if (!is_valid_int(tok)) {
+            printf("ERROR: Buffer size must be a valid integer.\n");
+            return;
+        }
+
+        int val = atoi(tok);
+        if (val < 1 || val > MAX_BUFFER_CAPACITY) {
+            printf("ERROR: Buffer size must be between 1 and %d.\n", MAX_BUFFER_CAPACITY);
+            return;
+        }
+
+        buffer_capacity = val;
+        buffer_mb = 0;
+    } else if (strcmp(tok, "buffer_mb") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for buffer memory.\n");
+            return;
+        }
+        if (!is_valid_int(tok)) {
+            printf("ERROR: Buffer memory must be a valid integer.\n");
+            return;
+        }
+
+        int val = atoi(tok);
+        if (val < 0 || val > 65536) {
+            printf("ERROR: Buffer memory must be between 0 and 65536 MiB.\n");
+            return;
+        }
+
+        buffer_mb = val;
+    } else if (strcmp(tok, "cpus") == 0 || strcmp(tok, "consumer_cpus") == 0) {
+        bool producers = strcmp(tok, "cpus") == 0;
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for CPUs.\n");
+            return;
+        }
+        uint64_t cpus;
+        if (parse_cpu_list(tok, &cpus) != EXIT_SUCCESS) {
+            printf("ERROR: CPUs must be a list such as 2,3 or 0-3 (each below %d), or 'any'.\n", MAX_PINNED_CPUS);
+            return;
+        }
+
+        if (producers)
+            producer_cpus = cpus;
+        else
+            consumer_cpus = cpus;
+    } else if (strcmp(tok, "priority") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for priority.\n");
+            return;
+        }
+        if (!is_valid_int(tok)) {
+            printf("ERROR: Priority must be a valid integer.\n");
+            return;
+        }
+
+        int val = atoi(tok);
+        if (val < 0 || val > 99) {
+            printf("ERROR: Priority must be between 0 and 99.\n");
+            return;
+        }
+
+        rt_priority = val;
+    } else if (strcmp(tok, "output") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for output.\n");
+            return;
+        }
+        bool found = false;
+        for (int i = OUTPUT_TOUCHSTONE; i <= OUTPUT_NONE; i++) {
+            if (strcmp(tok, output_names[i]) == 0) {
+                sweep_output = i;
+                found = true;
+            }
+        }
+        if (!found) {
+            printf("ERROR: output must be 'touchstone', 'archive', 'both' or 'none'\n");
+            return;
+        }
+    } else if (strcmp(tok, "tdr") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for tdr.\n");
+            return;
+        }
+        TdrMode mode;
+        if (parse_tdr_mode(tok, &mode) != EXIT_SUCCESS) {
+            printf("ERROR: tdr must be 'off', 'impulse' or 'step'\n");
+            return;
+        }
+        tok = next_token(cmd);
+        TdrWindow window = tdr_window;
+        if (tok != NULL && parse_tdr_window(tok, &window) != EXIT_SUCCESS) {
+            printf("ERROR: tdr window must be 'rectangular', 'hann' or 'blackman'\n");
+            return;
+        }
+        tdr_mode = mode;
+        tdr_window = window;
+    } else if (strcmp(tok, "peak") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for peak.\n");
+            return;
+        }
+        PeakMode mode;
+        if (parse_peak_mode(tok, &mode) != EXIT_SUCCESS) {
+            printf("ERROR: peak must be 'off', 's21peak', 's21dip' or 's11dip'\n");
+            return;
+        }
+        tok = next_token(cmd);
+        int window = 0;
+        if (tok != NULL) {
+            if (!is_valid_int(tok)) {
+                printf("ERROR: peak window must be a valid integer.\n");
+                return;
+            }
+            window = atoi(tok);
+            if (window < 0) {
+                printf("ERROR: peak window cannot be negative.\n");
+                return;
+            }
+        }
+        peak_mode = mode;
+        peak_window = window;
+    } else if (strcmp(tok, "backpressure") == 0) {
+        tok = next_token(cmd);
+        if (tok == NULL) {
+            printf("ERROR: No value provided for backpressure.\n");
+            return;
+        }
+        if (parse_buffer_policy(tok, &buffer_policy) != EXIT_SUCCESS) {
+            printf("ERROR: backpressure must be 'block', 'oldest', 'newest' or 'spill'\n");
+            return;
+        }
     } else {
-        printf("Parameter not recognised. Available parameters: start, stop, scans, sweeps, points, verbose\n");
+        printf("Parameter not recognised. Available parameters: start, stop, scans, sweeps, time, period, at, points, verbose, share, retries, resync, buffer, buffer_mb, backpressure, cpus, consumer_cpus, priority, output, tdr, peak\n");
     }
 }
 
 void list() {
+   int capacity = buffer_mb > 0 ? buffer_capacity_for_budget((size_t)buffer_mb << 20, pps) : buffer_capacity;
+   char last_scan[32] = "";
+   if (resolution != nbr_scans * pps)
+       snprintf(last_scan, sizeof(last_scan), " (last scan %d)", resolution - (nbr_scans - 1) * pps);
+   struct scan_cost_model model;
+   get_scan_cost_model(-1, &model);
+   char period[32] = "as soon as the last is done";
+   if (sweep_period_ms > 0)
+       snprintf(period, sizeof(period), "every %d ms", sweep_period_ms);
+   char at[16] = "now";
+   if (sweep_at >= 0)
+       snprintf(at, sizeof(at), "%02d:%02d:%02d", sweep_at / 3600, sweep_at / 60 % 60, sweep_at % 60);
+   char cpus[64], writer_cpus[64], priority[32] = "normal";
+   format_cpu_list(producer_cpus, cpus, sizeof(cpus));
+   format_cpu_list(consumer_cpus, writer_cpus, sizeof(writer_cpus));
+   if (rt_priority > 0)
+       snprintf(priority, sizeof(priority), "real-time %d", rt_priority);
+   char peak_window_text[48] = "5% of the points either side";
+   if (peak_window > 0)
+       snprintf(peak_window_text, sizeof(peak_window_text), "%d points either side", peak_window);
    printf("\
     Current settings:\n\
         Start frequency: %ld Hz\n\
         Stop frequency: %ld Hz\n\
         Resolution: %d\n\
             Number of scans: %d\n\
-            Points per scan: %d\n\
+            Points per scan: %d%s\n\
+            Estimated sweep time: %.1f ms per VNA (%.1f ms per scan + %.3f ms per point%s)\n\
         Number of sweeps: %d\n\
+        Time to sweep: %d s\n\
+        Sweeps start: %s, from %s\n\
         Number of VNAs: %d\n\
-        Verbose: %s\n", 
-        start, stop, resolution, nbr_scans, pps, sweeps, get_vna_count(), verbose ? "true" : "false");
+        Verbose: %s\n\
+        Share scans between VNAs: %s\n\
+        Retries per failed scan: %d\n\
+        Resync before retry: %s\n\
+        Buffer size: %d scans (%.1f MiB)%s\n\
+        Backpressure: %s\n\
+        VNA thread CPUs: %s, priority %s\n\
+        Output thread CPUs: %s\n\
+        Output files: %s\n\
+        Time domain: %s (%s window)\n\
+        Resonance tracking: %s (%s)\n\
+        Segments: %d%s\n", 
+        start, stop, resolution, nbr_scans, pps, last_scan,
+        (nbr_scans * model.command_ns + resolution * model.point_ns) / 1e6, model.command_ns / 1e6,
+        model.point_ns / 1e6, model.weight > 0 ? ", from recent scans" : ", typical for a NanoVNA-H",
+        sweeps, time_to_sweep, period, at, get_vna_count(), verbose ? "true" : "false",
+        share_bands ? "true" : "false", scan_retries, resync ? "true" : "false",
+        capacity, capacity * buffer_scan_bytes(pps) / 1048576.0, buffer_mb > 0 ? ", from buffer_mb" : "",
+        buffer_policy_name(buffer_policy), cpus, priority, writer_cpus, output_names[sweep_output],
+        tdr_mode_name(tdr_mode), tdr_window_name(tdr_window), peak_mode_name(peak_mode), peak_window_text,
+        nbr_segments, nbr_segments > 0 ? " (used instead of start, stop and resolution, see 'segment list')" : "");
 }
 
 
@@ -565,14 +1329,66 @@ void list_vnas() {
     }
 }
 
-void vna_commands() {
-    char* tok = strtok(NULL, " \n");
+void vna_stats(struct command *cmd) {
+    char* tok = next_token(cmd);
+    int vna_list[MAXIMUM_VNA_PORTS];
+    int nbr_vnas = get_connected_vnas(vna_list);
+    if (tok != NULL && strcmp(tok,"reset") == 0) {
+        for (int i = 0; i < MAXIMUM_VNA_PORTS; i++)
+            reset_vna_stats(i);
+        printf("VNA stats reset\n");
+        return;
+    }
+    if (nbr_vnas == 0) {
+        printf("No VNAs connected\n");
+        return;
+    }
+    printf("    id  scans  failed  retries  resyncs  dropped  mean recovery  max recovery  sweep time/point  cost/scan  cost/point\n");
+    for (int i = 0; i < nbr_vnas; i++) {
+        struct vna_scan_stats stats;
+        if (get_vna_stats(vna_list[i], &stats) != EXIT_SUCCESS)
+            continue;
+        double mean_ms = stats.recoveries ? stats.recovery_ns / 1e6 / stats.recoveries : 0.0;
+        struct scan_cost_model model;
+        get_scan_cost_model(vna_list[i], &model);
+        printf("    %2d  %5ld  %6ld  %7ld  %7ld  %7ld  %10.1f ms  %9.1f ms  %13.1f us  %6.1f ms  %7.1f us\n",
+            vna_list[i], stats.scans, stats.failed_pulls, stats.retries, stats.resyncs,
+            stats.dropped_scans, mean_ms, stats.max_recovery_ns / 1e6, stats.sweep_ns_per_point / 1e3,
+            model.command_ns / 1e6, model.point_ns / 1e3);
+    }
+}
+
+void vna_capture(struct command *cmd) {
+    char* id_tok = next_token(cmd);
+    char* path = next_token(cmd);
+    if (id_tok == NULL || path == NULL || !is_valid_int(id_tok)) {
+        printf("Usage: vna capture <id> <file/stop>\n");
+        return;
+    }
+    int vna_id = atoi(id_tok);
+    if (vna_id < 0 || vna_id >= MAXIMUM_VNA_PORTS || !is_connected(vna_id)) {
+        printf("vna %d not connected\n",vna_id);
+        return;
+    }
+    if (strcmp(path,"stop") == 0) {
+        if (stop_capture(vna_id) != EXIT_SUCCESS)
+            printf("vna %d is not being captured\n",vna_id);
+        else
+            printf("Stopped capturing vna %d\n",vna_id);
+        return;
+    }
+    if (start_capture(vna_id,path) == EXIT_SUCCESS)
+        printf("Capturing vna %d to %s\n",vna_id,path);
+}
+
+void vna_commands(struct command *cmd) {
+    char* tok = next_token(cmd);
     if (tok == NULL) {
         printf("Usage: vna <add/list> [name]\nSee 'help scan' for more info.\n");
         return;
     }
     if (strcmp(tok,"add") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             printf("Attempting to add all found vnas:\n");
             int added = add_all_vnas();
@@ -595,11 +1411,11 @@ void vna_commands() {
             fprintf(stderr, "VNA is already connected\n");
             break;
         case 4:
-            fprintf(stderr, "Serial device is not a NanoVNA-H\n");
+            fprintf(stderr, "Serial device is not a NanoVNA-H, or not a valid capture file\n");
             break;
         }
     } else if (strcmp(tok,"remove") == 0) {
-        tok = strtok(NULL, " \n");
+        tok = next_token(cmd);
         if (tok == NULL) {
             fprintf(stderr, "please provide an address\n");
             return;
@@ -614,6 +1430,10 @@ void vna_commands() {
         vna_ping();
     } else if (strcmp(tok,"id") == 0) {
         vna_id();
+    } else if (strcmp(tok,"stats") == 0) {
+        vna_stats(cmd);
+    } else if (strcmp(tok,"capture") == 0) {
+        vna_capture(cmd);
     } else if (strcmp(tok,"reset") == 0) {
         vna_reset();
     } else {
@@ -621,42 +1441,753 @@ void vna_commands() {
     }
 }
 
-int read_command() {
-    char buff[50];
-    fgets(buff, sizeof(buff), stdin);
+void stream_commands(struct command *cmd) {
+    char* tok = next_token(cmd);
+    if (tok == NULL) {
+        printf("Usage: stream <start/stop/list>\nSee 'help stream' for more info.\n");
+    } else if (strcmp(tok,"start") == 0) {
+        char* port_tok = next_token(cmd);
+        char* policy_tok = next_token(cmd);
+        if (port_tok == NULL || !is_valid_int(port_tok)) {
+            printf("Usage: stream start <port> [drop/disconnect]\n");
+            return;
+        }
+        int port = atoi(port_tok);
+        if (port < 1 || port > 65534) {
+            printf("ERROR: port must be between 1 and 65534.\n");
+            return;
+        }
+        StreamPolicy policy = STREAM_DROP;
+        if (policy_tok != NULL && strcmp(policy_tok,"disconnect") == 0) {
+            policy = STREAM_DISCONNECT;
+        } else if (policy_tok != NULL && strcmp(policy_tok,"drop") != 0) {
+            printf("ERROR: slow client policy must be drop or disconnect.\n");
+            return;
+        }
+        if (start_stream_server(port, port+1, policy) == EXIT_SUCCESS)
+            printf("Streaming scans on port %d, control on port %d\n", port, port+1);
+    } else if (strcmp(tok,"stop") == 0) {
+        if (!is_streaming()) {
+            printf("Not streaming\n");
+            return;
+        }
+        stop_stream_server();
+        printf("Stream server stopped\n");
+    } else if (strcmp(tok,"list") == 0) {
+        uint16_t data_port, control_port;
+        if (get_stream_ports(&data_port, &control_port) != EXIT_SUCCESS) {
+            printf("Not streaming\n");
+            return;
+        }
+        struct stream_client_info clients[STREAM_MAX_CLIENTS];
+        int nbr_clients = get_stream_clients(clients);
+        printf("Streaming on port %u, control on port %u, %d clients\n", data_port, control_port, nbr_clients);
+        if (nbr_clients > 0)
+            printf("    id  type     address                  sent    dropped  queued\n");
+        for (int i = 0; i < nbr_clients; i++) {
+            printf("    %2d  %-7s  %-21s  %7ld  %9ld  %6zu\n", clients[i].id, clients[i].control ? "control" : "data",
+                clients[i].address, clients[i].frames, clients[i].dropped, clients[i].queued);
+        }
+    } else {
+        printf("Usage: stream <start/stop/list>\nSee 'help stream' for more info.\n");
+    }
+}
+
+/**
+ * Reads a frequency argument, checking it is within the range the VNAs support
+ * 
+ * @return the frequency in Hz, or 0 if missing or invalid (after printing why)
+ */
+static long frequency_argument(const char *tok, const char *name) {
+    if (tok == NULL || !is_valid_long(tok)) {
+        printf("ERROR: %s frequency must be a number.\n", name);
+        return 0;
+    }
+    long val = atol(tok);
+    if (val < 10000 || val > 1500000000) {
+        printf("ERROR: %s frequency must be between 10kHz and 1.5GHz.\n", name);
+        return 0;
+    }
+    return val;
+}
 
-    char* tok = strtok(buff, " \n");
+void list_segments() {
+    if (nbr_segments == 0) {
+        printf("No segments, sweeps cover %ld-%ld Hz in %d scans of %d points\n", start, stop, nbr_scans, pps);
+        return;
+    }
+    printf("    #  start (Hz)   stop (Hz)    points  spacing\n");
+    for (int i = 0; i < nbr_segments; i++) {
+        printf("    %d  %-11" PRIu64 "  %-11" PRIu64 "  %6d  %s\n", i, segments[i].start, segments[i].stop,
+            segments[i].points, segments[i].spacing == SPACING_LOG ? "log" : "linear");
+    }
+    struct sweep_plan plan;
+    if (create_segmented_sweep_plan(&plan, segments, nbr_segments, segment_pps()) != EXIT_SUCCESS)
+        return;
+    printf("    %d points in %d scans of up to %d points (evenly spaced at the closest spacing: %" PRIu64 " scans)\n",
+        plan.nbr_points, plan.nbr_scans, segment_pps(), sweep_plan_uniform_scans(&plan, segment_pps()));
+    destroy_sweep_plan(&plan);
+}
 
+void segment_commands(struct command *cmd) {
+    char* tok = next_token(cmd);
     if (tok == NULL) {
-        return 0;
-    } else if (strcmp(tok,"scan") == 0) {
-        scan();
+        printf("Usage: segment <add/list/clear>\nSee 'help segment' for more info.\n");
+    } else if (strcmp(tok,"add") == 0) {
+        char* start_tok = next_token(cmd);
+        char* stop_tok = next_token(cmd);
+        char* points_tok = next_token(cmd);
+        char* spacing_tok = next_token(cmd);
+        if (points_tok == NULL) {
+            printf("Usage: segment add <start> <stop> <points> [linear/log]\n");
+            return;
+        }
+        long seg_start = frequency_argument(start_tok, "Start");
+        long seg_stop = frequency_argument(stop_tok, "Stop");
+        if (seg_start == 0 || seg_stop == 0)
+            return;
+        if (seg_stop <= seg_start) {
+            printf("ERROR: Stop frequency must be greater than start frequency.\n");
+            return;
+        }
+        if (!is_valid_int(points_tok) || atoi(points_tok) < 2) {
+            printf("ERROR: A segment must have at least 2 points.\n");
+            return;
+        }
+        SegmentSpacing spacing = SPACING_LINEAR;
+        if (spacing_tok != NULL && strcmp(spacing_tok,"log") == 0) {
+            spacing = SPACING_LOG;
+        } else if (spacing_tok != NULL && strcmp(spacing_tok,"linear") != 0 && strcmp(spacing_tok,"lin") != 0) {
+            printf("ERROR: spacing must be linear or log.\n");
+            return;
+        }
+        if (nbr_segments == MAX_SWEEP_SEGMENTS) {
+            printf("ERROR: at most %d segments.\n", MAX_SWEEP_SEGMENTS);
+            return;
+        }
+
+        segments[nbr_segments] = (struct sweep_segment){seg_start, seg_stop, atoi(points_tok), spacing};
+        // check the segments still make a valid plan before keeping it
+        struct sweep_plan plan;
+        if (create_segmented_sweep_plan(&plan, segments, nbr_segments + 1, segment_pps()) != EXIT_SUCCESS) {
+            printf("ERROR: segment not added.\n");
+            return;
+        }
+        nbr_segments++;
+        printf("Sweeps now cover %d points in %d scans\n", plan.nbr_points, plan.nbr_scans);
+        destroy_sweep_plan(&plan);
+    } else if (strcmp(tok,"list") == 0) {
+        list_segments();
+    } else if (strcmp(tok,"clear") == 0) {
+        nbr_segments = 0;
+        printf("Segments cleared, sweeps cover %ld-%ld Hz\n", start, stop);
+    } else {
+        printf("Usage: segment <add/list/clear>\nSee 'help segment' for more info.\n");
+    }
+}
+
+//----------------------------------------
+// Calibration
+//----------------------------------------
+
+/**
+ * Standards measured on each VNA since it was last calibrated
+ */
+static struct cal_capture *cal_captures[MAXIMUM_VNA_PORTS];
+
+static const char *standard_names[CAL_STANDARDS] = {"short", "open", "load", "thru"};
+
+/**
+ * Reads a VNA id argument
+ * 
+ * @return the id, or -1 if missing or invalid (after printing why)
+ */
+static int cal_vna_argument(const char *tok, const char *usage) {
+    if (tok == NULL || !is_valid_int(tok)) {
+        printf("Usage: %s\n", usage);
+        return -1;
+    }
+    int vna_id = atoi(tok);
+    if (vna_id < 0 || vna_id >= MAXIMUM_VNA_PORTS) {
+        printf("ERROR: vna ids must be between 0 and %d.\n", MAXIMUM_VNA_PORTS);
+        return -1;
+    }
+    return vna_id;
+}
+
+/**
+ * @return the id of a running sweep using the VNA, or -1 if there isn't one
+ */
+static int sweep_using_vna(int vna_id) {
+    for (int i = 0; i < MAX_ONGOING_SCANS; i++) {
+        struct scan_progress progress;
+        if (get_scan_progress(i, &progress) != EXIT_SUCCESS)
+            continue;
+        for (int v = 0; v < progress.nbr_vnas; v++) {
+            if (progress.vna_list[v] == vna_id)
+                return i;
+        }
+    }
+    return -1;
+}
+
+static void free_cal_capture(int vna_id) {
+    if (cal_captures[vna_id]) {
+        destroy_cal_capture(cal_captures[vna_id]);
+        free(cal_captures[vna_id]);
+        cal_captures[vna_id] = NULL;
+    }
+}
+
+/**
+ * Measures a standard on a VNA, over the grid the next sweep would use.
+ * Standards already measured on a different grid are thrown away.
+ */
+static void cal_measure(int vna_id, CalStandard standard) {
+    int scan_id = sweep_using_vna(vna_id);
+    if (scan_id >= 0) {
+        printf("ERROR: vna %d is in use by sweep %d.\n", vna_id, scan_id);
+        return;
+    }
+    struct sweep_plan plan;
+    if (current_sweep_plan(&plan, 1, 0) != EXIT_SUCCESS) {
+        printf("ERROR: these settings do not make a valid sweep.\n");
+        return;
+    }
+
+    struct cal_capture *cap = cal_captures[vna_id];
+    if (cap && (cap->plan.nbr_points != plan.nbr_points
+                || memcmp(cap->plan.freqs, plan.freqs, sizeof(uint64_t) * plan.nbr_points) != 0)) {
+        printf("Sweep settings have changed, standards measured before are discarded\n");
+        free_cal_capture(vna_id);
+        cap = NULL;
+    }
+    if (!cap) {
+        cap = malloc(sizeof(struct cal_capture));
+        if (!cap) {
+            fprintf(stderr, "Failed to allocate memory for calibration capture\n");
+            destroy_sweep_plan(&plan);
+            return;
+        }
+        if (create_cal_capture(cap, &plan) != EXIT_SUCCESS) {
+            free(cap);
+            return;
+        }
+        cal_captures[vna_id] = cap;
+    } else {
+        destroy_sweep_plan(&plan);
+    }
+
+    if (measure_standard(cap, standard, vna_id, scan_retries) != EXIT_SUCCESS) {
+        printf("ERROR: failed to measure %s on vna %d.\n", standard_names[standard], vna_id);
+        return;
+    }
+    printf("Measured %s on vna %d: %d points from %" PRIu64 " to %" PRIu64 " Hz\n", standard_names[standard],
+        vna_id, cap->plan.nbr_points, cap->plan.start, cap->plan.stop);
+}
+
+void list_calibrations() {
+    bool any = false;
+    for (int i = 0; i < MAXIMUM_VNA_PORTS; i++) {
+        int nbr_points;
+        uint64_t cal_start, cal_stop;
+        bool thru;
+        if (get_vna_calibration(i, &nbr_points, &cal_start, &cal_stop, &thru) == EXIT_SUCCESS) {
+            printf("    VNA %d: calibrated %" PRIu64 "-%" PRIu64 " Hz at %d points, correcting %s\n",
+                i, cal_start, cal_stop, nbr_points, thru ? "S11 and S21" : "S11");
+            any = true;
+        }
+        if (cal_captures[i]) {
+            printf("    VNA %d: measured", i);
+            for (int s = 0; s < CAL_STANDARDS; s++) {
+                if (cal_captures[i]->measured[s])
+                    printf(" %s", standard_names[s]);
+            }
+            printf(" (not solved yet)\n");
+            any = true;
+        }
+    }
+    if (!any)
+        printf("No VNAs calibrated\n");
+}
+
+void cal_commands(struct command *cmd) {
+    char* tok = next_token(cmd);
+    if (tok == NULL) {
+        printf("Usage: cal <measure/solve/save/load/off/list>\nSee 'help cal' for more info.\n");
+    } else if (strcmp(tok,"measure") == 0) {
+        const char *usage = "cal measure <short/open/load/thru> <vna id>";
+        char* standard_tok = next_token(cmd);
+        int vna_id = cal_vna_argument(next_token(cmd), usage);
+        if (standard_tok == NULL || vna_id < 0)
+            return;
+        int standard = 0;
+        while (standard < CAL_STANDARDS && strcmp(standard_tok, standard_names[standard]) != 0)
+            standard++;
+        if (standard == CAL_STANDARDS) {
+            printf("ERROR: standard must be short, open, load or thru.\n");
+        } else if (!is_connected(vna_id)) {
+            printf("vna %d not connected\n", vna_id);
+        } else {
+            cal_measure(vna_id, standard);
+        }
+    } else if (strcmp(tok,"solve") == 0) {
+        int vna_id = cal_vna_argument(next_token(cmd), "cal solve <vna id>");
+        if (vna_id < 0)
+            return;
+        if (!cal_captures[vna_id]) {
+            printf("ERROR: no standards measured on vna %d.\n", vna_id);
+            return;
+        }
+        struct calibration *cal = malloc(sizeof(struct calibration));
+        if (!cal || solve_calibration(cal_captures[vna_id], cal) != EXIT_SUCCESS) {
+            printf("ERROR: vna %d not calibrated.\n", vna_id);
+            free(cal);
+            return;
+        }
+        bool thru = cal->thru;
+        set_vna_calibration(vna_id, cal);
+        free_cal_capture(vna_id);
+        printf("Calibrated vna %d, sweeps started from now on correct %s\n", vna_id, thru ? "S11 and S21" : "S11");
+    } else if (strcmp(tok,"save") == 0 || strcmp(tok,"load") == 0) {
+        bool save = strcmp(tok,"save") == 0;
+        const char *usage = save ? "cal save <vna id> <file>" : "cal load <vna id> <file>";
+        int vna_id = cal_vna_argument(next_token(cmd), usage);
+        char* path = next_token(cmd);
+        if (vna_id < 0)
+            return;
+        if (path == NULL) {
+            printf("Usage: %s\n", usage);
+        } else if (save) {
+            if (save_vna_calibration(vna_id, path) == EXIT_SUCCESS)
+                printf("Saved calibration of vna %d to %s\n", vna_id, path);
+            else
+                printf("ERROR: calibration of vna %d not saved.\n", vna_id);
+        } else {
+            struct calibration *cal = malloc(sizeof(struct calibration));
+            if (!cal || load_calibration(cal, path) != EXIT_SUCCESS) {
+                printf("ERROR: calibration not loaded.\n");
+                free(cal);
+                return;
+            }
+            printf("Loaded calibration of %d points from %" PRIu64 " to %" PRIu64 " Hz for vna %d\n",
+                cal->nbr_points, cal->freqs[0], cal->freqs[cal->nbr_points - 1], vna_id);
+            set_vna_calibration(vna_id, cal);
+        }
+    } else if (strcmp(tok,"off") == 0) {
+        int vna_id = cal_vna_argument(next_token(cmd), "cal off <vna id>");
+        if (vna_id < 0)
+            return;
+        set_vna_calibration(vna_id, NULL);
+        free_cal_capture(vna_id);
+        printf("Calibration of vna %d turned off\n", vna_id);
+    } else if (strcmp(tok,"list") == 0) {
+        list_calibrations();
+    } else {
+        printf("Usage: cal <measure/solve/save/load/off/list>\nSee 'help cal' for more info.\n");
+    }
+}
+
+//----------------------------------------
+// Background jobs
+//----------------------------------------
+
+/**
+ * A command running on its own thread, started by ending it with '&'
+ *
+ * Slots are only changed by the main thread, except done and
+ * finished_ns, which the job sets as it finishes.
+ */
+struct job {
+    int id;                 // 0 if the slot is free
+    struct command cmd;
+    pthread_t thread;
+    atomic_bool done;
+    bool joined;
+    uint64_t started_ns;
+    atomic_uint_fast64_t finished_ns;
+};
+
+static struct job jobs[MAX_JOBS];
+static int last_job_id = 0;
+
+/**
+ * Runs a job's command, then marks it done
+ */
+static void* run_job(void *arguments) {
+    struct job *job = arguments;
+    run_command(&job->cmd);
+    job->finished_ns = monotonic_ns();
+    job->done = true;
+    printf("[job %d] done (%.3f s)\n", job->id, (job->finished_ns - job->started_ns) / 1e9);
+    fflush(stdout);
+    return NULL;
+}
+
+/**
+ * Joins a finished job's thread, once
+ */
+static void join_job(struct job *job) {
+    if (!job->joined) {
+        pthread_join(job->thread, NULL);
+        job->joined = true;
+    }
+}
+
+int start_job(const char *line) {
+    struct job *job = NULL;
+    // a free slot, or else the oldest finished job
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id == 0) {
+            job = &jobs[i];
+            break;
+        }
+        if (jobs[i].done && (job == NULL || jobs[i].id < job->id))
+            job = &jobs[i];
+    }
+    if (job == NULL) {
+        fprintf(stderr, "ERROR: %d jobs already running\n", MAX_JOBS);
+        return -1;
+    }
+    if (job->id != 0)
+        join_job(job);
+
+    job->id = 0;
+    if (tokenise_command(&job->cmd, line) != EXIT_SUCCESS) {
+        fprintf(stderr, "ERROR: command too long\n");
+        return -1;
+    }
+    char *tok = peek_token(&job->cmd);
+    if (tok == NULL) {
+        return -1;
+    } else if (strcmp(tok,"exit") == 0 || strcmp(tok,"jobs") == 0 || strcmp(tok,"wait") == 0) {
+        fprintf(stderr, "ERROR: %s cannot run in the background\n", tok);
+        return -1;
+    }
+
+    job->done = false;
+    job->joined = false;
+    job->started_ns = monotonic_ns();
+    job->finished_ns = 0;
+    job->id = ++last_job_id;
+    if (pthread_create(&job->thread, NULL, &run_job, job) != 0) {
+        fprintf(stderr, "Error %i creating job thread: %s\n", errno, strerror(errno));
+        job->id = 0;
+        return -1;
+    }
+    printf("[job %d] started\n", job->id);
+    return job->id;
+}
+
+void list_jobs() {
+    bool any = false;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id == 0)
+            continue;
+        if (!any)
+            printf("    id  state    time        command\n");
+        any = true;
+        bool done = jobs[i].done;
+        uint64_t end = done ? jobs[i].finished_ns : monotonic_ns();
+        printf("    %2d  %-7s  %8.3f s  ", jobs[i].id, done ? "done" : "running", (end - jobs[i].started_ns) / 1e9);
+        for (int t = 0; t < jobs[i].cmd.nbr_tokens; t++)
+            printf("%s%s", t ? " " : "", jobs[i].cmd.tokens[t]);
+        printf("\n");
+    }
+    if (!any)
+        printf("No jobs\n");
+}
+
+int wait_jobs(int job_id) {
+    int waited = 0;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].id == 0 || (job_id != 0 && jobs[i].id != job_id))
+            continue;
+        join_job(&jobs[i]);
+        waited++;
+    }
+    if (job_id != 0 && waited == 0)
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Handles the wait command: waits for the given job, or all jobs
+ */
+static void wait_command(struct command *cmd) {
+    char* tok = next_token(cmd);
+    if (tok == NULL) {
+        wait_jobs(0);
+        return;
+    }
+    if (!is_valid_int(tok) || atoi(tok) <= 0) {
+        printf("Usage: wait [job id]\n");
+        return;
+    }
+    if (wait_jobs(atoi(tok)) != EXIT_SUCCESS)
+        printf("ERROR: no job %s\n", tok);
+}
+
+/**
+ * Handles the sleep command: pauses for the given number of seconds
+ */
+static void sleep_command(struct command *cmd) {
+    char* tok = next_token(cmd);
+    char* end = NULL;
+    double seconds = tok ? strtod(tok, &end) : -1;
+    if (tok == NULL || *end != '\0' || !(seconds >= 0 && seconds <= 86400)) {
+        printf("Usage: sleep <seconds>\n");
+        return;
+    }
+    struct timespec duration = {(time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9)};
+    while (nanosleep(&duration, &duration) != 0 && errno == EINTR)
+        ;
+}
+
+//----------------------------------------
+// Reading commands
+//----------------------------------------
+
+/**
+ * @return true if a command reads or changes the settings, so must run
+ *         under settings_lock. Commands that only wait ('sweep wait',
+ *         'sweep stop', 'wait', 'sleep') don't, so never hold up the rest;
+ *         stop_sweep and collect_sweep see to it that only one caller
+ *         joins each sweep.
+ */
+static bool uses_settings(const char *tok, struct command *cmd) {
+    if (strcmp(tok,"sweep") == 0) {
+        char *sub = peek_token(cmd);
+        return sub != NULL && strcmp(sub,"start") == 0;
+    }
+    return strcmp(tok,"scan") == 0 || strcmp(tok,"set") == 0 || strcmp(tok,"list") == 0
+        || strcmp(tok,"segment") == 0 || strcmp(tok,"plan") == 0 || strcmp(tok,"cal") == 0
+        || strcmp(tok,"stream") == 0;
+}
+
+/**
+ * Runs a command whose first word has already been taken
+ *
+ * @return 1 if the command was exit, 0 otherwise
+ */
+static int dispatch_command(const char *tok, struct command *cmd) {
+    if (strcmp(tok,"scan") == 0) {
+        scan(cmd);
     } else if (strcmp(tok,"sweep") == 0) {
-        sweep();
+        sweep(cmd);
     } else if (strcmp(tok,"exit") == 0) {
         return 1;
     } else if (strcmp(tok,"help") == 0) {
-        help();
+        help(cmd);
     } else if (strcmp(tok,"set") == 0) {
-        set();
+        set(cmd);
     } else if (strcmp(tok, "list") == 0) {
         list();
     } else if (strcmp(tok,"vna") == 0) {
-        vna_commands();
+        vna_commands(cmd);
+    } else if (strcmp(tok,"stream") == 0) {
+        stream_commands(cmd);
+    } else if (strcmp(tok,"segment") == 0) {
+        segment_commands(cmd);
+    } else if (strcmp(tok,"plan") == 0) {
+        plan_sweeps(cmd);
+    } else if (strcmp(tok,"cal") == 0) {
+        cal_commands(cmd);
+    } else if (strcmp(tok,"jobs") == 0) {
+        list_jobs();
+    } else if (strcmp(tok,"wait") == 0) {
+        wait_command(cmd);
+    } else if (strcmp(tok,"sleep") == 0) {
+        sleep_command(cmd);
     } else {
         printf("Command not recognised. Type 'help' for list of available commands.\n");
     }
     return 0;
 }
 
+int run_command(struct command *cmd) {
+    char* tok = next_token(cmd);
+    if (tok == NULL)
+        return 0;
+
+    bool locked = uses_settings(tok, cmd);
+    if (locked)
+        pthread_mutex_lock(&settings_lock);
+    int result = dispatch_command(tok, cmd);
+    if (locked)
+        pthread_mutex_unlock(&settings_lock);
+    return result;
+}
+
+int execute_command(const char *line) {
+    char text[MAX_COMMAND_LENGTH];
+    if (strlen(line) >= sizeof(text)) {
+        printf("ERROR: commands must be under %d characters.\n", MAX_COMMAND_LENGTH);
+        return 0;
+    }
+    strcpy(text, line);
+
+    // a trailing '&' (before any comment) runs the command in the background
+    char *end = strchr(text, '#');
+    if (end == NULL)
+        end = text + strlen(text);
+    while (end > text && isspace((unsigned char)end[-1]))
+        end--;
+    if (end > text && end[-1] == '&') {
+        end[-1] = '\0';
+        start_job(text);
+        return 0;
+    }
+
+    struct command cmd;
+    if (tokenise_command(&cmd, text) != EXIT_SUCCESS) {
+        printf("ERROR: commands can have at most %d words.\n", MAX_COMMAND_TOKENS);
+        return 0;
+    }
+    return run_command(&cmd);
+}
+
+int run_commands(const char *commands) {
+    const char *c = commands;
+    while (*c != '\0') {
+        c += strspn(c, " \t\r");
+        size_t length = strcspn(c, ";\n");
+        if (length == 0) {
+            // nothing between separators
+        } else if (length >= MAX_COMMAND_LENGTH) {
+            printf("ERROR: commands must be under %d characters.\n", MAX_COMMAND_LENGTH);
+        } else {
+            char line[MAX_COMMAND_LENGTH];
+            memcpy(line, c, length);
+            line[length] = '\0';
+            printf(">>> %s\n", line);
+            if (execute_command(line) == 1)
+                return 1;
+        }
+        c += length;
+        if (*c != '\0')
+            c++;
+    }
+    return 0;
+}
+
+int run_script(const char *path) {
+    FILE *script = fopen(path, "r");
+    if (!script) {
+        fprintf(stderr, "Error opening script %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[MAX_COMMAND_LENGTH];
+    int line_number = 0;
+    int fin = 0;
+    while (fin != 1 && fgets(line, sizeof(line), script) != NULL) {
+        line_number++;
+        size_t length = strlen(line);
+        if (length == sizeof(line)-1 && line[length-1] != '\n' && !feof(script)) {
+            fprintf(stderr, "%s:%d: line too long, skipped\n", path, line_number);
+            int c;
+            while ((c = fgetc(script)) != EOF && c != '\n')
+                ;
+            continue;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        printf(">>> %s\n", line);
+        fin = execute_command(line);
+    }
+    fclose(script);
+    return fin;
+}
+
+/**
+ * Set once stdin has reached end of file while streaming,
+ * so commands are only taken from control clients
+ */
+static bool stdin_closed = false;
+
+/**
+ * Waits for the next command, from stdin or, while streaming,
+ * from a control client.
+ * 
+ * @param buff buffer to put the command in
+ * @param size size of buff
+ * @return id of the control client it came from, -1 if from stdin,
+ * -2 if there are no more commands to come
+ */
+static int next_command(char *buff, int size) {
+    int client = take_stream_command(buff, size);
+    if (client >= 0)
+        return client;
+    while (is_streaming()) {
+        struct pollfd fds[2] = {
+            {stdin_closed ? -1 : STDIN_FILENO, POLLIN, 0},
+            {stream_command_fd(), POLLIN, 0}
+        };
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            break;
+        client = take_stream_command(buff, size);
+        if (client >= 0)
+            return client;
+        if (fds[0].revents) {
+            if (fgets(buff, size, stdin) != NULL)
+                return -1;
+            stdin_closed = true;
+        }
+    }
+    if (stdin_closed || fgets(buff, size, stdin) == NULL)
+        return -2;
+    return -1;
+}
+
+int read_command() {
+    char buff[MAX_COMMAND_LENGTH];
+    int client = next_command(buff, sizeof(buff));
+    if (client == -2)
+        return 1;
+    if (client >= 0) {
+        // echo commands from control clients, so everyone can follow what is happening
+        printf("%s\n", buff);
+        if (strncmp(buff, "exit", 4) == 0 && (buff[4] == '\0' || isspace((unsigned char)buff[4]))) {
+            close_stream_client(client);
+            return 0;
+        }
+    } else if (strchr(buff, '\n') == NULL && !feof(stdin)) {
+        // too long for buff, so throw the rest of the line away
+        int c;
+        while ((c = getchar()) != EOF && c != '\n')
+            ;
+        printf("ERROR: commands must be under %d characters.\n", MAX_COMMAND_LENGTH);
+        return 0;
+    }
+    return execute_command(buff);
+}
+
 int initialise_settings() {
     start = 50000000;
     stop = 900000000;
     resolution = 505;
     nbr_scans = 5;
     pps = 101;
+    plan_points = true;
     sweeps = 1;
+    time_to_sweep = 10;
+    sweep_period_ms = 0;
+    sweep_at = -1;
+    producer_cpus = 0;
+    consumer_cpus = 0;
+    rt_priority = 0;
     verbose = false;
+    share_bands = false;
+    scan_retries = DEFAULT_SCAN_RETRIES;
+    resync = true;
+    buffer_capacity = N;
+    buffer_policy = BUFFER_BLOCK;
+    buffer_mb = 0;
+    sweep_output = OUTPUT_TOUCHSTONE;
+    tdr_mode = TDR_OFF;
+    tdr_window = TDR_HANN;
+    peak_mode = PEAK_OFF;
+    peak_window = 0;
+    nbr_segments = 0;
 
     return initialise_port_array();
 }
@@ -668,16 +2199,42 @@ int initialise_settings() {
 #ifndef TESTSUITE
 
 /**
- * Initialises settings then repeatedly calls read_command
- * until it returns 1 (meaning the exit command has been sent)
+ * Initialises settings, runs any scripts or -c commands given, then
+ * repeatedly calls read_command until it returns 1 (meaning the exit
+ * command has been sent). With scripts or -c commands, the program exits
+ * once they have run, unless -i is also given.
  */
-int main() {
+int main(int argc, char *argv[]) {
+    // read stdin a byte at a time, so poll sees every command still to be read
+    setvbuf(stdin, NULL, _IONBF, 0);
     initialise_settings();
     int fin = 0;
+    bool batch = false;
+    bool interactive = false;
+    for (int i = 1; i < argc && fin != 1; i++) {
+        if (strcmp(argv[i], "-c") == 0 && i+1 < argc) {
+            batch = true;
+            fin = run_commands(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            interactive = true;
+        } else if (argv[i][0] != '-') {
+            batch = true;
+            if (run_script(argv[i]) == 1)
+                fin = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-i] [-c \"command; command...\"] [script...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (batch && !interactive)
+        fin = 1;
     while (fin != 1) {
         printf(">>> ");
+        fflush(stdout);
         fin = read_command();
     }
+    wait_jobs(0);
+    stop_stream_server();
     return 0;
 }
-#endif
\ No newline at end of file
+#endif
@@ -3,30 +3,77 @@
 
 #include "VnaScanMultithreaded.h"
 #include "VnaCommunication.h"
+#include "VnaStreamServer.h"
+#include "VnaCalibration.h"
+#include "VnaTdr.h"
+#include "VnaPeak.h"
 
 #include <string.h>
 #include <stdio.h>
+#include <ctype.h>
 
-// maybe make a struct for the commands I'm passing around?
+#define MAX_COMMAND_LENGTH 1024
+#define MAX_COMMAND_TOKENS 64
+#define MAX_JOBS 16
+#define MAX_POINTS_PER_SCAN 101 // most points the firmware takes in one scan command
+
+/**
+ * A command split into words
+ * 
+ * Each command handler takes the words it needs with next_token, so
+ * commands can be parsed on any thread without sharing state (unlike strtok).
+ */
+struct command {
+    char line[MAX_COMMAND_LENGTH];      // the command, split in place
+    char *tokens[MAX_COMMAND_TOKENS];   // the words, pointing into line
+    int nbr_tokens;
+    int next;                           // index of the next word to take
+};
+
+/**
+ * Splits a command into words separated by whitespace.
+ * A word starting with '#' starts a comment, ignored with the rest of the line.
+ * 
+ * @param cmd the command to fill
+ * @param line the text of the command
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the line is longer than
+ *  MAX_COMMAND_LENGTH or has more than MAX_COMMAND_TOKENS words
+ */
+int tokenise_command(struct command *cmd, const char *line);
+
+/**
+ * Takes the next word of a command
+ * 
+ * @param cmd the command
+ * @return the word, or NULL if there are none left
+ */
+char* next_token(struct command *cmd);
+
+/**
+ * Looks at the next word of a command without taking it
+ * 
+ * @param cmd the command
+ * @return the word, or NULL if there are none left
+ */
+char* peek_token(struct command *cmd);
 
 /**
  * Handles print command
  * 
- * Exprects strtok to be set up by read_command()
+ * @param cmd the command, with 'help' already taken
  */
-void help();
+void help(struct command *cmd);
 
 /**
- * Takes strtok args to make a list of vnas
+ * Takes the rest of a command's words to make a list of vnas
  * 
  * does input validation and checks vnas are connected
- * expects strtok to be set up by read_command()
  * 
- * @param tok the first argument
+ * @param cmd the command, with the words before the vna ids already taken
  * @param vnas the array to put the new list of vnas into
  * @return number of vnas in list
  */
-int get_vna_list_from_args(char* tok, int* vnas);
+int get_vna_list_from_args(struct command *cmd, int* vnas);
 
 /**
  * Handles scan command
@@ -35,9 +82,9 @@ int get_vna_list_from_args(char* tok, int* vnas);
  * then the argument(s) after that to determine which vnas to pass in.
  * Uses the parameters set up by set()
  * 
- * Expects strtok to be set up by read_command()
+ * @param cmd the command, with 'scan' already taken
  */
-void scan();
+void scan(struct command *cmd);
 
 /**
  * Handles sweep command
@@ -46,12 +93,27 @@ void scan();
  * 
  * start: then takes the argument(s) after that to determine which vnas to pass in.
  * stop: takes the next argument to decide which sweep to stop / all sweeps if NULL.
+ * wait: waits for a sweep / all sweeps to finish (see sweep_wait)
  * list: lists status of all sweeps
+ * 
+ * @param cmd the command, with 'sweep' already taken
  */
-void sweep();
+void sweep(struct command *cmd);
 
 /**
- * Calculates a number of scans and points per scan value given a resolution.
+ * Waits for a sweep, or all sweeps that finish by themselves, to finish
+ * and frees their scan ids, optionally giving up after a timeout
+ * 
+ * @param cmd the command, with 'sweep wait' already taken
+ */
+void sweep_wait(struct command *cmd);
+
+/**
+ * Calculates a number of scans and points per scan value given a resolution,
+ * for a sweep with one VNA.
+ * 
+ * Sweeps have exactly res points, the last scan taking whatever is left, in
+ * the fewest scans with the points spread evenly between them.
  * 
  * @param res the resolution value to assign other things off of
  * @param nbr_scans the place to put the new nbr_scans value
@@ -60,13 +122,30 @@ void sweep();
  */
 int calculate_resolution(int res, int* nbr_scans, int* points_per_scan);
 
+/**
+ * Calculates a number of scans and points per scan value given a resolution,
+ * for a run of sweeps whose scans are shared between nbr_vnas VNAs.
+ * 
+ * Picks the split the scan cost model, fitted to recent scans, says will
+ * finish soonest. See plan_resolution.
+ * 
+ * @param res the resolution value to assign other things off of
+ * @param nbr_vnas number of VNAs sharing each sweep
+ * @param nbr_sweeps number of sweeps in the run, or 0 if it runs until stopped
+ * @param nbr_scans the place to put the new nbr_scans value
+ * @param points_per_scan the place to put the new points_per_scan value
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on invalid res
+ */
+int calculate_shared_resolution(int res, int nbr_vnas, int nbr_sweeps, int* nbr_scans, int* points_per_scan);
+
 /**
  * Gives a new value to a setting that would be passed into a new scan/sweep
  * 
  * Does input validation itself.
- * Expects strtok to be set up.
+ * 
+ * @param cmd the command, with 'set' already taken
  */
-void set();
+void set(struct command *cmd);
 
 /**
  * Lists the current settings that would be passed into a new scan/sweep
@@ -78,6 +157,22 @@ void list();
  */
 void list_vnas();
 
+/**
+ * Prints the scan reliability stats of each connected VNA,
+ * or resets them if the next token is 'reset'.
+ *
+ * @param cmd the command, with 'vna stats' already taken
+ */
+void vna_stats(struct command *cmd);
+
+/**
+ * Starts recording a VNA's serial traffic to a file, or stops
+ * recording if the file name given is 'stop'.
+ *
+ * @param cmd the command, with 'vna capture' already taken
+ */
+void vna_capture(struct command *cmd);
+
 /**
  * Handles VNA connection-related commands, passing control to
  * relevant VnaCommunication method.
@@ -85,15 +180,128 @@ void list_vnas();
  * Will take an input for the type of VNA command,
  * then potentially the vna to be targeted.
  * 
- * Expects strtok to be set up by read_command()
+ * @param cmd the command, with 'vna' already taken
+ */
+void vna_commands(struct command *cmd);
+
+/**
+ * Handles stream commands: starting, stopping and listing
+ * the clients of the streaming server.
+ *
+ * @param cmd the command, with 'stream' already taken
+ */
+void stream_commands(struct command *cmd);
+
+/**
+ * Prints how much of a running sweep is done, how fast it is going, and
+ * when it is predicted to finish
+ *
+ * @param progress the sweep's progress
+ */
+void print_scan_progress(const struct scan_progress *progress);
+
+/**
+ * Predicts how long a 'scan num' would take with the current settings,
+ * from the VNAs' scan cost models, without starting it
+ *
+ * @param cmd the command, with 'plan' already taken
+ */
+void plan_sweeps(struct command *cmd);
+
+/**
+ * Lists the sweep segments, and how many scans they take
+ */
+void list_segments();
+
+/**
+ * Handles segment commands: adding, listing and clearing
+ * the segments sweeps cover
+ *
+ * @param cmd the command, with 'segment' already taken
+ */
+void segment_commands(struct command *cmd);
+
+/**
+ * Lists the VNAs that are calibrated, or have standards measured
+ */
+void list_calibrations();
+
+/**
+ * Handles cal commands: measuring standards, solving, saving, loading
+ * and turning off the calibration of a VNA
+ *
+ * @param cmd the command, with 'cal' already taken
+ */
+void cal_commands(struct command *cmd);
+
+/**
+ * Runs a command in the background, on its own thread
+ * 
+ * The command shares the current settings with everything else, and
+ * its output is printed as it happens. Commands that read or change the
+ * settings take turns with each other, wherever they run. exit, jobs and
+ * wait can't be run in the background.
+ * 
+ * @param line the command, without the '&'
+ * @return the job's id (from 1), or -1 if it couldn't be started
+ */
+int start_job(const char *line);
+
+/**
+ * Lists background jobs that are running or have finished
+ */
+void list_jobs();
+
+/**
+ * Waits for background jobs to finish
+ * 
+ * @param job_id the job to wait for, or 0 for every job
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if there is no such job
+ */
+int wait_jobs(int job_id);
+
+/**
+ * Hands execution of a command over to the relevant function, holding
+ * the settings lock while it runs if it reads or changes the settings
+ * 
+ * @param cmd the command, with no words taken yet
+ * @return 1 if the command was exit, otherwise 0
+ */
+int run_command(struct command *cmd);
+
+/**
+ * Runs a line of text as a command. If it ends with '&', it is
+ * started as a background job instead of being waited for.
+ * 
+ * @param line the command
+ * @return 1 if the command was exit, otherwise 0
+ */
+int execute_command(const char *line);
+
+/**
+ * Runs commands separated by ';' or new lines, echoing each one
+ * 
+ * @param commands the commands, e.g. "vna add memory:0; sweep start"
+ * @return 1 if one of them was exit (the rest are not run), otherwise 0
  */
-void vna_commands();
+int run_commands(const char *commands);
 
 /**
- * Reads a single command from stdin, sets up strtok and hands
- * exectution over to relevant other function.
+ * Runs every line of a script file as a command, echoing each one
+ * 
+ * @param path the script
+ * @return 1 if the script ran exit (the rest is not run), 0 when it has
+ *  all run, -1 if it couldn't be opened
+ */
+int run_script(const char *path);
+
+/**
+ * Reads a single command from stdin and runs it with execute_command.
+ * 
+ * While streaming, commands sent by control clients are taken too.
+ * 'exit' from a control client only disconnects that client.
  * 
- * @return returns 1 if exit command issued, otherwise returns 0.
+ * @return returns 1 if exit command issued or stdin has ended, otherwise returns 0.
  */
 int read_command();
 
@@ -1,5 +1,5 @@
 #include "VnaCommunication.h"
-#include <glob.h>
+#include <pthread.h>
 
 /**
  * Current number of connected VNAs
@@ -15,18 +15,34 @@ int total_vnas = 0;
 char **vna_names = NULL;
 
 /**
- * The file descriptors of all currently connected VNAs
+ * The connections to all currently connected VNAs
  * indexed by vna_id
- * -1 if unnocupied, >=0 if occupied.
+ * ops is NULL if unnocupied.
  */
-int * vna_fds = NULL;
+struct vna_transport *vna_transports = NULL;
 
 /**
- * The initial settings of all currently connected VNAs
- * indexed by vna_id
- * May be any value when unnocupied, must be written over.
+ * Slots taken by an add_vna still connecting to and testing its VNA.
+ * They aren't counted as connected until that has succeeded.
+ */
+static bool vna_reserved[MAXIMUM_VNA_PORTS];
+
+/**
+ * Guards total_vnas, vna_names, vna_reserved and which vna_transports are
+ * in use, as background jobs add and remove VNAs on their own threads.
+ * Not held while talking to a VNA.
  */
-struct termios* vna_initial_settings = NULL;
+static pthread_mutex_t vna_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Open capture files, indexed by vna_id
+ * NULL when that VNA is not being captured.
+ * Guarded by capture_lock, nbr_captures lets reads skip the lock
+ * when nothing is being captured.
+ */
+static FILE *vna_captures[MAXIMUM_VNA_PORTS];
+static volatile int nbr_captures = 0;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /**
  * For SIGINT handling, ensures signal handler cannot
@@ -46,142 +62,104 @@ void fatal_error_signal(int sig) {
     raise (sig);
 }
 
-int open_serial(const char *port, struct termios *init_tty) {
-    int fd = open(port, O_RDWR | O_NOCTTY);
-    if (fd < 0) {
-         // 2. Dyanmic port detection (MacOS)
-        #ifdef __APPLE__
-        if (strstr(port, "ttyACM") != NULL) {
-            // Checking for the "/dev/cy.usbmodem*" pattern
-            glob_t glob_result;
-
-            if (glob("/dev/cu.usbmodem*", 0, NULL, &glob_result) == 0) {
-                int i = 0;
-                while (i < glob_result.gl_pathc && fd < 0) {
-                    char *candidate = glob_result.gl_pathv[i];
-
-                    // Attempt to open the candidate port
-                    fd = open(candidate, O_RDWR | O_NOCTTY);
-                    i++;
-                }
-                globfree(&glob_result);
-            }
-        }
-        if (fd < 0) {
-            fprintf(stderr, "Error opening serial port %s: %s\n", port, strerror(errno));
-            return -1;
+/**
+ * Appends one record to a VNA's capture file, if it is being captured
+ */
+static void capture_bytes(int vna_num, char direction, const void *bytes, size_t length) {
+    if (nbr_captures == 0 || length == 0)
+        return;
+    pthread_mutex_lock(&capture_lock);
+    FILE *capture = vna_captures[vna_num];
+    if (capture) {
+        uint8_t header[5] = {direction, length & 0xff, (length >> 8) & 0xff,
+                             (length >> 16) & 0xff, (length >> 24) & 0xff};
+        if (fwrite(header, 1, sizeof(header), capture) != sizeof(header) ||
+            fwrite(bytes, 1, length, capture) != length) {
+            fprintf(stderr, "Error writing capture of vna %d: %s\n", vna_num, strerror(errno));
         }
-        #else
-        fprintf(stderr, "Error opening serial port %s: %s\n", port, strerror(errno));
-        return -1;
-        #endif
     }
+    pthread_mutex_unlock(&capture_lock);
+}
 
-    if (configure_serial(fd,init_tty) != 0) {
-        fprintf(stderr, "Error configuring port %s: %s\n", port, strerror(errno));
-        close(fd);
-        return -1;
+int start_capture(int vna_num, const char *path) {
+    if (vna_num < 0 || vna_num >= MAXIMUM_VNA_PORTS)
+        return EXIT_FAILURE;
+    stop_capture(vna_num);
+
+    FILE *capture = fopen(path, "wb");
+    if (!capture) {
+        fprintf(stderr, "Error opening capture file %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
     }
+    fputs(CAPTURE_MAGIC, capture);
 
-    return fd;
+    pthread_mutex_lock(&capture_lock);
+    vna_captures[vna_num] = capture;
+    nbr_captures++;
+    pthread_mutex_unlock(&capture_lock);
+    return EXIT_SUCCESS;
 }
 
-int configure_serial(int serial_port, struct termios *initial_tty) {
-    int error = tcgetattr(serial_port, initial_tty); // put actual initial tty in
-    if (error != 0) {
-        fprintf(stderr, "Error %i from tcgetattr: %s\n", errno, strerror(errno));
+int stop_capture(int vna_num) {
+    if (vna_num < 0 || vna_num >= MAXIMUM_VNA_PORTS)
         return EXIT_FAILURE;
+    pthread_mutex_lock(&capture_lock);
+    FILE *capture = vna_captures[vna_num];
+    if (capture) {
+        vna_captures[vna_num] = NULL;
+        nbr_captures--;
     }
-    struct termios tty = *initial_tty; // copy for editing
-
-    // Configure baud rate (115200)
-    cfsetispeed(&tty, B115200);  // Input speed
-    cfsetospeed(&tty, B115200);  // Output speed
-
-    // Configure 8N1 (8 data bits, no parity, 1 stop bit)
-    tty.c_cflag &= ~PARENB;  // Clear parity bit (no parity)
-    tty.c_cflag &= ~CSTOPB;  // Clear stop bit (1 stop bit)
-    tty.c_cflag &= ~CSIZE;   // Clear data size bits
-    tty.c_cflag |= CS8;      // Set 8 data bits
+    pthread_mutex_unlock(&capture_lock);
 
-    // Disable hardware flow control
-    #ifdef CRTSCTS
-    tty.c_cflag &= ~CRTSCTS;
-    #elif defined(CNEW_RTSCTS)
-    tty.c_cflag &= ~CNEW_RTSCTS;
-    #endif
-
-    tty.c_cflag |= CREAD | CLOCAL;  // Turn on READ & ignore modem control lines
-
-    // Set RAW mode (binary communication, no line processing)
-    tty.c_lflag &= ~ICANON;  // Disable canonical mode (line-by-line)
-    tty.c_lflag &= ~ECHO;    // Disable echo
-    tty.c_lflag &= ~ECHOE;   // Disable erasure
-    tty.c_lflag &= ~ECHONL;  // Disable new-line echo
-    tty.c_lflag &= ~ISIG;    // Disable interpretation of INTR, QUIT and SUSP
-
-    // Disable software flow control
-    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
-    
-    // Disable special handling of received bytes
-    tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL);
-    
-    // Prevent special interpretation of output bytes
-    tty.c_oflag &= ~OPOST;  // Disable output processing
-    tty.c_oflag &= ~ONLCR;  // Prevent conversion of newline to carriage return/line feed
-
-    // Set timeout configuration
-    // VMIN = 0, VTIME > 0: Timeout with no minimum bytes
-    // Read returns when data arrives or timeout expires
-    tty.c_cc[VMIN] = 0;   // No minimum
-    tty.c_cc[VTIME] = 10; // 1 second timeout (tenths of a second)
-
-    // Apply settings
-    if (tcsetattr(serial_port, TCSANOW, &tty) != 0) {
-        fprintf(stderr, "Error %i from tcsetattr: %s\n", errno, strerror(errno));
+    if (!capture)
+        return EXIT_FAILURE;
+    if (fclose(capture) != 0) {
+        fprintf(stderr, "Error closing capture of vna %d: %s\n", vna_num, strerror(errno));
         return EXIT_FAILURE;
     }
-
     return EXIT_SUCCESS;
 }
 
-int restore_serial(int fd, const struct termios *settings) {
-    if (tcsetattr(fd, TCSANOW, settings) != 0) {
-        return errno;
-    }
-    return EXIT_SUCCESS;
+bool is_capturing(int vna_num) {
+    if (vna_num < 0 || vna_num >= MAXIMUM_VNA_PORTS)
+        return false;
+    pthread_mutex_lock(&capture_lock);
+    bool capturing = vna_captures[vna_num] != NULL;
+    pthread_mutex_unlock(&capture_lock);
+    return capturing;
+}
+
+bool is_replay(int vna_num) {
+    return vna_transports[vna_num].ops == &replay_transport;
 }
 
 ssize_t write_command(int vna_num, const char *cmd) {
     size_t cmd_len = strlen(cmd);
-    ssize_t bytes_written = write(vna_fds[vna_num], cmd, cmd_len);
-    
-    if (bytes_written < 0) {
-        fprintf(stderr, "Error writing to fd %d: %s\n", vna_fds[vna_num], strerror(errno));
-        return -1;
-    } else if (bytes_written < (ssize_t)cmd_len) {
-        fprintf(stderr, "Warning: Partial write (%zd of %zu bytes) on fd %d\n", 
-                bytes_written, cmd_len, vna_fds[vna_num]);
-    }
-    
-    return bytes_written;
+    capture_bytes(vna_num, CAPTURE_SENT, cmd, cmd_len);
+    struct vna_transport *transport = &vna_transports[vna_num];
+    return transport->ops->write_all(transport, (const uint8_t *)cmd, cmd_len);
+}
+
+int flush_vna(int vna_num) {
+    struct vna_transport *transport = &vna_transports[vna_num];
+    return transport->ops->flush(transport);
 }
 
 ssize_t read_exact(int vna_num, uint8_t *buffer, size_t length) {
+    struct vna_transport *transport = &vna_transports[vna_num];
     ssize_t bytes_read = 0;
     
     while (bytes_read < (ssize_t)length) {
-        ssize_t n = read(vna_fds[vna_num], buffer + bytes_read, length - bytes_read);
-        
-        if (n < 0) {
-            fprintf(stderr, "Error reading from fd %d: %s\n",
-                     vna_fds[vna_num], strerror(errno));
+        ssize_t n = transport->ops->read_some(transport, buffer + bytes_read, length - bytes_read,
+                                              TRANSPORT_READ_TIMEOUT_MS);
+        if (n < 0)
             return -1;
-        } else if (n == 0) {
+        capture_bytes(vna_num, CAPTURE_RECEIVED, buffer + bytes_read, n);
+        if (n == 0) {
             // Timeout or end of file
             if (bytes_read > 0) {
-                fprintf(stderr, "Timeout: only read %zd of %zu bytes from fd %d\n", 
-                        bytes_read, length, vna_fds[vna_num]);
+                fprintf(stderr, "Timeout: only read %zd of %zu bytes from vna %d\n", 
+                        bytes_read, length, vna_num);
             }
             return bytes_read;
         }
@@ -192,10 +170,59 @@ ssize_t read_exact(int vna_num, uint8_t *buffer, size_t length) {
     return bytes_read;
 }
 
+uint64_t monotonic_ns(void) {
+    struct timespec now;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+ssize_t drain_vna(int vna_num, int quiet_ms, int max_ms) {
+    struct vna_transport *transport = &vna_transports[vna_num];
+    uint8_t scratch[256];
+    ssize_t discarded = 0;
+    uint64_t deadline = monotonic_ns() + (uint64_t)max_ms * 1000000ULL;
+
+    while (monotonic_ns() < deadline) {
+        ssize_t n = transport->ops->read_some(transport, scratch, sizeof(scratch), quiet_ms);
+        if (n < 0)
+            return -1;
+        else if (n == 0)
+            break; // line has gone quiet
+        capture_bytes(vna_num, CAPTURE_DISCARDED, scratch, n);
+        discarded += n;
+    }
+    transport->ops->flush(transport);
+    return discarded;
+}
+
+int interrupt_vna(int vna_num) {
+    if (!vna_transports || vna_num < 0 || vna_num >= MAXIMUM_VNA_PORTS)
+        return EXIT_FAILURE;
+    return interrupt_transport(&vna_transports[vna_num]);
+}
+
+bool vna_interrupted(int vna_num) {
+    if (!vna_transports || vna_num < 0 || vna_num >= MAXIMUM_VNA_PORTS)
+        return false;
+    return transport_interrupted(&vna_transports[vna_num]);
+}
+
+void clear_vna_interrupt(int vna_num) {
+    if (!vna_transports || vna_num < 0 || vna_num >= MAXIMUM_VNA_PORTS)
+        return;
+    clear_transport_interrupt(&vna_transports[vna_num]);
+}
+
 #define INFO_SIZE 292
 
 int test_vna(int vna_num) {
-    tcflush(vna_fds[vna_num],TCIOFLUSH);
+    if (is_replay(vna_num))
+        return EXIT_SUCCESS;
+    flush_vna(vna_num);
     const char *msg = "info\r";
     if (write_command(vna_num, msg) < 0) {
         fprintf(stderr, "Failed to send info command\n");
@@ -205,6 +232,8 @@ int test_vna(int vna_num) {
     char buffer[INFO_SIZE+1];
     int num_bytes = read_exact(vna_num,(uint8_t*)buffer,INFO_SIZE);
     buffer[num_bytes] = '\0';
+    // the rest of the reply would otherwise be read as the start of the first scan
+    drain_vna(vna_num,50,1000);
     if (strstr(buffer,"NanoVNA-H"))
         return EXIT_SUCCESS;
     else
@@ -212,133 +241,191 @@ int test_vna(int vna_num) {
 }
 
 int get_vna_count() {
-    return total_vnas;
+    pthread_mutex_lock(&vna_table_lock);
+    int count = total_vnas;
+    pthread_mutex_unlock(&vna_table_lock);
+    return count;
 }
 
-int in_vna_list(const char* vna_path) {
-    for (int i = 0; i < total_vnas; i++) {
-        if (strcmp(vna_path,vna_names[i]) == 0)
+/**
+ * in_vna_list, for callers holding vna_table_lock. Counts VNAs still
+ * being added, so the same path can't be added twice at once.
+ */
+static int path_in_table(const char* vna_path) {
+    for (int i = 0; i < MAXIMUM_VNA_PORTS; i++) {
+        if (vna_names[i] && strcmp(vna_path,vna_names[i]) == 0)
             return 1;
     }
     return 0;
 }
 
+int in_vna_list(const char* vna_path) {
+    pthread_mutex_lock(&vna_table_lock);
+    int found = path_in_table(vna_path);
+    pthread_mutex_unlock(&vna_table_lock);
+    return found;
+}
+
+/**
+ * is_connected, for callers holding vna_table_lock
+ */
+static bool slot_connected(int vna_id) {
+    return vna_transports[vna_id].ops != NULL && !vna_reserved[vna_id];
+}
+
 bool is_connected(int vna_id) {
-    return (vna_fds[vna_id] >= 0);
+    pthread_mutex_lock(&vna_table_lock);
+    bool connected = slot_connected(vna_id);
+    pthread_mutex_unlock(&vna_table_lock);
+    return connected;
 }
 
 int get_connected_vnas(int* vna_list) {
     int count = 0;
-    int i = 0;
-    while (count < total_vnas) {
-        if (vna_fds[i] >= 0) {
-            vna_list[count] = i;
-            count++;
-        }
-        i++;
+    pthread_mutex_lock(&vna_table_lock);
+    for (int i = 0; i < MAXIMUM_VNA_PORTS; i++) {
+        if (slot_connected(i))
+            vna_list[count++] = i;
     }
+    pthread_mutex_unlock(&vna_table_lock);
     return count;
 }
 
+/**
+ * Copies the path of a connected VNA, so it can be printed without
+ * holding vna_table_lock while the VNA is talked to
+ *
+ * @return true if the VNA is connected, false if not (name is untouched)
+ */
+static bool copy_vna_name(int vna_num, char *name) {
+    pthread_mutex_lock(&vna_table_lock);
+    bool connected = slot_connected(vna_num);
+    if (connected)
+        strncpy(name,vna_names[vna_num],MAXIMUM_VNA_PATH_LENGTH);
+    pthread_mutex_unlock(&vna_table_lock);
+    return connected;
+}
+
+/**
+ * Stops any capture and closes the connection to a VNA,
+ * leaving it marked as unoccupied
+ */
+static void close_vna(int vna_num) {
+    stop_capture(vna_num);
+    close_transport(&vna_transports[vna_num]);
+}
+
+/**
+ * Closes a connected VNA and frees its slot, for callers holding
+ * vna_table_lock (or tearing everything down)
+ */
+static void remove_slot(int vna_num) {
+    close_vna(vna_num);
+    free(vna_names[vna_num]);
+    vna_names[vna_num] = NULL;
+    total_vnas--;
+}
+
 int add_vna(char* vna_path) {
-    if (total_vnas >= MAXIMUM_VNA_PORTS)
+    pthread_mutex_lock(&vna_table_lock);
+    if (total_vnas >= MAXIMUM_VNA_PORTS) {
+        pthread_mutex_unlock(&vna_table_lock);
         return 1;
+    }
     int path_len = strlen(vna_path);
-    if (path_len > MAXIMUM_VNA_PATH_LENGTH)
+    if (path_len > MAXIMUM_VNA_PATH_LENGTH) {
+        pthread_mutex_unlock(&vna_table_lock);
         return 2;
+    }
 
-    if (in_vna_list(vna_path))
+    if (path_in_table(vna_path)) {
+        pthread_mutex_unlock(&vna_table_lock);
         return 3;
-    
-    int fd = open_serial(vna_path,&vna_initial_settings[total_vnas]);
-    if (fd < 0)
-        return -1;
+    }
 
+    // reserve a slot no other VNA has or is being added to
     int vna_id = -1;
     int i = 0;
     while (i < MAXIMUM_VNA_PORTS && vna_id < 0) {
-        if (vna_fds[i] < 0)
+        if (!vna_names[i] && vna_transports[i].ops == NULL)
             vna_id = i;
         i++;
     }
     if (vna_id < 0) {
-        fprintf(stderr, "how did we get here? add\n");
-        return -1;
-    }
-
-    vna_fds[vna_id] = fd;
-
-    if (test_vna(vna_id) != EXIT_SUCCESS) {
-        restore_serial(fd,&vna_initial_settings[vna_id]);
-        close(fd);
-        vna_fds[vna_id] = -1;
-        return 4;
+        // the rest are taken by VNAs still being added
+        pthread_mutex_unlock(&vna_table_lock);
+        return 1;
     }
-    
     vna_names[vna_id] = calloc(sizeof(char),MAXIMUM_VNA_PATH_LENGTH);
     if (!vna_names[vna_id]) {
-        restore_serial(fd,&vna_initial_settings[vna_id]);
-        close(fd);
-        vna_fds[vna_id] = -1;
+        pthread_mutex_unlock(&vna_table_lock);
         return -1;
     }
-    strncpy(vna_names[vna_id],vna_path,path_len);
-    total_vnas++;
-
-    return EXIT_SUCCESS;
+    memcpy(vna_names[vna_id],vna_path,path_len);
+    vna_reserved[vna_id] = true;
+    pthread_mutex_unlock(&vna_table_lock);
+
+    // connecting and testing can take a while, so not under the lock
+    int error = EXIT_SUCCESS;
+    const char *rest;
+    const struct vna_transport_ops *ops = transport_for_path(vna_path, &rest);
+    if (open_transport(&vna_transports[vna_id], vna_path) != EXIT_SUCCESS) {
+        // a replay that can't be read is as good as not being a VNA
+        error = (ops == &replay_transport && access(rest, R_OK) == 0) ? 4 : -1;
+    } else if (test_vna(vna_id) != EXIT_SUCCESS) {
+        close_transport(&vna_transports[vna_id]);
+        error = 4;
+    }
+
+    pthread_mutex_lock(&vna_table_lock);
+    vna_reserved[vna_id] = false;
+    if (error == EXIT_SUCCESS) {
+        total_vnas++;
+    } else {
+        free(vna_names[vna_id]);
+        vna_names[vna_id] = NULL;
+    }
+    pthread_mutex_unlock(&vna_table_lock);
+
+    return error;
 }
 
 int remove_vna_name(char* vna_path) {
     int vna_num = -1;
 
+    pthread_mutex_lock(&vna_table_lock);
     int i = 0;
-    while (i < total_vnas && vna_num < 0) {
-        if (strcmp(vna_path,vna_names[i]) == 0) {
+    while (i < MAXIMUM_VNA_PORTS && vna_num < 0) {
+        if (slot_connected(i) && strcmp(vna_path,vna_names[i]) == 0) {
             vna_num = i;
         }
         i++;
     }
     if (vna_num < 0) {
+        pthread_mutex_unlock(&vna_table_lock);
         return EXIT_FAILURE;
     }
 
-    if (restore_serial(vna_fds[vna_num],&vna_initial_settings[vna_num]) != 0 && !fatal_error_in_progress) {
-        fprintf(stderr, "Error %i restoring settings on port %d: %s\n", errno, vna_num, strerror(errno));
-    }
-    if (close(vna_fds[vna_num]) != 0 && !fatal_error_in_progress) {
-        fprintf(stderr, "Error %i closing port %d: %s\n", errno, vna_num, strerror(errno));
-    }
-
-    vna_fds[vna_num] = -1;
-    free(vna_names[vna_num]);
-    vna_names[vna_num] = NULL;
-
-    total_vnas--;
+    remove_slot(vna_num);
+    pthread_mutex_unlock(&vna_table_lock);
 
     return EXIT_SUCCESS;
 }
 
 int remove_vna_number(int vna_num) {
 
-    if (vna_num < 0 || vna_num > MAXIMUM_VNA_PORTS) {
+    if (vna_num < 0 || vna_num >= MAXIMUM_VNA_PORTS) {
         return EXIT_FAILURE;
-    } else if (vna_fds[vna_num] < 0) {
+    }
+    pthread_mutex_lock(&vna_table_lock);
+    if (!slot_connected(vna_num)) {
+        pthread_mutex_unlock(&vna_table_lock);
         fprintf(stderr, "No connection at vna id %d\n", vna_num);
         return EXIT_FAILURE;
     }
 
-    if (restore_serial(vna_fds[vna_num],&vna_initial_settings[vna_num]) != 0 && !fatal_error_in_progress) {
-        fprintf(stderr, "Error %i restoring settings on port %d: %s\n", errno, vna_num, strerror(errno));
-    }
-    if (close(vna_fds[vna_num]) != 0 && !fatal_error_in_progress) {
-        fprintf(stderr, "Error %i closing port %d: %s\n", errno, vna_num, strerror(errno));
-    }
-
-    vna_fds[vna_num] = -1;
-    free(vna_names[vna_num]);
-    vna_names[vna_num] = NULL;
-
-    total_vnas--;
+    remove_slot(vna_num);
+    pthread_mutex_unlock(&vna_table_lock);
 
     return EXIT_SUCCESS;
 }
@@ -354,8 +441,7 @@ int find_vnas(char** paths, const char* search_dir) {
     while ((dir = readdir(d)) != NULL) {
         if (strstr(dir->d_name,"ttyACM")) {
             char vna_name[MAXIMUM_VNA_PATH_LENGTH];
-            strncpy(vna_name,"/dev/",6);
-            strncat(vna_name,dir->d_name,MAXIMUM_VNA_PATH_LENGTH-6);
+            snprintf(vna_name,sizeof(vna_name),"/dev/%.*s",MAXIMUM_VNA_PATH_LENGTH-6,dir->d_name);
 
             if (!in_vna_list(vna_name) && count < MAXIMUM_VNA_PORTS) {
                 paths[count] = NULL;
@@ -389,31 +475,52 @@ int add_all_vnas() {
 
 void vna_id() {
     char* buffer = calloc(sizeof(char),8);
-    for (int i = 0; i < total_vnas; i++) {
-        tcflush(vna_fds[i],TCIOFLUSH);
+    char name[MAXIMUM_VNA_PATH_LENGTH+1] = {0};
+    for (int i = 0; i < MAXIMUM_VNA_PORTS; i++) {
+        if (!copy_vna_name(i,name))
+            continue;
+        if (is_replay(i)) {
+            fprintf(stdout,"    %d. %s replay of a capture\n",i,name);
+            continue;
+        }
+        flush_vna(i);
         write_command(i,"version\r");
         read_exact(i,(uint8_t *)buffer,7);
-        fprintf(stdout,"    %d. %s NanoVNA-H version %s\n",i,vna_names[i],buffer);
+        fprintf(stdout,"    %d. %s NanoVNA-H version %s\n",i,name,buffer);
     }
+    free(buffer);
 }
 
 void vna_ping() {
-    for (int i = 0; i < total_vnas; i++) {
+    char name[MAXIMUM_VNA_PATH_LENGTH+1] = {0};
+    for (int i = 0; i < MAXIMUM_VNA_PORTS; i++) {
+        if (!copy_vna_name(i,name))
+            continue;
         if (test_vna(i) == 0) {
-            fprintf(stdout,"    %s says pong\n",vna_names[i]);
+            fprintf(stdout,"    %s says pong\n",name);
         }
         else {
-            fprintf(stdout,"    failed to ping %s\n",vna_names[i]);
+            fprintf(stdout,"    failed to ping %s\n",name);
         }
     }
 }
 
 void vna_reset() {
-    for (int i = 0; i < total_vnas; i++) {
-        write_command(i,"reset\r");
+    pthread_mutex_lock(&vna_table_lock);
+    for (int i = 0; i < MAXIMUM_VNA_PORTS; i++) {
+        if (vna_reserved[i]) {
+            pthread_mutex_unlock(&vna_table_lock);
+            fprintf(stderr, "VNAs are still being added, not resetting\n");
+            return;
+        }
+    }
+    for (int i = 0; i < MAXIMUM_VNA_PORTS; i++) {
+        if (slot_connected(i))
+            write_command(i,"reset\r");
     }
     teardown_port_array();
     initialise_port_array();
+    pthread_mutex_unlock(&vna_table_lock);
     // add_all_vnas();
 }
 
@@ -422,11 +529,13 @@ void vna_status() {
 }
 
 void print_vnas() {
+    pthread_mutex_lock(&vna_table_lock);
     for (int i = 0; i < MAXIMUM_VNA_PORTS; i++) {
-        if (vna_fds[i] >= 0) {
+        if (slot_connected(i)) {
             printf("    %d. %s\n", i, vna_names[i]);
         }
     }
+    pthread_mutex_unlock(&vna_table_lock);
 }
 
 int initialise_port_array() {
@@ -443,42 +552,34 @@ int initialise_port_array() {
     }
 
     vna_names = calloc(sizeof(char*),MAXIMUM_VNA_PORTS);
-    vna_fds = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
-    vna_initial_settings = calloc(sizeof(struct termios),MAXIMUM_VNA_PORTS);
-    if (!vna_names || !vna_fds || !vna_initial_settings) {
+    vna_transports = calloc(sizeof(struct vna_transport),MAXIMUM_VNA_PORTS);
+    if (!vna_names || !vna_transports) {
         fprintf(stderr,"failed to allocate memory for port arrays\n");
         if (vna_names) {
             free(vna_names);
             vna_names=NULL;
         }
-        if (vna_fds) {
-            free(vna_fds);
-            vna_fds=NULL;
-        }
-        if (vna_initial_settings) {
-            free(vna_initial_settings);
-            vna_initial_settings=NULL;
+        if (vna_transports) {
+            free(vna_transports);
+            vna_transports=NULL;
         }
         return EXIT_FAILURE;
     }
-    for (int i = 0; i < MAXIMUM_VNA_PORTS; i++)
-        vna_fds[i] = -1;
     total_vnas = 0;
 
     return EXIT_SUCCESS;
 }
 
 void teardown_port_array() {
+    // not under vna_table_lock, as the SIGINT handler may have interrupted its holder
     for (int i = 0; i < MAXIMUM_VNA_PORTS; i++) {
-        if (is_connected(i)) {
-            remove_vna_number(i);
+        if (slot_connected(i)) {
+            remove_slot(i);
         }
     }
 
-    free(vna_initial_settings);
-    vna_initial_settings = NULL;
     free(vna_names);
     vna_names = NULL;
-    free(vna_fds);
-    vna_fds = NULL;
+    free(vna_transports);
+    vna_transports = NULL;
 }
\ No newline at end of file
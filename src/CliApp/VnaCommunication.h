@@ -15,9 +15,13 @@
 #include <termios.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <poll.h>
+#include <time.h>
 
-#define MAXIMUM_VNA_PORTS 10
-#define MAXIMUM_VNA_PATH_LENGTH 25
+#include "VnaTransport.h"
+
+#define MAXIMUM_VNA_PORTS 32
+#define MAXIMUM_VNA_PATH_LENGTH 64
 
 /**
  * Fatal error handling. 
@@ -30,63 +34,112 @@
 void fatal_error_signal(int sig);
 
 /**
- * Opens a serial port and configures its settings
+ * Writes a command to the serial port with error checking
  * 
- * On apple devices, attempts to connect a usbmodem device
- * if /dev/ttyACM* doens't work.
+ * @param vna_num The index of the vna to be used.
+ * @param cmd The command string to send (should include \r terminator)
+ * @return Number of bytes written on success, -1 on error
+ */
+ssize_t write_command(int vna_num, const char *cmd);
+
+/**
+ * Reads exact number of bytes from serial port
+ * Handles partial reads by continuing until all bytes are received
  * 
- * @param port The device path (e.g., "/dev/ttyACM0")
- * @param init_tty Memory location to store the initial settings of the port
- * @return File descriptor on success, -1 on failure
+ * @param vna_num The index of the vna to be used.
+ * @param buffer The buffer to read data into
+ * @param length The number of bytes to read
+ * @return Number of bytes read on success, -1 on error, 0 on timeout
  */
-int open_serial(const char *port, struct termios *init_tty);
+ssize_t read_exact(int vna_num, uint8_t *buffer, size_t length);
 
 /**
- * Configures serial port settings for NanoVNA communication
+ * Reads the raw monotonic clock, which is never stepped or slewed by NTP.
+ * Falls back to CLOCK_MONOTONIC where CLOCK_MONOTONIC_RAW is not available.
  * 
- * Sets up 115200 baud, 8N1, raw mode, no flow control
- * Saves original settings for later restoration:
- * Will not be restored automatically.
+ * @return Nanoseconds since an arbitrary fixed point
+ */
+uint64_t monotonic_ns(void);
+
+/**
+ * Discards everything the VNA sends until the line has been quiet for quiet_ms
+ * 
+ * Used to get back to a clean stream after a failed read, when the VNA may
+ * still be part way through sending a reply. Gives up after max_ms even if
+ * data is still arriving.
  * 
- * @param serial_port The file descriptor of the open serial port
- * @param initial_tty A memory location to store the initial settings 
- * @return 0 on success, another number otherwise.
+ * @param vna_num The index of the vna to be used.
+ * @param quiet_ms How long the line must be silent before it is considered drained
+ * @param max_ms Maximum time to spend draining
+ * @return Number of bytes discarded, -1 on error
  */
-int configure_serial(int serial_port, struct termios *initial_tty);
+ssize_t drain_vna(int vna_num, int quiet_ms, int max_ms);
 
 /**
- * Restores serial port to original settings
+ * Throws away any bytes the VNA has sent that have not been read yet
+ * 
+ * @param vna_num The index of the vna to be used.
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on error
+ */
+int flush_vna(int vna_num);
+
+/**
+ * Makes reads from a VNA give up straight away, including one blocked
+ * waiting for it in another thread, until clear_vna_interrupt is called
+ * 
+ * A read cut short leaves the rest of the reply on its way, so the
+ * stream needs a drain_vna once the interrupt has been cleared.
  * 
- * @param fd The file descriptor of the serial port
- * @param settings The original termios settings to restore
+ * @param vna_num The index of the vna to be used.
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if it is not connected
+ */
+int interrupt_vna(int vna_num);
+
+/**
+ * @return true if reads from the VNA with this id have been interrupted
+ */
+bool vna_interrupted(int vna_num);
+
+/**
+ * Lets reads from an interrupted VNA wait for it again
  * 
- * @return EXIT_SUCCESS on success, errno on error
+ * @param vna_num The index of the vna to be used.
  */
-int restore_serial(int fd, const struct termios *settings);
+void clear_vna_interrupt(int vna_num);
 
 /**
- * Writes a command to the serial port with error checking
+ * Starts recording everything sent to and received from a VNA
+ * 
+ * Any capture already running on this VNA is stopped first.
  * 
  * @param vna_num The index of the vna to be used.
- * @param cmd The command string to send (should include \r terminator)
- * @return Number of bytes written on success, -1 on error
+ * @param path File to write the capture to, overwritten if it exists
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the file cannot be opened
  */
-ssize_t write_command(int vna_num, const char *cmd);
+int start_capture(int vna_num, const char *path);
 
 /**
- * Reads exact number of bytes from serial port
- * Handles partial reads by continuing until all bytes are received
+ * Stops recording a VNA and closes its capture file
  * 
  * @param vna_num The index of the vna to be used.
- * @param buffer The buffer to read data into
- * @param length The number of bytes to read
- * @return Number of bytes read on success, -1 on error, 0 on timeout
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if it was not being captured
  */
-ssize_t read_exact(int vna_num, uint8_t *buffer, size_t length);
+int stop_capture(int vna_num);
+
+/**
+ * @return true if the VNA with this id is being captured
+ */
+bool is_capturing(int vna_num);
+
+/**
+ * @return true if the VNA with this id is replaying a capture file
+ */
+bool is_replay(int vna_num);
 
 /**
  * Tests connection to NanoVNA by issuing info command
  * Sends "info" command and checks answered by NanoVNA
+ * Replay VNAs always pass without reading anything.
  * 
  * @param vna_num The index of the vna to be used.
  * @return 0 on success, 1 on error / not a VNA
@@ -126,8 +179,17 @@ int get_connected_vnas(int* vna_list);
  * Checks that path is a valid length, there is space in ports,
  * can be connected to, and represents a NanoVNA-H connection.
  * 
+ * Paths with a prefix use a transport other than a serial port:
+ *   memory:<name>  an emulated NanoVNA-H held in memory, for testing
+ *   replay:<file>  plays back a capture file (see VnaTransport.h)
+ *   tcp:<host>:<port>  a VNA shared over the network
+ * 
+ * Safe to call from several threads at once: the VNA's slot is reserved
+ * before connecting to it, so each gets its own id.
+ * 
  * @param vna_path a string pointing to the NanoVNA connection file
- * @return 0 if successful, -1 if system error, 1-4 for invalid strings of different types.
+ * @return 0 if successful, -1 if system error, 1-4 for invalid strings of different types
+ * (4 is also returned for a capture file that cannot be replayed).
  */
 int add_vna(char* vna_path);
 
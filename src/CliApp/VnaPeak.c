@@ -0,0 +1,229 @@
+#include "VnaPeak.h"
+
+#include <math.h>
+
+//----------------------------------------
+// Names
+//----------------------------------------
+
+const char *peak_mode_name(PeakMode mode) {
+    switch (mode) {
+    case PEAK_OFF:
+        return "off";
+    case PEAK_S21_PEAK:
+        return "s21peak";
+    case PEAK_S21_DIP:
+        return "s21dip";
+    case PEAK_S11_DIP:
+        return "s11dip";
+    }
+    return "unknown";
+}
+
+int parse_peak_mode(const char *name, PeakMode *mode) {
+    const PeakMode modes[] = {PEAK_OFF, PEAK_S21_PEAK, PEAK_S21_DIP, PEAK_S11_DIP};
+    for (size_t i = 0; i < sizeof(modes)/sizeof(modes[0]); i++) {
+        if (strcmp(name, peak_mode_name(modes[i])) == 0) {
+            *mode = modes[i];
+            return EXIT_SUCCESS;
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+//----------------------------------------
+// Tracker
+//----------------------------------------
+
+int init_peak_tracker(struct peak_tracker *tracker, const struct sweep_plan *plan, PeakMode mode, int window) {
+    memset(tracker, 0, sizeof(*tracker));
+    tracker->mode = mode;
+    tracker->plan = plan;
+    if (plan->nbr_points < 3) {
+        fprintf(stderr, "Peak tracking needs sweeps of at least 3 points\n");
+        return EXIT_FAILURE;
+    }
+    if (window <= 0) {
+        window = plan->nbr_points * PEAK_WINDOW_FRACTION;
+        if (window < PEAK_MIN_WINDOW)
+            window = PEAK_MIN_WINDOW;
+    }
+    tracker->window = window;
+    return EXIT_SUCCESS;
+}
+
+void destroy_peak_tracker(struct peak_tracker *tracker) {
+    for (int v = 0; v < MAXIMUM_VNA_PORTS; v++) {
+        for (int s = 0; s < SWEEP_TRACKER_SLOTS; s++)
+            free(tracker->sweeps[v][s].values);
+    }
+    memset(tracker, 0, sizeof(*tracker));
+}
+
+/**
+ * How far a point stands out in the direction the tracker is looking:
+ * its level in dB for a peak, minus that for a dip
+ */
+static double score(struct peak_tracker *tracker, const struct complex *values, int k) {
+    tracker->points_examined++;
+    double power = (double)values[k].re * values[k].re + (double)values[k].im * values[k].im;
+    double db = 10 * log10(power > 1e-20 ? power : 1e-20);
+    return tracker->mode == PEAK_S21_PEAK ? db : -db;
+}
+
+static int highest_score(struct peak_tracker *tracker, const struct complex *values, int lo, int hi) {
+    int best = lo;
+    double best_score = score(tracker, values, lo);
+    for (int k = lo + 1; k <= hi; k++) {
+        double s = score(tracker, values, k);
+        if (s > best_score) {
+            best = k;
+            best_score = s;
+        }
+    }
+    return best;
+}
+
+/**
+ * Walks from the extremum towards one end of the sweep until the score
+ * falls to level, and interpolates the frequency it does so at
+ *
+ * @param direction -1 to walk down in frequency, 1 to walk up
+ * @return the frequency, or NaN if the sweep ends first
+ */
+static double crossing(struct peak_tracker *tracker, const struct complex *values, int k, double top,
+                       double level, int direction) {
+    const uint64_t *freqs = tracker->plan->freqs;
+    double last = top;
+    for (int j = k + direction; j >= 0 && j < tracker->plan->nbr_points; j += direction) {
+        double s = score(tracker, values, j);
+        if (s <= level) {
+            double f_last = freqs[j - direction];
+            return f_last + (last - level) / (last - s) * ((double)freqs[j] - f_last);
+        }
+        last = s;
+    }
+    return NAN;
+}
+
+void find_peak(struct peak_tracker *tracker, int vna_id, const struct complex *values, struct peak_record *record) {
+    const uint64_t *freqs = tracker->plan->freqs;
+    int n = tracker->plan->nbr_points;
+    struct peak_track *track = &tracker->tracks[vna_id];
+
+    bool full = !track->found || track->since_full >= PEAK_FULL_SEARCH_SWEEPS;
+    int lo = 0, hi = n - 1;
+    if (!full) {
+        lo = track->bin - tracker->window > 0 ? track->bin - tracker->window : 0;
+        hi = track->bin + tracker->window < n - 1 ? track->bin + tracker->window : n - 1;
+    }
+    int k = highest_score(tracker, values, lo, hi);
+    if (!full && ((k == lo && lo > 0) || (k == hi && hi < n - 1))) {
+        // still climbing at the edge of the window, so the resonance has moved out of it
+        full = true;
+        lo = 0;
+        hi = n - 1;
+        k = highest_score(tracker, values, lo, hi);
+    }
+
+    // vertex of the parabola through the extremum and its neighbours, which needn't be evenly spaced
+    double f0 = freqs[k];
+    double top = score(tracker, values, k);
+    double peak_score = top;
+    if (k > 0 && k < n - 1) {
+        double a = (double)freqs[k - 1] - f0;
+        double b = (double)freqs[k + 1] - f0;
+        double d0 = score(tracker, values, k - 1) - top;
+        double d2 = score(tracker, values, k + 1) - top;
+        double c2 = (d2 / b - d0 / a) / (b - a);
+        double c1 = d0 / a - c2 * a;
+        if (c2 < 0) {
+            double t = -c1 / (2 * c2);
+            t = t < a ? a : (t > b ? b : t);
+            f0 += t;
+            peak_score = top + c1 * t + c2 * t * t;
+        }
+    }
+
+    double depth = peak_score - (score(tracker, values, lo) + score(tracker, values, hi)) / 2;
+    double q = NAN;
+    if (depth > 0) {
+        double level = peak_score - (tracker->mode == PEAK_S21_PEAK ? 3 : depth / 2);
+        double low = crossing(tracker, values, k, top, level, -1);
+        double high = crossing(tracker, values, k, top, level, 1);
+        if (!isnan(low) && !isnan(high) && high > low)
+            q = f0 / (high - low);
+    }
+
+    record->vna_id = vna_id;
+    record->mode = tracker->mode;
+    record->frequency = f0;
+    record->q = q;
+    record->depth = depth;
+    record->level = tracker->mode == PEAK_S21_PEAK ? peak_score : -peak_score;
+    record->full_search = full;
+
+    track->found = true;
+    track->bin = k;
+    track->since_full = full ? 0 : track->since_full + 1;
+    tracker->records++;
+    if (full)
+        tracker->full_searches++;
+}
+
+/**
+ * Finds the slot gathering a VNA's sweep, taking a free one (or the
+ * oldest) if it has none
+ *
+ * @return the slot, or NULL if memory for it couldn't be allocated
+ */
+static struct peak_sweep *find_sweep(struct peak_tracker *tracker, int vna_id, int sweep) {
+    struct peak_sweep *slots = tracker->sweeps[vna_id];
+    struct peak_sweep *slot = NULL;
+    for (int s = 0; s < SWEEP_TRACKER_SLOTS; s++) {
+        if (slots[s].used && slots[s].sweep == sweep)
+            return &slots[s];
+        if (!slot || (slot->used && (!slots[s].used || slots[s].sweep < slot->sweep)))
+            slot = &slots[s];
+    }
+    if (slot->used)
+        tracker->abandoned++;
+    if (!slot->values) {
+        slot->values = malloc(tracker->plan->nbr_points * sizeof(struct complex));
+        if (!slot->values) {
+            fprintf(stderr, "Failed to allocate memory for peak tracking of VNA %d\n", vna_id);
+            slot->used = false;
+            return NULL;
+        }
+    }
+    slot->used = true;
+    slot->sweep = sweep;
+    slot->arrived = 0;
+    slot->send_ns = UINT64_MAX;
+    return slot;
+}
+
+bool peak_add_scan(struct peak_tracker *tracker, const struct datapoint_nanoVNA_H *data, struct peak_record *record) {
+    if (data->vna_id < 0 || data->vna_id >= MAXIMUM_VNA_PORTS)
+        return false;
+    const struct scan_range *range = sweep_plan_scan(tracker->plan, data->scan_index);
+    if (!range || range->pps != data->pps)
+        return false;
+    struct peak_sweep *slot = find_sweep(tracker, data->vna_id, data->sweep);
+    if (!slot)
+        return false;
+    bool s11 = tracker->mode == PEAK_S11_DIP;
+    for (int i = 0; i < data->pps; i++)
+        slot->values[range->first_bin + i] = s11 ? data->point[i].s11 : data->point[i].s21;
+    if (data->send_ns < slot->send_ns)
+        slot->send_ns = data->send_ns;
+    if (++slot->arrived < tracker->plan->nbr_scans)
+        return false;
+
+    slot->used = false;
+    find_peak(tracker, data->vna_id, slot->values, record);
+    record->scan_id = data->scan_id;
+    record->sweep = data->sweep;
+    record->send_ns = slot->send_ns;
+    return true;
+}
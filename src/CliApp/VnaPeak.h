@@ -0,0 +1,150 @@
+#ifndef VNAPEAK_H_
+#define VNAPEAK_H_
+
+#include "VnaScanMultithreaded.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+/**
+ * Tracks the resonance of each VNA's device, sweep by sweep
+ *
+ * As each sweep of a VNA completes, its extremum (the top of an S21 peak,
+ * or the bottom of an S21 or S11 dip) is found in dB and refined between
+ * points by fitting a parabola through it and its neighbours, giving the
+ * resonant frequency f0 and its level. Q is f0 over the bandwidth, the
+ * width of the resonance where it crosses:
+ *     a peak - 3 dB below the top (the loaded Q of a transmission resonator)
+ *     a dip  - half its depth, in dB
+ * found by walking out from the extremum and interpolating between points.
+ * Depth is how far the extremum stands out, in dB, from the average of the
+ * two ends of the span searched.
+ *
+ * Resonances move slowly compared to the sweep rate, so once a VNA's has
+ * been found only PEAK_WINDOW points either side of where it last was are
+ * searched. The whole sweep is searched again if the extremum lands on the
+ * edge of that window (it has moved out of it), and every
+ * PEAK_FULL_SEARCH_SWEEPS sweeps in case a deeper resonance has appeared
+ * elsewhere.
+ */
+#define PEAK_FULL_SEARCH_SWEEPS 64
+
+/**
+ * Points either side of the last resonance searched when the window isn't
+ * set, as a fraction of the sweep's points (but at least PEAK_MIN_WINDOW)
+ */
+#define PEAK_WINDOW_FRACTION 0.05
+#define PEAK_MIN_WINDOW 8
+
+/**
+ * One sweep's resonance
+ */
+struct peak_record {
+    int vna_id;
+    int scan_id;
+    int sweep;
+    PeakMode mode;
+    uint64_t send_ns;   // monotonic_ns() when the sweep's first scan command was written
+    double frequency;   // f0 in Hz
+    double q;           // NaN if the resonance runs off the sweep before its bandwidth is found
+    double depth;       // dB
+    double level;       // dB at f0
+    bool full_search;   // if the whole sweep was searched, rather than the window
+};
+
+/**
+ * One sweep of a VNA, gathered as its scans arrive
+ */
+struct peak_sweep {
+    bool used;
+    int sweep;
+    int arrived;            // scans of the sweep so far
+    uint64_t send_ns;       // earliest send time of those scans
+    struct complex *values; // the plan's nbr_points values of the tracked parameter
+};
+
+/**
+ * Where a VNA's resonance was last seen
+ */
+struct peak_track {
+    bool found;
+    int bin;                // point of the plan nearest the last resonance
+    int since_full;         // sweeps since the whole sweep was last searched
+};
+
+/**
+ * Gathers each VNA's sweeps and finds their resonances as they complete
+ *
+ * Like the time domain stage, each VNA has SWEEP_TRACKER_SLOTS sweeps in
+ * progress at most, and the oldest is given up on when another starts.
+ */
+struct peak_tracker {
+    PeakMode mode;
+    const struct sweep_plan *plan;
+    int window;                     // points either side of the last resonance searched
+    struct peak_sweep sweeps[MAXIMUM_VNA_PORTS][SWEEP_TRACKER_SLOTS];
+    struct peak_track tracks[MAXIMUM_VNA_PORTS];
+    long records;                   // resonances found
+    long full_searches;             // of those, how many searched the whole sweep
+    long abandoned;                 // sweeps given up on before they completed
+    long points_examined;           // points whose magnitude was worked out
+};
+
+/**
+ * Sets up a tracker for sweeps of one plan
+ *
+ * @param tracker pointer to the space reserved for this struct (uninitialised)
+ * @param plan the plan of the sweeps, which must outlive the tracker
+ * @param mode the resonance to track, not PEAK_OFF
+ * @param window points either side of the last resonance to search, 0 to
+ *        work it out from the plan
+ * @return EXIT_SUCCESS, or EXIT_FAILURE (with a message) if the plan has
+ *         fewer than 3 points
+ */
+int init_peak_tracker(struct peak_tracker *tracker, const struct sweep_plan *plan, PeakMode mode, int window);
+
+/**
+ * Frees everything a tracker allocated (but not the struct itself)
+ *
+ * @param tracker pointer to the tracker to clean up
+ */
+void destroy_peak_tracker(struct peak_tracker *tracker);
+
+/**
+ * Adds a scan to its VNA's sweep, and finds the sweep's resonance if this
+ * scan completes it
+ *
+ * @param tracker the tracker
+ * @param data the scan
+ * @param record filled in if the sweep completed
+ * @return true if record was filled in
+ */
+bool peak_add_scan(struct peak_tracker *tracker, const struct datapoint_nanoVNA_H *data, struct peak_record *record);
+
+/**
+ * Finds the resonance in a whole sweep of a VNA (without gathering it scan
+ * by scan), searching around the VNA's last one if it has been found before
+ *
+ * @param tracker the tracker
+ * @param vna_id the VNA the sweep is from, whose track is updated
+ * @param values the plan's nbr_points values of the tracked parameter
+ * @param record filled in, apart from its scan_id, sweep and send_ns
+ */
+void find_peak(struct peak_tracker *tracker, int vna_id, const struct complex *values, struct peak_record *record);
+
+/**
+ * Parses the name of a mode ("off", "s21peak", "s21dip" or "s11dip")
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if it isn't one
+ */
+int parse_peak_mode(const char *name, PeakMode *mode);
+
+/**
+ * @return the name of a mode, as parse_peak_mode takes it
+ */
+const char *peak_mode_name(PeakMode mode);
+
+#endif /* VNAPEAK_H_ */
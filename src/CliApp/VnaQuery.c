@@ -0,0 +1,503 @@
+#include "VnaQuery.h"
+
+#include <math.h>
+
+//----------------------------------------
+// Statistics
+//----------------------------------------
+
+void init_query(struct query *query) {
+    memset(query, 0, sizeof(*query));
+    for (int v = 0; v < MAXIMUM_VNA_PORTS; v++)
+        query->vnas[v] = true;
+    query->to_ns = UINT64_MAX;
+    query->max_hz = UINT32_MAX;
+    query->format = QUERY_CSV;
+    query->nbr_threads = 1;
+}
+
+void init_query_result(struct query_result *result) {
+    memset(result, 0, sizeof(*result));
+}
+
+void destroy_query_result(struct query_result *result) {
+    for (int v = 0; v < MAXIMUM_VNA_PORTS; v++)
+        free(result->bins[v]);
+    init_query_result(result);
+}
+
+/**
+ * Adds a value to a series, which then has count values
+ */
+static void stat_add(struct query_stat *stat, long count, double value) {
+    if (count == 1) {
+        stat->mean = stat->min = stat->max = value;
+        stat->m2 = 0;
+        return;
+    }
+    double delta = value - stat->mean;
+    stat->mean += delta / count;
+    stat->m2 += delta * (value - stat->mean);
+    if (value < stat->min)
+        stat->min = value;
+    if (value > stat->max)
+        stat->max = value;
+}
+
+/**
+ * Combines two series of n and m values (Chan et al.'s parallel form of
+ * Welford's method)
+ */
+static void stat_merge(struct query_stat *dst, long n, const struct query_stat *src, long m) {
+    if (m == 0)
+        return;
+    if (n == 0) {
+        *dst = *src;
+        return;
+    }
+    double total = n + m;
+    double delta = src->mean - dst->mean;
+    dst->mean += delta * m / total;
+    dst->m2 += src->m2 + delta * delta * n * m / total;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+double query_stat_std(const struct query_stat *stat, long count) {
+    return count < 2 ? 0 : sqrt(stat->m2 / count);
+}
+
+static double magnitude_db(struct complex s) {
+    return 20 * log10(fmax(hypot(s.re, s.im), QUERY_MIN_MAGNITUDE));
+}
+
+/**
+ * Finds a VNA's bin for a key, adding an empty one if there's none
+ *
+ * @return the bin, or NULL if memory for it couldn't be allocated
+ */
+static struct query_bin *find_bin(struct query_result *result, int vna_id, uint32_t key) {
+    struct query_bin *bins = result->bins[vna_id];
+    int n = result->nbr_bins[vna_id];
+    int i = result->hint[vna_id];
+    // points of a scan come in order of frequency, so mostly it's the next bin
+    if (i >= n || bins[i].key != key) {
+        int lo = 0, hi = n;
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            if (bins[mid].key < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        i = lo;
+        if (i == n || bins[i].key != key) {
+            if (n == result->size[vna_id]) {
+                int size = n ? 2 * n : 128;
+                struct query_bin *grown = realloc(bins, size * sizeof(struct query_bin));
+                if (!grown) {
+                    fprintf(stderr, "Failed to allocate memory for %d frequency bins\n", size);
+                    return NULL;
+                }
+                result->bins[vna_id] = bins = grown;
+                result->size[vna_id] = size;
+            }
+            memmove(&bins[i + 1], &bins[i], (n - i) * sizeof(struct query_bin));
+            memset(&bins[i], 0, sizeof(struct query_bin));
+            bins[i].key = key;
+            result->nbr_bins[vna_id]++;
+        }
+    }
+    result->hint[vna_id] = i + 1;
+    return &bins[i];
+}
+
+int add_query_scan(struct query_result *result, const struct query *query, const struct datapoint_nanoVNA_H *data) {
+    long added = 0;
+    for (int i = 0; i < data->pps; i++) {
+        const struct nanovna_raw_datapoint *p = &data->point[i];
+        if (p->frequency < query->min_hz || p->frequency > query->max_hz)
+            continue;
+        // a NaN would spoil every statistic of its bin
+        if (!isfinite(p->s11.re) || !isfinite(p->s11.im) || !isfinite(p->s21.re) || !isfinite(p->s21.im))
+            continue;
+        struct query_bin *bin = find_bin(result, data->vna_id,
+                                         query->bin_hz ? p->frequency / query->bin_hz : p->frequency);
+        if (!bin)
+            return EXIT_FAILURE;
+        bin->count++;
+        bin->s11_sum[0] += p->s11.re;
+        bin->s11_sum[1] += p->s11.im;
+        bin->s21_sum[0] += p->s21.re;
+        bin->s21_sum[1] += p->s21.im;
+        stat_add(&bin->s11_db, bin->count, magnitude_db(p->s11));
+        stat_add(&bin->s21_db, bin->count, magnitude_db(p->s21));
+        added++;
+    }
+    if (added) {
+        result->scans++;
+        result->points += added;
+    }
+    return EXIT_SUCCESS;
+}
+
+int merge_query_results(struct query_result *dst, const struct query_result *src) {
+    for (int v = 0; v < MAXIMUM_VNA_PORTS; v++) {
+        dst->hint[v] = 0;
+        for (int i = 0; i < src->nbr_bins[v]; i++) {
+            const struct query_bin *from = &src->bins[v][i];
+            struct query_bin *to = find_bin(dst, v, from->key);
+            if (!to)
+                return EXIT_FAILURE;
+            stat_merge(&to->s11_db, to->count, &from->s11_db, from->count);
+            stat_merge(&to->s21_db, to->count, &from->s21_db, from->count);
+            for (int k = 0; k < 2; k++) {
+                to->s11_sum[k] += from->s11_sum[k];
+                to->s21_sum[k] += from->s21_sum[k];
+            }
+            to->count += from->count;
+        }
+    }
+    dst->scans += src->scans;
+    dst->points += src->points;
+    return EXIT_SUCCESS;
+}
+
+//----------------------------------------
+// Printing
+//----------------------------------------
+
+/**
+ * Frequency printed for a bin: its centre, or the frequency itself
+ */
+static uint64_t bin_frequency(const struct query *query, uint32_t key) {
+    if (!query->bin_hz)
+        return key;
+    return (uint64_t)key * query->bin_hz + query->bin_hz / 2;
+}
+
+static void print_header(const char *path, const struct query *query, FILE *out) {
+    if (query->format == QUERY_TOUCHSTONE) {
+        fprintf(out, "! Touchstone file generated from scan archive %s\n", path);
+        if (!query->raw)
+            fprintf(out, "! Mean S parameters of each %s\n", query->bin_hz ? "frequency bin" : "frequency");
+        fprintf(out, "# Hz S RI R 50\n");
+    } else if (query->raw) {
+        fprintf(out, "vna,sweep,scan,time_s,frequency_hz,s11_re,s11_im,s21_re,s21_im,s11_db,s21_db\n");
+    } else {
+        fprintf(out, "vna,frequency_hz,points,s11_db_mean,s11_db_min,s11_db_max,s11_db_std,"
+                     "s21_db_mean,s21_db_min,s21_db_max,s21_db_std,s11_re,s11_im,s21_re,s21_im\n");
+    }
+}
+
+/**
+ * Prints the points of a scan inside the query's band
+ */
+static void print_raw_scan(const struct query *query, const struct datapoint_nanoVNA_H *data, FILE *out) {
+    if (query->format == QUERY_TOUCHSTONE)
+        fprintf(out, "! vna %d sweep %d scan %d sent %.9f s received %.9f s\n", data->vna_id, data->sweep,
+            data->scan_index, data->send_ns / 1e9, data->receive_ns / 1e9);
+    for (int i = 0; i < data->pps; i++) {
+        const struct nanovna_raw_datapoint *p = &data->point[i];
+        if (p->frequency < query->min_hz || p->frequency > query->max_hz)
+            continue;
+        if (query->format == QUERY_TOUCHSTONE)
+            fprintf(out, "%u %.10e %.10e %.10e %.10e 0 0 0 0\n",
+                p->frequency, p->s11.re, p->s11.im, p->s21.re, p->s21.im);
+        else
+            fprintf(out, "%d,%d,%d,%.9f,%u,%.9e,%.9e,%.9e,%.9e,%.4f,%.4f\n", data->vna_id, data->sweep,
+                data->scan_index, data->send_ns / 1e9, p->frequency, p->s11.re, p->s11.im,
+                p->s21.re, p->s21.im, magnitude_db(p->s11), magnitude_db(p->s21));
+    }
+}
+
+static void print_bins(const struct query *query, const struct query_result *result, FILE *out) {
+    for (int v = 0; v < MAXIMUM_VNA_PORTS; v++) {
+        if (result->nbr_bins[v] && query->format == QUERY_TOUCHSTONE)
+            fprintf(out, "! vna %d\n", v);
+        for (int i = 0; i < result->nbr_bins[v]; i++) {
+            const struct query_bin *b = &result->bins[v][i];
+            double n = b->count;
+            if (query->format == QUERY_TOUCHSTONE) {
+                fprintf(out, "%" PRIu64 " %.10e %.10e %.10e %.10e 0 0 0 0\n", bin_frequency(query, b->key),
+                    b->s11_sum[0] / n, b->s11_sum[1] / n, b->s21_sum[0] / n, b->s21_sum[1] / n);
+                continue;
+            }
+            fprintf(out, "%d,%" PRIu64 ",%ld,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f,%.9e,%.9e,%.9e,%.9e\n",
+                v, bin_frequency(query, b->key), b->count,
+                b->s11_db.mean, b->s11_db.min, b->s11_db.max, query_stat_std(&b->s11_db, b->count),
+                b->s21_db.mean, b->s21_db.min, b->s21_db.max, query_stat_std(&b->s21_db, b->count),
+                b->s11_sum[0] / n, b->s11_sum[1] / n, b->s21_sum[0] / n, b->s21_sum[1] / n);
+        }
+    }
+}
+
+//----------------------------------------
+// Planning
+//----------------------------------------
+
+static int add_chunk(struct query_chunk **chunks, long *nbr_chunks, long *size, struct query_chunk chunk) {
+    if (*nbr_chunks == *size) {
+        long grown_size = *size ? 2 * *size : 64;
+        struct query_chunk *grown = realloc(*chunks, grown_size * sizeof(struct query_chunk));
+        if (!grown) {
+            fprintf(stderr, "Failed to allocate memory for %ld chunks\n", grown_size);
+            return EXIT_FAILURE;
+        }
+        *chunks = grown;
+        *size = grown_size;
+    }
+    (*chunks)[(*nbr_chunks)++] = chunk;
+    return EXIT_SUCCESS;
+}
+
+int plan_query_chunks(struct archive_reader *reader, const struct query *query,
+                      struct query_chunk **chunks, long *nbr_chunks) {
+    *chunks = NULL;
+    *nbr_chunks = 0;
+    long size = 0;
+    if (!reader->index_offset)
+        return add_chunk(chunks, nbr_chunks, &size, (struct query_chunk){-1, 0, INT32_MAX, 0});
+
+    for (int v = 0; v < MAXIMUM_VNA_PORTS; v++) {
+        if (!query->vnas[v])
+            continue;
+        struct archive_index_entry e, next;
+        long i = find_archive_sweep(reader, v, 0);
+        if (i < 0 || read_archive_index(reader, i, &e) != EXIT_SUCCESS)
+            continue;
+        // a chunk's scans were sent from its first sweep's start until the next chunk's
+        while (e.time_ns < query->to_ns) {
+            int end_sweep = e.sweep / ARCHIVE_KEY_SWEEPS * ARCHIVE_KEY_SWEEPS + ARCHIVE_KEY_SWEEPS;
+            long j = end_sweep < 0 ? -1 : find_archive_sweep(reader, v, end_sweep);
+            if (j >= 0 && read_archive_index(reader, j, &next) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            if ((j < 0 || next.time_ns > query->from_ns)
+                    && add_chunk(chunks, nbr_chunks, &size,
+                                 (struct query_chunk){v, e.sweep, j < 0 ? INT32_MAX : end_sweep, e.time_ns}) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            if (j < 0)
+                break;
+            e = next;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+//----------------------------------------
+// Running
+//----------------------------------------
+
+/**
+ * Printed points of a chunk, for raw queries, held until the chunks before
+ * it have been printed
+ */
+struct chunk_output {
+    char *text;
+    size_t length;
+    bool done;
+    bool failed;
+};
+
+/**
+ * State shared by the threads of a query
+ */
+struct query_job {
+    const char *path;
+    const struct query *query;
+    struct query_chunk *chunks;
+    long nbr_chunks;
+    struct chunk_output *outputs;       // raw queries only
+    struct query_result *results;       // one per thread, for the bins
+    pthread_mutex_t lock;
+    pthread_cond_t changed;             // a chunk was finished or printed
+    long next;                          // next chunk to be claimed
+    long printed;                       // chunks printed so far (raw queries)
+    bool failed;
+};
+
+struct query_thread_args {
+    struct query_job *job;
+    int thread;
+};
+
+/**
+ * Decodes one chunk, adding its scans inside the query to result or
+ * printing them to out
+ */
+static int run_chunk(struct archive_reader *reader, const struct query *query, const struct query_chunk *chunk,
+                     struct query_result *result, FILE *out) {
+    if (chunk->vna_id >= 0 && seek_archive_sweep(reader, chunk->vna_id, chunk->first_sweep) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    int got;
+    struct datapoint_nanoVNA_H data;
+    while ((got = read_archive_scan(reader, &data)) == 1) {
+        // a VNA's sweeps are one after another, so nothing later is wanted
+        if (chunk->vna_id >= 0 && (data.sweep >= chunk->end_sweep || data.send_ns >= query->to_ns)) {
+            free(data.point);
+            break;
+        }
+        int added = EXIT_SUCCESS;
+        if (query->vnas[data.vna_id] && data.send_ns >= query->from_ns && data.send_ns < query->to_ns) {
+            if (out)
+                print_raw_scan(query, &data, out);
+            else
+                added = add_query_scan(result, query, &data);
+        }
+        free(data.point);
+        if (added != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+    return got < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Claims chunks and decodes them until there are none left
+ *
+ * For raw queries, threads stay at most two chunks each ahead of the
+ * printing, so a slow reader of the output doesn't fill memory.
+ */
+static void *query_thread(void *arguments) {
+    struct query_thread_args *args = arguments;
+    struct query_job *job = args->job;
+    struct archive_reader reader;
+    bool opened = open_archive_reader(&reader, job->path) == EXIT_SUCCESS;
+    int nbr_threads = job->query->nbr_threads;
+
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        while (job->outputs && job->next < job->nbr_chunks && job->next >= job->printed + 2 * nbr_threads)
+            pthread_cond_wait(&job->changed, &job->lock);
+        long c = job->next++;
+        pthread_mutex_unlock(&job->lock);
+        if (c >= job->nbr_chunks)
+            break;
+
+        struct chunk_output *output = job->outputs ? &job->outputs[c] : NULL;
+        FILE *out = output ? open_memstream(&output->text, &output->length) : NULL;
+        int result = EXIT_FAILURE;
+        if (opened && (!output || out))
+            result = run_chunk(&reader, job->query, &job->chunks[c], &job->results[args->thread], out);
+        if (out)
+            fclose(out);
+
+        pthread_mutex_lock(&job->lock);
+        if (result != EXIT_SUCCESS)
+            job->failed = true;
+        if (output) {
+            output->failed = result != EXIT_SUCCESS;
+            output->done = true;
+            pthread_cond_broadcast(&job->changed);
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+    if (opened)
+        close_archive_reader(&reader);
+    return NULL;
+}
+
+/**
+ * Prints each chunk's points once the thread decoding it is done, in order
+ */
+static void print_outputs(struct query_job *job, FILE *out) {
+    for (long c = 0; c < job->nbr_chunks; c++) {
+        struct chunk_output *output = &job->outputs[c];
+        pthread_mutex_lock(&job->lock);
+        while (!output->done)
+            pthread_cond_wait(&job->changed, &job->lock);
+        pthread_mutex_unlock(&job->lock);
+        if (!output->failed)
+            fwrite(output->text, 1, output->length, out);
+        free(output->text);
+        output->text = NULL;
+        pthread_mutex_lock(&job->lock);
+        job->printed = c + 1;
+        pthread_cond_broadcast(&job->changed);
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+int run_query(const char *path, const struct query *query, FILE *out) {
+    struct archive_reader reader;
+    if (open_archive_reader(&reader, path) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    struct query_job job = {.path = path, .query = query};
+    int planned = plan_query_chunks(&reader, query, &job.chunks, &job.nbr_chunks);
+    close_archive_reader(&reader);
+    if (planned != EXIT_SUCCESS) {
+        free(job.chunks);
+        return EXIT_FAILURE;
+    }
+
+    int nbr_threads = query->nbr_threads;
+    if (nbr_threads > job.nbr_chunks)
+        nbr_threads = job.nbr_chunks;
+    if (nbr_threads < 1)
+        nbr_threads = 1;
+    struct query thread_query = *query;
+    thread_query.nbr_threads = nbr_threads;
+    job.query = &thread_query;
+    pthread_t *threads = malloc(nbr_threads * sizeof(pthread_t));
+    struct query_thread_args *args = malloc(nbr_threads * sizeof(struct query_thread_args));
+    job.results = malloc(nbr_threads * sizeof(struct query_result));
+    if (query->raw)
+        job.outputs = calloc(job.nbr_chunks ? job.nbr_chunks : 1, sizeof(struct chunk_output));
+    if (!threads || !args || !job.results || (query->raw && !job.outputs)) {
+        fprintf(stderr, "Failed to allocate memory for %d query threads\n", nbr_threads);
+        free(threads);
+        free(args);
+        free(job.results);
+        free(job.outputs);
+        free(job.chunks);
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
+
+    for (int t = 0; t < nbr_threads; t++)
+        init_query_result(&job.results[t]);
+    // threads that did start take every chunk between them
+    int started = 0;
+    for (int t = 0; t < nbr_threads; t++) {
+        args[t] = (struct query_thread_args){&job, t};
+        int err = pthread_create(&threads[t], NULL, &query_thread, &args[t]);
+        if (err != 0) {
+            fprintf(stderr, "Failed to start query thread: %s\n", strerror(err));
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        job.failed = true;
+    } else if (query->raw) {
+        print_header(path, query, out);
+        print_outputs(&job, out);
+    }
+    for (int t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+
+    int result = job.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    if (!query->raw) {
+        for (int t = 1; t < nbr_threads; t++)
+            if (merge_query_results(&job.results[0], &job.results[t]) != EXIT_SUCCESS)
+                result = EXIT_FAILURE;
+        if (result == EXIT_SUCCESS) {
+            print_header(path, query, out);
+            print_bins(query, &job.results[0], out);
+        }
+    }
+    for (int t = 0; t < nbr_threads; t++)
+        destroy_query_result(&job.results[t]);
+    pthread_cond_destroy(&job.changed);
+    pthread_mutex_destroy(&job.lock);
+    free(threads);
+    free(args);
+    free(job.results);
+    free(job.outputs);
+    free(job.chunks);
+    if (result != EXIT_SUCCESS)
+        fprintf(stderr, "Failed to read all of %s, it may be damaged or cut short\n", path);
+    return result;
+}
@@ -0,0 +1,174 @@
+#ifndef VNAQUERY_H_
+#define VNAQUERY_H_
+
+#include "VnaArchive.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * Magnitudes below this (-200 dB) are taken as this when converted to dB,
+ * so an exact zero reading doesn't make a bin's mean -inf
+ */
+#define QUERY_MIN_MAGNITUDE 1e-10
+
+/**
+ * Output formats of a query
+ *
+ * QUERY_CSV        - comma separated, with a header line
+ * QUERY_TOUCHSTONE - touchstone lines, each VNA's after a comment naming it
+ */
+typedef enum {
+    QUERY_CSV,
+    QUERY_TOUCHSTONE
+} QueryFormat;
+
+/**
+ * What a query reads from an archive and how it prints it
+ */
+struct query {
+    bool vnas[MAXIMUM_VNA_PORTS];   // VNAs whose scans are read
+    uint64_t from_ns;               // scans sent before this (since the archive's start) are left out
+    uint64_t to_ns;                 // as are scans sent at or after this
+    uint32_t min_hz;                // points below this frequency are left out
+    uint32_t max_hz;                // as are points above this one
+    uint32_t bin_hz;                // width of the frequency bins, 0 for a bin per frequency
+    bool raw;                       // print every point instead of the bins' statistics
+    QueryFormat format;
+    int nbr_threads;                // threads decoding the archive
+};
+
+/**
+ * Running mean, variance, min and max of a series (Welford's method, so
+ * it stays accurate over billions of values)
+ */
+struct query_stat {
+    double mean;
+    double m2;      // sum of squared differences from the mean
+    double min;
+    double max;
+};
+
+/**
+ * Statistics of every point of a VNA falling in one frequency bin
+ */
+struct query_bin {
+    uint32_t key;               // frequency / bin_hz, or the frequency for a bin per frequency
+    long count;
+    double s11_sum[2];          // sums of the real and imaginary parts, for the mean S parameters
+    double s21_sum[2];
+    struct query_stat s11_db;   // of the magnitude in dB
+    struct query_stat s21_db;
+};
+
+/**
+ * Bins of each VNA, kept sorted by key
+ */
+struct query_result {
+    struct query_bin *bins[MAXIMUM_VNA_PORTS];
+    int nbr_bins[MAXIMUM_VNA_PORTS];
+    int size[MAXIMUM_VNA_PORTS];    // bins allocated
+    int hint[MAXIMUM_VNA_PORTS];    // bin after the last one used, where the next point most likely goes
+    long scans;                     // scans that had points inside the query
+    long points;
+};
+
+/**
+ * A run of a VNA's sweeps that can be decoded on its own: from the start of
+ * an ARCHIVE_KEY_SWEEPS epoch (whose blocks reference nothing earlier) up
+ * to the next
+ */
+struct query_chunk {
+    int vna_id;
+    int first_sweep;
+    int end_sweep;          // first sweep after the chunk
+    uint64_t time_ns;       // when its first sweep started
+};
+
+/**
+ * Sets a query to read everything in an archive: every VNA, all the time
+ * and the whole band, one bin per frequency, as CSV on one thread
+ *
+ * @param query pointer to the space reserved for this struct (uninitialised)
+ */
+void init_query(struct query *query);
+
+/**
+ * Sets up a result with no bins
+ *
+ * @param result pointer to the space reserved for this struct (uninitialised)
+ */
+void init_query_result(struct query_result *result);
+
+/**
+ * Frees the bins of a result (but not the struct itself)
+ *
+ * @param result pointer to the result to clean up
+ */
+void destroy_query_result(struct query_result *result);
+
+/**
+ * Adds the points of a scan inside the query's band to their bins (the
+ * scan's VNA and time aren't checked)
+ *
+ * @param result the result to add to
+ * @param query the query, for its band and bin width
+ * @param data the scan
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if memory for a bin couldn't be allocated
+ */
+int add_query_scan(struct query_result *result, const struct query *query, const struct datapoint_nanoVNA_H *data);
+
+/**
+ * Adds the bins of one result to another, as though every point of src
+ * had been added to dst
+ *
+ * @param dst the result added to
+ * @param src the result added, left unchanged
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if memory for a bin couldn't be allocated
+ */
+int merge_query_results(struct query_result *dst, const struct query_result *src);
+
+/**
+ * Standard deviation of a series
+ *
+ * @param stat the series' statistics
+ * @param count the number of values in it
+ * @return the (population) standard deviation, 0 for fewer than two values
+ */
+double query_stat_std(const struct query_stat *stat, long count);
+
+/**
+ * Splits the part of an archive a query covers into chunks that can be
+ * decoded in parallel, using the archive's index
+ *
+ * An archive without an index is one chunk, of every VNA (vna_id -1)
+ * from its first block to its last.
+ *
+ * @param reader the archive
+ * @param query the query, for its VNAs and times
+ * @param chunks set to a malloced array of the chunks, in order of VNA then sweep
+ * @param nbr_chunks set to the number of chunks
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the index can't be read or memory allocated
+ */
+int plan_query_chunks(struct archive_reader *reader, const struct query *query,
+                      struct query_chunk **chunks, long *nbr_chunks);
+
+/**
+ * Runs a query on an archive, decoding its chunks on query->nbr_threads
+ * threads, and prints the points (raw) or the bins' statistics
+ *
+ * Raw points come out in order of VNA, then sweep. Bins come out in order
+ * of VNA, then frequency.
+ *
+ * @param path the archive
+ * @param query the query
+ * @param out where to print
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the archive can't be read
+ */
+int run_query(const char *path, const struct query *query, FILE *out);
+
+#endif /* VNAQUERY_H_ */
@@ -0,0 +1,138 @@
+#include "VnaQuery.h"
+
+#include <math.h>
+#include <getopt.h>
+#include <unistd.h>
+
+/*
+ * Queries scan archives written by the scanner (see VnaQuery.h)
+ *
+ * Picks out some VNAs, a stretch of time and a band from an archive, and
+ * prints either the points themselves or statistics of each frequency
+ * (or bin of frequencies) over all the sweeps picked, as CSV or touchstone.
+ * The archive is decoded on every core, a run of sweeps at a time.
+ */
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-v vnas] [-t from[:to]] [-f min[:max]] [-b width] [-r] [-o csv|touchstone] [-j threads] [-w file] <archive>\n"
+        "    -v VNAs to read, comma separated ids (default all)\n"
+        "    -t seconds since the start of the archive to read scans from, and up to (default all)\n"
+        "    -f lowest and highest frequency in Hz to read (default all)\n"
+        "    -b width of frequency bins in Hz (default a bin per frequency)\n"
+        "    -r print every point instead of the statistics of each bin\n"
+        "    -o output format (default csv)\n"
+        "    -j threads decoding the archive (default one per core)\n"
+        "    -w file to write to (default standard output)\n", name);
+}
+
+static bool parse_vnas(char *text, struct query *query) {
+    memset(query->vnas, 0, sizeof(query->vnas));
+    for (char *item = strtok(text, ","); item; item = strtok(NULL, ",")) {
+        char *end;
+        long v = strtol(item, &end, 10);
+        if (*item == '\0' || *end != '\0' || v < 0 || v >= MAXIMUM_VNA_PORTS)
+            return false;
+        query->vnas[v] = true;
+    }
+    return true;
+}
+
+/**
+ * Parses "a" or "a:b" (either may be left empty) into two numbers
+ */
+static bool parse_range(const char *text, double *from, double *to) {
+    char *end;
+    if (*text != ':') {
+        *from = strtod(text, &end);
+        if (end == text || !(*from >= 0))
+            return false;
+        text = end;
+    }
+    if (*text == '\0')
+        return true;
+    if (*text != ':')
+        return false;
+    text++;
+    if (*text == '\0')
+        return true;
+    *to = strtod(text, &end);
+    return end != text && *end == '\0' && *to >= *from;
+}
+
+int main(int argc, char *argv[]) {
+    struct query query;
+    init_query(&query);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    query.nbr_threads = cores > 0 ? cores : 1;
+    const char *output = NULL;
+    double from, to, bin;
+    int opt;
+    while ((opt = getopt(argc, argv, "v:t:f:b:ro:j:w:h")) != -1) {
+        bool ok = true;
+        switch (opt) {
+        case 'v':
+            ok = parse_vnas(optarg, &query);
+            break;
+        case 't':
+            from = 0;
+            to = 1e9;
+            ok = parse_range(optarg, &from, &to) && to <= 1e9;
+            query.from_ns = from * 1e9;
+            query.to_ns = to < 1e9 ? to * 1e9 : UINT64_MAX;
+            break;
+        case 'f':
+            from = 0;
+            to = UINT32_MAX;
+            ok = parse_range(optarg, &from, &to) && to <= UINT32_MAX;
+            query.min_hz = ceil(from);
+            query.max_hz = to;
+            break;
+        case 'b':
+            bin = atof(optarg);
+            ok = bin >= 1 && bin <= UINT32_MAX;
+            query.bin_hz = ok ? bin : 0;
+            break;
+        case 'r':
+            query.raw = true;
+            break;
+        case 'o':
+            if (strcmp(optarg, "csv") == 0)
+                query.format = QUERY_CSV;
+            else if (strcmp(optarg, "touchstone") == 0)
+                query.format = QUERY_TOUCHSTONE;
+            else
+                ok = false;
+            break;
+        case 'j':
+            query.nbr_threads = atoi(optarg);
+            ok = query.nbr_threads >= 1;
+            break;
+        case 'w':
+            output = optarg;
+            break;
+        default:
+            ok = false;
+        }
+        if (!ok) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = stdout;
+    if (output && !(out = fopen(output, "w"))) {
+        fprintf(stderr, "Failed to open %s for writing: %s\n", output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    int result = run_query(argv[optind], &query, out);
+    if (out != stdout && fclose(out) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", output, strerror(errno));
+        result = EXIT_FAILURE;
+    }
+    return result;
+}
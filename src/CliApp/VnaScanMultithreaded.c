@@ -1,5 +1,14 @@
+#define _GNU_SOURCE // pthread_setaffinity_np and RUSAGE_THREAD on Linux
 #include "VnaScanMultithreaded.h"
+#include "VnaStreamServer.h"
+#include "VnaCalibration.h"
+#include "VnaArchive.h"
+#include "VnaTdr.h"
+#include "VnaPeak.h"
 #include <glob.h>
+#include <ctype.h>
+#include <sched.h>
+#include <sys/resource.h>
 
 //---------------------------------------------------
 // Scan state global variables (access with mutex)
@@ -31,35 +40,220 @@ pthread_t* scan_threads = NULL;
  */
 pthread_mutex_t scan_state_lock = PTHREAD_MUTEX_INITIALIZER;
 
+//---------------------------------------------------
+// VNA stats global variables (access with mutex)
+//---------------------------------------------------
+
+/**
+ * Reliability counters for each VNA. Indexed by vna_id.
+ */
+struct vna_scan_stats scan_stats[MAXIMUM_VNA_PORTS];
+
+/**
+ * Mutex to make scan_stats thread safe.
+ */
+pthread_mutex_t scan_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Buffer of each running sweep, so its counters can be read.
+ * Indexed by scan_id, guarded by scan_state_lock.
+ */
+static struct bounded_buffer *scan_buffers[MAX_ONGOING_SCANS];
+/**
+ * Task scheduler of each running sweep, so stop_sweep can close it.
+ * Indexed by scan_id, guarded by scan_state_lock.
+ */
+static struct task_scheduler *scan_schedulers[MAX_ONGOING_SCANS];
+/**
+ * Progress of each running sweep, valid while its buffer is in scan_buffers
+ */
+static struct scan_progress scan_progresses[MAX_ONGOING_SCANS];
+/**
+ * Set once a sweep's thread has written out its last scan, and
+ * scan_finished_cond broadcast. Indexed by scan_id, guarded by scan_state_lock.
+ */
+static bool scan_finished[MAX_ONGOING_SCANS];
+/**
+ * Counts the sweeps started in each slot, so a waiter can tell its sweep
+ * from a later one given the same scan_id
+ */
+static unsigned scan_generation[MAX_ONGOING_SCANS];
+/**
+ * Set by whichever caller is to join a sweep's thread and free its id, so
+ * no other tries to. Indexed by scan_id, guarded by scan_state_lock.
+ */
+static bool scan_joining[MAX_ONGOING_SCANS];
+/**
+ * The VNAs each sweep uses. A VNA (and its interrupt pipe) belongs to one
+ * sweep at a time. Indexed by scan_id then vna_id, guarded by scan_state_lock.
+ */
+static bool scan_vnas[MAX_ONGOING_SCANS][MAXIMUM_VNA_PORTS];
+static pthread_cond_t scan_finished_cond;
+static pthread_once_t scan_finished_once = PTHREAD_ONCE_INIT;
+/**
+ * Set by stop_sweep, after which producers take no more sub-scans.
+ * Indexed by scan_id.
+ */
+static atomic_bool scan_cancelled[MAX_ONGOING_SCANS];
+
 //----------------------------------------
 // Bounded Buffer Logic
 //----------------------------------------
 
 int create_bounded_buffer(struct bounded_buffer *bb, int pps) {
-    struct datapoint_nanoVNA_H **buffer = malloc(sizeof(struct datapoint_nanoVNA_H *)*N);
+    return create_bounded_buffer_with_policy(bb, pps, N, BUFFER_BLOCK);
+}
+
+int create_bounded_buffer_with_policy(struct bounded_buffer *bb, int pps, int capacity, BufferPolicy policy) {
+    if (capacity < 1 || capacity > MAX_BUFFER_CAPACITY) {
+        fprintf(stderr, "Buffer capacity must be between 1 and %d\n", MAX_BUFFER_CAPACITY);
+        return EXIT_FAILURE;
+    }
+    struct datapoint_nanoVNA_H **buffer = calloc(capacity, sizeof(struct datapoint_nanoVNA_H *));
     if (!buffer) {
         fprintf(stderr, "Failed to allocate buffer memory\n");
         return EXIT_FAILURE;
     }
-    *bb = (struct bounded_buffer){buffer,0,0,0,pps,0,PTHREAD_MUTEX_INITIALIZER,PTHREAD_COND_INITIALIZER,PTHREAD_COND_INITIALIZER};
+    FILE *spill = NULL;
+    if (policy == BUFFER_SPILL) {
+        // removed automatically when closed, or if the program dies
+        spill = tmpfile();
+        if (!spill) {
+            fprintf(stderr, "Failed to create buffer spill file: %s\n", strerror(errno));
+            free(buffer);
+            return EXIT_FAILURE;
+        }
+    }
+    *bb = (struct bounded_buffer){buffer,0,0,0,pps,0,PTHREAD_MUTEX_INITIALIZER,PTHREAD_COND_INITIALIZER,PTHREAD_COND_INITIALIZER,
+                                  capacity,policy,spill,0,0,{0}};
+    bb->stats.capacity = capacity;
+    bb->stats.scan_bytes = buffer_scan_bytes(pps);
+    bb->stats.policy = policy;
     return EXIT_SUCCESS;
 }
 
 void destroy_bounded_buffer(struct bounded_buffer *buffer) {
+    if (buffer->spill)
+        fclose(buffer->spill);
     free(buffer->buffer);
     buffer->buffer = NULL;
     free(buffer);
     buffer = NULL;
 }
 
+/**
+ * Frees a scan and its points
+ */
+static void free_datapoint(struct datapoint_nanoVNA_H *data) {
+    free(data->point);
+    free(data);
+}
+
+/**
+ * Puts data at the back of the in memory buffer, which must have room.
+ * Call with the buffer's lock held.
+ */
+static void push_buff(struct bounded_buffer *buffer, struct datapoint_nanoVNA_H *data) {
+    buffer->buffer[buffer->in] = data;
+    buffer->in = (buffer->in+1) % buffer->capacity;
+    buffer->count++;
+    if (buffer->count > buffer->stats.peak)
+        buffer->stats.peak = buffer->count;
+}
+
+/**
+ * Appends a scan to the spill file and frees it. Call with the buffer's lock held.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if it couldn't be written (data not freed)
+ */
+static int spill_buff(struct bounded_buffer *buffer, struct datapoint_nanoVNA_H *data) {
+    if (fseeko(buffer->spill, buffer->spill_write, SEEK_SET) != 0
+        || fwrite(data, sizeof(struct datapoint_nanoVNA_H), 1, buffer->spill) != 1
+        || (data->pps > 0 && fwrite(data->point, sizeof(struct nanovna_raw_datapoint), data->pps, buffer->spill) != (size_t)data->pps)
+        || fflush(buffer->spill) != 0) {
+        return EXIT_FAILURE;
+    }
+    buffer->spill_write = ftello(buffer->spill);
+    buffer->stats.spilled++;
+    buffer->stats.spill_queued++;
+    free_datapoint(data);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Moves the oldest scan in the spill file to the back of the in memory
+ * buffer, which must have room. Call with the buffer's lock held.
+ * If the file can't be read, everything waiting in it is lost.
+ */
+static void unspill_buff(struct bounded_buffer *buffer) {
+    struct datapoint_nanoVNA_H *data = malloc(sizeof(struct datapoint_nanoVNA_H));
+    struct nanovna_raw_datapoint *point = NULL;
+    if (!data
+        || fseeko(buffer->spill, buffer->spill_read, SEEK_SET) != 0
+        || fread(data, sizeof(struct datapoint_nanoVNA_H), 1, buffer->spill) != 1
+        || data->pps < 0
+        || !(point = malloc(sizeof(struct nanovna_raw_datapoint)*(data->pps > 0 ? data->pps : 1)))
+        || (data->pps > 0 && fread(point, sizeof(struct nanovna_raw_datapoint), data->pps, buffer->spill) != (size_t)data->pps)) {
+        fprintf(stderr, "Failed to read buffer spill file, %d scans lost\n", buffer->stats.spill_queued);
+        free(data);
+        free(point);
+        buffer->stats.spill_lost += buffer->stats.spill_queued;
+        buffer->stats.spill_queued = 0;
+        buffer->spill_read = buffer->spill_write = 0;
+        return;
+    }
+    buffer->spill_read = ftello(buffer->spill);
+    data->point = point;
+    push_buff(buffer, data);
+    buffer->stats.unspilled++;
+    if (--buffer->stats.spill_queued == 0) {
+        // empty, so start again at the beginning rather than growing the file
+        buffer->spill_read = buffer->spill_write = 0;
+    }
+}
+
 void add_buff(struct bounded_buffer *buffer, struct datapoint_nanoVNA_H *data) {
     pthread_mutex_lock(&buffer->lock);
-    while (buffer->count == N) {
-        pthread_cond_wait(&buffer->take_cond, &buffer->lock);
+    buffer->stats.added++;
+    if (buffer->policy == BUFFER_SPILL && (buffer->count == buffer->capacity || buffer->stats.spill_queued > 0)) {
+        // anything already spilled is older, so it must go in first
+        if (spill_buff(buffer, data) == EXIT_SUCCESS) {
+            pthread_mutex_unlock(&buffer->lock);
+            return;
+        }
+        if (buffer->stats.spill_queued > 0) {
+            fprintf(stderr, "Failed to write buffer spill file, scan dropped: %s\n", strerror(errno));
+            buffer->stats.spill_lost++;
+            free_datapoint(data);
+            pthread_mutex_unlock(&buffer->lock);
+            return;
+        }
+        // nothing spilled yet, so fall back to waiting for room
     }
-    buffer->buffer[buffer->in] = data;
-    buffer->in = (buffer->in+1) % N;
-    buffer->count++;
+    if (buffer->count == buffer->capacity && buffer->policy == BUFFER_DROP_NEWEST) {
+        buffer->stats.dropped_newest++;
+        free_datapoint(data);
+        pthread_mutex_unlock(&buffer->lock);
+        return;
+    }
+    if (buffer->count == buffer->capacity && buffer->policy == BUFFER_DROP_OLDEST) {
+        struct datapoint_nanoVNA_H *oldest = buffer->buffer[buffer->out];
+        buffer->buffer[buffer->out] = NULL;
+        buffer->out = (buffer->out + 1) % buffer->capacity;
+        buffer->count--;
+        buffer->stats.dropped_oldest++;
+        if (oldest)
+            free_datapoint(oldest);
+    }
+    if (buffer->count == buffer->capacity) {
+        uint64_t blocked_from = monotonic_ns();
+        buffer->stats.blocked++;
+        while (buffer->count == buffer->capacity) {
+            pthread_cond_wait(&buffer->take_cond, &buffer->lock);
+        }
+        buffer->stats.blocked_ns += monotonic_ns() - blocked_from;
+    }
+    push_buff(buffer, data);
     pthread_cond_signal(&buffer->add_cond);
     pthread_mutex_unlock(&buffer->lock);
     return;
@@ -76,18 +270,391 @@ struct datapoint_nanoVNA_H* take_buff(struct bounded_buffer *buffer) {
     }
     struct datapoint_nanoVNA_H *data = buffer->buffer[buffer->out];
     buffer->buffer[buffer->out] = NULL;
-    buffer->out = (buffer->out + 1) % N;
+    buffer->out = (buffer->out + 1) % buffer->capacity;
     buffer->count--;
+    if (buffer->stats.spill_queued > 0)
+        unspill_buff(buffer);
     pthread_cond_signal(&buffer->take_cond);
     pthread_mutex_unlock(&buffer->lock);
     return data;
 }
 
+void mark_buffer_complete(struct bounded_buffer *buffer) {
+    pthread_mutex_lock(&buffer->lock);
+    buffer->complete = true;
+    pthread_cond_broadcast(&buffer->add_cond);
+    pthread_mutex_unlock(&buffer->lock);
+}
+
+size_t buffer_scan_bytes(int pps) {
+    return sizeof(struct datapoint_nanoVNA_H *) + sizeof(struct datapoint_nanoVNA_H)
+        + (pps > 0 ? pps : 0) * sizeof(struct nanovna_raw_datapoint);
+}
+
+int buffer_capacity_for_budget(size_t budget_bytes, int pps) {
+    size_t capacity = budget_bytes / buffer_scan_bytes(pps);
+    if (capacity < 1)
+        return 1;
+    if (capacity > MAX_BUFFER_CAPACITY)
+        return MAX_BUFFER_CAPACITY;
+    return (int)capacity;
+}
+
+void get_buffer_stats(struct bounded_buffer *buffer, struct buffer_stats *stats) {
+    pthread_mutex_lock(&buffer->lock);
+    *stats = buffer->stats;
+    stats->queued = buffer->count;
+    pthread_mutex_unlock(&buffer->lock);
+}
+
+const char* buffer_policy_name(BufferPolicy policy) {
+    switch (policy) {
+    case BUFFER_BLOCK:
+        return "block";
+    case BUFFER_DROP_OLDEST:
+        return "oldest";
+    case BUFFER_DROP_NEWEST:
+        return "newest";
+    case BUFFER_SPILL:
+        return "spill";
+    }
+    return "unknown";
+}
+
+int parse_buffer_policy(const char *name, BufferPolicy *policy) {
+    const BufferPolicy policies[] = {BUFFER_BLOCK, BUFFER_DROP_OLDEST, BUFFER_DROP_NEWEST, BUFFER_SPILL};
+    for (size_t i = 0; i < sizeof(policies)/sizeof(policies[0]); i++) {
+        if (strcmp(name, buffer_policy_name(policies[i])) == 0) {
+            *policy = policies[i];
+            return EXIT_SUCCESS;
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+//----------------------------------------
+// Sub-band Task Scheduling
+//----------------------------------------
+
+/**
+ * Appends a task to the back of a deque, growing it if it is full.
+ * 
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on allocation failure
+ */
+static int push_task(struct task_deque *deque, const struct scan_task *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        int new_capacity = deque->capacity * 2;
+        struct scan_task *tasks = malloc(sizeof(struct scan_task) * new_capacity);
+        if (!tasks) {
+            pthread_mutex_unlock(&deque->lock);
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < deque->count; i++)
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = new_capacity;
+        deque->head = 0;
+    }
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = *task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Takes the task at the front of a deque (owner's end).
+ * 
+ * @return true if a task was taken, false if the deque was empty
+ */
+static bool pop_task(struct task_deque *deque, struct scan_task *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == 0) {
+        pthread_mutex_unlock(&deque->lock);
+        return false;
+    }
+    *task = deque->tasks[deque->head];
+    deque->head = (deque->head + 1) % deque->capacity;
+    deque->count--;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+/**
+ * Takes the task at the back of a deque (thieves' end).
+ * 
+ * @return true if a task was taken, false if the deque was empty
+ */
+static bool steal_task(struct task_deque *deque, struct scan_task *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == 0) {
+        pthread_mutex_unlock(&deque->lock);
+        return false;
+    }
+    deque->count--;
+    *task = deque->tasks[(deque->head + deque->count) % deque->capacity];
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+/**
+ * Steals a task from whichever other worker has the most tasks queued.
+ * 
+ * @return true if a task was stolen, false if every other deque is empty
+ */
+static bool steal_from_busiest(struct task_scheduler *sched, int thief, struct scan_task *task) {
+    while (true) {
+        int victim = -1;
+        int most = 0;
+        for (int i = 0; i < sched->nbr_workers; i++) {
+            // only a hint, so read without the lock, steal_task checks it properly
+            int count = atomic_load_explicit(&sched->deques[i].count, memory_order_relaxed);
+            if (i != thief && count > most) {
+                most = count;
+                victim = i;
+            }
+        }
+        if (victim < 0)
+            return false;
+        if (steal_task(&sched->deques[victim], task))
+            return true;
+    }
+}
+
+/**
+ * Pushes every sub-band of one sweep, either all onto one worker's deque
+ * or dealt round-robin across all deques starting with first_worker.
+ * 
+ * Sub-band ranges come straight from the scheduler's sweep plan.
+ */
+static int release_sweep(struct task_scheduler *sched, int sweep, int first_worker, bool deal) {
+    for (int scan = 0; scan < sched->plan->nbr_scans; scan++) {
+        const struct scan_range *range = sweep_plan_scan(sched->plan, scan);
+        struct scan_task task = {sweep, scan, (int)range->start, (int)range->stop, range->pps};
+        int worker = deal ? (first_worker + scan) % sched->nbr_workers : first_worker;
+        if (push_task(&sched->deques[worker], &task) != EXIT_SUCCESS) {
+            fprintf(stderr, "Failed to allocate memory for scan task\n");
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int create_task_scheduler(struct task_scheduler *sched, int nbr_workers, bool share_bands,
+                          const struct sweep_plan *plan, int nbr_sweeps) {
+    int nbr_scans = plan->nbr_scans;
+    sched->deques = calloc(sizeof(struct task_deque), nbr_workers);
+    sched->released = calloc(sizeof(int), nbr_workers);
+    sched->ticked = calloc(sizeof(long), nbr_workers);
+    if (!sched->deques || !sched->released || !sched->ticked) {
+        free(sched->deques);
+        free(sched->released);
+        free(sched->ticked);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < nbr_workers; i++) {
+        sched->deques[i].capacity = nbr_scans;
+        sched->deques[i].tasks = malloc(sizeof(struct scan_task) * nbr_scans);
+        if (!sched->deques[i].tasks) {
+            for (int j = 0; j < i; j++)
+                free(sched->deques[j].tasks);
+            free(sched->deques);
+            free(sched->released);
+            free(sched->ticked);
+            return EXIT_FAILURE;
+        }
+        atomic_init(&sched->deques[i].count, 0);
+        pthread_mutex_init(&sched->deques[i].lock, NULL);
+    }
+    sched->nbr_workers = nbr_workers;
+    sched->share_bands = share_bands;
+    sched->plan = plan;
+    sched->nbr_sweeps = nbr_sweeps;
+    sched->ticks = -1;
+    sched->missed = 0;
+    memset(sched->unfinished, 0, sizeof(sched->unfinished));
+    sched->closed = false;
+    atomic_init(&sched->active_workers, nbr_workers);
+    pthread_cond_init(&sched->tick, NULL);
+    pthread_mutex_init(&sched->lock, NULL);
+    return EXIT_SUCCESS;
+}
+
+void pace_task_scheduler(struct task_scheduler *sched, bool paced) {
+    pthread_mutex_lock(&sched->lock);
+    sched->ticks = paced ? 0 : -1;
+    for (int i = 0; i < sched->nbr_workers; i++)
+        sched->ticked[i] = 0;
+    pthread_cond_broadcast(&sched->tick);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void tick_task_scheduler(struct task_scheduler *sched) {
+    pthread_mutex_lock(&sched->lock);
+    if (sched->ticks >= 0)
+        sched->ticks++;
+    pthread_cond_broadcast(&sched->tick);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void close_task_scheduler(struct task_scheduler *sched) {
+    pthread_mutex_lock(&sched->lock);
+    sched->closed = true;
+    pthread_cond_broadcast(&sched->tick);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void destroy_task_scheduler(struct task_scheduler *sched) {
+    for (int i = 0; i < sched->nbr_workers; i++) {
+        free(sched->deques[i].tasks);
+        pthread_mutex_destroy(&sched->deques[i].lock);
+    }
+    free(sched->deques);
+    sched->deques = NULL;
+    free(sched->released);
+    sched->released = NULL;
+    free(sched->ticked);
+    sched->ticked = NULL;
+    pthread_cond_destroy(&sched->tick);
+    pthread_mutex_destroy(&sched->lock);
+}
+
+bool next_scan_task(struct task_scheduler *sched, int worker, struct scan_task *task, bool may_release) {
+    while (true) {
+        if (pop_task(&sched->deques[worker], task))
+            return true;
+        if (sched->share_bands && steal_from_busiest(sched, worker, task))
+            return true;
+        if (!may_release)
+            return false;
+
+        // nothing to do, so start the next sweep
+        int slot = sched->share_bands ? 0 : worker;
+        pthread_mutex_lock(&sched->lock);
+        if (sched->closed || (sched->nbr_sweeps >= 0 && sched->released[slot] >= sched->nbr_sweeps)) {
+            pthread_mutex_unlock(&sched->lock);
+            return false;
+        }
+        int *unfinished = &sched->unfinished[sched->released[slot] % SWEEP_TRACKER_SLOTS];
+        if (sched->share_bands && *unfinished > 0) {
+            // the consumer already has as many sweeps in progress as it can
+            // follow, so wait for the oldest of them to finish
+            pthread_cond_wait(&sched->tick, &sched->lock);
+            pthread_mutex_unlock(&sched->lock);
+            continue;
+        }
+        if (sched->ticks >= 0 && sched->ticked[slot] >= sched->ticks) {
+            // not yet time for the next sweep, look again on the next tick,
+            // or when another worker deals this one some of its sweep
+            pthread_cond_wait(&sched->tick, &sched->lock);
+            pthread_mutex_unlock(&sched->lock);
+            continue;
+        }
+        if (sched->share_bands)
+            *unfinished = sched->plan->nbr_scans;
+        int error = release_sweep(sched, sched->released[slot], worker, sched->share_bands);
+        sched->released[slot]++;
+        if (sched->ticks >= 0) {
+            sched->missed += sched->ticks - sched->ticked[slot] - 1;
+            sched->ticked[slot] = sched->ticks;
+        }
+        if (sched->share_bands)
+            pthread_cond_broadcast(&sched->tick);
+        pthread_mutex_unlock(&sched->lock);
+        if (error != EXIT_SUCCESS)
+            return false;
+    }
+}
+
+void finish_scan_task(struct task_scheduler *sched, const struct scan_task *task) {
+    if (!sched->share_bands)
+        return;
+    pthread_mutex_lock(&sched->lock);
+    if (--sched->unfinished[task->sweep % SWEEP_TRACKER_SLOTS] == 0)
+        pthread_cond_broadcast(&sched->tick);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+//----------------------------------------
+// Sweep Completion Tracking
+//----------------------------------------
+
+void init_sweep_tracker(struct sweep_tracker *tracker, int nbr_scans, bool shared) {
+    tracker->nbr_scans = nbr_scans;
+    tracker->shared = shared;
+    for (int owner = 0; owner < MAXIMUM_VNA_PORTS; owner++) {
+        for (int slot = 0; slot < SWEEP_TRACKER_SLOTS; slot++)
+            tracker->slots[owner][slot] = (struct sweep_progress){-1, 0};
+    }
+}
+
+static void finish_sweep(struct sweep_tracker *tracker, int owner, struct sweep_progress *progress, struct sweep_event *event) {
+    event->owner = tracker->shared ? SWEEP_OWNER_SHARED : owner;
+    event->sweep = progress->sweep;
+    event->arrived = progress->arrived;
+    event->complete = (progress->arrived == tracker->nbr_scans);
+    *progress = (struct sweep_progress){-1, 0};
+}
+
+int track_sweep_record(struct sweep_tracker *tracker, const struct datapoint_nanoVNA_H *data, struct sweep_event *events) {
+    int owner = tracker->shared ? 0 : data->vna_id;
+    if (owner < 0 || owner >= MAXIMUM_VNA_PORTS)
+        return 0;
+    struct sweep_progress *slots = tracker->slots[owner];
+    int nbr_events = 0;
+
+    struct sweep_progress *progress = NULL;
+    struct sweep_progress *vacant = NULL;
+    struct sweep_progress *oldest = NULL;
+    for (int slot = 0; slot < SWEEP_TRACKER_SLOTS; slot++) {
+        if (slots[slot].sweep == data->sweep)
+            progress = &slots[slot];
+        else if (slots[slot].sweep == -1 && !vacant)
+            vacant = &slots[slot];
+        else if (slots[slot].sweep != -1 && (!oldest || slots[slot].sweep < oldest->sweep))
+            oldest = &slots[slot];
+    }
+    if (!progress) {
+        if (!vacant) {
+            // no room, so the oldest sweep has lost sub-bands
+            finish_sweep(tracker, owner, oldest, &events[nbr_events++]);
+            vacant = oldest;
+        }
+        progress = vacant;
+        progress->sweep = data->sweep;
+    }
+
+    progress->arrived++;
+    if (progress->arrived == tracker->nbr_scans)
+        finish_sweep(tracker, owner, progress, &events[nbr_events++]);
+    return nbr_events;
+}
+
+int flush_sweep_tracker(struct sweep_tracker *tracker, struct sweep_event *events) {
+    int nbr_events = 0;
+    for (int owner = 0; owner < MAXIMUM_VNA_PORTS; owner++) {
+        // report oldest first
+        while (true) {
+            struct sweep_progress *oldest = NULL;
+            for (int slot = 0; slot < SWEEP_TRACKER_SLOTS; slot++) {
+                struct sweep_progress *p = &tracker->slots[owner][slot];
+                if (p->sweep != -1 && (!oldest || p->sweep < oldest->sweep))
+                    oldest = p;
+            }
+            if (!oldest)
+                break;
+            finish_sweep(tracker, owner, oldest, &events[nbr_events++]);
+        }
+    }
+    return nbr_events;
+}
+
 //----------------------------------------
 // Pulling Data Logic
 //----------------------------------------
 
-int find_binary_header(int vna_id, struct nanovna_raw_datapoint* first_point, uint16_t expected_mask, uint16_t expected_points) {
+int find_binary_header(int vna_id, struct nanovna_raw_datapoint* first_point, uint16_t expected_mask, uint16_t expected_points, uint64_t *header_ns) {
     int max_bytes = 500;  // Maximum bytes to scan before giving up
     int dp_size = (unsigned int)sizeof(struct nanovna_raw_datapoint); // Amount of bytes that should be pulled at a time
     uint8_t bytes[sizeof(struct nanovna_raw_datapoint)];
@@ -97,6 +664,7 @@ int find_binary_header(int vna_id, struct nanovna_raw_datapoint* first_point, ui
         fprintf(stderr, "Failed to read initial header bytes\n");
         return EXIT_FAILURE;
     }
+    uint64_t read_ns = monotonic_ns();
     uint8_t window[4] = {bytes[0],bytes[1],bytes[2],bytes[3]};
     
     // Check if we already have the header
@@ -122,6 +690,7 @@ int find_binary_header(int vna_id, struct nanovna_raw_datapoint* first_point, ui
             fprintf(stderr, "Timeout waiting for binary header\n");
             return EXIT_FAILURE;
         }
+        read_ns = monotonic_ns();
         i = 0;
 
         while (i < dp_size && !found) {
@@ -157,16 +726,16 @@ int find_binary_header(int vna_id, struct nanovna_raw_datapoint* first_point, ui
         bytes[mid+j] = remainder[j];
 
     memcpy(first_point,bytes,dp_size);
+    if (header_ns)
+        *header_ns = read_ns;
     return EXIT_SUCCESS;
 }
 
 struct datapoint_nanoVNA_H* pull_scan(int vna_id, int start, int stop, int pps) {
-    struct timeval send_time, receive_time;
-    gettimeofday(&send_time, NULL);
-
     // Send scan command
     char msg_buff[50];
     snprintf(msg_buff, sizeof(msg_buff), "scan %d %d %i %i\r", start, stop, pps, MASK);
+    uint64_t send_ns = monotonic_ns();
     if (write_command(vna_id, msg_buff) < 0) {
         fprintf(stderr, "Failed to send scan command\n");
         return NULL;
@@ -178,6 +747,7 @@ struct datapoint_nanoVNA_H* pull_scan(int vna_id, int start, int stop, int pps)
         fprintf(stderr, "Failed to allocate memory for data points\n");
         return NULL;
     }
+    data->pps = pps;
     data->point = malloc(sizeof(struct nanovna_raw_datapoint) * pps);
     if (!data->point) {
         fprintf(stderr, "Failed to allocate memory for raw data points\n");
@@ -186,7 +756,7 @@ struct datapoint_nanoVNA_H* pull_scan(int vna_id, int start, int stop, int pps)
     }
 
     // Find binary header and read first point
-    int header_found = find_binary_header(vna_id, &data->point[0], MASK, pps);
+    int header_found = find_binary_header(vna_id, &data->point[0], MASK, pps, &data->header_ns);
     if (header_found != EXIT_SUCCESS) {
         fprintf(stderr, "Failed to find binary header\n");
         free(data->point);
@@ -210,120 +780,645 @@ struct datapoint_nanoVNA_H* pull_scan(int vna_id, int start, int stop, int pps)
         }
     }
 
-    // Set VNA ID (software metadata)
+    // Set VNA ID (software metadata), the caller fills in which sweep this is
     data->vna_id = vna_id;
+    data->scan_id = -1;
+    data->sweep = 0;
+    data->scan_index = 0;
     // Set Timestamps
-    gettimeofday(&receive_time, NULL);
-    data->send_time = send_time;
-    data->receive_time = receive_time;
+    data->receive_ns = monotonic_ns();
+    data->send_ns = send_ns;
+    data->sweep_ns_per_point = 0;
+    return data;
+}
+
+#define RESYNC_QUIET_MS 50
+#define RESYNC_MAX_MS 3000
+
+int resync_vna(int vna_id, bool sync) {
+    if (drain_vna(vna_id, RESYNC_QUIET_MS, RESYNC_MAX_MS) < 0)
+        return EXIT_FAILURE;
+    if (sync) {
+        // an empty line makes the firmware answer with a fresh prompt
+        if (write_command(vna_id, "\r") < 0)
+            return EXIT_FAILURE;
+        if (drain_vna(vna_id, RESYNC_QUIET_MS, RESYNC_MAX_MS) < 0)
+            return EXIT_FAILURE;
+    }
+    pthread_mutex_lock(&scan_stats_lock);
+    scan_stats[vna_id].resyncs++;
+    pthread_mutex_unlock(&scan_stats_lock);
+    return EXIT_SUCCESS;
+}
+
+static uint64_t elapsed_ns(const struct timespec *from, const struct timespec *to) {
+    return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000000ULL + to->tv_nsec - from->tv_nsec;
+}
+
+struct datapoint_nanoVNA_H* pull_scan_retry(int vna_id, int start, int stop, int pps, int retries, bool sync) {
+    struct datapoint_nanoVNA_H *data = pull_scan(vna_id, start, stop, pps);
+    if (data) {
+        pthread_mutex_lock(&scan_stats_lock);
+        scan_stats[vna_id].scans++;
+        pthread_mutex_unlock(&scan_stats_lock);
+        update_sweep_time(data, pps);
+        update_scan_cost(data, pps);
+        return data;
+    }
+    // cut short by stop_sweep, not a fault of the VNA
+    if (vna_interrupted(vna_id))
+        return NULL;
+
+    struct timespec failed_at, recovered_at;
+    clock_gettime(CLOCK_MONOTONIC, &failed_at);
+    pthread_mutex_lock(&scan_stats_lock);
+    scan_stats[vna_id].failed_pulls++;
+    pthread_mutex_unlock(&scan_stats_lock);
+
+    for (int attempt = 0; attempt < retries && !data && !vna_interrupted(vna_id); attempt++) {
+        if (resync_vna(vna_id, sync) != EXIT_SUCCESS)
+            break;
+        data = pull_scan(vna_id, start, stop, pps);
+
+        pthread_mutex_lock(&scan_stats_lock);
+        scan_stats[vna_id].retries++;
+        if (!data)
+            scan_stats[vna_id].failed_pulls++;
+        pthread_mutex_unlock(&scan_stats_lock);
+    }
+
+    if (!data && vna_interrupted(vna_id))
+        return NULL;
+
+    pthread_mutex_lock(&scan_stats_lock);
+    if (data) {
+        clock_gettime(CLOCK_MONOTONIC, &recovered_at);
+        uint64_t took = elapsed_ns(&failed_at, &recovered_at);
+        scan_stats[vna_id].scans++;
+        scan_stats[vna_id].recoveries++;
+        scan_stats[vna_id].recovery_ns += took;
+        if (took > scan_stats[vna_id].max_recovery_ns)
+            scan_stats[vna_id].max_recovery_ns = took;
+    } else {
+        scan_stats[vna_id].dropped_scans++;
+        fprintf(stderr, "Dropped scan %d-%d Hz on vna %d after %d retries\n", start, stop, vna_id, retries);
+    }
+    pthread_mutex_unlock(&scan_stats_lock);
+
+    if (data) {
+        update_sweep_time(data, pps);
+        update_scan_cost(data, pps);
+    } else {
+        // leave the stream clean for the next sub-band
+        resync_vna(vna_id, sync);
+    }
     return data;
 }
 
+void update_sweep_time(struct datapoint_nanoVNA_H *data, int pps) {
+    if (data->vna_id < 0 || data->vna_id >= MAXIMUM_VNA_PORTS || pps < 1 || data->header_ns < data->send_ns)
+        return;
+    double sample = (double)(data->header_ns - data->send_ns) / pps;
+    pthread_mutex_lock(&scan_stats_lock);
+    double *estimate = &scan_stats[data->vna_id].sweep_ns_per_point;
+    if (*estimate == 0)
+        *estimate = sample;
+    else
+        *estimate += SWEEP_TIME_EWMA_WEIGHT * (sample - *estimate);
+    data->sweep_ns_per_point = *estimate;
+    pthread_mutex_unlock(&scan_stats_lock);
+}
+
+/**
+ * Decayed sums of scan sizes (x) and times (y) for the least squares fit
+ */
+struct scan_cost_sums {
+    double w, x, y, xx, xy;
+};
+
+/**
+ * Sums for each VNA, guarded by scan_stats_lock
+ */
+static struct scan_cost_sums scan_cost[MAXIMUM_VNA_PORTS];
+
+void update_scan_cost(const struct datapoint_nanoVNA_H *data, int pps) {
+    if (data->vna_id < 0 || data->vna_id >= MAXIMUM_VNA_PORTS || pps < 1 || data->receive_ns < data->send_ns)
+        return;
+    double x = pps;
+    double y = (double)(data->receive_ns - data->send_ns);
+    double keep = 1.0 - SCAN_COST_DECAY;
+    pthread_mutex_lock(&scan_stats_lock);
+    struct scan_cost_sums *sums = &scan_cost[data->vna_id];
+    sums->w = sums->w * keep + 1;
+    sums->x = sums->x * keep + x;
+    sums->y = sums->y * keep + y;
+    sums->xx = sums->xx * keep + x * x;
+    sums->xy = sums->xy * keep + x * y;
+    pthread_mutex_unlock(&scan_stats_lock);
+}
+
+/**
+ * Fits a fixed and a per point cost to the sums, see get_scan_cost_model
+ */
+static void fit_scan_cost(const struct scan_cost_sums *sums, struct scan_cost_model *model) {
+    *model = (struct scan_cost_model){DEFAULT_COMMAND_NS, DEFAULT_POINT_NS, sums->w};
+    if (sums->w <= 0)
+        return;
+    double mean_x = sums->x / sums->w;
+    double mean_y = sums->y / sums->w;
+    double var_x = sums->xx / sums->w - mean_x * mean_x;
+    double cov_xy = sums->xy / sums->w - mean_x * mean_y;
+    // sizes must differ by a point or so on average for the slope to mean anything
+    if (var_x >= 1.0) {
+        double slope = cov_xy / var_x;
+        double intercept = mean_y - slope * mean_x;
+        if (slope >= 0 && intercept >= 0) {
+            model->point_ns = slope;
+            model->command_ns = intercept;
+            return;
+        }
+    }
+    model->command_ns = mean_y < DEFAULT_COMMAND_NS ? mean_y : DEFAULT_COMMAND_NS;
+    model->point_ns = (mean_y - model->command_ns) / mean_x;
+}
+
+void get_scan_cost_model(int vna_id, struct scan_cost_model *model) {
+    struct scan_cost_sums sums = {0};
+    pthread_mutex_lock(&scan_stats_lock);
+    if (vna_id >= 0 && vna_id < MAXIMUM_VNA_PORTS)
+        sums = scan_cost[vna_id];
+    if (sums.w <= 0) {
+        // every VNA's scans together
+        for (int i = 0; i < MAXIMUM_VNA_PORTS; i++) {
+            sums.w += scan_cost[i].w;
+            sums.x += scan_cost[i].x;
+            sums.y += scan_cost[i].y;
+            sums.xx += scan_cost[i].xx;
+            sums.xy += scan_cost[i].xy;
+        }
+    }
+    pthread_mutex_unlock(&scan_stats_lock);
+    fit_scan_cost(&sums, model);
+}
+
+void reset_scan_cost_model(void) {
+    pthread_mutex_lock(&scan_stats_lock);
+    memset(scan_cost, 0, sizeof(scan_cost));
+    pthread_mutex_unlock(&scan_stats_lock);
+}
+
+double predict_scans_ns(const int *vna_list, int nbr_vnas, bool shared, double scans, double pps) {
+    if (nbr_vnas < 1 || scans <= 0)
+        return 0;
+    double rate = 0;    // scans per ns, all VNAs together
+    double slowest = 0; // ns per scan of the slowest VNA
+    for (int i = 0; i < nbr_vnas; i++) {
+        struct scan_cost_model model;
+        get_scan_cost_model(vna_list[i], &model);
+        double scan_ns = model.command_ns + pps * model.point_ns;
+        if (scan_ns <= 0)
+            continue;
+        rate += 1.0 / scan_ns;
+        if (scan_ns > slowest)
+            slowest = scan_ns;
+    }
+    if (shared)
+        return rate > 0 ? scans / rate : 0;
+    // each VNA does its own share, so the slowest finishes last
+    return scans / nbr_vnas * slowest;
+}
+
+double predict_sweeps_ns(const struct sweep_plan *plan, const int *vna_list, int nbr_vnas, bool shared, long nbr_sweeps) {
+    double scans = (double)nbr_sweeps * plan->nbr_scans * (shared ? 1 : nbr_vnas);
+    return predict_scans_ns(vna_list, nbr_vnas, shared, scans, (double)plan->nbr_points / plan->nbr_scans);
+}
+
+uint64_t estimate_point_time(const struct datapoint_nanoVNA_H *data, int point, int pps) {
+    uint64_t back = (uint64_t)((pps - point - 0.5) * data->sweep_ns_per_point);
+    return back < data->header_ns ? data->header_ns - back : 0;
+}
+
+int get_vna_stats(int vna_id, struct vna_scan_stats *stats) {
+    if (vna_id < 0 || vna_id >= MAXIMUM_VNA_PORTS)
+        return EXIT_FAILURE;
+    pthread_mutex_lock(&scan_stats_lock);
+    *stats = scan_stats[vna_id];
+    pthread_mutex_unlock(&scan_stats_lock);
+    return EXIT_SUCCESS;
+}
+
+void reset_vna_stats(int vna_id) {
+    if (vna_id < 0 || vna_id >= MAXIMUM_VNA_PORTS)
+        return;
+    pthread_mutex_lock(&scan_stats_lock);
+    scan_stats[vna_id] = (struct vna_scan_stats){0};
+    scan_cost[vna_id] = (struct scan_cost_sums){0};
+    pthread_mutex_unlock(&scan_stats_lock);
+}
+
 //----------------------------------------
-// Producer/Consumer Thread Logic
+// Thread Placement
 //----------------------------------------
 
-void* scan_producer(void *arguments) {
+int get_thread_sched_stats(struct thread_sched_stats *stats) {
+    *stats = (struct thread_sched_stats){0};
+#ifdef __linux__
+    FILE *file = fopen("/proc/thread-self/schedstat", "r");
+    if (!file)
+        return EXIT_FAILURE;
+    unsigned long long run_ns, wait_ns;
+    long timeslices;
+    int fields = fscanf(file, "%llu %llu %ld", &run_ns, &wait_ns, &timeslices);
+    fclose(file);
+    if (fields != 3)
+        return EXIT_FAILURE;
+    stats->run_ns = run_ns;
+    stats->wait_ns = wait_ns;
+    stats->timeslices = timeslices;
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == 0)
+        stats->preemptions = usage.ru_nivcsw;
+    stats->available = true;
+    return EXIT_SUCCESS;
+#else
+    return EXIT_FAILURE;
+#endif
+}
 
-    struct scan_producer_args *args = (struct scan_producer_args*)arguments;
-    int pps = args->bfr->pps;
+/**
+ * Starts a thread already pinned to cpus and/or under SCHED_FIFO, so it
+ * never runs anywhere else
+ *
+ * @return 0, or the error from setting up its attributes or creating it
+ */
+static int start_placed_thread(pthread_t *thread, void *(*start)(void *), void *arg,
+                               uint64_t cpus, int rt_priority) {
+    if (!cpus && rt_priority <= 0)
+        return pthread_create(thread, NULL, start, arg);
+    pthread_attr_t attr;
+    int error = pthread_attr_init(&attr);
+    if (error != 0)
+        return error;
+    if (cpus) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < MAX_PINNED_CPUS; cpu++) {
+            if (cpus >> cpu & 1)
+                CPU_SET(cpu, &set);
+        }
+        error = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+#else
+        error = ENOTSUP;
+#endif
+    }
+    if (error == 0 && rt_priority > 0) {
+        struct sched_param param = {0};
+        param.sched_priority = rt_priority;
+        error = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (error == 0)
+            error = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        if (error == 0)
+            error = pthread_attr_setschedparam(&attr, &param);
+    }
+    if (error == 0)
+        error = pthread_create(thread, &attr, start, arg);
+    pthread_attr_destroy(&attr);
+    return error;
+}
 
-    for (int sweep = 0; sweep < args->nbr_sweeps; sweep++) {
-        if (args->nbr_sweeps > 1) {
-            printf("[Producer] Starting sweep %d/%d\n", sweep + 1, args->nbr_sweeps);
+static void report_pin_error(int error) {
+    fprintf(stderr, "Error pinning thread to CPUs: %s\n", strerror(error));
+}
+
+static void report_rt_error(int rt_priority, int error) {
+    fprintf(stderr, "Error setting real-time priority %d: %s%s\n", rt_priority, strerror(error),
+            error == EPERM ? " (needs root or CAP_SYS_NICE)" : "");
+}
+
+int create_placed_thread(pthread_t *thread, void *(*start)(void *), void *arg, uint64_t cpus, int rt_priority) {
+    int error = start_placed_thread(thread, start, arg, cpus, rt_priority);
+    if (error != 0 && cpus && rt_priority > 0) {
+        // find out which of the two can't be had, and keep the other
+        int pin_error = start_placed_thread(thread, start, arg, cpus, 0);
+        if (pin_error == 0) {
+            report_rt_error(rt_priority, error);
+            return 0;
         }
+        report_pin_error(pin_error);
+        cpus = 0;
+        error = start_placed_thread(thread, start, arg, 0, rt_priority);
+    }
+    if (error != 0) {
+        if (cpus)
+            report_pin_error(error);
+        else if (rt_priority > 0)
+            report_rt_error(rt_priority, error);
+        error = pthread_create(thread, NULL, start, arg);
+    }
+    return error;
+}
 
-        int current = args->start;
-        int step = (int)round(args->stop - args->start) / ((args->nbr_scans*pps)-1);
-        for (int scan = 0; scan < args->nbr_scans; scan++) {
-            struct datapoint_nanoVNA_H *data = pull_scan(args->vna_id,current,
-                                                        current + step*(pps-1), pps);
-            // add to buffer
-            if (data)
-                add_buff(args->bfr,data);
+int parse_cpu_list(const char *list, uint64_t *cpus) {
+    if (strcmp(list, "any") == 0) {
+        *cpus = 0;
+        return EXIT_SUCCESS;
+    }
+    uint64_t mask = 0;
+    const char *p = list;
+    while (true) {
+        char *end;
+        if (!isdigit((unsigned char)*p))
+            return EXIT_FAILURE;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            if (!isdigit((unsigned char)*p))
+                return EXIT_FAILURE;
+            last = strtol(p, &end, 10);
+        }
+        if (last < first || last >= MAX_PINNED_CPUS)
+            return EXIT_FAILURE;
+        for (long cpu = first; cpu <= last; cpu++)
+            mask |= 1ULL << cpu;
+        if (*end == '\0')
+            break;
+        if (*end != ',')
+            return EXIT_FAILURE;
+        p = end + 1;
+    }
+    *cpus = mask;
+    return EXIT_SUCCESS;
+}
 
-            current += step*args->bfr->pps;
+void format_cpu_list(uint64_t cpus, char *buffer, size_t size) {
+    if (cpus == 0) {
+        snprintf(buffer, size, "any");
+        return;
+    }
+    size_t used = 0;
+    buffer[0] = '\0';
+    int cpu = 0;
+    while (cpu < MAX_PINNED_CPUS && used < size) {
+        if (!(cpus >> cpu & 1)) {
+            cpu++;
+            continue;
         }
+        int last = cpu;
+        while (last + 1 < MAX_PINNED_CPUS && (cpus >> (last + 1) & 1))
+            last++;
+        const char *comma = used > 0 ? "," : "";
+        if (last == cpu)
+            used += snprintf(buffer + used, size - used, "%s%d", comma, cpu);
+        else
+            used += snprintf(buffer + used, size - used, "%s%d-%d", comma, cpu, last);
+        cpu = last + 1;
     }
+}
+
+/**
+ * @return the nth CPU (counting round and round) of a mask, as a mask of
+ *         just that CPU, or 0 if the mask is empty
+ */
+static uint64_t nth_cpu(uint64_t cpus, int n) {
+    int count = __builtin_popcountll(cpus);
+    if (count == 0)
+        return 0;
+    n %= count;
+    for (int cpu = 0; cpu < MAX_PINNED_CPUS; cpu++) {
+        if ((cpus >> cpu & 1) && n-- == 0)
+            return 1ULL << cpu;
+    }
+    return 0;
+}
+
+/**
+ * Prints how much a sweep thread was kept from running
+ */
+static void report_thread_sched(int scan_id, const char *thread, const struct thread_sched_stats *stats, long scans) {
+    if (!stats->available)
+        return;
+    printf("Sweep %d %s: waited %.3f ms for a CPU over %ld timeslices", scan_id, thread,
+           stats->wait_ns / 1e6, stats->timeslices);
+    if (scans > 0)
+        printf(" (%.1f us per scan)", stats->wait_ns / 1e3 / scans);
+    printf(", preempted %ld times\n", stats->preemptions);
+}
+
+//----------------------------------------
+// Producer/Consumer Thread Logic
+//----------------------------------------
+
+/**
+ * Shared body of scan_producer and sweep_producer.
+ * 
+ * Pulls tasks from the scheduler (a private one if args->sched is NULL)
+ * and puts the resulting scans on the buffer. If ongoing is true new sweeps
+ * are only released while the scan state is positive. Stops between
+ * sub-scans once the sweep is cancelled, resynchronising the VNA if
+ * stop_sweep interrupted a read part way through a reply.
+ * 
+ * @return true if this was the last producer of the scheduler to finish
+ */
+static bool produce_scans(struct scan_producer_args *args, bool ongoing) {
+    struct sweep_plan local_plan;
+    struct task_scheduler local_sched;
+    struct task_scheduler *sched = args->sched;
+    int worker = args->worker;
+    if (!sched) {
+        if (create_sweep_plan(&local_plan, args->start, args->stop, args->nbr_scans, args->bfr->pps) != EXIT_SUCCESS)
+            return true;
+        if (create_task_scheduler(&local_sched, 1, false, &local_plan,
+                                  ongoing ? -1 : args->nbr_sweeps) != EXIT_SUCCESS) {
+            fprintf(stderr, "Failed to allocate memory for task scheduler\n");
+            destroy_sweep_plan(&local_plan);
+            return true;
+        }
+        sched = &local_sched;
+        worker = 0;
+    }
+
+    struct scan_task task;
+    int last_sweep = -1;
+    bool cut_short = false;
+    args->scans_pulled = 0;
+    while (!atomic_load(&scan_cancelled[args->scan_id]) &&
+           next_scan_task(sched, worker, &task, !ongoing || scan_states[args->scan_id] > 0)) {
+        if (!ongoing && args->nbr_sweeps > 1 && task.sweep != last_sweep && !sched->share_bands) {
+            printf("[Producer] Starting sweep %d/%d\n", task.sweep + 1, args->nbr_sweeps);
+        }
+        last_sweep = task.sweep;
+
+        struct datapoint_nanoVNA_H *data = pull_scan_retry(args->vna_id, task.start, task.stop, task.pps,
+                                                           args->retries, args->sync);
+        // add to buffer
+        if (data) {
+            data->scan_id = args->scan_id;
+            data->sweep = task.sweep;
+            data->scan_index = task.scan;
+            add_buff(args->bfr,data);
+            args->scans_pulled++;
+        } else if (vna_interrupted(args->vna_id)) {
+            cut_short = true;
+        }
+        finish_scan_task(sched, &task);
+    }
+    if (cut_short) {
+        clear_vna_interrupt(args->vna_id);
+        resync_vna(args->vna_id, args->sync);
+    }
+    get_thread_sched_stats(&args->sched_stats);
+
+    bool last = (atomic_fetch_sub(&sched->active_workers, 1) == 1);
+    if (sched == &local_sched) {
+        destroy_task_scheduler(&local_sched);
+        destroy_sweep_plan(&local_plan);
+    }
+    return last;
+}
+
+void* scan_producer(void *arguments) {
+
+    struct scan_producer_args *args = (struct scan_producer_args*)arguments;
+
+    bool last = produce_scans(args, false);
+
     pthread_mutex_lock(&scan_state_lock);
-    if (--scan_states[args->scan_id] <= 0)
-        args->bfr->complete = true;
+    --scan_states[args->scan_id];
     pthread_mutex_unlock(&scan_state_lock);
+    if (last)
+        mark_buffer_complete(args->bfr);
     return NULL;
 }
 
 void* sweep_producer(void *arguments) {
 
     struct scan_producer_args *args = (struct scan_producer_args*)arguments;
-    int pps = args->bfr->pps;
 
-    while (scan_states[args->scan_id] > 0) {
-        int total_scans = args->nbr_scans;
-        int step = (args->stop - args->start) / total_scans;
-        int current = args->start;
-        while (total_scans > 0) {
-            struct datapoint_nanoVNA_H *data = pull_scan(args->vna_id,current,
-                                                        current + step, pps);
-            // add to buffer
-            if (data)
-                add_buff(args->bfr,data);
+    if (produce_scans(args, true))
+        mark_buffer_complete(args->bfr);
+    return NULL;
+}
+
+
+static void report_sweep_events(struct scan_consumer_args *args, int scan_id, struct sweep_event *events, int nbr_events) {
+    for (int i = 0; i < nbr_events; i++) {
+        stream_publish_sweep(scan_id, &events[i], args->plan->nbr_scans);
+        if (!args->verbose)
+            continue;
+        printf("SWEEP %s %s %d %d %d %d %d %s\n",
+            args->id_string, args->label, scan_id, events[i].owner, events[i].sweep,
+            events[i].arrived, args->plan->nbr_scans, events[i].complete ? "COMPLETE" : "INCOMPLETE");
+    }
+}
 
-            // finish loop
-            total_scans--;
-            current += step;
+/**
+ * Writes a time domain response to the consumer's TDR file and, if verbose,
+ * prints a summary of it with the time and magnitude of its largest peak
+ */
+static void write_tdr_record(struct scan_consumer_args *args, const struct tdr_record *record) {
+    FILE *f = args->tdr_file;
+    if (f) {
+        fprintf(f, "! vna %d sweep %d sent %.9f s points %d step %.6e s\n",
+            record->vna_id, record->sweep, ((double)record->send_ns - (double)args->program_start_ns) / 1e9, record->nbr_points, record->time_step);
+        for (int i = 0; i < record->nbr_points; i++)
+            fprintf(f, "%.6e %.6e %.6e\n", i * record->time_step, record->response[i].re, record->response[i].im);
+    }
+    if (args->verbose) {
+        int peak = 0;
+        float peak_mag = 0;
+        for (int i = 0; i < record->nbr_points; i++) {
+            float mag = hypotf(record->response[i].re, record->response[i].im);
+            if (mag > peak_mag) {
+                peak = i;
+                peak_mag = mag;
+            }
         }
+        printf("TDR %s %s %d %d %d %d %.6e %.6e %.6e\n",
+            args->id_string, args->label, record->scan_id, record->vna_id, record->sweep,
+            record->nbr_points, record->time_step, peak * record->time_step, peak_mag);
     }
-    args->bfr->complete = true;
-    return NULL;
 }
 
-void* scan_timer(void *arguments) { 
-    struct scan_timer_args *args = (struct scan_timer_args *)arguments;
-    sleep(args->time_to_wait);
-    scan_states[args->scan_id] = 0;
-    printf("---\ntimer done\n---\n");
-    return NULL;
+/**
+ * Writes a resonance to the consumer's peak file and, if verbose, prints it
+ */
+static void write_peak_record(struct scan_consumer_args *args, const struct peak_record *record) {
+    double secs = ((double)record->send_ns - (double)args->program_start_ns) / 1e9;
+    if (args->peak_file) {
+        fprintf(args->peak_file, "%d,%d,%.9f,%.3f,%.2f,%.3f,%.3f\n",
+            record->vna_id, record->sweep, secs, record->frequency, record->q, record->depth, record->level);
+    }
+    if (args->verbose) {
+        printf("PEAK %s %s %d %d %d %.9f %.3f %.2f %.3f %.3f\n",
+            args->id_string, args->label, record->scan_id, record->vna_id, record->sweep,
+            secs, record->frequency, record->q, record->depth, record->level);
+    }
 }
 
 void* scan_consumer(void *arguments) {
 
     struct scan_consumer_args *args = (struct scan_consumer_args*)arguments;
-    int pps = args->bfr->pps;
 
     FILE *f = args->touchstone_file;
     if (args->verbose)
-        printf("ID Label VNA TimeSent TimeRecv Freq SParam Format Value\n");
+        printf("ID Label VNA TimeSent TimeRecv Freq SParam Format Value ScanID Sweep SubBand TimePoint\n");
+
+    struct sweep_tracker *tracker = NULL;
+    if (args->plan) {
+        tracker = malloc(sizeof(struct sweep_tracker));
+        if (tracker)
+            init_sweep_tracker(tracker, args->plan->nbr_scans, args->share_bands);
+        else
+            fprintf(stderr, "Failed to allocate memory for sweep tracker, sweep events disabled\n");
+    }
+    struct sweep_event events[MAXIMUM_VNA_PORTS*SWEEP_TRACKER_SLOTS];
+    int scan_id = -1;
 
     while (!args->bfr->complete || (args->bfr->count != 0)) {
 
         struct datapoint_nanoVNA_H *data = take_buff(args->bfr);
         if (!data) {
             // take_buff has returned nothing as there was nothing left to take
-            return NULL;
+            break;
+        }
+        scan_id = data->scan_id;
+        int pps = data->pps;
+
+        if (args->calibrations && args->plan && data->vna_id >= 0 && data->vna_id < MAXIMUM_VNA_PORTS
+            && args->calibrations[data->vna_id]) {
+            const struct scan_range *range = sweep_plan_scan(args->plan, data->scan_index);
+            if (range && range->pps == pps)
+                apply_calibration(args->calibrations[data->vna_id], range->first_bin, data->point, pps);
         }
 
-        double send_secs = ((double)(data->send_time.tv_sec - args->program_start_time.tv_sec) + 
-                            (double)(data->send_time.tv_usec - args->program_start_time.tv_usec) / 1e6);
-        double recv_secs = ((double)(data->receive_time.tv_sec - args->program_start_time.tv_sec) + 
-                            (double)(data->receive_time.tv_usec - args->program_start_time.tv_usec) / 1e6);
+        double send_secs = ((double)data->send_ns - (double)args->program_start_ns) / 1e9;
+        double recv_secs = ((double)data->receive_ns - (double)args->program_start_ns) / 1e9;
 
         for (int i = 0; i < pps; i++) {
             struct nanovna_raw_datapoint *p = &data->point[i];
             
             // Console output
             if (args->verbose) {
+                double point_secs = ((double)estimate_point_time(data, i, pps) - (double)args->program_start_ns) / 1e9;
                 // Row 1: S11 Real
-                printf("%s %s %d %.6f %.6f %u S11 REAL %.10e\n",
-                    args->id_string, args->label, data->vna_id, send_secs, recv_secs, p->frequency, p->s11.re);
+                printf("%s %s %d %.9f %.9f %u S11 REAL %.10e %d %d %d %.9f\n",
+                    args->id_string, args->label, data->vna_id, send_secs, recv_secs, p->frequency, p->s11.re,
+                    data->scan_id, data->sweep, data->scan_index, point_secs);
                 // Row 2: S11 Imaginary
-                printf("%s %s %d %.6f %.6f %u S11 IMG %.10e\n",
-                    args->id_string, args->label, data->vna_id, send_secs, recv_secs, p->frequency, p->s11.im);
+                printf("%s %s %d %.9f %.9f %u S11 IMG %.10e %d %d %d %.9f\n",
+                    args->id_string, args->label, data->vna_id, send_secs, recv_secs, p->frequency, p->s11.im,
+                    data->scan_id, data->sweep, data->scan_index, point_secs);
                 // Row 3: S21 Real
-                printf("%s %s %d %.6f %.6f %u S21 REAL %.10e\n",
-                    args->id_string, args->label, data->vna_id, send_secs, recv_secs, p->frequency, p->s21.re);
+                printf("%s %s %d %.9f %.9f %u S21 REAL %.10e %d %d %d %.9f\n",
+                    args->id_string, args->label, data->vna_id, send_secs, recv_secs, p->frequency, p->s21.re,
+                    data->scan_id, data->sweep, data->scan_index, point_secs);
                 // Row 4: S21 Imaginary
-                printf("%s %s %d %.6f %.6f %u S21 IMG %.10e\n",
-                    args->id_string, args->label, data->vna_id, send_secs, recv_secs, p->frequency, p->s21.im);
+                printf("%s %s %d %.9f %.9f %u S21 IMG %.10e %d %d %d %.9f\n",
+                    args->id_string, args->label, data->vna_id, send_secs, recv_secs, p->frequency, p->s21.im,
+                    data->scan_id, data->sweep, data->scan_index, point_secs);
             }
             // Touchstone File Output
             if (f) {
@@ -332,9 +1427,47 @@ void* scan_consumer(void *arguments) {
             }
         }
 
+        if (args->archive && write_archive_scan(args->archive, data) != EXIT_SUCCESS) {
+            fprintf(stderr, "Warning: scans from here on are not archived\n");
+            args->archive = NULL;
+        }
+
+        stream_publish_scan(data, pps);
+
+        struct tdr_record record;
+        if (args->tdr && tdr_add_scan(args->tdr, data, &record)) {
+            write_tdr_record(args, &record);
+            stream_publish_tdr(&record);
+        }
+
+        struct peak_record peak;
+        if (args->peaks && peak_add_scan(args->peaks, data, &peak)) {
+            write_peak_record(args, &peak);
+            stream_publish_peak(&peak);
+        }
+
+        if (scan_id >= 0 && scan_id < MAX_ONGOING_SCANS) {
+            pthread_mutex_lock(&scan_state_lock);
+            scan_progresses[scan_id].scans_done++;
+            scan_progresses[scan_id].points_done += pps;
+            pthread_mutex_unlock(&scan_state_lock);
+        }
+
+        if (tracker) {
+            int nbr_events = track_sweep_record(tracker, data, events);
+            report_sweep_events(args, scan_id, events, nbr_events);
+        }
+
         free(data->point);
         free(data);
     }
+
+    if (tracker) {
+        int nbr_events = flush_sweep_tracker(tracker, events);
+        report_sweep_events(args, scan_id, events, nbr_events);
+        free(tracker);
+    }
+    get_thread_sched_stats(&args->sched_stats);
     return NULL;
 }
 
@@ -361,6 +1494,54 @@ FILE * create_touchstone_file(struct tm *tm_info, bool verbose) {
     return touchstone_file;
 }
 
+struct archive_writer * create_archive_file(struct tm *tm_info, const char *label, uint64_t start_ns, bool verbose) {
+    char filename[128];
+    strftime(filename, sizeof(filename), "vna_scan_at_%Y-%m-%d_%H-%M-%S.vnar", tm_info);
+
+    struct archive_writer *archive = malloc(sizeof(struct archive_writer));
+    if (!archive || open_archive_writer(archive, filename, label, start_ns) != EXIT_SUCCESS) {
+        fprintf(stderr, "Warning: Failed to open %s for writing. Scan will continue without archiving.\n", filename);
+        free(archive);
+        return NULL;
+    }
+    if (verbose)
+        printf("Archiving data to: %s\n", filename);
+    return archive;
+}
+
+FILE * create_tdr_file(struct tm *tm_info, TdrMode mode, TdrWindow window, bool verbose) {
+    char filename[128];
+    strftime(filename, sizeof(filename), "vna_scan_at_%Y-%m-%d_%H-%M-%S.tdr", tm_info);
+
+    FILE *tdr_file = fopen(filename, "w");
+    if (!tdr_file) {
+        fprintf(stderr, "Warning: Failed to open %s for writing. Scan will continue without saving time domain responses.\n", filename);
+    } else {
+        if (verbose)
+            printf("Saving time domain responses to: %s\n", filename);
+        fprintf(tdr_file, "! S11 %s responses from multi-VNA scan, %s window\n",
+            tdr_mode_name(mode), tdr_window_name(window));
+        fprintf(tdr_file, "! Each sweep: a line of its vna, sweep, send time, points and time step,\n");
+        fprintf(tdr_file, "! then one line per point of time in seconds, real, imaginary\n");
+    }
+    return tdr_file;
+}
+
+FILE * create_peak_file(struct tm *tm_info, bool verbose) {
+    char filename[128];
+    strftime(filename, sizeof(filename), "vna_scan_at_%Y-%m-%d_%H-%M-%S.peaks.csv", tm_info);
+
+    FILE *peak_file = fopen(filename, "w");
+    if (!peak_file) {
+        fprintf(stderr, "Warning: Failed to open %s for writing. Scan will continue without saving resonances.\n", filename);
+    } else {
+        if (verbose)
+            printf("Saving resonances to: %s\n", filename);
+        fprintf(peak_file, "vna,sweep,time_s,f0_hz,q,depth_db,level_db\n");
+    }
+    return peak_file;
+}
+
 //----------------------------------------
 // Scan State Logic
 //----------------------------------------
@@ -375,12 +1556,24 @@ FILE * create_touchstone_file(struct tm *tm_info, bool verbose) {
 #define STATIC static
 #endif
 
+/**
+ * Sets up scan_finished_cond to time out on the monotonic clock
+ */
+static void initialise_finished_cond(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&scan_finished_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
 /**
  * Initialises scan state arrays if they are not already initialised.
- * 
+ *
  * @return EXIT_SUCCESS on success, error code on failure
  */
 STATIC int initialise_scan_state() {
+    pthread_once(&scan_finished_once, initialise_finished_cond);
     pthread_mutex_lock(&scan_state_lock);
     if (scan_states == NULL) {
         ongoing_scans = 0;
@@ -444,6 +1637,10 @@ STATIC int initialise_scan() {
         return -1;
     }
     scan_states[scan_id] = 0;
+    scan_finished[scan_id] = false;
+    scan_joining[scan_id] = false;
+    atomic_store(&scan_cancelled[scan_id], false);
+    scan_generation[scan_id]++;
     ongoing_scans++;
 
     pthread_mutex_unlock(&scan_state_lock);
@@ -458,8 +1655,35 @@ STATIC int initialise_scan() {
 STATIC void destroy_scan(int scan_id) {
     pthread_mutex_lock(&scan_state_lock);
     scan_states[scan_id] = -1;
+    scan_joining[scan_id] = false;
+    memset(scan_vnas[scan_id], 0, sizeof(scan_vnas[scan_id]));
     ongoing_scans--;
+    pthread_cond_broadcast(&scan_finished_cond);
+    pthread_mutex_unlock(&scan_state_lock);
+}
+
+/**
+ * Gives a new sweep its VNAs, unless another sweep is already using one
+ * of them (they would read each other's replies, and stopping either
+ * would interrupt both).
+ * 
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if a VNA is already in a sweep
+ */
+static int claim_sweep_vnas(int scan_id, int nbr_vnas, const int *vna_list) {
+    pthread_mutex_lock(&scan_state_lock);
+    for (int i = 0; i < nbr_vnas; i++) {
+        for (int other = 0; other < MAX_ONGOING_SCANS; other++) {
+            if (other != scan_id && scan_vnas[other][vna_list[i]]) {
+                fprintf(stderr, "VNA %d is already in sweep %d\n", vna_list[i], other);
+                pthread_mutex_unlock(&scan_state_lock);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    for (int i = 0; i < nbr_vnas; i++)
+        scan_vnas[scan_id][vna_list[i]] = true;
     pthread_mutex_unlock(&scan_state_lock);
+    return EXIT_SUCCESS;
 }
 
 bool is_running(int scan_id) {
@@ -510,19 +1734,273 @@ struct run_sweep_args {
     int pps;
     const char *user_label;
     bool verbose;
+    struct sweep_options options;
+};
+
+//----------------------------------------
+// Sweep Timers
+//----------------------------------------
+
+/**
+ * When a sweep is next due to start and when its time is up, in
+ * CLOCK_MONOTONIC ns. Indexed by scan_id, guarded by timer_lock.
+ */
+struct sweep_timer {
+    bool armed;
+    struct task_scheduler *sched;   // ticked at each start time, or NULL
+    uint64_t next_ns;               // next start time, or 0 if none
+    uint64_t period_ns;             // between start times, or 0 for just one
+    uint64_t end_ns;                // when the sweep's time is up, or 0 for never
 };
-void* run_sweep(void* arguments){
+static struct sweep_timer sweep_timers[MAX_ONGOING_SCANS];
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;   // signalled whenever a timer is armed or disarmed
+static pthread_once_t timer_once = PTHREAD_ONCE_INIT;
+
+static uint64_t timer_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Ends a sweep whose time is up, as stop_sweep would but without waiting
+ * for it. Called with timer_lock held.
+ */
+static void expire_sweep_timer(int scan_id) {
+    struct sweep_timer *timer = &sweep_timers[scan_id];
+    pthread_mutex_lock(&scan_state_lock);
+    if (scan_states[scan_id] > 0)
+        scan_states[scan_id] = 0;
+    pthread_mutex_unlock(&scan_state_lock);
+    if (timer->sched)
+        close_task_scheduler(timer->sched);
+    timer->armed = false;
+    printf("---\ntimer done\n---\n");
+}
+
+/**
+ * Runs every sweep's timer, sleeping until the earliest is next due
+ */
+static void* sweep_timer_thread(void *arguments) {
+    (void)arguments;
+    pthread_mutex_lock(&timer_lock);
+    while (true) {
+        uint64_t now = timer_now_ns();
+        uint64_t wake = UINT64_MAX;
+        for (int i = 0; i < MAX_ONGOING_SCANS; i++) {
+            struct sweep_timer *timer = &sweep_timers[i];
+            if (!timer->armed)
+                continue;
+            if (timer->end_ns && now >= timer->end_ns) {
+                expire_sweep_timer(i);
+                continue;
+            }
+            if (timer->next_ns && now >= timer->next_ns) {
+                if (timer->sched)
+                    tick_task_scheduler(timer->sched);
+                if (timer->period_ns) {
+                    // stay on the grid, skipping start times already passed,
+                    // so waking late never pushes back the sweeps after
+                    timer->next_ns += timer->period_ns * ((now - timer->next_ns) / timer->period_ns + 1);
+                } else {
+                    // a delayed start, after which sweeps follow each other straight away
+                    if (timer->sched)
+                        pace_task_scheduler(timer->sched, false);
+                    timer->next_ns = 0;
+                }
+            }
+            if (timer->next_ns && timer->next_ns < wake)
+                wake = timer->next_ns;
+            if (timer->end_ns && timer->end_ns < wake)
+                wake = timer->end_ns;
+        }
+
+        if (wake == UINT64_MAX) {
+            pthread_cond_wait(&timer_cond, &timer_lock);
+        } else {
+            struct timespec deadline = {wake / 1000000000ULL, wake % 1000000000ULL};
+            pthread_cond_timedwait(&timer_cond, &timer_lock, &deadline);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Starts the timer thread, which runs for the rest of the program
+ */
+static void initialise_sweep_timers(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_t thread;
+    int error = pthread_create(&thread, NULL, &sweep_timer_thread, NULL);
+    if (error != 0)
+        fprintf(stderr, "Error %i creating sweep timer thread: %s\n", error, strerror(error));
+    else
+        pthread_detach(thread);
+}
+
+int arm_sweep_timer(int scan_id, struct task_scheduler *sched, uint64_t start_delay_ns, uint64_t period_ns, uint64_t duration_ns) {
+    if (scan_id < 0 || scan_id >= MAX_ONGOING_SCANS)
+        return EXIT_FAILURE;
+    pthread_once(&timer_once, initialise_sweep_timers);
+
+    // paced before any worker can release a sweep unasked
+    bool paced = sched && (start_delay_ns > 0 || period_ns > 0);
+    if (paced)
+        pace_task_scheduler(sched, true);
+
+    uint64_t first_ns = timer_now_ns() + start_delay_ns;
+    pthread_mutex_lock(&timer_lock);
+    sweep_timers[scan_id] = (struct sweep_timer){
+        true,
+        sched,
+        paced ? first_ns : 0,
+        period_ns,
+        duration_ns ? first_ns + duration_ns : 0
+    };
+    pthread_cond_signal(&timer_cond);
+    pthread_mutex_unlock(&timer_lock);
+    return EXIT_SUCCESS;
+}
+
+void disarm_sweep_timer(int scan_id) {
+    if (scan_id < 0 || scan_id >= MAX_ONGOING_SCANS)
+        return;
+    pthread_mutex_lock(&timer_lock);
+    sweep_timers[scan_id].armed = false;
+    sweep_timers[scan_id].sched = NULL;
+    pthread_cond_signal(&timer_cond);
+    pthread_mutex_unlock(&timer_lock);
+}
+
+/**
+ * Frees the calibrations made for a sweep by plan_vna_calibration
+ */
+static void free_calibrations(struct calibration **calibrations) {
+    for (int i = 0; i < MAXIMUM_VNA_PORTS; i++) {
+        if (calibrations[i]) {
+            destroy_calibration(calibrations[i]);
+            free(calibrations[i]);
+        }
+    }
+}
+
+/**
+ * Sets up the time domain stage a sweep's options ask for, and its file
+ *
+ * @return the stage (allocated with malloc), or NULL if there isn't one
+ */
+static struct tdr_stage * open_tdr_stage(struct run_sweep_args *args, const struct sweep_plan *plan,
+                                         struct tm *tm_info, FILE **tdr_file) {
+    *tdr_file = NULL;
+    if (args->options.tdr == TDR_OFF)
+        return NULL;
+    if (args->options.share_bands) {
+        fprintf(stderr, "Warning: time domain responses need each VNA to sweep every band, not shared bands. Scan will continue without them.\n");
+        return NULL;
+    }
+    struct tdr_stage *stage = malloc(sizeof(struct tdr_stage));
+    if (!stage) {
+        fprintf(stderr, "Failed to allocate memory for time domain stage\n");
+        return NULL;
+    }
+    if (init_tdr_stage(stage, plan, args->options.tdr, args->options.tdr_window) != EXIT_SUCCESS) {
+        fprintf(stderr, "Warning: Scan will continue without time domain responses.\n");
+        free(stage);
+        return NULL;
+    }
+    *tdr_file = create_tdr_file(tm_info, args->options.tdr, args->options.tdr_window, args->verbose);
+    return stage;
+}
+
+/**
+ * Frees a stage made by open_tdr_stage and closes its file, if there are any
+ */
+static void close_tdr_stage(struct tdr_stage *stage, FILE *tdr_file) {
+    if (tdr_file)
+        fclose(tdr_file);
+    if (stage) {
+        destroy_tdr_stage(stage);
+        free(stage);
+    }
+}
+
+/**
+ * Sets up the resonance tracker a sweep's options ask for, and its file
+ *
+ * @return the tracker (allocated with malloc), or NULL if there isn't one
+ */
+static struct peak_tracker * open_peak_tracker(struct run_sweep_args *args, const struct sweep_plan *plan,
+                                               struct tm *tm_info, FILE **peak_file) {
+    *peak_file = NULL;
+    if (args->options.peak == PEAK_OFF)
+        return NULL;
+    if (args->options.share_bands) {
+        fprintf(stderr, "Warning: tracking resonances needs each VNA to sweep every band, not shared bands. Scan will continue without it.\n");
+        return NULL;
+    }
+    struct peak_tracker *tracker = malloc(sizeof(struct peak_tracker));
+    if (!tracker) {
+        fprintf(stderr, "Failed to allocate memory for resonance tracker\n");
+        return NULL;
+    }
+    if (init_peak_tracker(tracker, plan, args->options.peak, args->options.peak_window) != EXIT_SUCCESS) {
+        fprintf(stderr, "Warning: Scan will continue without tracking resonances.\n");
+        free(tracker);
+        return NULL;
+    }
+    *peak_file = create_peak_file(tm_info, args->verbose);
+    return tracker;
+}
+
+/**
+ * Frees a tracker made by open_peak_tracker and closes its file, if there are any
+ */
+static void close_peak_tracker(struct peak_tracker *tracker, FILE *peak_file) {
+    if (peak_file)
+        fclose(peak_file);
+    if (tracker) {
+        destroy_peak_tracker(tracker);
+        free(tracker);
+    }
+}
+
+/**
+ * Closes and frees an archive made by create_archive_file, if there is one
+ */
+static void close_archive_file(struct archive_writer *archive) {
+    if (archive) {
+        close_archive_writer(archive);
+        free(archive);
+    }
+}
+
+/**
+ * Runs a sweep from start to finish: sets up its plan, buffer and
+ * scheduler, runs its producers and consumer until they are done,
+ * then frees everything including arguments
+ */
+static void* conduct_sweep(void* arguments){
 
     struct run_sweep_args *args = (struct run_sweep_args*)arguments;
 
     int error;
 
-    struct timeval program_start_time;
-    gettimeofday(&program_start_time, NULL);
+    uint64_t program_start_ns = monotonic_ns();
     time_t now = time(NULL);
     struct tm *tm_info = localtime(&now);
 
-    FILE* touchstone_file = create_touchstone_file(tm_info,args->verbose);
+    FILE* touchstone_file = NULL;
+    if (args->options.output == OUTPUT_TOUCHSTONE || args->options.output == OUTPUT_BOTH)
+        touchstone_file = create_touchstone_file(tm_info,args->verbose);
+    struct archive_writer *archive = NULL;
+    if (args->options.output == OUTPUT_ARCHIVE || args->options.output == OUTPUT_BOTH)
+        archive = create_archive_file(tm_info, args->user_label, program_start_ns, args->verbose);
     char id_string[64];
     strftime(id_string, sizeof(id_string), "%Y%m%d_%H%M%S", tm_info);
 
@@ -531,25 +2009,86 @@ void* run_sweep(void* arguments){
     if (!bb) {
         fprintf(stderr, "Failed to allocate memory for bounded buffer construct\n");
         free(args->vna_list);
+        free((void*)args->options.segments);
+        close_archive_file(archive);
         free(arguments);
         return NULL;
     }
-    error = create_bounded_buffer(bb,args->nbr_vnas);
+    int capacity = args->options.buffer_capacity;
+    if (args->options.buffer_mb > 0)
+        capacity = buffer_capacity_for_budget((size_t)args->options.buffer_mb << 20, args->pps);
+    error = create_bounded_buffer_with_policy(bb, args->pps, capacity, args->options.buffer_policy);
     if (error != 0) {
         fprintf(stderr, "Failed to create bounded buffer\n");
         free(bb);
         free(args->vna_list);
+        free((void*)args->options.segments);
+        close_archive_file(archive);
+        free(arguments);
+        return NULL;
+    }
+
+    struct sweep_plan plan;
+    if (args->options.nbr_segments > 0) {
+        error = create_segmented_sweep_plan(&plan, args->options.segments, args->options.nbr_segments, args->pps);
+        args->nbr_scans = plan.nbr_scans;
+    } else if (args->options.nbr_points > 0) {
+        error = create_sweep_plan_points(&plan, args->start, args->stop, args->options.nbr_points, args->pps);
+        args->nbr_scans = plan.nbr_scans;
+    } else {
+        error = create_sweep_plan(&plan, args->start, args->stop, args->nbr_scans, args->pps);
+    }
+    if (error != 0) {
+        fprintf(stderr, "Failed to create sweep plan\n");
+        destroy_bounded_buffer(bb);
+        free(args->vna_list);
+        free((void*)args->options.segments);
+        close_archive_file(archive);
+        free(arguments);
+        return NULL;
+    }
+
+    struct task_scheduler sched;
+    error = create_task_scheduler(&sched, args->nbr_vnas, args->options.share_bands, &plan,
+                                  args->sweep_mode == NUM_SWEEPS ? args->sweeps : -1);
+    if (error != 0) {
+        fprintf(stderr, "Failed to create task scheduler\n");
+        destroy_sweep_plan(&plan);
+        destroy_bounded_buffer(bb);
+        free(args->vna_list);
+        free((void*)args->options.segments);
+        close_archive_file(archive);
         free(arguments);
         return NULL;
     }
 
+    struct scan_progress progress = {args->sweep_mode, args->sweeps, args->nbr_vnas, {0}, args->options.share_bands,
+                                      plan.nbr_scans, plan.nbr_points, monotonic_ns(), 0, 0};
+    memcpy(progress.vna_list, args->vna_list, sizeof(int) * args->nbr_vnas);
     pthread_mutex_lock(&scan_state_lock);
     scan_states[args->scan_id] = args->nbr_vnas;
+    scan_buffers[args->scan_id] = bb;
+    scan_schedulers[args->scan_id] = &sched;
+    scan_progresses[args->scan_id] = progress;
     pthread_mutex_unlock(&scan_state_lock);
+
+    // a start time in the past just means straight away
+    uint64_t start_delay_ns = 0;
+    if (args->options.start_at > 0) {
+        double delay = difftime(args->options.start_at, time(NULL));
+        if (delay > 0)
+            start_delay_ns = (uint64_t)(delay * 1e9);
+    }
+    uint64_t duration_ns = 0;
+    if (args->sweep_mode == TIME)
+        duration_ns = args->sweeps > 0 ? (uint64_t)args->sweeps * 1000000000ULL : 1;
+    arm_sweep_timer(args->scan_id, &sched, start_delay_ns,
+                    (uint64_t)args->options.period_ms * 1000000ULL, duration_ns);
     
 
     struct scan_producer_args producer_args[args->nbr_vnas];
     pthread_t producers[args->nbr_vnas];
+    bool producer_started[args->nbr_vnas];
     for (int i = 0; i < args->nbr_vnas; i++) {
         producer_args[i].scan_id = args->scan_id;
         producer_args[i].vna_id = args->vna_list[i];
@@ -558,18 +2097,41 @@ void* run_sweep(void* arguments){
         producer_args[i].stop = args->stop;
         producer_args[i].nbr_sweeps = args->sweeps;
         producer_args[i].bfr = bb;
-
-        if (args->sweep_mode == NUM_SWEEPS) {
-            error = pthread_create(&producers[i], NULL, &scan_producer, &producer_args[i]);
-        } else {
-            error = pthread_create(&producers[i], NULL, &sweep_producer, &producer_args[i]);
-        }
-
+        producer_args[i].sched = &sched;
+        producer_args[i].worker = i;
+        producer_args[i].retries = args->options.retries;
+        producer_args[i].sync = args->options.sync;
+        producer_args[i].scans_pulled = 0;
+        producer_args[i].sched_stats = (struct thread_sched_stats){0};
+
+        error = create_placed_thread(&producers[i], args->sweep_mode == NUM_SWEEPS ? &scan_producer : &sweep_producer,
+                                     &producer_args[i], nth_cpu(args->options.producer_cpus, i),
+                                     args->options.rt_priority);
+
+        producer_started[i] = error == 0;
         if(error != 0){
             fprintf(stderr, "Error %i creating producer thread %d: %s\n", errno, i, strerror(errno));
+            // finish up for it, so the others still know when they are the last
+            if (args->sweep_mode == NUM_SWEEPS) {
+                pthread_mutex_lock(&scan_state_lock);
+                --scan_states[args->scan_id];
+                pthread_mutex_unlock(&scan_state_lock);
+            }
+            if (atomic_fetch_sub(&sched.active_workers, 1) == 1)
+                mark_buffer_complete(bb);
         }
     }
 
+    // each VNA's calibration is fixed for the whole sweep, on the sweep's grid
+    struct calibration *calibrations[MAXIMUM_VNA_PORTS] = {NULL};
+    for (int i = 0; i < args->nbr_vnas; i++)
+        calibrations[args->vna_list[i]] = plan_vna_calibration(args->vna_list[i], &plan);
+
+    FILE *tdr_file;
+    struct tdr_stage *tdr = open_tdr_stage(args, &plan, tm_info, &tdr_file);
+    FILE *peak_file;
+    struct peak_tracker *peaks = open_peak_tracker(args, &plan, tm_info, &peak_file);
+
     pthread_t consumer;
     struct scan_consumer_args consumer_args = {
         bb, 
@@ -577,32 +2139,62 @@ void* run_sweep(void* arguments){
         id_string,
         (char*)args->user_label,
         args->verbose,
-        program_start_time
+        program_start_ns,
+        &plan,
+        args->options.share_bands,
+        calibrations,
+        archive,
+        tdr,
+        tdr_file,
+        peaks,
+        peak_file,
+        {0}
     };
-    error = pthread_create(&consumer, NULL, &scan_consumer, &consumer_args);
+    error = create_placed_thread(&consumer, &scan_consumer, &consumer_args, args->options.consumer_cpus, 0);
     if(error != 0){
         fprintf(stderr, "Error %i creating consumer thread: %s\n", errno, strerror(errno));
+        // the producers are already running, so stop them before freeing what they use
+        disarm_sweep_timer(args->scan_id);
+        atomic_store(&scan_cancelled[args->scan_id], true);
+        close_task_scheduler(&sched);
+        // with nothing taking scans, producers would block on a full buffer
+        struct datapoint_nanoVNA_H *data;
+        while ((data = take_buff(bb)) != NULL)
+            free_datapoint(data);
+        for (int i = 0; i < args->nbr_vnas; i++) {
+            if (producer_started[i])
+                pthread_join(producers[i], NULL);
+        }
+        pthread_mutex_lock(&scan_state_lock);
+        scan_buffers[args->scan_id] = NULL;
+        scan_schedulers[args->scan_id] = NULL;
+        pthread_mutex_unlock(&scan_state_lock);
+
+        if (touchstone_file)
+            fclose(touchstone_file);
+        free_calibrations(calibrations);
+        close_tdr_stage(tdr, tdr_file);
+        close_peak_tracker(peaks, peak_file);
+        destroy_task_scheduler(&sched);
+        destroy_sweep_plan(&plan);
         destroy_bounded_buffer(bb);
         free(args->vna_list);
+        free((void*)args->options.segments);
+        close_archive_file(archive);
         free(arguments);
         return NULL;
     }
 
-    if (args->sweep_mode == TIME) {
-        sleep(args->sweeps);
-        pthread_mutex_lock(&scan_state_lock);
-        scan_states[args->scan_id] = args->nbr_vnas;
-        pthread_mutex_unlock(&scan_state_lock);
-        printf("---\ntimer done\n---\n");
-    }
-
     // wait for threads to finish
 
     for(int i = 0; i < args->nbr_vnas; i++) {
+        if (!producer_started[i])
+            continue;
         error = pthread_join(producers[i], NULL);
         if(error != 0)
             printf("Error %i from join producer:\n", errno);
     }
+    disarm_sweep_timer(args->scan_id);
 
     error = pthread_join(consumer,NULL);
     if(error != 0)
@@ -612,31 +2204,108 @@ void* run_sweep(void* arguments){
     if (touchstone_file) {
         fclose(touchstone_file);
     }
+    if (archive && args->verbose && archive->raw_bytes > 0) {
+        printf("Sweep %d archived %ld scans in %.2f MiB, %.1f times smaller than their %.2f MiB of readings\n",
+            args->scan_id, archive->scans, archive->archive_bytes / 1048576.0,
+            (double)archive->raw_bytes / archive->archive_bytes, archive->raw_bytes / 1048576.0);
+    }
+    close_archive_file(archive);
+    if (tdr && args->verbose && tdr->transforms > 0) {
+        printf("Sweep %d transformed %ld sweeps to the time domain in %.1f us each (longest %.1f us), %ld incomplete sweeps skipped\n",
+            args->scan_id, tdr->transforms, tdr->transform_ns / 1e3 / tdr->transforms,
+            tdr->longest_ns / 1e3, tdr->abandoned);
+    }
+    close_tdr_stage(tdr, tdr_file);
+    if (peaks && args->verbose && peaks->records > 0) {
+        printf("Sweep %d tracked %ld resonances, %ld searching the whole sweep, %.1f points examined per sweep of %d, %ld incomplete sweeps skipped\n",
+            args->scan_id, peaks->records, peaks->full_searches, (double)peaks->points_examined / peaks->records,
+            plan.nbr_points, peaks->abandoned);
+    }
+    close_peak_tracker(peaks, peak_file);
 
     // finish up
+    pthread_mutex_lock(&scan_state_lock);
+    scan_buffers[args->scan_id] = NULL;
+    scan_schedulers[args->scan_id] = NULL;
+    pthread_mutex_unlock(&scan_state_lock);
+
+    struct buffer_stats stats;
+    get_buffer_stats(bb, &stats);
+    if (args->verbose || stats.peak == stats.capacity) {
+        printf("Sweep %d buffer peaked at %d of %d scans (%.1f of %.1f MiB), VNAs waited %ld times for %.3f s\n",
+            args->scan_id, stats.peak, stats.capacity, stats.peak * stats.scan_bytes / 1048576.0,
+            stats.capacity * stats.scan_bytes / 1048576.0, stats.blocked, stats.blocked_ns / 1e9);
+    }
+    if (args->verbose || args->options.producer_cpus || args->options.consumer_cpus || args->options.rt_priority > 0) {
+        long total_scans = 0;
+        for (int i = 0; i < args->nbr_vnas; i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "producer for vna %d", producer_args[i].vna_id);
+            report_thread_sched(args->scan_id, name, &producer_args[i].sched_stats, producer_args[i].scans_pulled);
+            total_scans += producer_args[i].scans_pulled;
+        }
+        report_thread_sched(args->scan_id, "consumer", &consumer_args.sched_stats, total_scans);
+    }
+    if (sched.missed > 0) {
+        printf("Sweep %d missed %ld start times, its sweeps took longer than the %d ms period\n",
+            args->scan_id, sched.missed, args->options.period_ms);
+    }
+    if (stats.dropped_oldest || stats.dropped_newest || stats.spilled || stats.spill_lost) {
+        printf("Sweep %d fell behind: %ld scans dropped, %ld spilled to disk, %ld lost from the spill file\n",
+            args->scan_id, stats.dropped_oldest + stats.dropped_newest, stats.spilled, stats.spill_lost);
+    }
+
+    free_calibrations(calibrations);
+    destroy_task_scheduler(&sched);
+    destroy_sweep_plan(&plan);
     destroy_bounded_buffer(bb);
     free(args->vna_list);
+    free((void*)args->options.segments);
     free(arguments);
 
     return NULL;
 }
 
-int start_sweep(int nbr_vnas, int* vna_list, int nbr_scans, int start, int stop, SweepMode sweep_mode, int sweeps, int pps, const char* user_label, bool verbose) {
+void* run_sweep(void* arguments) {
+    int scan_id = ((struct run_sweep_args*)arguments)->scan_id;
+
+    conduct_sweep(arguments);
+
+    pthread_mutex_lock(&scan_state_lock);
+    scan_finished[scan_id] = true;
+    pthread_cond_broadcast(&scan_finished_cond);
+    pthread_mutex_unlock(&scan_state_lock);
+    return NULL;
+}
+
+int start_sweep(int nbr_vnas, int* vna_list, int nbr_scans, int start, int stop, SweepMode sweep_mode, int sweeps, int pps, const char* user_label, bool verbose, const struct sweep_options *options) {
 
     if (nbr_vnas < 1) {
         fprintf(stderr, "No VNAs!\n");
         return -2;
     }
 
+    for (int i = 0; i < nbr_vnas; i++) {
+        if (vna_list[i] < 0 || vna_list[i] >= MAXIMUM_VNA_PORTS) {
+            fprintf(stderr, "No VNA %d\n", vna_list[i]);
+            return -2;
+        }
+    }
+
     int scan_id = initialise_scan();
 
     if (scan_id < 0) {
         return scan_id;
     }
+    if (claim_sweep_vnas(scan_id, nbr_vnas, vna_list) != EXIT_SUCCESS) {
+        destroy_scan(scan_id);
+        return -1;
+    }
 
     struct run_sweep_args *args = malloc(sizeof(struct run_sweep_args));
     if (!args) {
         fprintf(stderr, "failed to allocate memory for arguments");
+        destroy_scan(scan_id);
         return -1;
     }
     args->scan_id = scan_id;
@@ -650,6 +2319,24 @@ int start_sweep(int nbr_vnas, int* vna_list, int nbr_scans, int start, int stop,
     args->pps = pps;
     args->user_label = user_label;
     args->verbose = verbose;
+    if (options)
+        args->options = *options;
+    else
+        args->options = (struct sweep_options){false, DEFAULT_SCAN_RETRIES, true, N, BUFFER_BLOCK, 0, NULL, 0, 0, 0, 0, 0, 0, 0, OUTPUT_TOUCHSTONE, TDR_OFF, TDR_HANN, PEAK_OFF, 0};
+    if (args->options.nbr_segments > 0) {
+        // the caller's segments may change once this returns
+        struct sweep_segment *segments = malloc(sizeof(struct sweep_segment) * args->options.nbr_segments);
+        if (!segments) {
+            fprintf(stderr, "failed to allocate memory for sweep segments");
+            free(args);
+            destroy_scan(scan_id);
+            return -1;
+        }
+        memcpy(segments, args->options.segments, sizeof(struct sweep_segment) * args->options.nbr_segments);
+        args->options.segments = segments;
+    } else {
+        args->options.segments = NULL;
+    }
 
     pthread_mutex_lock(&scan_state_lock);
     pthread_create(&scan_threads[scan_id],NULL,&run_sweep,args);
@@ -658,7 +2345,117 @@ int start_sweep(int nbr_vnas, int* vna_list, int nbr_scans, int start, int stop,
     return scan_id;
 }
 
+int get_sweep_buffer_stats(int scan_id, struct buffer_stats *stats) {
+    if (scan_id < 0 || scan_id >= MAX_ONGOING_SCANS)
+        return EXIT_FAILURE;
+    pthread_mutex_lock(&scan_state_lock);
+    struct bounded_buffer *bb = scan_buffers[scan_id];
+    if (bb)
+        get_buffer_stats(bb, stats);
+    pthread_mutex_unlock(&scan_state_lock);
+    return bb ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int get_scan_progress(int scan_id, struct scan_progress *progress) {
+    if (scan_id < 0 || scan_id >= MAX_ONGOING_SCANS)
+        return EXIT_FAILURE;
+    pthread_mutex_lock(&scan_state_lock);
+    bool running = scan_buffers[scan_id] != NULL;
+    if (running)
+        *progress = scan_progresses[scan_id];
+    pthread_mutex_unlock(&scan_state_lock);
+    return running ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int predict_scan_remaining(const struct scan_progress *progress, uint64_t now_ns, double *remaining_ns) {
+    if (progress->mode == TIME) {
+        double end_ns = progress->start_ns + progress->sweeps * 1e9;
+        *remaining_ns = end_ns > now_ns ? end_ns - now_ns : 0;
+        return EXIT_SUCCESS;
+    }
+    if (progress->mode != NUM_SWEEPS || progress->scans_per_sweep < 1)
+        return EXIT_FAILURE;
+    long total = (long)progress->sweeps * progress->scans_per_sweep * (progress->share_bands ? 1 : progress->nbr_vnas);
+    long left = total - progress->scans_done;
+    if (left < 0)
+        left = 0;
+    *remaining_ns = predict_scans_ns(progress->vna_list, progress->nbr_vnas, progress->share_bands, left,
+                                     (double)progress->points_per_sweep / progress->scans_per_sweep);
+    // the VNAs may not be what's holding the sweep back, so don't predict faster than it has gone
+    if (progress->scans_done > 0 && now_ns > progress->start_ns) {
+        double so_far_ns = (double)(now_ns - progress->start_ns) / progress->scans_done * left;
+        if (so_far_ns > *remaining_ns)
+            *remaining_ns = so_far_ns;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Waits, with scan_state_lock held, for the sweep in scan_id's slot to
+ * finish or to be replaced by a later one
+ *
+ * @param generation set to the generation of the sweep waited for
+ * @return EXIT_SUCCESS once it has finished or been replaced, ETIMEDOUT
+ *  if it is still going after timeout_secs, or -1 if there is no such sweep
+ */
+static int await_sweep_locked(int scan_id, double timeout_secs, unsigned *generation) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (timeout_secs > 0) {
+        uint64_t ns = deadline.tv_nsec + (uint64_t)(timeout_secs * 1e9);
+        deadline.tv_sec += ns / 1000000000;
+        deadline.tv_nsec = ns % 1000000000;
+    }
+
+    if (scan_states[scan_id] == -1)
+        return -1;
+    *generation = scan_generation[scan_id];
+    int error = 0;
+    while (!scan_finished[scan_id] && scan_generation[scan_id] == *generation && error != ETIMEDOUT) {
+        if (timeout_secs < 0)
+            pthread_cond_wait(&scan_finished_cond, &scan_state_lock);
+        else
+            error = pthread_cond_timedwait(&scan_finished_cond, &scan_state_lock, &deadline);
+    }
+    // a sweep stopped and replaced while waiting has finished too
+    bool finished = scan_finished[scan_id] || scan_generation[scan_id] != *generation;
+    return finished ? EXIT_SUCCESS : ETIMEDOUT;
+}
+
+int wait_sweep(int scan_id, double timeout_secs) {
+    if (scan_states == NULL || scan_id < 0 || scan_id >= MAX_ONGOING_SCANS)
+        return -1;
+
+    unsigned generation;
+    pthread_mutex_lock(&scan_state_lock);
+    int error = await_sweep_locked(scan_id, timeout_secs, &generation);
+    pthread_mutex_unlock(&scan_state_lock);
+    return error;
+}
+
+int collect_sweep(int scan_id, double timeout_secs) {
+    if (scan_states == NULL || scan_id < 0 || scan_id >= MAX_ONGOING_SCANS)
+        return -1;
+
+    unsigned generation;
+    pthread_mutex_lock(&scan_state_lock);
+    int error = await_sweep_locked(scan_id, timeout_secs, &generation);
+    // a later sweep in the slot, or one already being stopped, is not ours to free
+    bool claimed = error == EXIT_SUCCESS && scan_generation[scan_id] == generation && !scan_joining[scan_id];
+    if (claimed)
+        scan_joining[scan_id] = true;
+    pthread_mutex_unlock(&scan_state_lock);
+
+    if (claimed) {
+        pthread_join(scan_threads[scan_id], NULL);
+        destroy_scan(scan_id);
+    }
+    return error;
+}
+
 int stop_sweep(int scan_id) {
+    if (scan_id < 0 || scan_id >= MAX_ONGOING_SCANS)
+        return -1;
     pthread_mutex_lock(&scan_state_lock);
     if (scan_states == NULL) {
         fprintf(stderr, "Scan array not initialised\n");
@@ -670,11 +2467,38 @@ int stop_sweep(int scan_id) {
         pthread_mutex_unlock(&scan_state_lock);
         return -1;
     }
+    if (scan_joining[scan_id]) {
+        // only one caller may join the thread, the rest wait for it to free the id
+        unsigned generation = scan_generation[scan_id];
+        while (scan_joining[scan_id] && scan_generation[scan_id] == generation)
+            pthread_cond_wait(&scan_finished_cond, &scan_state_lock);
+        pthread_mutex_unlock(&scan_state_lock);
+        return EXIT_SUCCESS;
+    }
 
+    scan_joining[scan_id] = true;
     scan_states[scan_id] = 0;
+    atomic_store(&scan_cancelled[scan_id], true);
+    // wakes any producer waiting for its next start time
+    if (scan_schedulers[scan_id])
+        close_task_scheduler(scan_schedulers[scan_id]);
+    // no other sweep uses these VNAs, so interrupting them only touches this one
+    int nbr_vnas = 0;
+    int vna_list[MAXIMUM_VNA_PORTS];
+    for (int vna_id = 0; vna_id < MAXIMUM_VNA_PORTS; vna_id++) {
+        if (scan_vnas[scan_id][vna_id])
+            vna_list[nbr_vnas++] = vna_id;
+    }
     pthread_mutex_unlock(&scan_state_lock);
 
+    // wake any producer blocked waiting for a VNA, rather than letting it time out
+    for (int i = 0; i < nbr_vnas; i++)
+        interrupt_vna(vna_list[i]);
+
     pthread_join(scan_threads[scan_id], NULL);
+    // a producer that had already finished never saw its interrupt
+    for (int i = 0; i < nbr_vnas; i++)
+        clear_vna_interrupt(vna_list[i]);
     destroy_scan(scan_id);
     
     return EXIT_SUCCESS;
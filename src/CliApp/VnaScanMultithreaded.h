@@ -5,6 +5,7 @@
 #define _DEFAULT_SOURCE
 
 #include "VnaCommunication.h"
+#include "VnaSweepPlan.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,7 +25,8 @@
 #include <sys/time.h>
 
 #define MASK 135 // mask passed to VNAs, defining how to format output
-#define N 100 // size of bounded buffer
+#define N 100 // default capacity of bounded buffer
+#define MAX_BUFFER_CAPACITY 100000
 #define MAX_ONGOING_SCANS 5
 
 //----------------------------------------
@@ -55,7 +57,14 @@ struct nanovna_raw_datapoint {
  */
 struct datapoint_nanoVNA_H {
     int vna_id;                               // Which VNA produced this data
-    struct timeval send_time, receive_time;   // Time information
+    int scan_id;                              // Which scan (sweep set) this data is part of
+    int sweep;                                // Sweep number within the scan, from 0
+    int scan_index;                           // Sub-band index within the sweep, from 0
+    uint64_t send_ns;                         // monotonic_ns() when the scan command was written
+    uint64_t header_ns;                       // monotonic_ns() when the binary header arrived
+    uint64_t receive_ns;                      // monotonic_ns() when the last byte arrived
+    double sweep_ns_per_point;                // the VNA's estimated sweep time per point (0 if unknown)
+    int pps;                                  // Number of datapoints in point
     struct nanovna_raw_datapoint *point;      // Array of measurement datapoints
 };
 
@@ -63,23 +72,69 @@ struct datapoint_nanoVNA_H {
 // Bounded Buffer Logic
 //----------------------------------------
 
+/**
+ * What add_buff does when the buffer is full
+ *
+ * BUFFER_BLOCK       - (default) waits for the consumer to take something,
+ *                      slowing the producers down to the consumer's pace
+ * BUFFER_DROP_OLDEST - frees the oldest scan waiting in the buffer to make room
+ * BUFFER_DROP_NEWEST - frees the scan being added
+ * BUFFER_SPILL       - appends the scan to an overflow file on disk, which is
+ *                      read back into the buffer, in order, as room frees up
+ */
+typedef enum {
+    BUFFER_BLOCK,
+    BUFFER_DROP_OLDEST,
+    BUFFER_DROP_NEWEST,
+    BUFFER_SPILL
+} BufferPolicy;
+
+/**
+ * Counters kept by a bounded buffer
+ */
+struct buffer_stats {
+    int capacity;               // scans the buffer holds in memory
+    size_t scan_bytes;          // memory used by each scan waiting in the buffer
+    BufferPolicy policy;
+    int queued;                 // scans waiting in memory now
+    int peak;                   // most scans ever waiting in memory
+    long added;                 // scans passed to add_buff
+    long blocked;               // times add_buff waited for room
+    uint64_t blocked_ns;        // total time add_buff spent waiting
+    long dropped_oldest;        // scans freed to make room for newer ones
+    long dropped_newest;        // scans freed instead of being added
+    long spilled;               // scans written to the overflow file
+    long unspilled;             // scans read back from the overflow file
+    int spill_queued;           // scans waiting in the overflow file now
+    long spill_lost;            // scans lost to overflow file errors
+};
+
 /**
  * Struct and functions used for shared buffer and concurrency variables
+ *
+ * While anything is waiting in the spill file the in memory buffer is full,
+ * and everything in the file is newer than everything in memory.
  */
 struct bounded_buffer {
     struct datapoint_nanoVNA_H **buffer;
     int count;
     int in;
     int out;
-    int pps;
+    int pps;                    // most points any scan in the buffer has
     atomic_int complete;
     pthread_mutex_t lock;
     pthread_cond_t take_cond;
     pthread_cond_t add_cond;
+    int capacity;
+    BufferPolicy policy;
+    FILE *spill;                // overflow file, only with BUFFER_SPILL
+    off_t spill_read;           // offset of the oldest scan in the spill file
+    off_t spill_write;          // offset the next spilled scan is written at
+    struct buffer_stats stats;
 };
 
 /**
- * Sets up a new bounded buffer
+ * Sets up a new bounded buffer holding N scans, which blocks when full
  * 
  * @param bb pointer to the space reserved for this struct (uninitialised)
  * @param pps the points to scan to associate with this buffer
@@ -87,6 +142,19 @@ struct bounded_buffer {
  */
 int create_bounded_buffer(struct bounded_buffer *bb, int pps);
 
+/**
+ * Sets up a new bounded buffer with the given capacity and policy for
+ * when it is full
+ * 
+ * @param bb pointer to the space reserved for this struct (uninitialised)
+ * @param pps the points to scan to associate with this buffer
+ * @param capacity number of scans held in memory, 1 to MAX_BUFFER_CAPACITY
+ * @param policy what add_buff does when the buffer is full
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on bad arguments or if
+ *  memory (or the spill file) can't be allocated
+ */
+int create_bounded_buffer_with_policy(struct bounded_buffer *bb, int pps, int capacity, BufferPolicy policy);
+
 /**
  * Frees all memory associated with the given bounded buffer
  * 
@@ -95,10 +163,12 @@ int create_bounded_buffer(struct bounded_buffer *bb, int pps);
 void destroy_bounded_buffer(struct bounded_buffer *buffer);
 
 /**
- * Puts specified data pointer into the buffer
+ * Puts specified data pointer into the buffer, applying the buffer's
+ * policy if it is full
  * 
  * @param buffer pointer to the buffer to put in
- * @param data pointer to the array of data to put in the buffer
+ * @param data pointer to the array of data to put in the buffer. The buffer
+ *  owns it from then on, and frees it (and its points) if it is dropped or spilled.
  */
 void add_buff(struct bounded_buffer *buffer, struct datapoint_nanoVNA_H *data);
 
@@ -110,6 +180,265 @@ void add_buff(struct bounded_buffer *buffer, struct datapoint_nanoVNA_H *data);
  */
 struct datapoint_nanoVNA_H* take_buff(struct bounded_buffer *buffer);
 
+/**
+ * Marks the buffer as complete and wakes any consumer waiting on it,
+ * so take_buff can return NULL once the remaining data has been drained.
+ * 
+ * @param buffer pointer to the buffer no more data will be added to
+ */
+void mark_buffer_complete(struct bounded_buffer *buffer);
+
+/**
+ * Memory a scan takes up while waiting in a buffer: its slot, the struct and its points
+ * 
+ * @param pps points per scan
+ * @return bytes per scan
+ */
+size_t buffer_scan_bytes(int pps);
+
+/**
+ * Works out how many scans fit in a memory budget
+ * 
+ * @param budget_bytes memory the buffer may use
+ * @param pps points per scan
+ * @return capacity to give create_bounded_buffer_with_policy, clamped to 1 - MAX_BUFFER_CAPACITY
+ */
+int buffer_capacity_for_budget(size_t budget_bytes, int pps);
+
+/**
+ * Copies the buffer's counters
+ * 
+ * @param buffer pointer to the buffer
+ * @param stats set to the counters
+ */
+void get_buffer_stats(struct bounded_buffer *buffer, struct buffer_stats *stats);
+
+/**
+ * @param policy a buffer policy
+ * @return its name, as used by the command line ("block", "oldest", "newest" or "spill")
+ */
+const char* buffer_policy_name(BufferPolicy policy);
+
+/**
+ * Parses a buffer policy name
+ * 
+ * @param name "block", "oldest", "newest" or "spill"
+ * @param policy set to the policy named
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the name is not recognised
+ */
+int parse_buffer_policy(const char *name, BufferPolicy *policy);
+
+//----------------------------------------
+// Sub-band Task Scheduling
+//----------------------------------------
+
+/**
+ * Sweeps of one owner that may be unfinished at once. The consumer's sweep
+ * tracker has this many slots per owner, so a shared scheduler holds back
+ * its next sweep until the one this many before it has finished.
+ */
+#define SWEEP_TRACKER_SLOTS 4
+
+/**
+ * A single firmware scan command's worth of work: one sub-band of one sweep.
+ */
+struct scan_task {
+    int sweep;  // which sweep this sub-band belongs to
+    int scan;   // index of the sub-band within its sweep
+    int start;  // first frequency of the sub-band in Hz, from the sweep plan
+    int stop;   // last frequency of the sub-band in Hz, from the sweep plan
+    int pps;    // points to pull in this sub-band
+};
+
+/**
+ * Double ended queue of tasks owned by one producer.
+ * 
+ * The owner takes from the front so its sub-bands are scanned in order,
+ * thieves take from the back so they disturb that order as little as possible.
+ */
+struct task_deque {
+    struct scan_task *tasks;
+    int capacity;
+    int head;
+    atomic_int count;   // changed under lock, but thieves may glance at it without
+    pthread_mutex_t lock;
+};
+
+/**
+ * Hands out sub-band tasks to the producer threads of a sweep.
+ * 
+ * Sweeps are released one at a time, whenever a producer runs out of work.
+ * If share_bands is false every producer gets its own copy of each sweep,
+ * so each VNA covers the whole band. If it is true each sweep's sub-bands
+ * are dealt out between the producers once, and a producer with an empty
+ * deque steals from the busiest other producer, so one slow or retrying
+ * VNA no longer holds up the rest of the sweep. A shared sweep isn't
+ * released while SWEEP_TRACKER_SLOTS sweeps before it are unfinished, as
+ * the consumer couldn't tell them apart from sweeps that lost sub-bands.
+ */
+struct task_scheduler {
+    int nbr_workers;
+    struct task_deque *deques;
+    bool share_bands;
+    const struct sweep_plan *plan;  // sub-band ranges of every sweep
+    int nbr_sweeps;         // sweeps to release per worker, or -1 for no limit
+    int *released;          // sweeps released so far, per worker (only [0] used if sharing)
+    long ticks;             // start times passed so far if paced by a sweep timer, otherwise -1
+    long *ticked;           // ticks when each worker last released a sweep (only [0] used if sharing)
+    long missed;            // start times passed while the sweep before was still going
+    int unfinished[SWEEP_TRACKER_SLOTS]; // tasks of each recent sweep not yet finished, by sweep modulo SWEEP_TRACKER_SLOTS (only if sharing)
+    bool closed;            // set once no more sweeps are to be released
+    atomic_int active_workers;
+    pthread_cond_t tick;    // broadcast on each tick, release, finished sweep and close
+    pthread_mutex_t lock;   // guards released, ticks, ticked, missed, unfinished and closed
+};
+
+/**
+ * Sets up a new task scheduler with empty deques
+ * 
+ * @param sched pointer to the space reserved for this struct (uninitialised)
+ * @param nbr_workers number of producer threads that will take from it
+ * @param share_bands true to split each sweep between the workers, false to give each worker every sweep
+ * @param plan the sweep plan to take sub-bands from, must outlive the scheduler
+ * @param nbr_sweeps number of sweeps to release, or -1 to keep releasing until told to stop
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on allocation failure
+ */
+int create_task_scheduler(struct task_scheduler *sched, int nbr_workers, bool share_bands,
+                          const struct sweep_plan *plan, int nbr_sweeps);
+
+/**
+ * Sets whether a scheduler waits for a start time from tick_task_scheduler
+ * before releasing each sweep, rather than releasing one as soon as a
+ * worker runs out of tasks
+ * 
+ * @param sched the scheduler
+ * @param paced true to wait for each tick, false to stop waiting
+ */
+void pace_task_scheduler(struct task_scheduler *sched, bool paced);
+
+/**
+ * Lets each worker of a paced scheduler release its next sweep. A worker
+ * still busy with its last sweep releases one as soon as it is done, and
+ * any further ticks that pass meanwhile are counted as missed.
+ * 
+ * @param sched the scheduler
+ */
+void tick_task_scheduler(struct task_scheduler *sched);
+
+/**
+ * Stops a scheduler releasing any more sweeps, waking any worker waiting
+ * for a tick. Tasks already released can still be taken.
+ * 
+ * @param sched the scheduler
+ */
+void close_task_scheduler(struct task_scheduler *sched);
+
+/**
+ * Frees the deques of a scheduler (but not the scheduler struct itself)
+ * 
+ * @param sched pointer to the scheduler to clean up
+ */
+void destroy_task_scheduler(struct task_scheduler *sched);
+
+/**
+ * Fetches the next task for a worker.
+ * 
+ * Tries the worker's own deque, then (if sharing) steals from the busiest
+ * other deque, then releases the next sweep if may_release is true and
+ * there are sweeps left to release.
+ * 
+ * @param sched the scheduler to take from
+ * @param worker index of the calling worker, 0 to nbr_workers-1
+ * @param task location to store the fetched task
+ * @param may_release false to stop new sweeps being started (e.g. scan has been stopped)
+ * @return true if a task was fetched, false if there is no work left for this worker
+ */
+bool next_scan_task(struct task_scheduler *sched, int worker, struct scan_task *task, bool may_release);
+
+/**
+ * Marks a task fetched by next_scan_task as done with, whether or not its
+ * scan succeeded. Call it once the scan is on the buffer, so the consumer
+ * has seen the sub-band before any sweep held back for it is released.
+ * 
+ * @param sched the scheduler the task came from
+ * @param task the task
+ */
+void finish_scan_task(struct task_scheduler *sched, const struct scan_task *task);
+
+//----------------------------------------
+// Sweep Completion Tracking
+//----------------------------------------
+
+#define SWEEP_OWNER_SHARED -1
+
+/**
+ * Progress of one sweep towards having all of its sub-bands
+ * (sweep is -1 when the slot is vacant)
+ */
+struct sweep_progress {
+    int sweep;
+    int arrived;
+};
+
+/**
+ * Reported by the sweep tracker when a sweep is finished with
+ * 
+ * owner    - vna_id that covered the sweep, or SWEEP_OWNER_SHARED if
+ *            the sweep was shared between VNAs
+ * sweep    - sweep number
+ * arrived  - sub-bands that arrived
+ * complete - true if every sub-band arrived, false if the sweep was
+ *            given up on (sub-bands dropped, or the scan ended first)
+ */
+struct sweep_event {
+    int owner;
+    int sweep;
+    int arrived;
+    bool complete;
+};
+
+/**
+ * Counts the sub-bands of each sweep arriving at the consumer.
+ * 
+ * Each owner (a VNA, or the whole scan when sub-bands are shared) has
+ * SWEEP_TRACKER_SLOTS slots, as only a few of its sweeps are ever in flight
+ * at once. If a sweep arrives with no free slot, the oldest sweep is given
+ * up on, as its missing sub-bands must have been dropped.
+ */
+struct sweep_tracker {
+    int nbr_scans;
+    bool shared;
+    struct sweep_progress slots[MAXIMUM_VNA_PORTS][SWEEP_TRACKER_SLOTS];
+};
+
+/**
+ * Sets up an empty sweep tracker
+ * 
+ * @param tracker pointer to the space reserved for this struct
+ * @param nbr_scans sub-bands per sweep
+ * @param shared true if sub-bands of a sweep are shared between VNAs
+ */
+void init_sweep_tracker(struct sweep_tracker *tracker, int nbr_scans, bool shared);
+
+/**
+ * Records the arrival of one sub-band
+ * 
+ * @param tracker the tracker to update
+ * @param data the record that arrived
+ * @param events array of at least 2 events to fill with any sweeps finished with
+ * @return number of events written
+ */
+int track_sweep_record(struct sweep_tracker *tracker, const struct datapoint_nanoVNA_H *data, struct sweep_event *events);
+
+/**
+ * Gives up on every sweep still in progress, for use once the scan has ended
+ * 
+ * @param tracker the tracker to empty
+ * @param events array of at least MAXIMUM_VNA_PORTS*SWEEP_TRACKER_SLOTS events
+ * @return number of events written
+ */
+int flush_sweep_tracker(struct sweep_tracker *tracker, struct sweep_event *events);
+
 //----------------------------------------
 // Pulling Data Logic
 //----------------------------------------
@@ -122,9 +451,10 @@ struct datapoint_nanoVNA_H* take_buff(struct bounded_buffer *buffer);
  * @param first_point Pointer to location at which to store the first point of the output
  * @param expected_mask The expected mask value (e.g., 135)
  * @param expected_points The expected points value (e.g., 101)
+ * @param header_ns If not NULL, set to monotonic_ns() as the read holding the header returned
  * @return EXIT_SUCCESS if header found, EXIT_FAILURE if timeout/header not found or error
  */
-int find_binary_header(int vna_id, struct nanovna_raw_datapoint* first_point, uint16_t expected_mask, uint16_t expected_points);
+int find_binary_header(int vna_id, struct nanovna_raw_datapoint* first_point, uint16_t expected_mask, uint16_t expected_points, uint64_t *header_ns);
 
 /**
  * A function to pull a scan from a NanoVNA
@@ -140,6 +470,250 @@ int find_binary_header(int vna_id, struct nanovna_raw_datapoint* first_point, ui
  */
 struct datapoint_nanoVNA_H* pull_scan(int vna_id, int start, int stop, int pps);
 
+/**
+ * Counters describing how reliably scans are being pulled from one VNA
+ */
+struct vna_scan_stats {
+    long scans;              // scans pulled successfully
+    long failed_pulls;       // pull_scan attempts that returned nothing
+    long retries;            // extra attempts made after a failure
+    long resyncs;            // times the stream was drained and resynchronised
+    long dropped_scans;      // sub-bands given up on after the retry budget ran out
+    long recoveries;         // failures followed by a successful retry
+    uint64_t recovery_ns;    // total time from first failure to successful retry
+    uint64_t max_recovery_ns;// longest single recovery
+    double sweep_ns_per_point; // moving average of firmware sweep time per point
+};
+
+/**
+ * Weight given to each new scan in the sweep time moving average
+ */
+#define SWEEP_TIME_EWMA_WEIGHT 0.125
+
+/**
+ * Folds a freshly pulled scan's timing into its VNA's sweep time estimate
+ * and stamps the scan with the updated estimate.
+ * 
+ * The firmware measures every point before sending the header, so the
+ * time from command to header, divided by the number of points, is taken
+ * as the sweep time per point. This includes the command and USB overhead,
+ * so it is a slight overestimate, but it is consistent per VNA.
+ * 
+ * @param data the scan just pulled, with send_ns and header_ns set
+ * @param pps the number of points in the scan
+ */
+void update_sweep_time(struct datapoint_nanoVNA_H *data, int pps);
+
+/**
+ * Time a scan command takes, modelled as a fixed cost per command (writing
+ * it, the firmware setting up, the header) plus a cost per point (measuring
+ * and sending it), fitted to a VNA's recent scans
+ */
+struct scan_cost_model {
+    double command_ns;   // fixed time per scan command
+    double point_ns;     // time per point
+    double weight;       // recent scans the fit is based on (older ones count for less), 0 if none
+};
+
+/**
+ * Rough costs for a NanoVNA-H over USB, used until scans have been timed
+ */
+#define DEFAULT_COMMAND_NS 20e6
+#define DEFAULT_POINT_NS 1.5e6
+
+/**
+ * Share of its weight each timed scan loses with every newer one from the
+ * same VNA, so the fit follows roughly the VNA's last hundred scans
+ */
+#define SCAN_COST_DECAY 0.01
+
+/**
+ * Folds a freshly pulled scan's total time, from command to last byte, into
+ * its VNA's scan cost model
+ *
+ * @param data the scan just pulled, with vna_id, send_ns and receive_ns set
+ * @param pps the number of points in the scan
+ */
+void update_scan_cost(const struct datapoint_nanoVNA_H *data, int pps);
+
+/**
+ * Fits the scan cost model to a VNA's recent scans
+ *
+ * A VNA with no timed scans gets the fit to every VNA's scans together,
+ * as does a vna_id of -1. Scans of different sizes are needed to tell the
+ * two costs apart. Until there are some, the fixed cost is taken as
+ * DEFAULT_COMMAND_NS (or the whole time, if less) and the rest put down to
+ * the points. With no timed scans at all the defaults are given.
+ *
+ * @param vna_id the VNA, or -1 for all of them
+ * @param model set to the fitted model
+ */
+void get_scan_cost_model(int vna_id, struct scan_cost_model *model);
+
+/**
+ * Forgets every VNA's timed scans, going back to the default costs
+ * (reset_vna_stats forgets one VNA's)
+ */
+void reset_scan_cost_model(void);
+
+/**
+ * Predicts how long some scans will take from the VNAs' scan cost models
+ *
+ * @param vna_list ids of the VNAs doing the scans
+ * @param nbr_vnas number of VNAs in vna_list
+ * @param shared true if the VNAs share the scans, each taking the next when
+ *               free, false if every VNA does an equal share of its own
+ * @param scans number of scans, in total across all the VNAs
+ * @param pps (average) points per scan
+ * @return the predicted time in ns
+ */
+double predict_scans_ns(const int *vna_list, int nbr_vnas, bool shared, double scans, double pps);
+
+/**
+ * Predicts how long a run of sweeps will take from the VNAs' scan cost models
+ *
+ * @param plan plan of each sweep
+ * @param vna_list ids of the VNAs doing the sweeps
+ * @param nbr_vnas number of VNAs in vna_list
+ * @param shared true if each sweep's scans are shared between the VNAs,
+ *               false if every VNA does every sweep itself
+ * @param nbr_sweeps number of sweeps (by each VNA, if not shared)
+ * @return the predicted time in ns
+ */
+double predict_sweeps_ns(const struct sweep_plan *plan, const int *vna_list, int nbr_vnas, bool shared, long nbr_sweeps);
+
+/**
+ * Estimates when a point of a scan was measured, for lining up captures
+ * from different VNAs.
+ * 
+ * Counts back from the header by the VNA's estimated sweep time per point,
+ * as the last point is measured just before the header is sent.
+ * 
+ * @param data the scan the point belongs to
+ * @param point index of the point within the scan
+ * @param pps number of points in the scan
+ * @return monotonic_ns() time the point was measured at
+ */
+uint64_t estimate_point_time(const struct datapoint_nanoVNA_H *data, int point, int pps);
+
+/**
+ * Drains whatever the VNA is still sending and, if sync is true,
+ * sends an empty command line and drains the prompt it produces.
+ * 
+ * Leaves the serial stream ready for a fresh command after a failed scan.
+ * 
+ * @param vna_id The program id of the vna to be used
+ * @param sync true to also send the sync command
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on a read/write error
+ */
+int resync_vna(int vna_id, bool sync);
+
+/**
+ * Calls pull_scan, and if it fails resynchronises the VNA with resync_vna
+ * and tries the same sub-band again, up to retries more times.
+ * 
+ * Every failure, retry and recovery is recorded in that VNA's stats.
+ * A pull cut short by interrupt_vna is not retried or counted, and the
+ * VNA is left for the caller to resynchronise once it clears the interrupt.
+ * 
+ * @param vna_id the VnaCommunication ID of the VNA to pull from
+ * @param start frequency in Hz
+ * @param stop frequency in Hz
+ * @param pps points to pull in this scan
+ * @param retries maximum number of extra attempts after the first failure
+ * @param sync passed to resync_vna between attempts
+ * @return A pointer to the pulled data, or NULL if every attempt failed
+ */
+struct datapoint_nanoVNA_H* pull_scan_retry(int vna_id, int start, int stop, int pps, int retries, bool sync);
+
+/**
+ * Copies the current stats for a VNA
+ * 
+ * @param vna_id the VnaCommunication ID of the VNA
+ * @param stats location to copy the stats to
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on id out of bounds
+ */
+int get_vna_stats(int vna_id, struct vna_scan_stats *stats);
+
+/**
+ * Sets all stats for a VNA back to zero
+ * 
+ * @param vna_id the VnaCommunication ID of the VNA
+ */
+void reset_vna_stats(int vna_id);
+
+//----------------------------------------
+// Thread Placement
+//----------------------------------------
+
+/**
+ * Highest CPU number + 1 that threads can be pinned to, the bits of a cpu mask
+ */
+#define MAX_PINNED_CPUS 64
+
+/**
+ * How much a thread has been kept from running, since it started
+ * 
+ * run_ns      - time spent running on a CPU
+ * wait_ns     - time spent ready to run but waiting for a CPU, the
+ *               scheduling latency that pinning and priority should cut
+ * timeslices  - times it was given a CPU
+ * preemptions - times a CPU was taken from it before it was done
+ * available   - false if the platform can't report these (all then 0)
+ */
+struct thread_sched_stats {
+    uint64_t run_ns;
+    uint64_t wait_ns;
+    long timeslices;
+    long preemptions;
+    bool available;
+};
+
+/**
+ * Reads the scheduling statistics of the calling thread (from
+ * /proc/thread-self/schedstat and getrusage on Linux)
+ * 
+ * @param stats set to the thread's statistics
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if they can't be read on this platform
+ */
+int get_thread_sched_stats(struct thread_sched_stats *stats);
+
+/**
+ * Creates a thread pinned to a set of CPUs and/or under SCHED_FIFO from
+ * the moment it starts, so none of its work runs unplaced
+ * 
+ * Placement that can't be had is reported and left out (keeping the rest
+ * if only one of the two fails), so a sweep still goes ahead without the
+ * privileges real-time priority needs.
+ * 
+ * @param thread location to store the new thread
+ * @param start the thread's function
+ * @param arg passed to start
+ * @param cpus bit n set to allow CPU n, or 0 to leave the thread's CPUs alone
+ * @param rt_priority SCHED_FIFO priority (1 to 99), or 0 to inherit the creator's policy
+ * @return 0, or the error from pthread_create if the thread couldn't be created at all
+ */
+int create_placed_thread(pthread_t *thread, void *(*start)(void *), void *arg, uint64_t cpus, int rt_priority);
+
+/**
+ * Parses a list of CPUs such as "2", "0,2" or "0-3,6", or "any"
+ * 
+ * @param list the list
+ * @param cpus set to the CPUs as a mask (bit n for CPU n), 0 for "any"
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if malformed or a CPU is
+ *         MAX_PINNED_CPUS or more
+ */
+int parse_cpu_list(const char *list, uint64_t *cpus);
+
+/**
+ * Writes a CPU mask as a list parse_cpu_list reads, with ranges collapsed
+ * 
+ * @param cpus the mask, 0 for "any"
+ * @param buffer where to write the list
+ * @param size size of buffer
+ */
+void format_cpu_list(uint64_t cpus, char *buffer, size_t size);
+
 //----------------------------------------
 // Producer/Consumer Thread Logic
 //----------------------------------------
@@ -155,16 +729,23 @@ struct scan_producer_args {
     int stop;
     int nbr_sweeps;
     struct bounded_buffer *bfr;
+    struct task_scheduler *sched; // shared scheduler, or NULL to scan alone
+    int worker;                   // this producer's index in sched
+    int retries;                  // extra attempts allowed per failed sub-band
+    bool sync;                    // send sync command when resynchronising
+    long scans_pulled;            // set by the producer as it finishes
+    struct thread_sched_stats sched_stats;  // set by the producer as it finishes
 };
 
 /**
  * A thread function to take a specified number of scans from a NanoVNA onto buffer
  *
  * Accesses buffer according to the producer-consumer problem, using add_buff
- * Computes step (frequency distance between scans) from start stop and points,
- * then pulls scans from NanoVNA in increments of pps points and appends to buffer.
+ * Takes sub-band tasks from the scheduler in sched until there are none left,
+ * pulls each from the NanoVNA and appends it to buffer. If sched is NULL a
+ * private scheduler is made from nbr_scans, start, stop and nbr_sweeps.
  * 
- * Decrements scan state when finished, if scan state == 0 sets scan to finished.
+ * Decrements scan state when finished, the last producer to finish sets the buffer to complete.
  * 
  * @param args pointer to scan_producer_args struct used to pass arguments into this function
  */
@@ -174,25 +755,38 @@ void* scan_producer(void *arguments);
  * A thread function to take scans continuously from a NanoVNA onto buffer
  * 
  * Accesses buffer according to the producer-consumer problem, using add_buff.
- * Pulls until scan state is set to 0, either by scan_timer or destroy_scan.
+ * Takes sub-band tasks as scan_producer does, but stops releasing new sweeps
+ * once scan state is set to 0, either by its sweep timer or stop_sweep.
  * 
  * @param args pointer to scan_producer_args struct used to pass arguments into this function
  */
 void* sweep_producer(void *arguments);
 
 /**
- * A thread function to wait a specified amount of time before signalling
- * a scan to stop (by setting scan state to 0).
+ * Arms the timer of a sweep, which starts its sweeps on a fixed cadence
+ * and/or ends it after a set time
  * 
- * Should probably be detatched.
+ * Every sweep's timer is run by one shared thread. Start times are kept
+ * on a fixed grid (start_delay + k * period), so a late wake-up or an
+ * overrunning sweep never shifts the ones after it.
  * 
- * @param args pointer to scan_timer_args struct
+ * @param scan_id the sweep's scan_id
+ * @param sched scheduler to pace with tick_task_scheduler, or NULL to only end the sweep
+ * @param start_delay_ns time from now until the first sweep starts
+ * @param period_ns time between sweep starts, or 0 to start each as soon
+ *  as the last is done
+ * @param duration_ns time from the first start until the sweep's time is up
+ *  (its scan state is set to 0 and sched closed), or 0 for no limit
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on scan_id out of range
  */
-struct scan_timer_args {
-    int time_to_wait;
-    int scan_id;
-};
-void* scan_timer(void* arguments);
+int arm_sweep_timer(int scan_id, struct task_scheduler *sched, uint64_t start_delay_ns, uint64_t period_ns, uint64_t duration_ns);
+
+/**
+ * Stops a sweep's timer, after which it no longer touches the scheduler
+ * 
+ * @param scan_id the sweep's scan_id
+ */
+void disarm_sweep_timer(int scan_id);
 
 /**
  * A thread function to print scans from buffer
@@ -200,18 +794,99 @@ void* scan_timer(void* arguments);
  * Accesses buffer according to the producer-consumer problem
  * Takes arrays of 101 readings from buffer and prints them until scans are done
  * 
+ * If verbose, each reading is printed with its scan id, sweep and sub-band,
+ * and the estimated time it was measured (see estimate_point_time). Once a sweep has all its sub-bands (or has been given up on) a line
+ * is printed in the format:
+ *     SWEEP <ID> <Label> <ScanID> <VNA> <Sweep> <Arrived> <Expected> COMPLETE|INCOMPLETE
+ * where VNA is -1 if the sweep was shared between VNAs.
+ * 
+ * Every scan and sweep event is also published to any stream server
+ * subscribers (see VnaStreamServer.h), whether verbose or not.
+ * 
+ * Scans from a VNA with a calibration in calibrations are corrected
+ * (see VnaCalibration.h) before any of this.
+ * 
+ * If archive is set, each scan is also appended to it compressed (see
+ * VnaArchive.h). Should that fail, the consumer warns and stops archiving.
+ * 
+ * If tdr is set, each VNA's calibrated S11 is gathered as its scans arrive
+ * and transformed as soon as its sweep is complete (see VnaTdr.h). Each
+ * transform is written to tdr_file, published to the stream server and, if
+ * verbose, summarised as "TDR id label scan vna sweep points step peak_time
+ * peak_magnitude".
+ * 
+ * If peaks is set, each VNA's sweeps are gathered the same way and their
+ * resonance found as each completes (see VnaPeak.h). Each one is written to
+ * peak_file, published to the stream server and, if verbose, printed as
+ * "PEAK id label scan vna sweep time f0 q depth level".
+ * 
  * @param args pointer to struct scan_consumer_args
  */
+struct calibration;
+struct archive_writer;
+struct tdr_stage;
+struct peak_tracker;
 struct scan_consumer_args {
     struct bounded_buffer  *bfr;
     FILE *touchstone_file;
     char *id_string;
     char *label;
     bool verbose;
-    struct timeval program_start_time;
+    uint64_t program_start_ns;      // monotonic_ns() when the scan started
+    const struct sweep_plan *plan;  // plan of the sweeps being consumed
+    bool share_bands;               // if sweeps are shared between VNAs
+    struct calibration **calibrations;  // per VNA id, on the plan's grid (NULL or NULLs if uncalibrated)
+    struct archive_writer *archive;     // compressed copy of every scan, or NULL
+    struct tdr_stage *tdr;              // transforms each completed sweep, or NULL
+    FILE *tdr_file;                     // text file of the transforms, or NULL
+    struct peak_tracker *peaks;         // finds each completed sweep's resonance, or NULL
+    FILE *peak_file;                    // CSV file of the resonances, or NULL
+    struct thread_sched_stats sched_stats;  // set by the consumer as it finishes
 };
 void* scan_consumer(void *args);
 
+/**
+ * What is worked out from each sweep's S11 in the time domain (see VnaTdr.h)
+ *
+ * TDR_OFF     - (default) nothing
+ * TDR_IMPULSE - the impulse response
+ * TDR_STEP    - the step response
+ */
+typedef enum {
+    TDR_OFF,
+    TDR_IMPULSE,
+    TDR_STEP
+} TdrMode;
+
+/**
+ * Window applied across a sweep before transforming it, trading the
+ * sharpness of each reflection's peak for lower side lobes around it
+ *
+ * TDR_RECTANGULAR - no window: the sharpest peaks, with side lobes 13 dB down
+ * TDR_HANN        - (default) peaks twice as wide, side lobes 31 dB down
+ * TDR_BLACKMAN    - peaks three times as wide, side lobes 58 dB down
+ */
+typedef enum {
+    TDR_RECTANGULAR,
+    TDR_HANN,
+    TDR_BLACKMAN
+} TdrWindow;
+
+/**
+ * Resonance tracked through each VNA's sweeps (see VnaPeak.h)
+ *
+ * PEAK_OFF      - (default) none
+ * PEAK_S21_PEAK - the highest point of S21, such as a band pass resonator
+ * PEAK_S21_DIP  - the lowest point of S21, such as a notch
+ * PEAK_S11_DIP  - the lowest point of S11, such as a matched antenna
+ */
+typedef enum {
+    PEAK_OFF,
+    PEAK_S21_PEAK,
+    PEAK_S21_DIP,
+    PEAK_S11_DIP
+} PeakMode;
+
 //----------------------------------------
 // Touchstone Files
 //----------------------------------------
@@ -226,6 +901,46 @@ void* scan_consumer(void *args);
  */
 FILE * create_touchstone_file(struct tm *tm_info, bool verbose);
 
+/**
+ * Opens a compressed scan archive (see VnaArchive.h) with name format
+ * "vna_scan_at_%Y-%m-%d_%H-%M-%S.vnar"
+ * 
+ * Caller's responsibility to close with close_archive_writer and free.
+ * 
+ * @param tm_info time information
+ * @param label stored in the archive's header (may be NULL)
+ * @param start_ns monotonic_ns() the scan times are stored relative to
+ * @param verbose if the file name is printed
+ * @return the writer (allocated with malloc), or NULL if the file can't be created
+ */
+struct archive_writer * create_archive_file(struct tm *tm_info, const char *label, uint64_t start_ns, bool verbose);
+
+/**
+ * Opens a text file for time domain responses (see VnaTdr.h) with name
+ * format "vna_scan_at_%Y-%m-%d_%H-%M-%S.tdr"
+ * 
+ * Caller's responsibility to close.
+ * 
+ * @param tm_info time information
+ * @param mode the response written to it
+ * @param window the window applied before transforming
+ * @param verbose if the file name is printed
+ * @return a pointer to the file as returned by fopen
+ */
+FILE * create_tdr_file(struct tm *tm_info, TdrMode mode, TdrWindow window, bool verbose);
+
+/**
+ * Opens a CSV file for resonances (see VnaPeak.h) with name format
+ * "vna_scan_at_%Y-%m-%d_%H-%M-%S.peaks.csv"
+ * 
+ * Caller's responsibility to close.
+ * 
+ * @param tm_info time information
+ * @param verbose if the file name is printed
+ * @return a pointer to the file as returned by fopen
+ */
+FILE * create_peak_file(struct tm *tm_info, bool verbose);
+
 //----------------------------------------
 // Scan State Logic
 //----------------------------------------
@@ -279,11 +994,71 @@ typedef enum {
     ONGOING
 } SweepMode;
 
+/**
+ * Files a sweep's scans are saved to
+ *
+ * OUTPUT_TOUCHSTONE - (default) a touchstone file of every point as text
+ * OUTPUT_ARCHIVE    - a compressed scan archive (see VnaArchive.h)
+ * OUTPUT_BOTH       - both of them
+ * OUTPUT_NONE       - neither, for when only the time domain responses or
+ *                     resonances are wanted
+ */
+typedef enum {
+    OUTPUT_TOUCHSTONE,
+    OUTPUT_ARCHIVE,
+    OUTPUT_BOTH,
+    OUTPUT_NONE
+} SweepOutput;
+
+/**
+ * Optional settings for a sweep. Pass NULL to start_sweep for the defaults.
+ * 
+ * share_bands - false (default): every VNA sweeps the whole band.
+ *               true: the sub-bands of each sweep are split between the VNAs,
+ *               with idle VNAs stealing sub-bands from busy ones.
+ * retries     - number of times a failed scan is retried before its sub-band is dropped.
+ * sync        - if a sync command is sent to the VNA while resynchronising after a failure.
+ * buffer_capacity - scans held between the VNAs and the consumer (N by default).
+ * buffer_policy   - what happens when the consumer falls behind and the buffer is full.
+ * buffer_mb       - if above 0, buffer_capacity is ignored and the buffer holds as
+ *                   many scans as fit in this many MiB at the sweep's points per scan.
+ * segments        - if nbr_segments is above 0, the sweep covers these segments (copied)
+ *                   instead of start to stop, and pps is the most points per scan.
+ *                   See create_segmented_sweep_plan.
+ * nbr_points      - if above 0 (and there are no segments), the sweep has exactly this
+ *                   many points, in scans of pps with the last taking the rest, and
+ *                   nbr_scans is ignored. See create_sweep_plan_points.
+ */
+struct sweep_options {
+    bool share_bands;
+    int retries;
+    bool sync;
+    int buffer_capacity;
+    BufferPolicy buffer_policy;
+    int buffer_mb;
+    const struct sweep_segment *segments;
+    int nbr_segments;
+    int nbr_points;
+    int period_ms;          // time between sweep starts, 0 to start each as soon as the last is done
+    time_t start_at;        // wall clock time of the first sweep, 0 to start straight away
+    uint64_t producer_cpus; // CPUs to pin producers to, one CPU each in turn, 0 for any
+    uint64_t consumer_cpus; // CPUs the consumer may run on, 0 for any
+    int rt_priority;        // SCHED_FIFO priority for the producers, 0 for the normal scheduler
+    SweepOutput output;     // files the scans are saved to
+    TdrMode tdr;            // time domain response worked out from each sweep
+    TdrWindow tdr_window;   // window applied before working it out
+    PeakMode peak;          // resonance tracked through each VNA's sweeps
+    int peak_window;        // points either side of the last resonance searched, 0 for the default
+};
+
+#define DEFAULT_SCAN_RETRIES 2
+
 /**
  * Orchestrates creating a new run_sweep thread and returns an ID for that thread.
  * 
  * Calls initialise_scan to obtain a scan_id, then creates a run_sweep thead using that
  * id to execute the sweep. Does not join that thread, it must be joined with stop_sweep.
+ * wait_sweep waits for it to finish by itself.
  * 
  * @param nbr_vnas Number of VNAs to scan with
  * @param vna_list Array containing the vna ids of all vnas to be scanned with. Will be freed by end of scan.
@@ -298,18 +1073,108 @@ typedef enum {
  * @param pps Number of points per scan
  * @param user_label 
  * @param verbose True -- prints scan data to stdout. False -- only produces file.
+ * @param options Further settings for the sweep (copied), or NULL for defaults.
  * 
- * @return scan_id - used to reference this scan thread etc. again (e.g. when closing it)
+ * @return scan_id - used to reference this scan thread etc. again (e.g. when closing it),
+ *  or negative if the sweep could not start, including when one of its VNAs
+ *  is already in another sweep
+ */
+int start_sweep(int nbr_vnas, int* vna_list, int nbr_scans, int start, int stop, SweepMode sweep_mode, int sweeps, int pps, const char* user_label, bool verbose, const struct sweep_options *options);
+
+/**
+ * Waits for a sweep to finish by itself, without polling: a sweep of
+ * NUM_SWEEPS once its last sweep is written out, a TIME sweep once its time
+ * is up and the scans in flight are written out. ONGOING sweeps only
+ * finish once stopped.
+ * 
+ * The sweep still holds its scan_id afterwards, until stop_sweep is called
+ * (which then returns straight away), see collect_sweep.
+ * 
+ * @param scan_id The ID used to reference this scan thread, returned by start_sweep
+ * @param timeout_secs longest time to wait, or a negative number to wait as long as it takes
+ * @return EXIT_SUCCESS once the sweep has finished, ETIMEDOUT if it is still
+ *  going after timeout_secs, or -1 if there is no such sweep
+ */
+int wait_sweep(int scan_id, double timeout_secs);
+
+/**
+ * As wait_sweep, then frees the sweep's scan_id once it has finished. If
+ * the sweep was stopped while waiting, whoever stopped it frees the id, and
+ * a later sweep since given the same scan_id is left alone.
+ * 
+ * @param scan_id The ID used to reference this scan thread, returned by start_sweep
+ * @param timeout_secs longest time to wait, or a negative number to wait as long as it takes
+ * @return EXIT_SUCCESS once the sweep has finished, ETIMEDOUT if it is still
+ *  going after timeout_secs, or -1 if there is no such sweep
  */
-int start_sweep(int nbr_vnas, int* vna_list, int nbr_scans, int start, int stop, SweepMode sweep_mode, int sweeps, int pps, const char* user_label, bool verbose);
+int collect_sweep(int scan_id, double timeout_secs);
 
 /**
  * Signals specified scan to end, waits for it to finish and joins the thread.
  * Then resets supporting data structures.
  * 
+ * Whatever the mode, the producers take no more sub-scans, and a read
+ * blocked waiting for one of the sweep's VNAs is interrupted, so this
+ * returns within about one sub-scan's time (plus a resync of any VNA whose
+ * reply was cut short, leaving its stream clean). Scans already pulled
+ * are still written out.
+ * 
+ * Safe to call from several threads at once: one of them joins the sweep,
+ * the others wait for it to free the scan_id.
+ * 
  * @param scan_id The ID used to reference this scan thread, returned by start_sweep
  * @return EXIT_SUCCESS on success, error code on failure.
  */
 int stop_sweep(int scan_id);
 
+/**
+ * Copies the counters of a running sweep's buffer
+ * 
+ * @param scan_id the sweep's ID, returned by start_sweep
+ * @param stats set to the counters
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the sweep has no buffer (not running)
+ */
+int get_sweep_buffer_stats(int scan_id, struct buffer_stats *stats);
+
+/**
+ * How far a running sweep has got, for predicting when it will finish
+ */
+struct scan_progress {
+    SweepMode mode;
+    int sweeps;                        // sweeps to run (NUM_SWEEPS) or seconds to run for (TIME)
+    int nbr_vnas;
+    int vna_list[MAXIMUM_VNA_PORTS];
+    bool share_bands;
+    int scans_per_sweep;
+    int points_per_sweep;
+    uint64_t start_ns;                 // monotonic_ns() when scanning started
+    long scans_done;                   // scans written out so far
+    long points_done;                  // points written out so far
+};
+
+/**
+ * Copies the progress of a running sweep
+ * 
+ * @param scan_id the sweep's ID, returned by start_sweep
+ * @param progress set to the progress
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the sweep is not running
+ */
+int get_scan_progress(int scan_id, struct scan_progress *progress);
+
+/**
+ * Predicts how much longer a sweep will run for
+ * 
+ * NUM_SWEEPS sweeps are predicted from the scans left and the VNAs' scan
+ * cost models, or from the rate scans have been written out so far if that
+ * is slower (the output may be what's holding the sweep back). TIME sweeps
+ * are predicted from the time they were given. ONGOING sweeps run until
+ * stopped, so have no prediction.
+ * 
+ * @param progress the sweep's progress, from get_scan_progress
+ * @param now_ns monotonic_ns() now
+ * @param remaining_ns set to the predicted time left
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the sweep runs until stopped
+ */
+int predict_scan_remaining(const struct scan_progress *progress, uint64_t now_ns, double *remaining_ns);
+
 #endif
\ No newline at end of file
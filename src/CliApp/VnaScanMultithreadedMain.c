@@ -111,18 +111,11 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    int id = start_sweep(nbr_vnas, vna_list, nbr_scans, start_freq, stop_freq, sweep_mode, sweeps, pps, user_label,true);
+    int id = start_sweep(nbr_vnas, vna_list, nbr_scans, start_freq, stop_freq, sweep_mode, sweeps, pps, user_label,true,NULL);
 
     // wait for scan to be done, then call stop_sweep
-    if (sweep_mode == TIME) {
-        sleep(sweeps);
-    } else if (sweep_mode == NUM_SWEEPS) {
-        char* state_buffer = calloc(sizeof(char),8);
-        do {
-            sleep(1);
-            get_state(id,state_buffer);
-        } while (state_buffer[0] != 'i');
-    }
+    if (id >= 0)
+        wait_sweep(id, -1);
     stop_sweep(id);
 
     // disconnect VNAs
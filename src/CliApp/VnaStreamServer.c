@@ -0,0 +1,721 @@
+#include "VnaStreamServer.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // macOS, where SIGPIPE is ignored instead
+#endif
+
+/**
+ * One connected client
+ *
+ * fd       - socket, -1 if the slot is vacant
+ * control  - true for control clients, false for data subscribers
+ * closing  - close once everything queued has been sent
+ * kick     - close straight away, as the queue overflowed
+ * queue    - ring of STREAM_QUEUE_SIZE bytes waiting to be sent,
+ *            from queue[head], len bytes long
+ * line     - command being received from a control client
+ */
+struct stream_client {
+    int fd;
+    bool control;
+    bool closing;
+    bool kick;
+    uint8_t *queue;
+    size_t head;
+    size_t len;
+    char line[STREAM_COMMAND_LENGTH];
+    size_t line_len;
+    long frames;
+    long dropped;
+    char address[64];
+};
+
+struct stream_command {
+    int client;
+    char line[STREAM_COMMAND_LENGTH];
+};
+
+/**
+ * State of the streaming server
+ *
+ * Everything but the atomics is guarded by lock, apart from the file
+ * descriptors, which are only changed while the server thread is not running.
+ * Nothing may print while holding lock: printing may have to wait for the
+ * server thread, which may be waiting for lock.
+ */
+static struct {
+    atomic_bool running;
+    StreamPolicy policy;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct stream_client clients[STREAM_MAX_CLIENTS];
+    atomic_int nbr_subscribers;
+    atomic_uint sequence;
+    int data_listener;
+    int control_listener;
+    uint16_t data_port;
+    uint16_t control_port;
+    int wake[2];            // written to whenever the server thread has something new to do
+    int command_pipe[2];    // holds one byte for each command waiting
+    struct stream_command commands[STREAM_MAX_COMMANDS];
+    int command_head;
+    int nbr_commands;
+    int console[2];         // the terminal's stdout and stderr
+    int output[2][2];       // pipes standing in for stdout and stderr
+} server = {
+    .lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+//----------------------------------------
+// Framing
+//----------------------------------------
+
+static uint8_t* put_u16(uint8_t *out, uint16_t value) {
+    out[0] = value & 0xff;
+    out[1] = value >> 8;
+    return out + 2;
+}
+
+static uint8_t* put_u32(uint8_t *out, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        out[i] = (value >> (8 * i)) & 0xff;
+    return out + 4;
+}
+
+static uint8_t* put_u64(uint8_t *out, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        out[i] = (value >> (8 * i)) & 0xff;
+    return out + 8;
+}
+
+static uint8_t* put_f32(uint8_t *out, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return put_u32(out, bits);
+}
+
+static uint8_t* put_f64(uint8_t *out, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return put_u64(out, bits);
+}
+
+static uint8_t* put_header(uint8_t *out, uint16_t type, uint32_t sequence, uint32_t length) {
+    memcpy(out, STREAM_FRAME_MAGIC, 4);
+    out = put_u16(out + 4, STREAM_FRAME_VERSION);
+    out = put_u16(out, type);
+    out = put_u32(out, sequence);
+    return put_u32(out, length);
+}
+
+size_t stream_encode_scan(uint8_t *out, size_t size, uint32_t sequence, const struct datapoint_nanoVNA_H *data, int pps) {
+    size_t length = STREAM_SCAN_HEADER_SIZE + (size_t)pps * STREAM_POINT_SIZE;
+    if (pps < 0 || size < STREAM_FRAME_HEADER_SIZE + length)
+        return 0;
+    uint8_t *p = put_header(out, STREAM_FRAME_SCAN, sequence, length);
+    p = put_u32(p, data->vna_id);
+    p = put_u32(p, data->scan_id);
+    p = put_u32(p, data->sweep);
+    p = put_u32(p, data->scan_index);
+    p = put_u64(p, data->send_ns);
+    p = put_u64(p, data->header_ns);
+    p = put_u64(p, data->receive_ns);
+    p = put_f64(p, data->sweep_ns_per_point);
+    p = put_u32(p, pps);
+    for (int i = 0; i < pps; i++) {
+        const struct nanovna_raw_datapoint *point = &data->point[i];
+        p = put_u32(p, point->frequency);
+        p = put_f32(p, point->s11.re);
+        p = put_f32(p, point->s11.im);
+        p = put_f32(p, point->s21.re);
+        p = put_f32(p, point->s21.im);
+    }
+    return p - out;
+}
+
+size_t stream_encode_sweep(uint8_t *out, size_t size, uint32_t sequence, int scan_id, const struct sweep_event *event, int expected) {
+    if (size < STREAM_FRAME_HEADER_SIZE + STREAM_SWEEP_SIZE)
+        return 0;
+    uint8_t *p = put_header(out, STREAM_FRAME_SWEEP, sequence, STREAM_SWEEP_SIZE);
+    p = put_u32(p, scan_id);
+    p = put_u32(p, event->owner);
+    p = put_u32(p, event->sweep);
+    p = put_u32(p, event->arrived);
+    p = put_u32(p, expected);
+    *p++ = event->complete;
+    return p - out;
+}
+
+size_t stream_encode_tdr(uint8_t *out, size_t size, uint32_t sequence, const struct tdr_record *record) {
+    size_t length = STREAM_TDR_HEADER_SIZE + (size_t)record->nbr_points * STREAM_TDR_POINT_SIZE;
+    if (record->nbr_points < 0 || size < STREAM_FRAME_HEADER_SIZE + length)
+        return 0;
+    uint8_t *p = put_header(out, STREAM_FRAME_TDR, sequence, length);
+    p = put_u32(p, record->vna_id);
+    p = put_u32(p, record->scan_id);
+    p = put_u32(p, record->sweep);
+    p = put_u32(p, record->mode);
+    p = put_u64(p, record->send_ns);
+    p = put_f64(p, record->time_step);
+    p = put_u32(p, record->nbr_points);
+    for (int i = 0; i < record->nbr_points; i++) {
+        p = put_f32(p, record->response[i].re);
+        p = put_f32(p, record->response[i].im);
+    }
+    return p - out;
+}
+
+size_t stream_encode_peak(uint8_t *out, size_t size, uint32_t sequence, const struct peak_record *record) {
+    if (size < STREAM_FRAME_HEADER_SIZE + STREAM_PEAK_SIZE)
+        return 0;
+    uint8_t *p = put_header(out, STREAM_FRAME_PEAK, sequence, STREAM_PEAK_SIZE);
+    p = put_u32(p, record->vna_id);
+    p = put_u32(p, record->scan_id);
+    p = put_u32(p, record->sweep);
+    p = put_u32(p, record->mode);
+    p = put_u64(p, record->send_ns);
+    p = put_f64(p, record->frequency);
+    p = put_f64(p, record->q);
+    p = put_f64(p, record->depth);
+    p = put_f64(p, record->level);
+    *p++ = record->full_search;
+    return p - out;
+}
+
+//----------------------------------------
+// Client queues
+//----------------------------------------
+
+static void wake_server(void) {
+    // the pipe is non-blocking, if it is full the server is already due to wake
+    ssize_t ignored = write(server.wake[1], "w", 1);
+    (void)ignored;
+}
+
+/**
+ * Appends bytes to a client's queue, applying the slow consumer policy
+ * if they do not fit. Expects lock to be held.
+ *
+ * @return true if queued
+ */
+static bool queue_bytes(struct stream_client *client, const uint8_t *bytes, size_t length) {
+    if (client->fd < 0 || client->kick)
+        return false;
+    if (STREAM_QUEUE_SIZE - client->len < length) {
+        if (server.policy == STREAM_DISCONNECT) {
+            client->kick = true;
+            wake_server();
+        }
+        client->dropped++;
+        return false;
+    }
+    size_t tail = (client->head + client->len) % STREAM_QUEUE_SIZE;
+    size_t first = length < STREAM_QUEUE_SIZE - tail ? length : STREAM_QUEUE_SIZE - tail;
+    memcpy(client->queue + tail, bytes, first);
+    memcpy(client->queue, bytes + first, length - first);
+    bool was_empty = client->len == 0;
+    client->len += length;
+    client->frames++;
+    if (was_empty)
+        wake_server();
+    return true;
+}
+
+static void publish(const uint8_t *frame, size_t length, bool control) {
+    pthread_mutex_lock(&server.lock);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        if (server.clients[i].control == control)
+            queue_bytes(&server.clients[i], frame, length);
+    }
+    pthread_mutex_unlock(&server.lock);
+}
+
+void stream_publish_scan(const struct datapoint_nanoVNA_H *data, int pps) {
+    if (!server.running || server.nbr_subscribers == 0)
+        return;
+    size_t size = STREAM_FRAME_HEADER_SIZE + STREAM_SCAN_HEADER_SIZE + (size_t)pps * STREAM_POINT_SIZE;
+    uint8_t *frame = malloc(size);
+    if (!frame)
+        return;
+    size_t length = stream_encode_scan(frame, size, atomic_fetch_add(&server.sequence, 1), data, pps);
+    publish(frame, length, false);
+    free(frame);
+}
+
+void stream_publish_sweep(int scan_id, const struct sweep_event *event, int expected) {
+    if (!server.running || server.nbr_subscribers == 0)
+        return;
+    uint8_t frame[STREAM_FRAME_HEADER_SIZE + STREAM_SWEEP_SIZE];
+    size_t length = stream_encode_sweep(frame, sizeof(frame), atomic_fetch_add(&server.sequence, 1), scan_id, event, expected);
+    publish(frame, length, false);
+}
+
+void stream_publish_tdr(const struct tdr_record *record) {
+    if (!server.running || server.nbr_subscribers == 0)
+        return;
+    size_t size = STREAM_FRAME_HEADER_SIZE + STREAM_TDR_HEADER_SIZE + (size_t)record->nbr_points * STREAM_TDR_POINT_SIZE;
+    uint8_t *frame = malloc(size);
+    if (!frame)
+        return;
+    size_t length = stream_encode_tdr(frame, size, atomic_fetch_add(&server.sequence, 1), record);
+    publish(frame, length, false);
+    free(frame);
+}
+
+void stream_publish_peak(const struct peak_record *record) {
+    if (!server.running || server.nbr_subscribers == 0)
+        return;
+    uint8_t frame[STREAM_FRAME_HEADER_SIZE + STREAM_PEAK_SIZE];
+    size_t length = stream_encode_peak(frame, sizeof(frame), atomic_fetch_add(&server.sequence, 1), record);
+    publish(frame, length, false);
+}
+
+/**
+ * Closes a client's socket and frees its slot. Expects lock to be held.
+ */
+static void drop_client(struct stream_client *client) {
+    if (client->fd < 0)
+        return;
+    close(client->fd);
+    client->fd = -1;
+    free(client->queue);
+    client->queue = NULL;
+    if (!client->control)
+        server.nbr_subscribers--;
+}
+
+/**
+ * Sends as much of a client's queue as the socket will take without blocking.
+ * Expects lock to be held.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the connection has failed
+ */
+static int send_queue(struct stream_client *client) {
+    while (client->len > 0) {
+        size_t chunk = client->len < STREAM_QUEUE_SIZE - client->head ? client->len : STREAM_QUEUE_SIZE - client->head;
+        ssize_t n = send(client->fd, client->queue + client->head, chunk, MSG_NOSIGNAL);
+        if (n < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? EXIT_SUCCESS : EXIT_FAILURE;
+        client->head = (client->head + n) % STREAM_QUEUE_SIZE;
+        client->len -= n;
+    }
+    return EXIT_SUCCESS;
+}
+
+//----------------------------------------
+// Control commands
+//----------------------------------------
+
+/**
+ * Adds a complete line from a control client to the command queue.
+ * Expects lock to be held.
+ */
+static void push_command(int client_id, const char *line) {
+    struct stream_client *client = &server.clients[client_id];
+    if (server.nbr_commands == STREAM_MAX_COMMANDS) {
+        const char *busy = "command queue full, command ignored\n";
+        queue_bytes(client, (const uint8_t*)busy, strlen(busy));
+        return;
+    }
+    struct stream_command *command = &server.commands[(server.command_head + server.nbr_commands) % STREAM_MAX_COMMANDS];
+    command->client = client_id;
+    strncpy(command->line, line, STREAM_COMMAND_LENGTH - 1);
+    command->line[STREAM_COMMAND_LENGTH - 1] = '\0';
+    server.nbr_commands++;
+    ssize_t ignored = write(server.command_pipe[1], "c", 1);
+    (void)ignored;
+}
+
+/**
+ * Splits bytes received from a control client into commands.
+ * Expects lock to be held.
+ */
+static void receive_commands(int client_id, const char *bytes, size_t length) {
+    struct stream_client *client = &server.clients[client_id];
+    for (size_t i = 0; i < length; i++) {
+        if (bytes[i] == '\n') {
+            client->line[client->line_len] = '\0';
+            if (client->line_len > 0)
+                push_command(client_id, client->line);
+            client->line_len = 0;
+        } else if (bytes[i] != '\r' && client->line_len < STREAM_COMMAND_LENGTH - 1) {
+            client->line[client->line_len++] = bytes[i];
+        }
+    }
+}
+
+int stream_command_fd(void) {
+    return server.running ? server.command_pipe[0] : -1;
+}
+
+int take_stream_command(char *line, size_t size) {
+    int client = -1;
+    pthread_mutex_lock(&server.lock);
+    if (server.nbr_commands > 0) {
+        struct stream_command *command = &server.commands[server.command_head];
+        client = command->client;
+        strncpy(line, command->line, size - 1);
+        line[size - 1] = '\0';
+        server.command_head = (server.command_head + 1) % STREAM_MAX_COMMANDS;
+        server.nbr_commands--;
+        char byte;
+        ssize_t ignored = read(server.command_pipe[0], &byte, 1);
+        (void)ignored;
+    }
+    pthread_mutex_unlock(&server.lock);
+    return client;
+}
+
+void close_stream_client(int client) {
+    if (client < 0 || client >= STREAM_MAX_CLIENTS)
+        return;
+    pthread_mutex_lock(&server.lock);
+    if (server.clients[client].fd >= 0) {
+        server.clients[client].closing = true;
+        wake_server();
+    }
+    pthread_mutex_unlock(&server.lock);
+}
+
+int get_stream_clients(struct stream_client_info *clients) {
+    int count = 0;
+    pthread_mutex_lock(&server.lock);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        struct stream_client *client = &server.clients[i];
+        if (client->fd < 0)
+            continue;
+        clients[count].id = i;
+        clients[count].control = client->control;
+        snprintf(clients[count].address, sizeof(clients[count].address), "%s", client->address);
+        clients[count].frames = client->frames;
+        clients[count].dropped = client->dropped;
+        clients[count].queued = client->len;
+        count++;
+    }
+    pthread_mutex_unlock(&server.lock);
+    return count;
+}
+
+//----------------------------------------
+// Server thread
+//----------------------------------------
+
+static void accept_client(int listener, bool control) {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    int fd = accept(listener, (struct sockaddr*)&address, &length);
+    if (fd < 0)
+        return;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    uint8_t *queue = malloc(STREAM_QUEUE_SIZE);
+    pthread_mutex_lock(&server.lock);
+    int slot = -1;
+    for (int i = 0; i < STREAM_MAX_CLIENTS && slot < 0; i++) {
+        if (server.clients[i].fd < 0)
+            slot = i;
+    }
+    if (slot < 0 || !queue) {
+        pthread_mutex_unlock(&server.lock);
+        dprintf(server.console[1], "Stream client refused: %s\n", queue ? "too many clients" : "out of memory");
+        free(queue);
+        close(fd);
+        return;
+    }
+    struct stream_client *client = &server.clients[slot];
+    memset(client, 0, sizeof(*client));
+    client->fd = fd;
+    client->control = control;
+    client->queue = queue;
+    inet_ntop(AF_INET, &address.sin_addr, client->address, sizeof(client->address));
+    snprintf(client->address + strlen(client->address), sizeof(client->address) - strlen(client->address),
+             ":%u", ntohs(address.sin_port));
+    if (!control)
+        server.nbr_subscribers++;
+    pthread_mutex_unlock(&server.lock);
+}
+
+/**
+ * Copies what the program printed to the terminal and to every control client
+ *
+ * @return false once the pipe has been closed and emptied
+ */
+static bool pass_output(int which) {
+    char buffer[4096];
+    ssize_t n = read(server.output[which][0], buffer, sizeof(buffer));
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN)) {
+        close(server.output[which][0]);
+        server.output[which][0] = -1;
+        return false;
+    }
+    if (n < 0)
+        return true;
+    for (ssize_t written = 0; written < n; ) {
+        ssize_t w = write(server.console[which], buffer + written, n - written);
+        if (w < 0 && errno != EINTR)
+            break;
+        if (w > 0)
+            written += w;
+    }
+    publish((const uint8_t*)buffer, n, true);
+    return true;
+}
+
+/**
+ * Reads from a client, queueing commands from control clients.
+ * Expects lock to be held.
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the client has disconnected
+ */
+static int receive_from(int client_id) {
+    struct stream_client *client = &server.clients[client_id];
+    char buffer[512];
+    ssize_t n = recv(client->fd, buffer, sizeof(buffer), 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        return EXIT_FAILURE;
+    if (n > 0 && client->control)
+        receive_commands(client_id, buffer, n);
+    return EXIT_SUCCESS;
+}
+
+static void* stream_server_thread(void *arguments) {
+    struct pollfd fds[5 + STREAM_MAX_CLIENTS];
+    int slots[5 + STREAM_MAX_CLIENTS];
+
+    while (server.running || server.output[0][0] >= 0 || server.output[1][0] >= 0) {
+        int n = 0;
+        fds[n].fd = server.wake[0];
+        fds[n].events = POLLIN;
+        slots[n++] = -1;
+        if (server.running) {
+            fds[n].fd = server.data_listener;
+            fds[n].events = POLLIN;
+            slots[n++] = -2;
+            fds[n].fd = server.control_listener;
+            fds[n].events = POLLIN;
+            slots[n++] = -3;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (server.output[i][0] >= 0) {
+                fds[n].fd = server.output[i][0];
+                fds[n].events = POLLIN;
+                slots[n++] = -4 - i;
+            }
+        }
+        pthread_mutex_lock(&server.lock);
+        for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+            if (server.clients[i].fd >= 0) {
+                fds[n].fd = server.clients[i].fd;
+                fds[n].events = POLLIN | (server.clients[i].len > 0 ? POLLOUT : 0);
+                slots[n++] = i;
+            }
+        }
+        pthread_mutex_unlock(&server.lock);
+
+        if (poll(fds, n, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            dprintf(server.console[1], "Stream server poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int k = 0; k < n; k++) {
+            if (!fds[k].revents)
+                continue;
+            if (slots[k] == -1) {
+                char scratch[64];
+                while (read(server.wake[0], scratch, sizeof(scratch)) > 0);
+            } else if (slots[k] == -2 || slots[k] == -3) {
+                accept_client(fds[k].fd, slots[k] == -3);
+            } else if (slots[k] <= -4) {
+                pass_output(-4 - slots[k]);
+            } else {
+                pthread_mutex_lock(&server.lock);
+                struct stream_client *client = &server.clients[slots[k]];
+                bool failed = false;
+                if (fds[k].revents & (POLLIN | POLLHUP | POLLERR))
+                    failed = receive_from(slots[k]) != EXIT_SUCCESS;
+                if (!failed && (fds[k].revents & POLLOUT))
+                    failed = send_queue(client) != EXIT_SUCCESS;
+                if (failed)
+                    drop_client(client);
+                pthread_mutex_unlock(&server.lock);
+            }
+        }
+
+        pthread_mutex_lock(&server.lock);
+        for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+            struct stream_client *client = &server.clients[i];
+            if (client->fd >= 0 && (client->kick || (client->closing && client->len == 0)))
+                drop_client(client);
+        }
+        pthread_mutex_unlock(&server.lock);
+    }
+
+    // one last try at sending whatever is still queued
+    pthread_mutex_lock(&server.lock);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        if (server.clients[i].fd >= 0) {
+            send_queue(&server.clients[i]);
+            drop_client(&server.clients[i]);
+        }
+    }
+    server.nbr_commands = 0;
+    pthread_mutex_unlock(&server.lock);
+    return NULL;
+}
+
+//----------------------------------------
+// Starting and stopping
+//----------------------------------------
+
+/**
+ * Opens a TCP socket listening on every interface
+ *
+ * @param port port to listen on, 0 for any
+ * @param bound set to the port actually listened on
+ * @return the socket, or -1 on error
+ */
+static int open_listener(uint16_t port, uint16_t *bound) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    socklen_t length = sizeof(address);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, STREAM_MAX_CLIENTS) != 0
+            || getsockname(fd, (struct sockaddr*)&address, &length) != 0) {
+        fprintf(stderr, "Error listening on port %u: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    *bound = ntohs(address.sin_port);
+    return fd;
+}
+
+static int open_pipe(int fds[2], bool nonblocking) {
+    if (pipe(fds) != 0) {
+        fprintf(stderr, "Error creating pipe: %s\n", strerror(errno));
+        fds[0] = fds[1] = -1;
+        return EXIT_FAILURE;
+    }
+    if (nonblocking) {
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    }
+    return EXIT_SUCCESS;
+}
+
+static void close_fd(int *fd) {
+    if (*fd >= 0)
+        close(*fd);
+    *fd = -1;
+}
+
+static void close_server_fds(void) {
+    close_fd(&server.data_listener);
+    close_fd(&server.control_listener);
+    for (int i = 0; i < 2; i++) {
+        close_fd(&server.wake[i]);
+        close_fd(&server.command_pipe[i]);
+        close_fd(&server.console[i]);
+        close_fd(&server.output[i][0]);
+        close_fd(&server.output[i][1]);
+    }
+}
+
+int start_stream_server(uint16_t data_port, uint16_t control_port, StreamPolicy policy) {
+    if (server.running) {
+        fprintf(stderr, "Stream server already running\n");
+        return EXIT_FAILURE;
+    }
+    server.data_listener = server.control_listener = -1;
+    for (int i = 0; i < 2; i++) {
+        server.wake[i] = server.command_pipe[i] = server.console[i] = -1;
+        server.output[i][0] = server.output[i][1] = -1;
+    }
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        server.clients[i].fd = -1;
+        server.clients[i].queue = NULL;
+    }
+    server.policy = policy;
+    server.nbr_subscribers = 0;
+    server.nbr_commands = 0;
+    server.command_head = 0;
+
+    server.data_listener = open_listener(data_port, &server.data_port);
+    server.control_listener = open_listener(control_port, &server.control_port);
+    if (server.data_listener < 0 || server.control_listener < 0
+            || open_pipe(server.wake, true) != EXIT_SUCCESS
+            || open_pipe(server.command_pipe, true) != EXIT_SUCCESS
+            || open_pipe(server.output[0], false) != EXIT_SUCCESS
+            || open_pipe(server.output[1], false) != EXIT_SUCCESS) {
+        close_server_fds();
+        return EXIT_FAILURE;
+    }
+    fcntl(server.output[0][0], F_SETFL, fcntl(server.output[0][0], F_GETFL) | O_NONBLOCK);
+    fcntl(server.output[1][0], F_SETFL, fcntl(server.output[1][0], F_GETFL) | O_NONBLOCK);
+
+    // pass stdout and stderr through the server thread from now on
+    fflush(stdout);
+    fflush(stderr);
+    server.console[0] = dup(STDOUT_FILENO);
+    server.console[1] = dup(STDERR_FILENO);
+    if (server.console[0] < 0 || server.console[1] < 0) {
+        fprintf(stderr, "Error duplicating stdout: %s\n", strerror(errno));
+        close_server_fds();
+        return EXIT_FAILURE;
+    }
+    dup2(server.output[0][1], STDOUT_FILENO);
+    dup2(server.output[1][1], STDERR_FILENO);
+
+    server.running = true;
+    int err = pthread_create(&server.thread, NULL, &stream_server_thread, NULL);
+    if (err != 0) {
+        server.running = false;
+        dup2(server.console[0], STDOUT_FILENO);
+        dup2(server.console[1], STDERR_FILENO);
+        fprintf(stderr, "Error %i creating stream server thread: %s\n", err, strerror(err));
+        close_server_fds();
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void stop_stream_server(void) {
+    if (!server.running)
+        return;
+    fflush(stdout);
+    fflush(stderr);
+    dup2(server.console[0], STDOUT_FILENO);
+    dup2(server.console[1], STDERR_FILENO);
+    // the server thread finishes once it has passed on everything left in the pipes
+    close_fd(&server.output[0][1]);
+    close_fd(&server.output[1][1]);
+    server.running = false;
+    wake_server();
+    pthread_join(server.thread, NULL);
+    close_server_fds();
+}
+
+bool is_streaming(void) {
+    return server.running;
+}
+
+int get_stream_ports(uint16_t *data_port, uint16_t *control_port) {
+    if (!server.running)
+        return EXIT_FAILURE;
+    *data_port = server.data_port;
+    *control_port = server.control_port;
+    return EXIT_SUCCESS;
+}
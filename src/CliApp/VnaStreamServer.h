@@ -0,0 +1,255 @@
+#ifndef VNASTREAMSERVER_H_
+#define VNASTREAMSERVER_H_
+
+#include "VnaScanMultithreaded.h"
+#include "VnaTdr.h"
+#include "VnaPeak.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+
+#define STREAM_MAX_CLIENTS 16
+#define STREAM_MAX_COMMANDS 16
+#define STREAM_COMMAND_LENGTH 256
+
+/**
+ * Bytes each client may have waiting to be sent before the slow
+ * consumer policy applies (about 500 scans of 101 points)
+ */
+#define STREAM_QUEUE_SIZE (1 << 20)
+
+/**
+ * Binary framing of the data port
+ *
+ * Every frame starts with a STREAM_FRAME_HEADER_SIZE byte header, all
+ * integers little endian:
+ *     0  magic     "VNAS"
+ *     4  version   uint16, STREAM_FRAME_VERSION
+ *     6  type      uint16, STREAM_FRAME_SCAN, STREAM_FRAME_SWEEP,
+ *                  STREAM_FRAME_TDR or STREAM_FRAME_PEAK
+ *     8  sequence  uint32, counts every frame published, so a gap shows
+ *                  frames were dropped for this subscriber
+ *     12 length    uint32, bytes of payload following the header
+ *
+ * A STREAM_FRAME_SCAN payload is one datapoint_nanoVNA_H:
+ *     0  vna_id, scan_id, sweep, scan_index     int32 each
+ *     16 send_ns, header_ns, receive_ns         uint64 each
+ *     40 sweep_ns_per_point                     float64
+ *     48 number of points                       uint32
+ *     52 the points, STREAM_POINT_SIZE bytes each, laid out as the
+ *        NanoVNA sends them: frequency uint32, then s11 re, s11 im,
+ *        s21 re, s21 im as float32
+ *
+ * A STREAM_FRAME_SWEEP payload reports a sweep_event:
+ *     0  scan_id, owner, sweep, arrived, expected   int32 each
+ *     20 complete                                  uint8
+ *
+ * A STREAM_FRAME_TDR payload is one tdr_record (see VnaTdr.h):
+ *     0  vna_id, scan_id, sweep, mode              int32 each
+ *     16 send_ns                                   uint64
+ *     24 time_step in seconds                      float64
+ *     32 number of points                          uint32
+ *     36 the responses, STREAM_TDR_POINT_SIZE bytes each: re, im as float32
+ *
+ * A STREAM_FRAME_PEAK payload is one peak_record (see VnaPeak.h):
+ *     0  vna_id, scan_id, sweep, mode              int32 each
+ *     16 send_ns                                   uint64
+ *     24 frequency, q, depth, level                float64 each
+ *     56 full_search                               uint8
+ */
+#define STREAM_FRAME_MAGIC "VNAS"
+#define STREAM_FRAME_VERSION 1
+#define STREAM_FRAME_HEADER_SIZE 16
+#define STREAM_FRAME_SCAN 1
+#define STREAM_FRAME_SWEEP 2
+#define STREAM_SCAN_HEADER_SIZE 52
+#define STREAM_POINT_SIZE 20
+#define STREAM_SWEEP_SIZE 21
+#define STREAM_FRAME_TDR 3
+#define STREAM_TDR_HEADER_SIZE 36
+#define STREAM_TDR_POINT_SIZE 8
+#define STREAM_FRAME_PEAK 4
+#define STREAM_PEAK_SIZE 57
+
+/**
+ * What happens when a client's queue is full
+ *
+ * STREAM_DROP       - the new frame (or text) is dropped for that client only
+ * STREAM_DISCONNECT - the client is disconnected
+ */
+typedef enum {
+    STREAM_DROP,
+    STREAM_DISCONNECT
+} StreamPolicy;
+
+/**
+ * A snapshot of one connected client, for listing
+ */
+struct stream_client_info {
+    int id;
+    bool control;         // control (text) connection, otherwise data subscriber
+    char address[64];
+    long frames;          // frames (or text chunks) queued for sending
+    long dropped;         // frames (or text chunks) dropped as the queue was full
+    size_t queued;        // bytes waiting to be sent
+};
+
+/**
+ * Encodes a scan as a STREAM_FRAME_SCAN frame
+ *
+ * @param out buffer to write the frame to
+ * @param size size of out
+ * @param sequence sequence number to put in the header
+ * @param data the scan
+ * @param pps number of points in the scan
+ * @return bytes written, or 0 if out is too small
+ */
+size_t stream_encode_scan(uint8_t *out, size_t size, uint32_t sequence, const struct datapoint_nanoVNA_H *data, int pps);
+
+/**
+ * Encodes a sweep event as a STREAM_FRAME_SWEEP frame
+ *
+ * @param out buffer to write the frame to
+ * @param size size of out
+ * @param sequence sequence number to put in the header
+ * @param scan_id the scan the sweep belongs to
+ * @param event the sweep event
+ * @param expected sub-bands per sweep
+ * @return bytes written, or 0 if out is too small
+ */
+size_t stream_encode_sweep(uint8_t *out, size_t size, uint32_t sequence, int scan_id, const struct sweep_event *event, int expected);
+
+/**
+ * Encodes a time domain response as a STREAM_FRAME_TDR frame
+ *
+ * @param out buffer to write the frame to
+ * @param size size of out
+ * @param sequence sequence number to put in the header
+ * @param record the response
+ * @return bytes written, or 0 if out is too small
+ */
+size_t stream_encode_tdr(uint8_t *out, size_t size, uint32_t sequence, const struct tdr_record *record);
+
+/**
+ * Encodes a resonance as a STREAM_FRAME_PEAK frame
+ *
+ * @param out buffer to write the frame to
+ * @param size size of out
+ * @param sequence sequence number to put in the header
+ * @param record the resonance
+ * @return bytes written, or 0 if out is too small
+ */
+size_t stream_encode_peak(uint8_t *out, size_t size, uint32_t sequence, const struct peak_record *record);
+
+/**
+ * Starts the streaming server
+ *
+ * Data subscribers connect to data_port and receive every scan published
+ * from then on, framed as above. Clients of control_port send the usual
+ * text commands, one per line, and receive everything the program prints.
+ * Each client has its own queue, sent by the server thread, so publishing
+ * never waits on the network.
+ *
+ * While running, stdout and stderr are passed through the server thread,
+ * which copies them to the terminal and to control clients.
+ *
+ * @param data_port TCP port for data subscribers, 0 for any free port
+ * @param control_port TCP port for control clients, 0 for any free port
+ * @param policy what to do with a client whose queue is full
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on error or if already running
+ */
+int start_stream_server(uint16_t data_port, uint16_t control_port, StreamPolicy policy);
+
+/**
+ * Disconnects all clients and stops the streaming server, passing
+ * stdout and stderr straight to the terminal again
+ */
+void stop_stream_server(void);
+
+/**
+ * @return true if the streaming server is running
+ */
+bool is_streaming(void);
+
+/**
+ * Finds the ports the server is listening on, useful when started with port 0
+ *
+ * @param data_port set to the data port
+ * @param control_port set to the control port
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if not running
+ */
+int get_stream_ports(uint16_t *data_port, uint16_t *control_port);
+
+/**
+ * Queues a scan for every data subscriber, without blocking
+ *
+ * @param data the scan, not kept after returning
+ * @param pps number of points in the scan
+ */
+void stream_publish_scan(const struct datapoint_nanoVNA_H *data, int pps);
+
+/**
+ * Queues a sweep event for every data subscriber, without blocking
+ *
+ * @param scan_id the scan the sweep belongs to
+ * @param event the sweep event
+ * @param expected sub-bands per sweep
+ */
+void stream_publish_sweep(int scan_id, const struct sweep_event *event, int expected);
+
+/**
+ * Queues a time domain response for every data subscriber, without blocking
+ *
+ * @param record the response, not kept after returning
+ */
+void stream_publish_tdr(const struct tdr_record *record);
+
+/**
+ * Queues a resonance for every data subscriber, without blocking
+ *
+ * @param record the resonance
+ */
+void stream_publish_peak(const struct peak_record *record);
+
+/**
+ * File descriptor that becomes readable when a control client has sent a command
+ *
+ * @return the descriptor, or -1 if not running
+ */
+int stream_command_fd(void);
+
+/**
+ * Takes the oldest command sent by a control client
+ *
+ * @param line buffer to copy the command to, without its line ending
+ * @param size size of line
+ * @return id of the client that sent it, or -1 if there are no commands waiting
+ */
+int take_stream_command(char *line, size_t size);
+
+/**
+ * Disconnects a client once everything queued for it has been sent
+ *
+ * @param client id of the client
+ */
+void close_stream_client(int client);
+
+/**
+ * Lists the connected clients
+ *
+ * @param clients array of at least STREAM_MAX_CLIENTS to fill
+ * @return number of clients
+ */
+int get_stream_clients(struct stream_client_info *clients);
+
+#endif
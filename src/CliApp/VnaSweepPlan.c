@@ -0,0 +1,302 @@
+#include "VnaSweepPlan.h"
+
+int create_sweep_plan(struct sweep_plan *plan, uint64_t start, uint64_t stop, int nbr_scans, int pps) {
+    if (nbr_scans < 1 || pps < 1 || stop <= start) {
+        fprintf(stderr, "Invalid sweep plan: %d scans of %d points, %" PRIu64 "-%" PRIu64 " Hz\n",
+                nbr_scans, pps, start, stop);
+        return EXIT_FAILURE;
+    }
+    uint64_t nbr_points = (uint64_t)nbr_scans * pps;
+    if (nbr_points > INT32_MAX) {
+        fprintf(stderr, "Cannot fit %" PRIu64 " distinct points into %" PRIu64 "-%" PRIu64 " Hz\n",
+                nbr_points, start, stop);
+        return EXIT_FAILURE;
+    }
+    return create_sweep_plan_points(plan, start, stop, (int)nbr_points, pps);
+}
+
+int create_sweep_plan_points(struct sweep_plan *plan, uint64_t start, uint64_t stop, int nbr_points, int pps) {
+    if (nbr_points < 1 || pps < 1 || stop <= start) {
+        fprintf(stderr, "Invalid sweep plan: %d points in scans of %d, %" PRIu64 "-%" PRIu64 " Hz\n",
+                nbr_points, pps, start, stop);
+        return EXIT_FAILURE;
+    }
+    uint64_t span = stop - start;
+    // need at least two points, at least 1 Hz apart, and span*k must not overflow
+    if (nbr_points < 2 || span < (uint64_t)nbr_points - 1 || span > UINT64_MAX / (uint64_t)(nbr_points - 1)) {
+        fprintf(stderr, "Cannot fit %d distinct points into %" PRIu64 "-%" PRIu64 " Hz\n",
+                nbr_points, start, stop);
+        return EXIT_FAILURE;
+    }
+    if (pps > nbr_points)
+        pps = nbr_points;
+    int nbr_scans = (nbr_points + pps - 1) / pps;
+
+    plan->freqs = malloc(sizeof(uint64_t) * nbr_points);
+    plan->scans = malloc(sizeof(struct scan_range) * nbr_scans);
+    if (!plan->freqs || !plan->scans) {
+        fprintf(stderr, "Failed to allocate memory for sweep plan\n");
+        free(plan->freqs);
+        free(plan->scans);
+        plan->freqs = NULL;
+        plan->scans = NULL;
+        return EXIT_FAILURE;
+    }
+
+    plan->start = start;
+    plan->stop = stop;
+    plan->nbr_scans = nbr_scans;
+    plan->pps = pps;
+    plan->nbr_points = nbr_points;
+    plan->uniform = true;
+
+    for (uint64_t k = 0; k < (uint64_t)nbr_points; k++)
+        plan->freqs[k] = start + (span * k) / (uint64_t)(nbr_points - 1);
+
+    for (int s = 0; s < nbr_scans; s++) {
+        int first = s * pps;
+        int points = nbr_points - first < pps ? nbr_points - first : pps;
+        plan->scans[s].first_bin = first;
+        plan->scans[s].start = plan->freqs[first];
+        plan->scans[s].stop = plan->freqs[first + points - 1];
+        plan->scans[s].pps = points;
+    }
+    return EXIT_SUCCESS;
+}
+
+int plan_resolution(int nbr_points, int max_pps, int parallel, int nbr_sweeps,
+                    double command_ns, double point_ns, int *nbr_scans, int *pps) {
+    if (nbr_points < 1 || max_pps < 1)
+        return EXIT_FAILURE;
+    if (parallel < 1)
+        parallel = 1;
+
+    // no use splitting into more than one scan per VNA per sweep
+    int fewest = (nbr_points + max_pps - 1) / max_pps;
+    int most = fewest * parallel < nbr_points ? fewest * parallel : nbr_points;
+    int best_scans = fewest;
+    double best_ns = -1;
+    for (int split = fewest; split <= most; split++) {
+        int size = (nbr_points + split - 1) / split;
+        int scans = (nbr_points + size - 1) / size;
+        double scan_ns = command_ns + size * point_ns;
+        double run_ns;
+        if (nbr_sweeps < 1) {
+            // idle VNAs start on the next sweep, so only the total work matters
+            run_ns = scans * scan_ns / parallel;
+        } else {
+            long rounds = ((long)nbr_sweeps * scans + parallel - 1) / parallel;
+            run_ns = rounds * scan_ns;
+        }
+        // ties go to fewer scans, which is less work in total
+        if (best_ns < 0 || run_ns < best_ns) {
+            best_ns = run_ns;
+            best_scans = scans;
+        }
+    }
+
+    // spread the points evenly, so the last scan is never much shorter
+    *pps = (nbr_points + best_scans - 1) / best_scans;
+    *nbr_scans = (nbr_points + *pps - 1) / *pps;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Checks the firmware's evenly spaced points from freqs[first] to freqs[last]
+ * are each within 1 Hz of the grid
+ */
+static bool fits_one_scan(const uint64_t *freqs, int first, int last) {
+    uint64_t span = freqs[last] - freqs[first];
+    for (int k = first + 1; k < last; k++) {
+        uint64_t even = freqs[first] + span * (uint64_t)(k - first) / (uint64_t)(last - first);
+        uint64_t diff = freqs[k] > even ? freqs[k] - even : even - freqs[k];
+        if (diff > 1)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Appends a segment's points to the grid, leaving out a first point
+ * equal to the last one already there
+ *
+ * @return number of points in the grid afterwards
+ */
+static int add_segment_points(uint64_t *freqs, int nbr_points, const struct sweep_segment *segment, int max_pps) {
+    int n = segment->points;
+    uint64_t span = segment->stop - segment->start;
+    double ratio = log((double)segment->stop / (double)segment->start);
+    for (int k = 0; k < n; k++) {
+        uint64_t freq;
+        if (segment->spacing == SPACING_LINEAR) {
+            freq = segment->start + span * (uint64_t)k / (uint64_t)(n - 1);
+        } else {
+            // ends of each scan's worth of points on the log curve, evenly spaced between
+            int first = k / max_pps * max_pps;
+            int last = first + max_pps - 1 < n - 1 ? first + max_pps - 1 : n - 1;
+            uint64_t low = (uint64_t)llround(segment->start * exp(ratio * first / (n - 1)));
+            uint64_t high = (uint64_t)llround(segment->start * exp(ratio * last / (n - 1)));
+            if (last == n - 1)
+                high = segment->stop;
+            freq = last == first ? low : low + (high - low) * (uint64_t)(k - first) / (uint64_t)(last - first);
+        }
+        if (k == 0 && nbr_points > 0 && freqs[nbr_points - 1] == freq)
+            continue;
+        freqs[nbr_points++] = freq;
+    }
+    return nbr_points;
+}
+
+int create_segmented_sweep_plan(struct sweep_plan *plan, const struct sweep_segment *segments, int nbr_segments, int max_pps) {
+    if (nbr_segments < 1 || nbr_segments > MAX_SWEEP_SEGMENTS || max_pps < 2) {
+        fprintf(stderr, "Invalid sweep plan: %d segments, up to %d points per scan\n", nbr_segments, max_pps);
+        return EXIT_FAILURE;
+    }
+    uint64_t total = 0;
+    for (int i = 0; i < nbr_segments; i++) {
+        const struct sweep_segment *segment = &segments[i];
+        if (segment->points < 2 || segment->start == 0 || segment->stop <= segment->start
+            || segment->stop - segment->start < (uint64_t)segment->points - 1) {
+            fprintf(stderr, "Invalid segment %d: %d points, %" PRIu64 "-%" PRIu64 " Hz\n",
+                    i, segment->points, segment->start, segment->stop);
+            return EXIT_FAILURE;
+        }
+        if (i > 0 && segment->start < segments[i-1].stop) {
+            fprintf(stderr, "Segment %d (from %" PRIu64 " Hz) overlaps the one before it (to %" PRIu64 " Hz)\n",
+                    i, segment->start, segments[i-1].stop);
+            return EXIT_FAILURE;
+        }
+        total += segment->points;
+    }
+    if (total > INT32_MAX) {
+        fprintf(stderr, "Too many points in sweep plan: %" PRIu64 "\n", total);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t *freqs = malloc(sizeof(uint64_t) * total);
+    // never more scans than points
+    struct scan_range *scans = malloc(sizeof(struct scan_range) * total);
+    if (!freqs || !scans) {
+        fprintf(stderr, "Failed to allocate memory for sweep plan\n");
+        free(freqs);
+        free(scans);
+        return EXIT_FAILURE;
+    }
+
+    int nbr_points = 0;
+    for (int i = 0; i < nbr_segments; i++)
+        nbr_points = add_segment_points(freqs, nbr_points, &segments[i], max_pps);
+    for (int k = 1; k < nbr_points; k++) {
+        if (freqs[k] <= freqs[k-1]) {
+            fprintf(stderr, "Points too close together to tell apart near %" PRIu64 " Hz\n", freqs[k]);
+            free(freqs);
+            free(scans);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // greedily take the longest run that fits in one scan, which gives the
+    // fewest scans for a grid made of evenly spaced runs
+    int nbr_scans = 0;
+    int most_pps = 0;
+    for (int first = 0; first < nbr_points; ) {
+        int last = first;
+        while (last + 1 < nbr_points && last + 1 - first < max_pps && fits_one_scan(freqs, first, last + 1))
+            last++;
+        scans[nbr_scans++] = (struct scan_range){first, freqs[first], freqs[last], last - first + 1};
+        if (last - first + 1 > most_pps)
+            most_pps = last - first + 1;
+        first = last + 1;
+    }
+
+    plan->start = freqs[0];
+    plan->stop = freqs[nbr_points - 1];
+    plan->nbr_scans = nbr_scans;
+    plan->pps = most_pps;
+    plan->nbr_points = nbr_points;
+    plan->uniform = false;
+    plan->freqs = freqs;
+    struct scan_range *shrunk = realloc(scans, sizeof(struct scan_range) * nbr_scans);
+    plan->scans = shrunk ? shrunk : scans;
+    return EXIT_SUCCESS;
+}
+
+uint64_t sweep_plan_uniform_scans(const struct sweep_plan *plan, int max_pps) {
+    if (plan->nbr_points < 2 || max_pps < 1)
+        return plan->nbr_scans;
+    uint64_t step = UINT64_MAX;
+    for (int k = 1; k < plan->nbr_points; k++) {
+        if (plan->freqs[k] - plan->freqs[k-1] < step)
+            step = plan->freqs[k] - plan->freqs[k-1];
+    }
+    uint64_t points = (plan->stop - plan->start) / step + 1;
+    return (points + max_pps - 1) / max_pps;
+}
+
+void destroy_sweep_plan(struct sweep_plan *plan) {
+    free(plan->freqs);
+    free(plan->scans);
+    plan->freqs = NULL;
+    plan->scans = NULL;
+}
+
+const struct scan_range* sweep_plan_scan(const struct sweep_plan *plan, int scan) {
+    if (scan < 0 || scan >= plan->nbr_scans)
+        return NULL;
+    return &plan->scans[scan];
+}
+
+/**
+ * Smallest grid index whose frequency is at or above start + offset.
+ * Inverts freqs[k] = start + floor(span*k/(n-1)), so k = ceil(offset*(n-1)/span).
+ */
+static uint64_t ceil_bin(const struct sweep_plan *plan, uint64_t offset) {
+    uint64_t span = plan->stop - plan->start;
+    uint64_t scaled = offset * (uint64_t)(plan->nbr_points - 1);
+    return scaled / span + (scaled % span != 0);
+}
+
+/**
+ * Smallest grid index whose frequency is at or above freq, found by binary
+ * search, for grids that don't follow the formula. freq must be within the band.
+ */
+static uint64_t search_bin(const struct sweep_plan *plan, uint64_t freq) {
+    uint64_t low = 0;
+    uint64_t high = plan->nbr_points - 1;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        if (plan->freqs[middle] < freq)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+int sweep_plan_bin(const struct sweep_plan *plan, uint64_t freq) {
+    if (freq < plan->start || freq > plan->stop)
+        return -1;
+    if (!plan->uniform) {
+        uint64_t k = search_bin(plan, freq);
+        return plan->freqs[k] == freq ? (int)k : -1;
+    }
+    uint64_t k = ceil_bin(plan, freq - plan->start);
+    return plan->freqs[k] == freq ? (int)k : -1;
+}
+
+int sweep_plan_nearest_bin(const struct sweep_plan *plan, uint64_t freq) {
+    uint64_t half_step = (plan->stop - plan->start) / (plan->nbr_points - 1) / 2;
+    if (!plan->uniform && plan->nbr_points > 1) {
+        half_step = freq < plan->start ? (plan->freqs[1] - plan->freqs[0]) / 2
+            : (plan->freqs[plan->nbr_points - 1] - plan->freqs[plan->nbr_points - 2]) / 2;
+    }
+    if (freq < plan->start)
+        return plan->start - freq <= half_step ? 0 : -1;
+    if (freq > plan->stop)
+        return freq - plan->stop <= half_step ? plan->nbr_points - 1 : -1;
+
+    uint64_t k = plan->uniform ? ceil_bin(plan, freq - plan->start) : search_bin(plan, freq);
+    if (k > 0 && freq - plan->freqs[k-1] < plan->freqs[k] - freq)
+        k--;
+    return (int)k;
+}
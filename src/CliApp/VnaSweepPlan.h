@@ -0,0 +1,205 @@
+#ifndef VNASWEEPPLAN_H_
+#define VNASWEEPPLAN_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <math.h>
+
+#define MAX_SWEEP_SEGMENTS 32
+
+/**
+ * How the points of a sweep segment are spread out
+ *
+ * SPACING_LINEAR - evenly, the same number of Hz apart
+ * SPACING_LOG    - the same ratio apart, so denser at the low end. The
+ *                  firmware only scans evenly spaced points, so each scan
+ *                  command's ends lie on the log curve and the points
+ *                  between them are evenly spaced.
+ */
+typedef enum {
+    SPACING_LINEAR,
+    SPACING_LOG
+} SegmentSpacing;
+
+/**
+ * One frequency range of a segmented sweep, with its own density
+ *
+ * start   - first frequency in Hz
+ * stop    - last frequency in Hz, above start
+ * points  - number of points from start to stop inclusive, at least 2
+ * spacing - how the points are spread between start and stop
+ */
+struct sweep_segment {
+    uint64_t start;
+    uint64_t stop;
+    int points;
+    SegmentSpacing spacing;
+};
+
+/**
+ * The frequency range covered by one scan command of a sweep
+ *
+ * first_bin - index into the plan's grid of this scan's first point
+ * start     - frequency of the first point in Hz
+ * stop      - frequency of the last point in Hz
+ * pps       - points taken by this scan
+ */
+struct scan_range {
+    int first_bin;
+    uint64_t start;
+    uint64_t stop;
+    int pps;
+};
+
+/**
+ * Precomputed plan of every frequency visited by one sweep
+ *
+ * The grid has nbr_points points, point k being exactly
+ * start + floor((stop-start)*k / (nbr_points-1)), worked out in 64 bits so
+ * it never drifts and the last point is always stop. Scan s covers points
+ * s*pps to s*pps+pps-1 of the grid, the last scan taking whatever is left.
+ *
+ * A segmented plan (see create_segmented_sweep_plan) has any strictly
+ * increasing grid, its scans may have different numbers of points, and pps
+ * is the most points any scan has.
+ *
+ * A plan is read-only once created, so it can be shared between threads
+ * without locking.
+ */
+struct sweep_plan {
+    uint64_t start;
+    uint64_t stop;
+    int nbr_scans;
+    int pps;
+    int nbr_points;
+    bool uniform;               // grid follows the formula above
+    uint64_t *freqs;            // nbr_points frequencies, strictly increasing
+    struct scan_range *scans;   // nbr_scans ranges
+};
+
+/**
+ * Builds the frequency grid and scan ranges for a sweep
+ *
+ * @param plan pointer to the space reserved for this struct (uninitialised)
+ * @param start first frequency in Hz
+ * @param stop last frequency in Hz, must be above start
+ * @param nbr_scans number of scan commands the sweep is split into
+ * @param pps points per scan
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on invalid arguments,
+ *         a grid too fine for the band, or failed allocation
+ */
+int create_sweep_plan(struct sweep_plan *plan, uint64_t start, uint64_t stop, int nbr_scans, int pps);
+
+/**
+ * Builds the frequency grid and scan ranges for a sweep of an exact number
+ * of points, which need not be a multiple of pps
+ *
+ * @param plan pointer to the space reserved for this struct (uninitialised)
+ * @param start first frequency in Hz
+ * @param stop last frequency in Hz, must be above start
+ * @param nbr_points number of points in the sweep
+ * @param pps points per scan, the last scan having fewer if they don't divide evenly
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on invalid arguments,
+ *         a grid too fine for the band, or failed allocation
+ */
+int create_sweep_plan_points(struct sweep_plan *plan, uint64_t start, uint64_t stop, int nbr_points, int pps);
+
+/**
+ * Chooses how to split a sweep of exactly nbr_points into scan commands
+ *
+ * Each scan command is taken to cost command_ns plus point_ns per point, and
+ * the split chosen is the one that finishes the run soonest with its scans
+ * shared between parallel VNAs, as the task scheduler does. With one VNA,
+ * or sweeps following each other without end, that is always the fewest
+ * commands. A short run of shared sweeps finishes sooner with smaller scans,
+ * so every VNA has one. The points are spread evenly between the scans, so
+ * only the last may have fewer, and by less than the number of scans.
+ *
+ * @param nbr_points points wanted in the sweep
+ * @param max_pps most points a single scan command may take
+ * @param parallel number of VNAs sharing each sweep's scans (1 if not shared)
+ * @param nbr_sweeps number of sweeps in the run, or 0 if it runs until stopped
+ * @param command_ns fixed time per scan command
+ * @param point_ns time per point
+ * @param nbr_scans set to the number of scans
+ * @param pps set to the points per scan (the last scan takes the rest)
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if nbr_points or max_pps is below 1
+ */
+int plan_resolution(int nbr_points, int max_pps, int parallel, int nbr_sweeps,
+                    double command_ns, double point_ns, int *nbr_scans, int *pps);
+
+/**
+ * Builds the frequency grid and scan ranges for a sweep made of segments
+ *
+ * The segments' points are joined into one grid (a point shared by the end of
+ * one segment and the start of the next is only visited once), which is then
+ * covered with as few scan commands as possible: each scan takes the longest
+ * run of points, up to max_pps, that the firmware's evenly spaced points match
+ * to within 1 Hz. Adjoining segments with the same spacing share scans.
+ *
+ * @param plan pointer to the space reserved for this struct (uninitialised)
+ * @param segments the segments, in increasing order of frequency, not overlapping
+ * @param nbr_segments number of segments, 1 to MAX_SWEEP_SEGMENTS
+ * @param max_pps most points a single scan command may take
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on invalid or overlapping segments,
+ *         points too close together to tell apart, or failed allocation
+ */
+int create_segmented_sweep_plan(struct sweep_plan *plan, const struct sweep_segment *segments, int nbr_segments, int max_pps);
+
+/**
+ * Works out how many scan commands a sweep over the same band would need
+ * if every point were as close together as the closest two in the plan
+ *
+ * @param plan the plan to compare
+ * @param max_pps most points a single scan command may take
+ * @return number of scans
+ */
+uint64_t sweep_plan_uniform_scans(const struct sweep_plan *plan, int max_pps);
+
+/**
+ * Frees the grid and ranges of a plan (but not the plan struct itself)
+ *
+ * @param plan pointer to the plan to clean up
+ */
+void destroy_sweep_plan(struct sweep_plan *plan);
+
+/**
+ * Gets the range of one scan in the plan
+ *
+ * @param plan the plan to read from
+ * @param scan index of the scan, 0 to nbr_scans-1
+ * @return pointer to the range, or NULL if scan is out of range
+ */
+const struct scan_range* sweep_plan_scan(const struct sweep_plan *plan, int scan);
+
+/**
+ * Finds which grid point a frequency is, in constant time
+ *
+ * The index is computed directly from the grid formula and then checked
+ * against the table, so no search is needed. Segmented plans are searched
+ * instead, in logarithmic time.
+ *
+ * @param plan the plan to look in
+ * @param freq frequency in Hz
+ * @return index into plan->freqs, or -1 if freq is not on the grid
+ */
+int sweep_plan_bin(const struct sweep_plan *plan, uint64_t freq);
+
+/**
+ * Finds the grid point closest to a frequency, in constant time
+ * (logarithmic for segmented plans)
+ *
+ * Useful for points reported by a VNA, as the firmware works out each scan's
+ * own points and can land a hertz away from the sweep grid.
+ *
+ * @param plan the plan to look in
+ * @param freq frequency in Hz
+ * @return index into plan->freqs of the nearest point, or -1 if freq is
+ *         more than half a grid step (the first or last step for segmented
+ *         plans) outside the band
+ */
+int sweep_plan_nearest_bin(const struct sweep_plan *plan, uint64_t freq);
+
+#endif
@@ -0,0 +1,303 @@
+#include "VnaTdr.h"
+
+#include <math.h>
+#include <time.h>
+
+//----------------------------------------
+// FFT
+//----------------------------------------
+
+int create_fft_plan(struct fft_plan *plan, int size) {
+    memset(plan, 0, sizeof(*plan));
+    if (size < 2 || size > TDR_MAX_SIZE || (size & (size - 1)) != 0)
+        return EXIT_FAILURE;
+    plan->size = size;
+    plan->bitrev = malloc(size * sizeof(int));
+    plan->cos_table = malloc(size / 2 * sizeof(double));
+    plan->sin_table = malloc(size / 2 * sizeof(double));
+    if (!plan->bitrev || !plan->cos_table || !plan->sin_table) {
+        fprintf(stderr, "Failed to allocate memory for FFTs of %d points\n", size);
+        destroy_fft_plan(plan);
+        return EXIT_FAILURE;
+    }
+    int bits = __builtin_ctz(size);
+    for (int i = 0; i < size; i++) {
+        int r = 0;
+        for (int b = 0; b < bits; b++)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        plan->bitrev[i] = r;
+    }
+    for (int k = 0; k < size / 2; k++) {
+        plan->cos_table[k] = cos(2 * M_PI * k / size);
+        plan->sin_table[k] = sin(2 * M_PI * k / size);
+    }
+    return EXIT_SUCCESS;
+}
+
+void destroy_fft_plan(struct fft_plan *plan) {
+    free(plan->bitrev);
+    free(plan->cos_table);
+    free(plan->sin_table);
+    memset(plan, 0, sizeof(*plan));
+}
+
+void fft(const struct fft_plan *plan, double *re, double *im, bool inverse) {
+    int n = plan->size;
+    for (int i = 0; i < n; i++) {
+        int j = plan->bitrev[i];
+        if (j > i) {
+            double t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+    double sign = inverse ? 1 : -1;
+    for (int half = 1; half < n; half *= 2) {
+        // twiddles for butterflies of span 2 * half are every (n / 2 / half)th entry
+        int stride = n / (2 * half);
+        for (int start = 0; start < n; start += 2 * half) {
+            for (int k = 0; k < half; k++) {
+                double wr = plan->cos_table[k * stride];
+                double wi = sign * plan->sin_table[k * stride];
+                int a = start + k, b = a + half;
+                double tr = re[b] * wr - im[b] * wi;
+                double ti = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
+
+//----------------------------------------
+// Names
+//----------------------------------------
+
+const char *tdr_mode_name(TdrMode mode) {
+    switch (mode) {
+    case TDR_OFF:
+        return "off";
+    case TDR_IMPULSE:
+        return "impulse";
+    case TDR_STEP:
+        return "step";
+    }
+    return "unknown";
+}
+
+const char *tdr_window_name(TdrWindow window) {
+    switch (window) {
+    case TDR_RECTANGULAR:
+        return "rectangular";
+    case TDR_HANN:
+        return "hann";
+    case TDR_BLACKMAN:
+        return "blackman";
+    }
+    return "unknown";
+}
+
+int parse_tdr_mode(const char *name, TdrMode *mode) {
+    const TdrMode modes[] = {TDR_OFF, TDR_IMPULSE, TDR_STEP};
+    for (size_t i = 0; i < sizeof(modes)/sizeof(modes[0]); i++) {
+        if (strcmp(name, tdr_mode_name(modes[i])) == 0) {
+            *mode = modes[i];
+            return EXIT_SUCCESS;
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+int parse_tdr_window(const char *name, TdrWindow *window) {
+    const TdrWindow windows[] = {TDR_RECTANGULAR, TDR_HANN, TDR_BLACKMAN};
+    for (size_t i = 0; i < sizeof(windows)/sizeof(windows[0]); i++) {
+        if (strcmp(name, tdr_window_name(windows[i])) == 0) {
+            *window = windows[i];
+            return EXIT_SUCCESS;
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+//----------------------------------------
+// Stage
+//----------------------------------------
+
+static double window_weight(TdrWindow window, int k, int n) {
+    if (n < 2)
+        return 1;
+    double x = 2 * M_PI * k / (n - 1);
+    switch (window) {
+    case TDR_HANN:
+        return 0.5 - 0.5 * cos(x);
+    case TDR_BLACKMAN:
+        return 0.42 - 0.5 * cos(x) + 0.08 * cos(2 * x);
+    default:
+        return 1;
+    }
+}
+
+int init_tdr_stage(struct tdr_stage *stage, const struct sweep_plan *plan, TdrMode mode, TdrWindow window) {
+    memset(stage, 0, sizeof(*stage));
+    stage->mode = mode;
+    stage->plan = plan;
+    int n = plan->nbr_points;
+    if (n < 2) {
+        fprintf(stderr, "TDR needs sweeps of at least 2 points\n");
+        return EXIT_FAILURE;
+    }
+    // the transform assumes evenly spaced points, which rounding to whole Hz barely disturbs
+    stage->frequency_step = (double)(plan->freqs[n - 1] - plan->freqs[0]) / (n - 1);
+    for (int i = 1; i < n; i++) {
+        if (fabs((plan->freqs[i] - plan->freqs[i - 1]) - stage->frequency_step) > 1 + 1e-3 * stage->frequency_step) {
+            fprintf(stderr, "TDR needs evenly spaced points, not segments or log spacing\n");
+            return EXIT_FAILURE;
+        }
+    }
+    int size = 2;
+    while (size < TDR_OVERSAMPLE * n && size < TDR_MAX_SIZE)
+        size *= 2;
+    if (size < TDR_OVERSAMPLE * n) {
+        fprintf(stderr, "TDR needs sweeps of at most %d points\n", TDR_MAX_SIZE / TDR_OVERSAMPLE);
+        return EXIT_FAILURE;
+    }
+    stage->window = malloc(n * sizeof(double));
+    stage->work_re = malloc(size * sizeof(double));
+    stage->work_im = malloc(size * sizeof(double));
+    stage->response = malloc(size * sizeof(struct complex));
+    if (!stage->window || !stage->work_re || !stage->work_im || !stage->response
+            || create_fft_plan(&stage->fft, size) != EXIT_SUCCESS) {
+        fprintf(stderr, "Failed to allocate memory for TDR of %d points\n", size);
+        destroy_tdr_stage(stage);
+        return EXIT_FAILURE;
+    }
+    double sum = 0;
+    for (int k = 0; k < n; k++) {
+        stage->window[k] = window_weight(window, k, n);
+        sum += stage->window[k];
+    }
+    stage->scale = 1 / sum;
+    return EXIT_SUCCESS;
+}
+
+void destroy_tdr_stage(struct tdr_stage *stage) {
+    for (int v = 0; v < MAXIMUM_VNA_PORTS; v++) {
+        for (int s = 0; s < SWEEP_TRACKER_SLOTS; s++) {
+            free(stage->sweeps[v][s].re);
+            free(stage->sweeps[v][s].im);
+        }
+    }
+    destroy_fft_plan(&stage->fft);
+    free(stage->window);
+    free(stage->work_re);
+    free(stage->work_im);
+    free(stage->response);
+    memset(stage, 0, sizeof(*stage));
+}
+
+void tdr_transform(struct tdr_stage *stage, const double *re, const double *im, struct tdr_record *record) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int n = stage->plan->nbr_points;
+    int size = stage->fft.size;
+    for (int k = 0; k < n; k++) {
+        stage->work_re[k] = re[k] * stage->window[k];
+        stage->work_im[k] = im[k] * stage->window[k];
+    }
+    memset(stage->work_re + n, 0, (size - n) * sizeof(double));
+    memset(stage->work_im + n, 0, (size - n) * sizeof(double));
+    fft(&stage->fft, stage->work_re, stage->work_im, true);
+
+    double sum_re = 0, sum_im = 0;
+    for (int k = 0; k < size; k++) {
+        double r = stage->work_re[k] * stage->scale;
+        double i = stage->work_im[k] * stage->scale;
+        if (stage->mode == TDR_STEP) {
+            sum_re += r;
+            sum_im += i;
+            r = sum_re;
+            i = sum_im;
+        }
+        stage->response[k] = (struct complex){(float)r, (float)i};
+    }
+    record->mode = stage->mode;
+    record->time_step = 1 / (size * stage->frequency_step);
+    record->nbr_points = size;
+    record->response = stage->response;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    uint64_t ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+    stage->transforms++;
+    stage->transform_ns += ns;
+    if (ns > stage->longest_ns)
+        stage->longest_ns = ns;
+}
+
+/**
+ * Finds the slot gathering a VNA's sweep, taking a free one (or the
+ * oldest) if it has none
+ *
+ * @return the slot, or NULL if memory for it couldn't be allocated
+ */
+static struct tdr_sweep *find_sweep(struct tdr_stage *stage, int vna_id, int sweep) {
+    struct tdr_sweep *slots = stage->sweeps[vna_id];
+    struct tdr_sweep *slot = NULL;
+    for (int s = 0; s < SWEEP_TRACKER_SLOTS; s++) {
+        if (slots[s].used && slots[s].sweep == sweep)
+            return &slots[s];
+        if (!slot || (slot->used && (!slots[s].used || slots[s].sweep < slot->sweep)))
+            slot = &slots[s];
+    }
+    if (slot->used)
+        stage->abandoned++;
+    if (!slot->re) {
+        int n = stage->plan->nbr_points;
+        slot->re = malloc(n * sizeof(double));
+        slot->im = malloc(n * sizeof(double));
+        if (!slot->re || !slot->im) {
+            fprintf(stderr, "Failed to allocate memory for TDR of VNA %d\n", vna_id);
+            free(slot->re);
+            free(slot->im);
+            slot->re = slot->im = NULL;
+            slot->used = false;
+            return NULL;
+        }
+    }
+    slot->used = true;
+    slot->sweep = sweep;
+    slot->arrived = 0;
+    slot->send_ns = UINT64_MAX;
+    return slot;
+}
+
+bool tdr_add_scan(struct tdr_stage *stage, const struct datapoint_nanoVNA_H *data, struct tdr_record *record) {
+    if (data->vna_id < 0 || data->vna_id >= MAXIMUM_VNA_PORTS)
+        return false;
+    const struct scan_range *range = sweep_plan_scan(stage->plan, data->scan_index);
+    if (!range || range->pps != data->pps)
+        return false;
+    struct tdr_sweep *slot = find_sweep(stage, data->vna_id, data->sweep);
+    if (!slot)
+        return false;
+    for (int i = 0; i < data->pps; i++) {
+        slot->re[range->first_bin + i] = data->point[i].s11.re;
+        slot->im[range->first_bin + i] = data->point[i].s11.im;
+    }
+    if (data->send_ns < slot->send_ns)
+        slot->send_ns = data->send_ns;
+    if (++slot->arrived < stage->plan->nbr_scans)
+        return false;
+
+    slot->used = false;
+    tdr_transform(stage, slot->re, slot->im, record);
+    record->vna_id = data->vna_id;
+    record->scan_id = data->scan_id;
+    record->sweep = data->sweep;
+    record->send_ns = slot->send_ns;
+    return true;
+}
@@ -0,0 +1,195 @@
+#ifndef VNATDR_H_
+#define VNATDR_H_
+
+#include "VnaScanMultithreaded.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+/**
+ * Time domain (TDR) responses of S11, worked out as each sweep of a VNA
+ * completes
+ *
+ * A sweep's N points of S11 (calibrated, if the VNA has a calibration) are
+ * multiplied by a window, zero padded to the first power of two of at
+ * least TDR_OVERSAMPLE * N, and transformed by an inverse FFT. Response k
+ * is then the reflection arriving k * time_step seconds after the incident
+ * wave, where time_step = 1 / (size * frequency step), so the response
+ * covers 1 / (frequency step) seconds (the round trip to anything further
+ * away aliases back to the start). It is scaled so a single reflection of
+ * S11 = G shows as a peak of G.
+ *
+ * The step response is the running sum of the impulse response. Like the
+ * NanoVNA's own low pass modes, it only means much when the sweep starts
+ * near DC with the start frequency equal to the frequency step.
+ */
+#define TDR_OVERSAMPLE 2
+
+/**
+ * Most points a transform can have, which at 8 bytes a point keeps a
+ * record's stream frame within half of a client's STREAM_QUEUE_SIZE
+ */
+#define TDR_MAX_SIZE 65536
+
+/**
+ * Precomputed tables for FFTs of one size
+ *
+ * A plan is read-only once created, so it can be shared between threads
+ * without locking.
+ */
+struct fft_plan {
+    int size;           // a power of two
+    int *bitrev;        // size entries, the bit reversal of each index
+    double *cos_table;  // size / 2 entries, cos(2 pi k / size)
+    double *sin_table;  // size / 2 entries, sin(2 pi k / size)
+};
+
+/**
+ * One time domain response of a VNA's sweep
+ */
+struct tdr_record {
+    int vna_id;
+    int scan_id;
+    int sweep;
+    TdrMode mode;
+    uint64_t send_ns;               // monotonic_ns() when the sweep's first scan command was written
+    double time_step;               // seconds between responses
+    int nbr_points;
+    const struct complex *response; // nbr_points responses
+};
+
+/**
+ * S11 of one sweep of a VNA, gathered as its scans arrive
+ */
+struct tdr_sweep {
+    bool used;
+    int sweep;
+    int arrived;        // scans of the sweep so far
+    uint64_t send_ns;   // earliest send time of those scans
+    double *re;         // the plan's nbr_points S11 values
+    double *im;
+};
+
+/**
+ * Gathers each VNA's sweeps and transforms them as they complete
+ *
+ * Each VNA has SWEEP_TRACKER_SLOTS sweeps in progress at most; if a scan
+ * of another sweep arrives, the oldest is given up on, as its missing
+ * scans must have been dropped.
+ */
+struct tdr_stage {
+    TdrMode mode;
+    const struct sweep_plan *plan;
+    double frequency_step;          // Hz between points of the plan
+    struct fft_plan fft;
+    double *window;                 // plan->nbr_points weights
+    double scale;                   // 1 / the sum of the weights
+    struct tdr_sweep sweeps[MAXIMUM_VNA_PORTS][SWEEP_TRACKER_SLOTS];
+    double *work_re;                // fft.size values being transformed
+    double *work_im;
+    struct complex *response;       // fft.size responses of the last record
+    long transforms;                // records made
+    long abandoned;                 // sweeps given up on before they completed
+    uint64_t transform_ns;          // total time spent transforming
+    uint64_t longest_ns;            // longest transform
+};
+
+/**
+ * Builds the tables for FFTs of one size
+ *
+ * @param plan pointer to the space reserved for this struct (uninitialised)
+ * @param size number of points, a power of two from 2 to TDR_MAX_SIZE
+ * @return EXIT_SUCCESS, or EXIT_FAILURE on a bad size or failed allocation
+ */
+int create_fft_plan(struct fft_plan *plan, int size);
+
+/**
+ * Frees the tables of a plan (but not the struct itself)
+ *
+ * @param plan pointer to the plan to clean up
+ */
+void destroy_fft_plan(struct fft_plan *plan);
+
+/**
+ * Transforms plan->size complex values in place (iterative radix-2)
+ *
+ * The forward transform is X[k] = sum x[n] e^(-2 pi i n k / size), the
+ * inverse uses e^(+2 pi i n k / size). Neither is scaled.
+ *
+ * @param plan tables for the size of the data
+ * @param re real parts
+ * @param im imaginary parts
+ * @param inverse true for the inverse transform
+ */
+void fft(const struct fft_plan *plan, double *re, double *im, bool inverse);
+
+/**
+ * Sets up a stage for sweeps of one plan
+ *
+ * @param stage pointer to the space reserved for this struct (uninitialised)
+ * @param plan the plan of the sweeps, which must have evenly spaced points
+ *        and outlive the stage
+ * @param mode TDR_IMPULSE or TDR_STEP
+ * @param window the window to apply
+ * @return EXIT_SUCCESS, or EXIT_FAILURE (with a message) if the plan's points
+ *         aren't evenly spaced, there are too many, or allocation failed
+ */
+int init_tdr_stage(struct tdr_stage *stage, const struct sweep_plan *plan, TdrMode mode, TdrWindow window);
+
+/**
+ * Frees everything a stage allocated (but not the struct itself)
+ *
+ * @param stage pointer to the stage to clean up
+ */
+void destroy_tdr_stage(struct tdr_stage *stage);
+
+/**
+ * Adds a scan's S11 to its VNA's sweep, and transforms the sweep if this
+ * scan completes it
+ *
+ * @param stage the stage
+ * @param data the scan
+ * @param record filled in if the sweep completed; its response is the
+ *        stage's, valid until the next call
+ * @return true if record was filled in
+ */
+bool tdr_add_scan(struct tdr_stage *stage, const struct datapoint_nanoVNA_H *data, struct tdr_record *record);
+
+/**
+ * Transforms the S11 of a whole sweep (without gathering it scan by scan)
+ *
+ * @param stage the stage
+ * @param re real parts of the plan's nbr_points S11 values
+ * @param im imaginary parts
+ * @param record filled in, apart from its vna_id, scan_id, sweep and send_ns
+ */
+void tdr_transform(struct tdr_stage *stage, const double *re, const double *im, struct tdr_record *record);
+
+/**
+ * Parses the name of a mode ("off", "impulse" or "step")
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if it isn't one
+ */
+int parse_tdr_mode(const char *name, TdrMode *mode);
+
+/**
+ * Parses the name of a window ("rectangular", "hann" or "blackman")
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if it isn't one
+ */
+int parse_tdr_window(const char *name, TdrWindow *window);
+
+/**
+ * @return the name of a mode, as parse_tdr_mode takes it
+ */
+const char *tdr_mode_name(TdrMode mode);
+
+/**
+ * @return the name of a window, as parse_tdr_window takes it
+ */
+const char *tdr_window_name(TdrWindow window);
+
+#endif /* VNATDR_H_ */
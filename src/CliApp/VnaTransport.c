@@ -0,0 +1,784 @@
+#include "VnaTransport.h"
+#include <glob.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+//----------------------------------------
+// Serial ports (termios)
+//----------------------------------------
+
+/**
+ * Opens a serial port without configuring it, trying any connected
+ * usbmodem device on apple if a ttyACM path doesn't exist
+ *
+ * @return File descriptor on success, -1 on failure
+ */
+static int open_serial_fd(const char *port) {
+    int fd = open(port, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+         // 2. Dyanmic port detection (MacOS)
+        #ifdef __APPLE__
+        if (strstr(port, "ttyACM") != NULL) {
+            // Checking for the "/dev/cy.usbmodem*" pattern
+            glob_t glob_result;
+
+            if (glob("/dev/cu.usbmodem*", 0, NULL, &glob_result) == 0) {
+                int i = 0;
+                while (i < glob_result.gl_pathc && fd < 0) {
+                    char *candidate = glob_result.gl_pathv[i];
+
+                    // Attempt to open the candidate port
+                    fd = open(candidate, O_RDWR | O_NOCTTY);
+                    i++;
+                }
+                globfree(&glob_result);
+            }
+        }
+        if (fd < 0) {
+            fprintf(stderr, "Error opening serial port %s: %s\n", port, strerror(errno));
+            return -1;
+        }
+        #else
+        fprintf(stderr, "Error opening serial port %s: %s\n", port, strerror(errno));
+        return -1;
+        #endif
+    }
+    return fd;
+}
+
+int open_serial(const char *port, struct termios *init_tty) {
+    int fd = open_serial_fd(port);
+    if (fd < 0)
+        return -1;
+
+    if (configure_serial(fd,init_tty) != 0) {
+        fprintf(stderr, "Error configuring port %s: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int configure_serial(int serial_port, struct termios *initial_tty) {
+    int error = tcgetattr(serial_port, initial_tty); // put actual initial tty in
+    if (error != 0) {
+        fprintf(stderr, "Error %i from tcgetattr: %s\n", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct termios tty = *initial_tty; // copy for editing
+
+    // Configure baud rate (115200)
+    cfsetispeed(&tty, B115200);  // Input speed
+    cfsetospeed(&tty, B115200);  // Output speed
+
+    // Configure 8N1 (8 data bits, no parity, 1 stop bit)
+    tty.c_cflag &= ~PARENB;  // Clear parity bit (no parity)
+    tty.c_cflag &= ~CSTOPB;  // Clear stop bit (1 stop bit)
+    tty.c_cflag &= ~CSIZE;   // Clear data size bits
+    tty.c_cflag |= CS8;      // Set 8 data bits
+
+    // Disable hardware flow control
+    #ifdef CRTSCTS
+    tty.c_cflag &= ~CRTSCTS;
+    #elif defined(CNEW_RTSCTS)
+    tty.c_cflag &= ~CNEW_RTSCTS;
+    #endif
+
+    tty.c_cflag |= CREAD | CLOCAL;  // Turn on READ & ignore modem control lines
+
+    // Set RAW mode (binary communication, no line processing)
+    tty.c_lflag &= ~ICANON;  // Disable canonical mode (line-by-line)
+    tty.c_lflag &= ~ECHO;    // Disable echo
+    tty.c_lflag &= ~ECHOE;   // Disable erasure
+    tty.c_lflag &= ~ECHONL;  // Disable new-line echo
+    tty.c_lflag &= ~ISIG;    // Disable interpretation of INTR, QUIT and SUSP
+
+    // Disable software flow control
+    tty.c_iflag &= ~(IXON | IXOFF | IXANY);
+    
+    // Disable special handling of received bytes
+    tty.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL);
+    
+    // Prevent special interpretation of output bytes
+    tty.c_oflag &= ~OPOST;  // Disable output processing
+    tty.c_oflag &= ~ONLCR;  // Prevent conversion of newline to carriage return/line feed
+
+    // Set timeout configuration
+    // VMIN = 0, VTIME > 0: Timeout with no minimum bytes
+    // Read returns when data arrives or timeout expires
+    tty.c_cc[VMIN] = 0;   // No minimum
+    tty.c_cc[VTIME] = 10; // 1 second timeout (tenths of a second)
+
+    // Apply settings
+    if (tcsetattr(serial_port, TCSANOW, &tty) != 0) {
+        fprintf(stderr, "Error %i from tcsetattr: %s\n", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int restore_serial(int fd, const struct termios *settings) {
+    if (tcsetattr(fd, TCSANOW, settings) != 0) {
+        return errno;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * State of a serial port transport
+ *
+ * initial    - settings the port had before configure, restored on close
+ * configured - whether initial holds anything yet
+ */
+struct termios_state {
+    struct termios initial;
+    bool configured;
+};
+
+static int termios_open(struct vna_transport *transport, const char *path) {
+    struct termios_state *state = calloc(1, sizeof(struct termios_state));
+    if (!state)
+        return EXIT_FAILURE;
+    transport->fd = open_serial_fd(path);
+    if (transport->fd < 0) {
+        free(state);
+        return EXIT_FAILURE;
+    }
+    transport->state = state;
+    return EXIT_SUCCESS;
+}
+
+static int termios_configure(struct vna_transport *transport) {
+    struct termios_state *state = transport->state;
+    struct termios current;
+    // keep the settings from before the first configure to restore later
+    if (configure_serial(transport->fd, state->configured ? &current : &state->initial) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+    state->configured = true;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Waits up to timeout_ms for the transport's fd to have bytes to read,
+ * or for it to be interrupted
+ *
+ * @return 1 if readable, 0 on timeout, -1 on error or interrupt
+ *         (errno ECANCELED)
+ */
+static int wait_readable(struct vna_transport *transport, int timeout_ms) {
+    struct pollfd pfds[2] = {
+        {transport->fd, POLLIN, 0},
+        {transport->interrupt[0], POLLIN, 0}
+    };
+    int ready;
+    do {
+        ready = poll(pfds, 2, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    if (ready < 0) {
+        fprintf(stderr, "Error polling fd %d: %s\n", transport->fd, strerror(errno));
+        return -1;
+    }
+    if (pfds[1].revents & POLLIN) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return ready;
+}
+
+static ssize_t termios_read_some(struct vna_transport *transport, uint8_t *buffer, size_t length, int timeout_ms) {
+    int ready = wait_readable(transport, timeout_ms);
+    if (ready <= 0)
+        return ready;
+    ssize_t n = read(transport->fd, buffer, length);
+    if (n < 0)
+        fprintf(stderr, "Error reading from fd %d: %s\n", transport->fd, strerror(errno));
+    return n;
+}
+
+static ssize_t termios_write_all(struct vna_transport *transport, const uint8_t *bytes, size_t length) {
+    size_t written = 0;
+    while (written < length) {
+        ssize_t n = write(transport->fd, bytes + written, length - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error writing to fd %d: %s\n", transport->fd, strerror(errno));
+            return -1;
+        }
+        written += n;
+    }
+    return written;
+}
+
+static int termios_flush(struct vna_transport *transport) {
+    return tcflush(transport->fd, TCIFLUSH) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void termios_close(struct vna_transport *transport) {
+    struct termios_state *state = transport->state;
+    if (state->configured && restore_serial(transport->fd, &state->initial) != 0)
+        fprintf(stderr, "Error %i restoring settings on fd %d: %s\n", errno, transport->fd, strerror(errno));
+    if (close(transport->fd) != 0)
+        fprintf(stderr, "Error %i closing fd %d: %s\n", errno, transport->fd, strerror(errno));
+    free(state);
+}
+
+const struct vna_transport_ops termios_transport = {
+    "", termios_open, termios_configure, termios_read_some, termios_write_all, termios_flush, termios_close
+};
+
+//----------------------------------------
+// In-memory emulated VNA
+//----------------------------------------
+
+#define MEMORY_LINE_LENGTH 128
+#define MEMORY_INFO "Board: NanoVNA-H\r\n" \
+    "2019-2022 Copyright NanoVNA.com\r\n" \
+    "based on  @DiSlord @edy555 ... source\r\n" \
+    "Licensed under GPL.\r\n" \
+    "Version: 1.2.14 [p:101, IF:12k, ADC:192k, Lcd:320x240]\r\n" \
+    "Build Time: Aug 31 2022 - 13:23:46\r\n" \
+    "Architecture: ARMv6-M Core Variant: Cortex-M0\r\n" \
+    "Platform: STM32F072xB Entry Level Medium Density devices\r\n"
+#define MEMORY_VERSION "NanoVNA-H v1.0-MEMORY-EMULATOR\r\nch> "
+#define MEMORY_PROMPT "ch> "
+
+/**
+ * State of a memory transport
+ *
+ * out      - bytes waiting to be read, from out[head] to out[head+len-1]
+ * line     - command being received, up to the next \r
+ * rng      - xorshift state for the emulated readings
+ */
+struct memory_state {
+    uint8_t *out;
+    size_t head;
+    size_t len;
+    size_t capacity;
+    char line[MEMORY_LINE_LENGTH];
+    size_t line_len;
+    uint64_t rng;
+};
+
+static int memory_queue(struct memory_state *state, const void *bytes, size_t length) {
+    if (state->head > 0 && state->head + state->len + length > state->capacity) {
+        memmove(state->out, state->out + state->head, state->len);
+        state->head = 0;
+    }
+    if (state->len + length > state->capacity) {
+        size_t capacity = state->capacity ? state->capacity : 4096;
+        while (capacity < state->len + length)
+            capacity *= 2;
+        uint8_t *grown = realloc(state->out, capacity);
+        if (!grown)
+            return EXIT_FAILURE;
+        state->out = grown;
+        state->capacity = capacity;
+    }
+    memcpy(state->out + state->head + state->len, bytes, length);
+    state->len += length;
+    return EXIT_SUCCESS;
+}
+
+static float memory_random(struct memory_state *state, float low, float high) {
+    uint64_t x = state->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    state->rng = x;
+    return low + (high - low) * (float)((x * 0x2545F4914F6CDD1DULL) >> 40) / (float)(1 << 24);
+}
+
+/**
+ * Queues the reply to one scan command, laid out as the firmware sends it
+ */
+static void memory_scan(struct memory_state *state, char *args) {
+    char *save = NULL;
+    char *tok[4];
+    for (int i = 0; i < 4; i++)
+        tok[i] = strtok_r(i == 0 ? args : NULL, " ", &save);
+    if (!tok[3]) {
+        memory_queue(state, MEMORY_PROMPT, strlen(MEMORY_PROMPT));
+        return;
+    }
+    uint64_t start = strtoull(tok[0], NULL, 10);
+    uint64_t stop = strtoull(tok[1], NULL, 10);
+    uint16_t points = (uint16_t)atoi(tok[2]);
+    uint16_t mask = (uint16_t)atoi(tok[3]);
+
+    uint8_t header[4] = {mask & 0xff, mask >> 8, points & 0xff, points >> 8};
+    memory_queue(state, header, sizeof(header));
+    uint64_t steps = points > 1 ? points - 1 : 1;
+    for (int i = 0; i < points; i++) {
+        uint32_t freq = (uint32_t)(start + (stop - start) * i / steps);
+        float values[4] = {
+            memory_random(state, -1, 1), memory_random(state, -1, 1),
+            memory_random(state, -0.5, 0.5), memory_random(state, -0.5, 0.5)
+        };
+        uint8_t pkt[20] = {freq & 0xff, (freq >> 8) & 0xff, (freq >> 16) & 0xff, freq >> 24};
+        memcpy(pkt + 4, values, sizeof(values));
+        memory_queue(state, pkt, sizeof(pkt));
+    }
+}
+
+static void memory_command(struct memory_state *state, char *line) {
+    while (*line == ' ' || *line == '\n')
+        line++;
+    if (strncmp(line, "scan ", 5) == 0) {
+        memory_scan(state, line + 5);
+    } else if (strcmp(line, "info") == 0) {
+        memory_queue(state, MEMORY_INFO, strlen(MEMORY_INFO));
+    } else if (strcmp(line, "version") == 0) {
+        memory_queue(state, MEMORY_VERSION, strlen(MEMORY_VERSION));
+    } else {
+        memory_queue(state, MEMORY_PROMPT, strlen(MEMORY_PROMPT));
+    }
+}
+
+static int memory_open(struct vna_transport *transport, const char *path) {
+    struct memory_state *state = calloc(1, sizeof(struct memory_state));
+    if (!state)
+        return EXIT_FAILURE;
+    // FNV-1a of the name, so each emulated VNA sends its own repeatable data
+    state->rng = 14695981039346656037ULL;
+    for (const char *c = path; *c; c++)
+        state->rng = (state->rng ^ (uint8_t)*c) * 1099511628211ULL;
+    if (state->rng == 0)
+        state->rng = 1;
+    transport->state = state;
+    transport->fd = -1;
+    return EXIT_SUCCESS;
+}
+
+static int memory_configure(struct vna_transport *transport) {
+    return EXIT_SUCCESS;
+}
+
+static ssize_t memory_read_some(struct vna_transport *transport, uint8_t *buffer, size_t length, int timeout_ms) {
+    struct memory_state *state = transport->state;
+    // nothing more will arrive while we wait, so don't
+    size_t n = length < state->len ? length : state->len;
+    memcpy(buffer, state->out + state->head, n);
+    state->head += n;
+    state->len -= n;
+    if (state->len == 0)
+        state->head = 0;
+    return n;
+}
+
+static ssize_t memory_write_all(struct vna_transport *transport, const uint8_t *bytes, size_t length) {
+    struct memory_state *state = transport->state;
+    for (size_t i = 0; i < length; i++) {
+        if (bytes[i] == '\r') {
+            state->line[state->line_len] = '\0';
+            memory_command(state, state->line);
+            state->line_len = 0;
+        } else if (state->line_len < MEMORY_LINE_LENGTH - 1) {
+            state->line[state->line_len++] = bytes[i];
+        }
+    }
+    return length;
+}
+
+static int memory_flush(struct vna_transport *transport) {
+    struct memory_state *state = transport->state;
+    state->head = 0;
+    state->len = 0;
+    return EXIT_SUCCESS;
+}
+
+static void memory_close(struct vna_transport *transport) {
+    struct memory_state *state = transport->state;
+    free(state->out);
+    free(state);
+}
+
+const struct vna_transport_ops memory_transport = {
+    MEMORY_PREFIX, memory_open, memory_configure, memory_read_some, memory_write_all, memory_flush, memory_close
+};
+
+int memory_transport_feed(struct vna_transport *transport, const void *bytes, size_t length) {
+    if (transport->ops != &memory_transport)
+        return EXIT_FAILURE;
+    return memory_queue(transport->state, bytes, length);
+}
+
+//----------------------------------------
+// Capture replay
+//----------------------------------------
+
+/**
+ * State of a replay transport
+ *
+ * data         - every byte received in the capture, in order
+ * len          - number of bytes in data
+ * pos          - index of the next byte to serve
+ * commands     - index into data at which each command was sent, ascending
+ * nbr_commands - number of entries in commands
+ * next_command - first entry of commands not yet matched by a write
+ */
+struct replay_state {
+    uint8_t *data;
+    size_t len;
+    size_t pos;
+    size_t *commands;
+    size_t nbr_commands;
+    size_t next_command;
+};
+
+/**
+ * Reads a capture file and keeps the bytes that were received from the VNA,
+ * and where in them each command was sent
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the file is not a valid capture
+ */
+static int load_replay(int fd, struct replay_state *replay) {
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)strlen(CAPTURE_MAGIC))
+        return EXIT_FAILURE;
+
+    size_t size = info.st_size;
+    uint8_t *file = malloc(size);
+    uint8_t *data = malloc(size);
+    // every record is at least 5 bytes
+    size_t *commands = malloc(sizeof(size_t) * (size / 5 + 1));
+    if (!file || !data || !commands) {
+        free(file);
+        free(data);
+        free(commands);
+        return EXIT_FAILURE;
+    }
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = read(fd, file + got, size - got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+
+    int error = EXIT_SUCCESS;
+    size_t len = 0;
+    size_t nbr_commands = 0;
+    size_t i = strlen(CAPTURE_MAGIC);
+    if (got != size || memcmp(file, CAPTURE_MAGIC, i) != 0)
+        error = EXIT_FAILURE;
+    while (error == EXIT_SUCCESS && i < size) {
+        if (size - i < 5) {
+            error = EXIT_FAILURE;
+            break;
+        }
+        char direction = file[i];
+        size_t length = file[i+1] | (file[i+2] << 8) | (file[i+3] << 16) | ((size_t)file[i+4] << 24);
+        i += 5;
+        if (length > size - i) {
+            error = EXIT_FAILURE;
+        } else if (direction == CAPTURE_RECEIVED) {
+            memcpy(data + len, file + i, length);
+            len += length;
+        } else if (direction == CAPTURE_SENT) {
+            commands[nbr_commands++] = len;
+        } else if (direction != CAPTURE_DISCARDED) {
+            error = EXIT_FAILURE;
+        }
+        i += length;
+    }
+    free(file);
+
+    if (error != EXIT_SUCCESS) {
+        fprintf(stderr, "Not a valid capture file\n");
+        free(data);
+        free(commands);
+        return EXIT_FAILURE;
+    }
+    replay->data = data;
+    replay->len = len;
+    replay->pos = 0;
+    replay->commands = commands;
+    replay->nbr_commands = nbr_commands;
+    replay->next_command = 0;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Goes back to the start of the capture once all of it has been served
+ */
+static void replay_wrap(struct replay_state *replay) {
+    if (replay->pos == replay->len) {
+        replay->pos = 0;
+        replay->next_command = 0;
+    }
+}
+
+/**
+ * @return true if the capture had a command sent at the current position
+ *         that has not yet been matched by a write
+ */
+static bool replay_waiting(const struct replay_state *replay) {
+    return replay->next_command < replay->nbr_commands &&
+           replay->commands[replay->next_command] <= replay->pos;
+}
+
+static int replay_open(struct vna_transport *transport, const char *path) {
+    struct replay_state *replay = calloc(1, sizeof(struct replay_state));
+    if (!replay)
+        return EXIT_FAILURE;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening capture file %s: %s\n", path, strerror(errno));
+        free(replay);
+        return EXIT_FAILURE;
+    }
+    int error = load_replay(fd, replay);
+    close(fd);
+    if (error != EXIT_SUCCESS) {
+        free(replay);
+        return EXIT_FAILURE;
+    }
+    transport->state = replay;
+    transport->fd = -1;
+    return EXIT_SUCCESS;
+}
+
+static int replay_configure(struct vna_transport *transport) {
+    return EXIT_SUCCESS;
+}
+
+static ssize_t replay_read_some(struct vna_transport *transport, uint8_t *buffer, size_t length, int timeout_ms) {
+    struct replay_state *replay = transport->state;
+    replay_wrap(replay);
+    if (replay_waiting(replay))
+        return 0;
+
+    // serve up to the end of this reply
+    size_t end = replay->next_command < replay->nbr_commands ? replay->commands[replay->next_command] : replay->len;
+    size_t n = end - replay->pos;
+    if (n > length)
+        n = length;
+    memcpy(buffer, replay->data + replay->pos, n);
+    replay->pos += n;
+    return n;
+}
+
+static ssize_t replay_write_all(struct vna_transport *transport, const uint8_t *bytes, size_t length) {
+    struct replay_state *replay = transport->state;
+    replay_wrap(replay);
+    if (replay_waiting(replay))
+        replay->next_command++;
+    return length;
+}
+
+static int replay_flush(struct vna_transport *transport) {
+    struct replay_state *replay = transport->state;
+    if (!replay_waiting(replay)) {
+        replay->pos = replay->next_command < replay->nbr_commands ? replay->commands[replay->next_command] : replay->len;
+        replay_wrap(replay);
+    }
+    return EXIT_SUCCESS;
+}
+
+static void replay_close(struct vna_transport *transport) {
+    struct replay_state *replay = transport->state;
+    free(replay->data);
+    free(replay->commands);
+    free(replay);
+}
+
+const struct vna_transport_ops replay_transport = {
+    REPLAY_PREFIX, replay_open, replay_configure, replay_read_some, replay_write_all, replay_flush, replay_close
+};
+
+//----------------------------------------
+// TCP
+//----------------------------------------
+
+static int tcp_open(struct vna_transport *transport, const char *path) {
+    char host[256];
+    const char *colon = strrchr(path, ':');
+    if (!colon || colon == path || (size_t)(colon - path) >= sizeof(host)) {
+        fprintf(stderr, "TCP address must be of the form host:port, not %s\n", path);
+        return EXIT_FAILURE;
+    }
+    memcpy(host, path, colon - path);
+    host[colon - path] = '\0';
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses;
+    int err = getaddrinfo(host, colon + 1, &hints, &addresses);
+    if (err != 0) {
+        fprintf(stderr, "Error looking up %s: %s\n", path, gai_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *address = addresses; address && fd < 0; address = address->ai_next) {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        fprintf(stderr, "Error connecting to %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    transport->fd = fd;
+    transport->state = NULL;
+    return EXIT_SUCCESS;
+}
+
+static int tcp_configure(struct vna_transport *transport) {
+    // commands are tiny, send them straight away rather than batching
+    int on = 1;
+    if (setsockopt(transport->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) != 0) {
+        fprintf(stderr, "Error %i setting TCP_NODELAY: %s\n", errno, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static ssize_t tcp_read_some(struct vna_transport *transport, uint8_t *buffer, size_t length, int timeout_ms) {
+    int ready = wait_readable(transport, timeout_ms);
+    if (ready <= 0)
+        return ready;
+    ssize_t n = recv(transport->fd, buffer, length, 0);
+    if (n == 0) {
+        fprintf(stderr, "Connection on fd %d closed by VNA\n", transport->fd);
+        errno = ECONNRESET;
+        return -1;
+    } else if (n < 0) {
+        fprintf(stderr, "Error reading from fd %d: %s\n", transport->fd, strerror(errno));
+    }
+    return n;
+}
+
+static ssize_t tcp_write_all(struct vna_transport *transport, const uint8_t *bytes, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        ssize_t n = send(transport->fd, bytes + sent, length - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error writing to fd %d: %s\n", transport->fd, strerror(errno));
+            return -1;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+static int tcp_flush(struct vna_transport *transport) {
+    uint8_t scratch[256];
+    while (recv(transport->fd, scratch, sizeof(scratch), MSG_DONTWAIT) > 0)
+        ;
+    return EXIT_SUCCESS;
+}
+
+static void tcp_close(struct vna_transport *transport) {
+    if (close(transport->fd) != 0)
+        fprintf(stderr, "Error %i closing fd %d: %s\n", errno, transport->fd, strerror(errno));
+}
+
+const struct vna_transport_ops tcp_transport = {
+    TCP_PREFIX, tcp_open, tcp_configure, tcp_read_some, tcp_write_all, tcp_flush, tcp_close
+};
+
+//----------------------------------------
+// Choosing a transport
+//----------------------------------------
+
+static const struct vna_transport_ops *prefixed_transports[] = {
+    &memory_transport, &replay_transport, &tcp_transport
+};
+
+const struct vna_transport_ops* transport_for_path(const char *path, const char **rest) {
+    for (size_t i = 0; i < sizeof(prefixed_transports) / sizeof(prefixed_transports[0]); i++) {
+        const char *prefix = prefixed_transports[i]->prefix;
+        if (strncmp(path, prefix, strlen(prefix)) == 0) {
+            *rest = path + strlen(prefix);
+            return prefixed_transports[i];
+        }
+    }
+    *rest = path;
+    return &termios_transport;
+}
+
+static int open_interrupt(struct vna_transport *transport) {
+    if (pipe(transport->interrupt) != 0) {
+        fprintf(stderr, "Error creating interrupt pipe: %s\n", strerror(errno));
+        transport->interrupt[0] = transport->interrupt[1] = -1;
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(transport->interrupt[i], F_SETFL, O_NONBLOCK);
+        fcntl(transport->interrupt[i], F_SETFD, FD_CLOEXEC);
+    }
+    return EXIT_SUCCESS;
+}
+
+int open_transport(struct vna_transport *transport, const char *path) {
+    const char *rest;
+    const struct vna_transport_ops *ops = transport_for_path(path, &rest);
+    transport->ops = NULL;
+    transport->fd = -1;
+    transport->state = NULL;
+    transport->interrupt[0] = transport->interrupt[1] = -1;
+    if (ops->open(transport, rest) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    transport->ops = ops;
+    if (open_interrupt(transport) != EXIT_SUCCESS) {
+        close_transport(transport);
+        return EXIT_FAILURE;
+    }
+    if (ops->configure(transport) != EXIT_SUCCESS) {
+        fprintf(stderr, "Error configuring %s\n", path);
+        close_transport(transport);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+void close_transport(struct vna_transport *transport) {
+    if (!transport->ops)
+        return;
+    transport->ops->close(transport);
+    for (int i = 0; i < 2; i++) {
+        if (transport->interrupt[i] >= 0)
+            close(transport->interrupt[i]);
+        transport->interrupt[i] = -1;
+    }
+    transport->ops = NULL;
+    transport->fd = -1;
+    transport->state = NULL;
+}
+
+int interrupt_transport(struct vna_transport *transport) {
+    if (!transport->ops || transport->interrupt[1] < 0)
+        return EXIT_FAILURE;
+    // the pipe is non-blocking, if it is full the transport is already interrupted
+    ssize_t ignored = write(transport->interrupt[1], "i", 1);
+    (void)ignored;
+    return EXIT_SUCCESS;
+}
+
+bool transport_interrupted(const struct vna_transport *transport) {
+    if (!transport->ops || transport->interrupt[0] < 0)
+        return false;
+    struct pollfd pfd = {transport->interrupt[0], POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+void clear_transport_interrupt(struct vna_transport *transport) {
+    if (!transport->ops || transport->interrupt[0] < 0)
+        return;
+    uint8_t scratch[64];
+    while (read(transport->interrupt[0], scratch, sizeof(scratch)) > 0);
+}
@@ -0,0 +1,209 @@
+#ifndef VNATRANSPORT_H_
+#define VNATRANSPORT_H_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+
+/**
+ * How long read_exact waits for more bytes before giving up,
+ * the same as the serial port's VTIME
+ */
+#define TRANSPORT_READ_TIMEOUT_MS 1000
+
+/**
+ * Path prefixes selecting a transport other than a serial port
+ */
+#define MEMORY_PREFIX "memory:"
+#define REPLAY_PREFIX "replay:"
+#define TCP_PREFIX "tcp:"
+
+/**
+ * Capture files
+ *
+ * A capture starts with CAPTURE_MAGIC, followed by one record per read or
+ * write: a direction byte (one of the CAPTURE_* values below), the length
+ * as a 4 byte little endian integer, then that many bytes.
+ */
+#define CAPTURE_MAGIC "VNACAP1\n"
+#define CAPTURE_SENT '>'        // command written to the VNA
+#define CAPTURE_RECEIVED '<'    // bytes read from the VNA
+#define CAPTURE_DISCARDED 'x'   // bytes thrown away by drain_vna
+
+struct vna_transport;
+
+/**
+ * The operations every way of talking to a VNA provides
+ *
+ * prefix    - path prefix that selects this transport, "" for serial ports
+ * open      - connects to the VNA at path (with the prefix removed),
+ *             returns EXIT_SUCCESS or EXIT_FAILURE
+ * configure - applies the link settings VNA communication needs,
+ *             returns EXIT_SUCCESS or EXIT_FAILURE
+ * read_some - reads between 1 and length bytes, waiting up to timeout_ms
+ *             for the first, returns bytes read, 0 on timeout, -1 on error
+ * write_all - writes all length bytes, returns length or -1 on error
+ * flush     - throws away any input not yet read,
+ *             returns EXIT_SUCCESS or EXIT_FAILURE
+ * close     - disconnects, restoring anything open or configure changed,
+ *             and frees the transport's state
+ */
+struct vna_transport_ops {
+    const char *prefix;
+    int (*open)(struct vna_transport *transport, const char *path);
+    int (*configure)(struct vna_transport *transport);
+    ssize_t (*read_some)(struct vna_transport *transport, uint8_t *buffer, size_t length, int timeout_ms);
+    ssize_t (*write_all)(struct vna_transport *transport, const uint8_t *bytes, size_t length);
+    int (*flush)(struct vna_transport *transport);
+    void (*close)(struct vna_transport *transport);
+};
+
+/**
+ * An open connection to a VNA
+ *
+ * ops       - the transport's operations, NULL when not open
+ * fd        - file descriptor, if the transport has one, otherwise -1
+ * state     - private to the transport
+ * interrupt - non-blocking pipe, a byte in it makes read_some give up
+ *             straight away (see interrupt_transport), -1 when not open
+ */
+struct vna_transport {
+    const struct vna_transport_ops *ops;
+    int fd;
+    void *state;
+    int interrupt[2];
+};
+
+/**
+ * Serial port (POSIX termios), used for any path without a prefix
+ */
+extern const struct vna_transport_ops termios_transport;
+
+/**
+ * Emulated NanoVNA-H held entirely in memory, memory:<name>
+ *
+ * Answers info, version and scan as the firmware does, instantly and with
+ * data that only depends on the name, so runs are repeatable and as fast
+ * as memory allows. Further bytes can be queued with memory_transport_feed.
+ */
+extern const struct vna_transport_ops memory_transport;
+
+/**
+ * Playback of a capture file, replay:<path>
+ *
+ * Serves the bytes received in the capture, with no timing. Like a real
+ * VNA, after each reply it goes quiet until the next command is written,
+ * and it starts again from the beginning when it runs out. Bytes thrown
+ * away by drain_vna during the capture are left out, so a replay follows
+ * the same path through any retries. Flushing skips the rest of a reply.
+ */
+extern const struct vna_transport_ops replay_transport;
+
+/**
+ * TCP connection to a VNA shared over the network, tcp:<host>:<port>
+ * (e.g. a serial port exposed with ser2net)
+ */
+extern const struct vna_transport_ops tcp_transport;
+
+/**
+ * Picks the transport a path refers to from its prefix
+ *
+ * @param path the path given by the user, e.g. /dev/ttyACM0 or memory:0
+ * @param rest set to the path with the prefix removed
+ * @return the transport's operations (termios_transport if no prefix matched)
+ */
+const struct vna_transport_ops* transport_for_path(const char *path, const char **rest);
+
+/**
+ * Opens and configures the transport a path refers to
+ *
+ * @param transport pointer to the space reserved for this struct (uninitialised)
+ * @param path the path given by the user, including any prefix
+ * @return EXIT_SUCCESS, or EXIT_FAILURE with transport->ops left NULL
+ */
+int open_transport(struct vna_transport *transport, const char *path);
+
+/**
+ * Closes an open transport and marks it as not open
+ *
+ * @param transport the transport to close, ignored if not open
+ */
+void close_transport(struct vna_transport *transport);
+
+/**
+ * Makes any read_some on a transport, running or yet to come, fail with
+ * errno ECANCELED instead of waiting for the VNA, until the interrupt is
+ * cleared. Safe to call from another thread than the one reading.
+ *
+ * @param transport an open transport
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if not open
+ */
+int interrupt_transport(struct vna_transport *transport);
+
+/**
+ * @return true if the transport has been interrupted and not cleared since
+ */
+bool transport_interrupted(const struct vna_transport *transport);
+
+/**
+ * Lets reads on an interrupted transport wait for the VNA again
+ *
+ * @param transport the transport to clear, ignored if not open
+ */
+void clear_transport_interrupt(struct vna_transport *transport);
+
+/**
+ * Queues bytes to be read from a memory transport, after anything
+ * it is already due to send
+ *
+ * @param transport an open memory transport
+ * @param bytes the bytes to queue
+ * @param length number of bytes
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if not a memory transport or out of memory
+ */
+int memory_transport_feed(struct vna_transport *transport, const void *bytes, size_t length);
+
+/**
+ * Opens a serial port and configures its settings
+ *
+ * On apple devices, attempts to connect a usbmodem device
+ * if /dev/ttyACM* doens't work.
+ *
+ * @param port The device path (e.g., "/dev/ttyACM0")
+ * @param init_tty Memory location to store the initial settings of the port
+ * @return File descriptor on success, -1 on failure
+ */
+int open_serial(const char *port, struct termios *init_tty);
+
+/**
+ * Configures serial port settings for NanoVNA communication
+ *
+ * Sets up 115200 baud, 8N1, raw mode, no flow control
+ * Saves original settings for later restoration:
+ * Will not be restored automatically.
+ *
+ * @param serial_port The file descriptor of the open serial port
+ * @param initial_tty A memory location to store the initial settings
+ * @return 0 on success, another number otherwise.
+ */
+int configure_serial(int serial_port, struct termios *initial_tty);
+
+/**
+ * Restores serial port to original settings
+ *
+ * @param fd The file descriptor of the serial port
+ * @param settings The original termios settings to restore
+ *
+ * @return EXIT_SUCCESS on success, errno on error
+ */
+int restore_serial(int fd, const struct termios *settings);
+
+#endif
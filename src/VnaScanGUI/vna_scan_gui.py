@@ -14,7 +14,7 @@ if __name__ == "__main__":
     sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
 
 # Import the VNA scanner wrapper
-from vna_scanner import VNAScanner, VNADataPoint
+from vna_scanner import VNAScanner, VNADataPoint, SweepEvent
 
 
 import colorsys
@@ -35,6 +35,7 @@ class VNAScannerGUI:
         self.sweep_history = []  # List of sweeps, each sweep is dict: {vna_id: {freq: (s11, s21)}}
         self.current_sweep = {}  # Current sweep being collected: {vna_id: {freq: (s11, s21)}}
         self.sweep_count = 0
+        self.current_sweep_number = -1  # Highest sweep number reported by the scanner
         self.max_sweep_history = 5  # Keep last N sweeps for opacity effect
         
         # VNA color cache (generated dynamically)
@@ -730,6 +731,7 @@ class VNAScannerGUI:
         self.sweep_history = []
         self.current_sweep = {}
         self.sweep_count = 0
+        self.current_sweep_number = -1
         self.auto_scaled = False  # Reset auto-scale flag
         
         self.ax.clear()
@@ -990,9 +992,15 @@ class VNAScannerGUI:
             self.current_sweep[vna_id] = {}
             self.root.after(0, lambda vid=vna_id: self.log(f"VNA{vid} connected - receiving data"))
         
-        # Check if this frequency was already seen for this VNA in current sweep
-        # If so, this VNA is starting a new sweep
-        if freq in self.current_sweep[vna_id]:
+        # The scanner stamps each point with its sweep number, so a higher number
+        # means a new sweep. Older parsers don't, so fall back to spotting a
+        # frequency this VNA has already sent in the current sweep.
+        if point.sweep >= 0:
+            new_sweep = point.sweep > self.current_sweep_number and self.current_sweep_number >= 0
+            self.current_sweep_number = max(self.current_sweep_number, point.sweep)
+        else:
+            new_sweep = freq in self.current_sweep[vna_id]
+        if new_sweep:
             # This VNA has wrapped around - save current sweep and start new one
             # Archive current sweep if it has data
             if self.current_sweep and any(len(data) > 0 for data in self.current_sweep.values()):
@@ -1028,6 +1036,13 @@ class VNAScannerGUI:
         # Schedule plot update (runs on main thread)
         self.root.after(0, self._schedule_plot_update)
     
+    def on_sweep_event(self, event: SweepEvent):
+        """Callback when the scanner reports a sweep has finished arriving"""
+        if not event.complete:
+            who = "shared sweep" if event.vna_id < 0 else f"VNA{event.vna_id} sweep"
+            self.root.after(0, lambda: self.log(
+                f"Warning: {who} {event.sweep} incomplete ({event.arrived}/{event.expected} sub-bands)"))
+    
     def on_status_update(self, message: str):
         """Callback for scanner status updates"""
         self.root.after(0, lambda: self.log(message))
@@ -1119,7 +1134,8 @@ class VNAScannerGUI:
                 time_limit=time_limit,
                 ports=ports,
                 data_callback=self.on_data_point,
-                status_callback=self.on_status_update
+                status_callback=self.on_status_update,
+                sweep_callback=self.on_sweep_event
             )
             
             if not success:
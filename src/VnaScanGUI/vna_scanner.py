@@ -27,6 +27,10 @@ class VNADataPoint:
     vna_id: int
     time_sent: float
     time_recv: float
+    scan_id: int = -1   # -1 if the parser did not report it
+    sweep: int = -1     # sweep number within the scan, from 0
+    sub_band: int = -1  # sub-band (scan command) within the sweep, from 0
+    time_point: float = -1.0  # estimated time this point was measured, -1 if not reported
     
     @property
     def s11_mag_db(self) -> float:
@@ -51,6 +55,17 @@ class VNADataPoint:
         return math.degrees(math.atan2(self.s21_im, self.s21_re))
 
 
+@dataclass
+class SweepEvent:
+    """Reported once a sweep has all its sub-bands, or has been given up on"""
+    scan_id: int
+    vna_id: int         # -1 if the sweep was shared between VNAs
+    sweep: int
+    arrived: int        # sub-bands received
+    expected: int       # sub-bands in a full sweep
+    complete: bool
+
+
 class VNAScanner:
     """
     Wrapper for VnaCommandParser C program.
@@ -73,6 +88,7 @@ class VNAScanner:
         self._is_scanning = False
         self._data_callback: Optional[Callable] = None
         self._status_callback: Optional[Callable] = None
+        self._sweep_callback: Optional[Callable] = None
         self._current_touchstone_file: Optional[str] = None
         
     def _find_parser(self) -> str:
@@ -139,7 +155,8 @@ class VNAScanner:
                    time_limit: int = 0,
                    ports: List[str] = None,
                    data_callback: Optional[Callable[[VNADataPoint], None]] = None,
-                   status_callback: Optional[Callable[[str], None]] = None) -> bool:
+                   status_callback: Optional[Callable[[str], None]] = None,
+                   sweep_callback: Optional[Callable[[SweepEvent], None]] = None) -> bool:
         """
         Start a VNA scan.
         
@@ -154,6 +171,7 @@ class VNAScanner:
             ports: List of VNA port paths
             data_callback: Called for each data point received
             status_callback: Called for status updates
+            sweep_callback: Called when a sweep has finished arriving
             
         Returns:
             True if scan started successfully
@@ -172,6 +190,7 @@ class VNAScanner:
         
         self._data_callback = data_callback
         self._status_callback = status_callback
+        self._sweep_callback = sweep_callback
         self._stop_flag.clear()
         
         # Start scan in background thread
@@ -281,8 +300,10 @@ class VNAScanner:
     def _parse_output(self):
         """Parse the VnaCommandParser output in real-time"""
         # Output format from scan_consumer:
-        # ID Label VNA TimeSent TimeRecv Freq SParam Format Value
-        # Example: 20260127_143052 InteractiveMode 0 0.001234 0.052345 50000000 S11 REAL 0.123456
+        # ID Label VNA TimeSent TimeRecv Freq SParam Format Value ScanID Sweep SubBand TimePoint
+        # Example: 20260127_143052 InteractiveMode 0 0.001234567 0.052345678 50000000 S11 REAL 0.123456 0 2 1 0.041234567
+        # and once a sweep has finished arriving:
+        # SWEEP ID Label ScanID VNA Sweep Arrived Expected COMPLETE|INCOMPLETE
         
         current_point = {}
         header_seen = False
@@ -309,6 +330,13 @@ class VNAScanner:
                     self._status_callback("Data header received, starting data collection...")
                 continue
             
+            # Sweep completion events
+            if line.startswith("SWEEP "):
+                event = self.parse_sweep_event(line)
+                if event and self._sweep_callback:
+                    self._sweep_callback(event)
+                continue
+            
             # Skip info messages
             if line.startswith("Saving data to:") or line.startswith("---"):
                 if self._status_callback and "Saving" in line:
@@ -338,6 +366,11 @@ class VNAScanner:
                         sparam = parts[6]  # S11 or S21
                         fmt = parts[7]     # REAL or IMG
                         value = float(parts[8])
+                        if len(parts) >= 12:
+                            scan_id, sweep, sub_band = int(parts[9]), int(parts[10]), int(parts[11])
+                        else:
+                            scan_id, sweep, sub_band = -1, -1, -1
+                        time_point = float(parts[12]) if len(parts) >= 13 else -1.0
                         
                         # Build composite key for this frequency point
                         key = (freq, vna_id, time_sent)
@@ -349,7 +382,9 @@ class VNAScanner:
                                 'time_sent': time_sent,
                                 'time_recv': time_recv,
                                 's11_re': 0, 's11_im': 0,
-                                's21_re': 0, 's21_im': 0
+                                's21_re': 0, 's21_im': 0,
+                                'scan_id': scan_id, 'sweep': sweep, 'sub_band': sub_band,
+                                'time_point': time_point
                             }
                         
                         # Store the value
@@ -371,7 +406,11 @@ class VNAScanner:
                                 s21_im=p['s21_im'],
                                 vna_id=p['vna_id'],
                                 time_sent=p['time_sent'],
-                                time_recv=p['time_recv']
+                                time_recv=p['time_recv'],
+                                scan_id=p['scan_id'],
+                                sweep=p['sweep'],
+                                sub_band=p['sub_band'],
+                                time_point=p['time_point']
                             )
                             
                             data_points_received += 1
@@ -398,6 +437,24 @@ class VNAScanner:
         if self._status_callback:
             self._status_callback(f"Data collection complete. Total points: {data_points_received}")
     
+    @staticmethod
+    def parse_sweep_event(line: str) -> Optional[SweepEvent]:
+        """Parse a SWEEP line from scan_consumer, or return None if malformed"""
+        parts = line.split()
+        if len(parts) < 9 or parts[0] != "SWEEP":
+            return None
+        try:
+            return SweepEvent(
+                scan_id=int(parts[3]),
+                vna_id=int(parts[4]),
+                sweep=int(parts[5]),
+                arrived=int(parts[6]),
+                expected=int(parts[7]),
+                complete=(parts[8] == "COMPLETE")
+            )
+        except ValueError:
+            return None
+    
     def stop_scan(self):
         """Stop the current scan"""
         self._stop_flag.set()
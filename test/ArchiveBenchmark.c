@@ -0,0 +1,199 @@
+/**
+ * Compression ratio and throughput of the scan archive (VnaArchive.h).
+ *
+ * Encodes a made up capture of resonators drifting slowly from sweep to
+ * sweep, with a little noise on every reading, then decodes it again and
+ * checks every reading comes back bit for bit. Sizes are compared against
+ * the readings as the NanoVNA sends them (20 bytes a point), the stream
+ * server's scan frames and the touchstone text the consumer writes.
+ *
+ * Usage:
+ *     ./ArchiveBenchmark [-w sweeps] [-v vnas] [-n scans] [-p points] [-z noise] [-s seed]
+ */
+#include "VnaArchive.h"
+
+#include <time.h>
+#include <getopt.h>
+
+/**
+ * Bytes of a scan frame on the stream server's data port, less its points
+ */
+#define STREAM_SCAN_FRAME_SIZE (16 + 52)
+
+struct options {
+    int sweeps;
+    int nbr_vnas;
+    int nbr_scans;
+    int pps;
+    double noise;       // standard deviation of the noise added to each reading
+    uint64_t seed;
+};
+
+/**
+ * xorshift64* generator, so runs with the same seed are identical
+ */
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double random_unit(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * Roughly normal noise (sum of four uniforms)
+ */
+static double random_noise(uint64_t *state, double sigma) {
+    double sum = 0;
+    for (int i = 0; i < 4; i++)
+        sum += random_unit(state) - 0.5;
+    return sum * sigma * 1.7320508;
+}
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-w sweeps] [-v vnas] [-n scans] [-p points] [-z noise] [-s seed]\n"
+        "    -w sweeps per VNA (default 1000)\n"
+        "    -v number of VNAs (default 2)\n"
+        "    -n scans per sweep (default 5)\n"
+        "    -p points per scan (default 101)\n"
+        "    -z standard deviation of noise on each reading (default 1e-4, 0 for none)\n"
+        "    -s random seed (default 1)\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    struct options opts = {1000, 2, 5, 101, 1e-4, 1};
+    int opt;
+    while ((opt = getopt(argc, argv, "w:v:n:p:z:s:h")) != -1) {
+        switch (opt) {
+        case 'w': opts.sweeps = atoi(optarg); break;
+        case 'v': opts.nbr_vnas = atoi(optarg); break;
+        case 'n': opts.nbr_scans = atoi(optarg); break;
+        case 'p': opts.pps = atoi(optarg); break;
+        case 'z': opts.noise = atof(optarg); break;
+        case 's': opts.seed = strtoull(optarg, NULL, 10); break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opts.sweeps < 1 || opts.nbr_vnas < 1 || opts.nbr_vnas > MAXIMUM_VNA_PORTS
+            || opts.nbr_scans < 1 || opts.pps < 1 || opts.noise < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // make the whole capture up front, so only the codec is timed
+    long nbr_blocks = (long)opts.sweeps * opts.nbr_vnas * opts.nbr_scans;
+    long nbr_points = nbr_blocks * opts.pps;
+    struct datapoint_nanoVNA_H *scans = malloc(nbr_blocks * sizeof(struct datapoint_nanoVNA_H));
+    struct nanovna_raw_datapoint *points = malloc(nbr_points * sizeof(struct nanovna_raw_datapoint));
+    size_t bound = archive_scan_bound(opts.pps);
+    uint8_t *payloads = malloc(nbr_blocks * bound);
+    size_t *lengths = malloc(nbr_blocks * sizeof(size_t));
+    if (!scans || !points || !payloads || !lengths) {
+        fprintf(stderr, "Failed to allocate memory for %ld scans\n", nbr_blocks);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t rng = opts.seed ? opts.seed : 1;
+    uint64_t touchstone_bytes = 0;
+    long b = 0;
+    for (int sweep = 0; sweep < opts.sweeps; sweep++) {
+        for (int vna = 0; vna < opts.nbr_vnas; vna++) {
+            for (int scan = 0; scan < opts.nbr_scans; scan++, b++) {
+                struct datapoint_nanoVNA_H *data = &scans[b];
+                data->vna_id = vna;
+                data->scan_id = 0;
+                data->sweep = sweep;
+                data->scan_index = scan;
+                data->send_ns = 1000000ULL + (uint64_t)b * 9000000ULL + next_random(&rng) % 100000;
+                data->header_ns = data->send_ns + 7500000 + next_random(&rng) % 200000;
+                data->receive_ns = data->header_ns + 600000;
+                data->sweep_ns_per_point = 74250.0;
+                data->pps = opts.pps;
+                data->point = &points[b * opts.pps];
+                double drift = 0.002 * sweep / opts.sweeps;
+                for (int i = 0; i < opts.pps; i++) {
+                    struct nanovna_raw_datapoint *p = &data->point[i];
+                    double x = ((double)(scan * opts.pps + i) / (opts.nbr_scans * opts.pps) - 0.5 - drift) * 40.0;
+                    double d = 1.0 + x * x;
+                    p->frequency = 50000000 + (scan * opts.pps + i) * 100000;
+                    p->s11.re = (float)(1.0 - 0.9 / d + random_noise(&rng, opts.noise));
+                    p->s11.im = (float)(0.9 * x / d + random_noise(&rng, opts.noise));
+                    p->s21.re = (float)(0.9 / d + random_noise(&rng, opts.noise));
+                    p->s21.im = (float)(-0.9 * x / d + random_noise(&rng, opts.noise));
+                    char line[128];
+                    touchstone_bytes += snprintf(line, sizeof(line), "%u %.10e %.10e %.10e %.10e 0 0 0 0\n",
+                        p->frequency, p->s11.re, p->s11.im, p->s21.re, p->s21.im);
+                }
+            }
+        }
+    }
+
+    struct archive_codec codec;
+    struct timespec t0, t1;
+    init_archive_codec(&codec);
+    uint64_t archive_bytes = ARCHIVE_HEADER_SIZE;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (b = 0; b < nbr_blocks; b++) {
+        ssize_t length = encode_archive_scan(&codec, &scans[b], 0, payloads + b * bound, bound);
+        if (length < 0) {
+            fprintf(stderr, "Failed to encode scan %ld\n", b);
+            return EXIT_FAILURE;
+        }
+        lengths[b] = length;
+        archive_bytes += ARCHIVE_BLOCK_HEADER_SIZE + length;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double encode_secs = elapsed(&t0, &t1);
+    destroy_archive_codec(&codec);
+
+    init_archive_codec(&codec);
+    long mismatches = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (b = 0; b < nbr_blocks; b++) {
+        struct datapoint_nanoVNA_H out;
+        if (decode_archive_scan(&codec, payloads + b * bound, lengths[b], 0, &out) != EXIT_SUCCESS) {
+            fprintf(stderr, "Failed to decode scan %ld\n", b);
+            return EXIT_FAILURE;
+        }
+        if (out.pps != opts.pps || memcmp(out.point, scans[b].point, opts.pps * sizeof(struct nanovna_raw_datapoint)) != 0)
+            mismatches++;
+        free(out.point);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double decode_secs = elapsed(&t0, &t1);
+    destroy_archive_codec(&codec);
+
+    uint64_t raw_bytes = (uint64_t)nbr_points * ARCHIVE_RAW_POINT_SIZE;
+    uint64_t frame_bytes = raw_bytes + (uint64_t)nbr_blocks * STREAM_SCAN_FRAME_SIZE;
+    printf("%ld scans of %d points (%d sweeps of %d VNAs x %d scans), noise %g\n",
+        nbr_blocks, opts.pps, opts.sweeps, opts.nbr_vnas, opts.nbr_scans, opts.noise);
+    printf("%-22s %12s %10s\n", "format", "bytes", "ratio");
+    printf("%-22s %12" PRIu64 " %10.2f\n", "touchstone text", touchstone_bytes, (double)touchstone_bytes / archive_bytes);
+    printf("%-22s %12" PRIu64 " %10.2f\n", "stream scan frames", frame_bytes, (double)frame_bytes / archive_bytes);
+    printf("%-22s %12" PRIu64 " %10.2f\n", "raw readings", raw_bytes, (double)raw_bytes / archive_bytes);
+    printf("%-22s %12" PRIu64 " %10.2f\n", "archive", archive_bytes, 1.0);
+    printf("%.2f bits per reading\n", archive_bytes * 8.0 / (nbr_points * 4.0));
+    printf("encode: %.1f MiB/s of raw readings, %.2f us per scan\n",
+        raw_bytes / 1048576.0 / encode_secs, encode_secs * 1e6 / nbr_blocks);
+    printf("decode: %.1f MiB/s of raw readings, %.2f us per scan\n",
+        raw_bytes / 1048576.0 / decode_secs, decode_secs * 1e6 / nbr_blocks);
+    if (mismatches) {
+        printf("%ld scans did not decode to what was encoded\n", mismatches);
+        return EXIT_FAILURE;
+    }
+    free(lengths);
+    free(payloads);
+    free(points);
+    free(scans);
+    return EXIT_SUCCESS;
+}
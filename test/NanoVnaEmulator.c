@@ -0,0 +1,546 @@
+/**
+ * Native NanoVNA-H emulator for load testing.
+ *
+ * Creates any number of pseudo-terminal pairs and serves all of them from a
+ * single epoll loop, answering the same commands as nanovna_emulator.py
+ * (info, version, scan, malform). The slave end of device i is symlinked to
+ * the path given by the -p pattern (default /tmp/vna%d_slave), so the
+ * scanner can open it like a real serial device.
+ *
+ * Like the real firmware, a scan is measured first and then sent in one
+ * burst: the reply is held back for points * point time (plus jitter),
+ * then the header and every point are queued at once.
+ *
+ * Linux only (epoll, posix_openpt).
+ *
+ * Usage:
+ *     ./NanoVnaEmulator [-n devices] [-p path_pattern] [-t point_us[,...]] [-j jitter_us]
+ *                       [-d dropout_chance] [-g garbage_chance] [-e] [-s seed]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+
+#define MAX_PATH_LENGTH 256
+#define COMMAND_LENGTH 128
+#define POINT_SIZE 20
+#define HEADER_SIZE 4
+#define PROMPT "ch> "
+
+/**
+ * Settings shared by every emulated device
+ *
+ * point_us       - firmware time to measure one point, per device
+ * nbr_point_us   - entries in point_us, the last is used by any further devices
+ * jitter_us      - up to this much is randomly added to each sweep
+ * dropout_chance - chance a scan reply stops part way through
+ * garbage_chance - chance random bytes are sent before a scan reply
+ * echo           - echo commands and send prompts like the real firmware
+ * seed           - seed for every device's random number generator
+ */
+struct emulator_options {
+    int nbr_devices;
+    const char *path_pattern;
+    long *point_us;
+    int nbr_point_us;
+    long jitter_us;
+    double dropout_chance;
+    double garbage_chance;
+    bool echo;
+    uint64_t seed;
+};
+
+/**
+ * Bytes waiting to be written to a device's master fd
+ */
+struct out_queue {
+    uint8_t *data;
+    size_t head;
+    size_t len;
+    size_t capacity;
+};
+
+/**
+ * State of one emulated device
+ *
+ * A scan in progress has busy_until set to the time its reply is due.
+ * Commands arriving meanwhile wait in the input buffer, as on the real device.
+ */
+struct device {
+    int index;
+    int master_fd;
+    int slave_fd;                 // kept open so the pty survives the scanner closing it
+    char link_path[MAX_PATH_LENGTH];
+    long point_us;
+    char input[COMMAND_LENGTH];
+    size_t input_len;
+    struct out_queue out;
+    bool writable_wanted;         // EPOLLOUT currently registered
+    uint64_t busy_until;          // 0 when idle
+    uint32_t scan_start, scan_stop;
+    uint16_t scan_points, scan_mask;
+    bool malform;                 // next scan sends bogus data
+    uint64_t rng;
+    long scans_served;
+};
+
+static volatile sig_atomic_t running = 1;
+
+static void handle_signal(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/**
+ * xorshift64* generator, so runs with the same seed are identical
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double random_unit(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+//----------------------------------------
+// Output queue
+//----------------------------------------
+
+static int queue_bytes(struct out_queue *q, const void *bytes, size_t n) {
+    if (q->head > 0 && q->head + q->len + n > q->capacity) {
+        memmove(q->data, q->data + q->head, q->len);
+        q->head = 0;
+    }
+    if (q->len + n > q->capacity) {
+        size_t capacity = q->capacity ? q->capacity : 4096;
+        while (capacity < q->len + n)
+            capacity *= 2;
+        uint8_t *grown = realloc(q->data, capacity);
+        if (!grown)
+            return EXIT_FAILURE;
+        q->data = grown;
+        q->capacity = capacity;
+    }
+    memcpy(q->data + q->head + q->len, bytes, n);
+    q->len += n;
+    return EXIT_SUCCESS;
+}
+
+static void set_writable_wanted(int epfd, struct device *dev, bool wanted) {
+    if (dev->writable_wanted == wanted)
+        return;
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | (wanted ? EPOLLOUT : 0);
+    ev.data.ptr = dev;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, dev->master_fd, &ev);
+    dev->writable_wanted = wanted;
+}
+
+/**
+ * Writes as much of the queue as the pty will take without blocking
+ */
+static void flush_device(int epfd, struct device *dev) {
+    while (dev->out.len > 0) {
+        ssize_t n = write(dev->master_fd, dev->out.data + dev->out.head, dev->out.len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (errno == EINTR)
+                continue;
+            // nobody listening, throw the bytes away
+            dev->out.len = 0;
+            break;
+        }
+        dev->out.head += n;
+        dev->out.len -= n;
+    }
+    if (dev->out.len == 0)
+        dev->out.head = 0;
+    set_writable_wanted(epfd, dev, dev->out.len > 0);
+}
+
+//----------------------------------------
+// Commands
+//----------------------------------------
+
+static void queue_text(struct device *dev, const char *text) {
+    queue_bytes(&dev->out, text, strlen(text));
+}
+
+static void queue_point(struct device *dev, uint32_t freq) {
+    uint8_t pkt[POINT_SIZE];
+    float values[4] = {
+        (float)(random_unit(&dev->rng) * 2.0 - 1.0),
+        (float)(random_unit(&dev->rng) * 2.0 - 1.0),
+        (float)(random_unit(&dev->rng) - 0.5),
+        (float)(random_unit(&dev->rng) - 0.5)
+    };
+    // little endian on the wire, as sent by the firmware
+    for (int b = 0; b < 4; b++)
+        pkt[b] = (freq >> (8 * b)) & 0xff;
+    memcpy(pkt + 4, values, sizeof(values));
+    queue_bytes(&dev->out, pkt, sizeof(pkt));
+}
+
+/**
+ * Called once a scan's sweep time has passed, queues the whole reply
+ */
+static void finish_scan(const struct emulator_options *opts, struct device *dev) {
+    dev->busy_until = 0;
+    dev->scans_served++;
+
+    if (dev->malform) {
+        dev->malform = false;
+        int count = (int)(dev->scan_points * random_unit(&dev->rng) * 2);
+        for (int i = 0; i < count; i++)
+            queue_point(dev, (uint32_t)(next_random(&dev->rng) % 100000000));
+        return;
+    }
+
+    if (random_unit(&dev->rng) < opts->garbage_chance) {
+        int count = 1 + next_random(&dev->rng) % 64;
+        for (int i = 0; i < count; i++) {
+            uint8_t byte = next_random(&dev->rng) & 0xff;
+            queue_bytes(&dev->out, &byte, 1);
+        }
+    }
+
+    uint8_t header[HEADER_SIZE] = {
+        dev->scan_mask & 0xff, dev->scan_mask >> 8,
+        dev->scan_points & 0xff, dev->scan_points >> 8
+    };
+    queue_bytes(&dev->out, header, sizeof(header));
+
+    int points = dev->scan_points;
+    if (random_unit(&dev->rng) < opts->dropout_chance)
+        points = next_random(&dev->rng) % dev->scan_points;
+
+    uint64_t span = dev->scan_stop - dev->scan_start;
+    uint64_t steps = dev->scan_points > 1 ? dev->scan_points - 1 : 1;
+    for (int i = 0; i < points; i++)
+        queue_point(dev, (uint32_t)(dev->scan_start + span * i / steps));
+
+    if (opts->echo && points == dev->scan_points)
+        queue_text(dev, PROMPT);
+}
+
+static void handle_command(const struct emulator_options *opts, struct device *dev, char *line) {
+    if (opts->echo) {
+        queue_text(dev, line);
+        queue_text(dev, "\r\n");
+    }
+
+    char *save = NULL;
+    char *command = strtok_r(line, " \t", &save);
+    if (!command) {
+        if (opts->echo)
+            queue_text(dev, PROMPT);
+        return;
+    }
+
+    if (strcmp(command, "scan") == 0) {
+        char *args[4];
+        for (int i = 0; i < 4; i++)
+            args[i] = strtok_r(NULL, " \t", &save);
+        if (!args[3]) {
+            queue_text(dev, "usage: scan {start(Hz)} {stop(Hz)} [points] [outmask]\r\n" PROMPT);
+            return;
+        }
+        dev->scan_start = strtoul(args[0], NULL, 10);
+        dev->scan_stop = strtoul(args[1], NULL, 10);
+        dev->scan_points = (uint16_t)atoi(args[2]);
+        dev->scan_mask = (uint16_t)atoi(args[3]);
+        long sweep_us = dev->point_us * dev->scan_points;
+        if (opts->jitter_us > 0)
+            sweep_us += next_random(&dev->rng) % (opts->jitter_us + 1);
+        dev->busy_until = now_us() + sweep_us;
+        if (dev->busy_until == 0)
+            dev->busy_until = 1;
+    } else if (strcmp(command, "info") == 0) {
+        queue_text(dev,
+            "Board: NanoVNA-H\r\n"
+            "2019-2022 Copyright NanoVNA.com\r\n"
+            "based on  @DiSlord @edy555 ... source\r\n"
+            "Licensed under GPL.\r\n"
+            "Version: 1.2.14 [p:101, IF:12k, ADC:192k, Lcd:320x240]\r\n"
+            "Build Time: Aug 31 2022 - 13:23:46\r\n"
+            "Architecture: ARMv6-M Core Variant: Cortex-M0\r\n"
+            "Platform: STM32F072xB Entry Level Medium Density devices\r\n");
+        if (opts->echo)
+            queue_text(dev, PROMPT);
+    } else if (strcmp(command, "version") == 0) {
+        queue_text(dev, "NanoVNA-H v1.0-TEST-EMULATOR\r\n" PROMPT);
+    } else if (strcmp(command, "malform") == 0) {
+        dev->malform = true;
+    } else {
+        queue_text(dev, PROMPT);
+    }
+}
+
+/**
+ * Runs every complete command in the input buffer, stopping at a scan
+ * so that later commands wait until its reply has been sent.
+ */
+static void process_input(const struct emulator_options *opts, struct device *dev) {
+    while (!dev->busy_until) {
+        char *end = memchr(dev->input, '\r', dev->input_len);
+        if (!end)
+            break;
+        size_t line_len = end - dev->input;
+        char line[COMMAND_LENGTH];
+        memcpy(line, dev->input, line_len);
+        line[line_len] = '\0';
+        // drop the line and any \n following it
+        size_t used = line_len + 1;
+        while (used < dev->input_len && dev->input[used] == '\n')
+            used++;
+        memmove(dev->input, dev->input + used, dev->input_len - used);
+        dev->input_len -= used;
+
+        // strip leading whitespace, strtok_r drops the trailing
+        char *start = line;
+        while (*start == ' ' || *start == '\n')
+            start++;
+        handle_command(opts, dev, start);
+    }
+}
+
+static void read_device(const struct emulator_options *opts, struct device *dev) {
+    while (true) {
+        if (dev->input_len == sizeof(dev->input)) {
+            // line too long for any real command, throw it away
+            dev->input_len = 0;
+        }
+        ssize_t n = read(dev->master_fd, dev->input + dev->input_len, sizeof(dev->input) - dev->input_len);
+        if (n <= 0)
+            break;
+        dev->input_len += n;
+    }
+    process_input(opts, dev);
+}
+
+//----------------------------------------
+// Device setup
+//----------------------------------------
+
+static int open_device(const struct emulator_options *opts, struct device *dev, int index) {
+    memset(dev, 0, sizeof(*dev));
+    dev->index = index;
+    dev->point_us = opts->point_us[index < opts->nbr_point_us ? index : opts->nbr_point_us - 1];
+    dev->rng = opts->seed ^ (0x9E3779B97F4A7C15ULL * (index + 1));
+    if (dev->rng == 0)
+        dev->rng = 1;
+
+    dev->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (dev->master_fd < 0 || grantpt(dev->master_fd) != 0 || unlockpt(dev->master_fd) != 0) {
+        fprintf(stderr, "Failed to create pty for device %d: %s\n", index, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    const char *slave_name = ptsname(dev->master_fd);
+    dev->slave_fd = open(slave_name, O_RDWR | O_NOCTTY);
+    if (dev->slave_fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", slave_name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct termios tty;
+    tcgetattr(dev->slave_fd, &tty);
+    cfmakeraw(&tty);
+    tcsetattr(dev->slave_fd, TCSANOW, &tty);
+
+    snprintf(dev->link_path, sizeof(dev->link_path), opts->path_pattern, index);
+    unlink(dev->link_path);
+    if (symlink(slave_name, dev->link_path) != 0) {
+        fprintf(stderr, "Failed to link %s to %s: %s\n", dev->link_path, slave_name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void close_device(struct device *dev) {
+    if (dev->link_path[0])
+        unlink(dev->link_path);
+    if (dev->slave_fd > 0)
+        close(dev->slave_fd);
+    if (dev->master_fd > 0)
+        close(dev->master_fd);
+    free(dev->out.data);
+}
+
+/**
+ * Reads a comma separated list of per-point times into opts
+ *
+ * @param opts options to store the list in
+ * @param list the -t argument, e.g. "100" or "100,250,80"
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any entry is not a non-negative number
+ */
+static int parse_point_times(struct emulator_options *opts, const char *list) {
+    int count = 1;
+    for (const char *c = list; *c; c++)
+        if (*c == ',')
+            count++;
+    long *times = malloc(sizeof(long) * count);
+    if (!times)
+        return EXIT_FAILURE;
+
+    const char *c = list;
+    for (int i = 0; i < count; i++) {
+        char *end;
+        times[i] = strtol(c, &end, 10);
+        if (end == c || times[i] < 0 || (*end != ',' && *end != '\0')) {
+            free(times);
+            return EXIT_FAILURE;
+        }
+        c = end + 1;
+    }
+    opts->point_us = times;
+    opts->nbr_point_us = count;
+    return EXIT_SUCCESS;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-n devices] [-p path_pattern] [-t point_us[,...]] [-j jitter_us]\n"
+        "          [-d dropout_chance] [-g garbage_chance] [-e] [-s seed]\n"
+        "    -n  number of devices to emulate (default 2)\n"
+        "    -p  printf pattern for each device's path (default /tmp/vna%%d_slave)\n"
+        "    -t  firmware time per point in microseconds (default 100), a comma separated\n"
+        "        list gives each device its own, the last repeating for any remaining\n"
+        "    -j  up to this many microseconds of random delay added to each sweep (default 0)\n"
+        "    -d  chance (0-1) a scan reply stops part way through (default 0)\n"
+        "    -g  chance (0-1) random bytes are sent before a scan reply (default 0)\n"
+        "    -e  echo commands and send prompts like the real firmware\n"
+        "    -s  random seed, runs with the same seed send the same data (default 1)\n",
+        name);
+}
+
+int main(int argc, char *argv[]) {
+    long default_point_us = 100;
+    struct emulator_options opts = {2, "/tmp/vna%d_slave", &default_point_us, 1, 0, 0.0, 0.0, false, 1};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:t:j:d:g:es:h")) != -1) {
+        switch (opt) {
+        case 'n': opts.nbr_devices = atoi(optarg); break;
+        case 'p': opts.path_pattern = optarg; break;
+        case 't':
+            if (parse_point_times(&opts, optarg) != EXIT_SUCCESS) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'j': opts.jitter_us = atol(optarg); break;
+        case 'd': opts.dropout_chance = atof(optarg); break;
+        case 'g': opts.garbage_chance = atof(optarg); break;
+        case 'e': opts.echo = true; break;
+        case 's': opts.seed = strtoull(optarg, NULL, 10); break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (opts.nbr_devices < 1 || opts.jitter_us < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct device *devices = calloc(opts.nbr_devices, sizeof(struct device));
+    int epfd = epoll_create1(0);
+    if (!devices || epfd < 0) {
+        fprintf(stderr, "Failed to set up emulator: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    int error = EXIT_SUCCESS;
+    int opened = 0;
+    for (; opened < opts.nbr_devices; opened++) {
+        if (open_device(&opts, &devices[opened], opened) != EXIT_SUCCESS) {
+            error = EXIT_FAILURE;
+            opened++;
+            break;
+        }
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &devices[opened];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, devices[opened].master_fd, &ev);
+        printf("%s\n", devices[opened].link_path);
+    }
+    fflush(stdout);
+    if (error == EXIT_SUCCESS)
+        fprintf(stderr, "Emulating %d devices, waiting for commands...\n", opts.nbr_devices);
+
+    struct epoll_event events[64];
+    while (running && error == EXIT_SUCCESS) {
+        // sleep until the next scan is due, or forever if none are running
+        uint64_t now = now_us();
+        uint64_t next_due = 0;
+        for (int i = 0; i < opts.nbr_devices; i++) {
+            if (devices[i].busy_until && (!next_due || devices[i].busy_until < next_due))
+                next_due = devices[i].busy_until;
+        }
+        int timeout_ms = -1;
+        if (next_due)
+            timeout_ms = next_due <= now ? 0 : (int)((next_due - now + 999) / 1000);
+
+        int ready = epoll_wait(epfd, events, 64, timeout_ms);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+            error = EXIT_FAILURE;
+            break;
+        }
+        for (int i = 0; i < ready; i++) {
+            struct device *dev = events[i].data.ptr;
+            if (events[i].events & EPOLLIN)
+                read_device(&opts, dev);
+            if (events[i].events & (EPOLLOUT | EPOLLIN))
+                flush_device(epfd, dev);
+        }
+
+        now = now_us();
+        for (int i = 0; i < opts.nbr_devices; i++) {
+            struct device *dev = &devices[i];
+            if (dev->busy_until && dev->busy_until <= now) {
+                finish_scan(&opts, dev);
+                process_input(&opts, dev);
+                flush_device(epfd, dev);
+            }
+        }
+    }
+
+    long total = 0;
+    for (int i = 0; i < opened; i++) {
+        total += devices[i].scans_served;
+        close_device(&devices[i]);
+    }
+    fprintf(stderr, "Emulator stopped after serving %ld scans\n", total);
+    close(epfd);
+    free(devices);
+    if (opts.point_us != &default_point_us)
+        free(opts.point_us);
+    return error;
+}
@@ -0,0 +1,47 @@
+#include "ScanFixtures.h"
+
+struct datapoint_nanoVNA_H *make_plan_scan(const struct sweep_plan *plan, const struct complex *values, bool s11,
+                                           int vna_id, int scan_id, int sweep, int scan_index, uint64_t send_ns) {
+    const struct scan_range *range = &plan->scans[scan_index];
+    struct datapoint_nanoVNA_H *data = calloc(1, sizeof(struct datapoint_nanoVNA_H));
+    data->vna_id = vna_id;
+    data->scan_id = scan_id;
+    data->sweep = sweep;
+    data->scan_index = scan_index;
+    data->send_ns = send_ns;
+    data->pps = range->pps;
+    data->point = calloc(range->pps, sizeof(struct nanovna_raw_datapoint));
+    for (int i = 0; i < range->pps; i++) {
+        data->point[i].frequency = plan->freqs[range->first_bin + i];
+        if (s11)
+            data->point[i].s11 = values[range->first_bin + i];
+        else
+            data->point[i].s21 = values[range->first_bin + i];
+    }
+    return data;
+}
+
+void free_plan_scan(struct datapoint_nanoVNA_H *data) {
+    free(data->point);
+    free(data);
+}
+
+void make_resonator_scan(struct datapoint_nanoVNA_H *data, struct nanovna_raw_datapoint *points, int pps,
+                         int start_hz, int step_hz, int vna_id, int sweep, int scan_index, uint64_t send_ns,
+                         double drift) {
+    *data = (struct datapoint_nanoVNA_H){0};
+    data->vna_id = vna_id;
+    data->sweep = sweep;
+    data->scan_index = scan_index;
+    data->send_ns = send_ns;
+    data->header_ns = send_ns + 2000000;
+    data->receive_ns = send_ns + 9000000;
+    data->pps = pps;
+    data->point = points;
+    for (int i = 0; i < pps; i++) {
+        double x = (i - (pps - 1) / 2.0) / 10.0 + drift;
+        points[i].frequency = start_hz + scan_index * pps * step_hz + i * step_hz;
+        points[i].s11 = (struct complex){(float)(1.0 / (1.0 + x * x)), (float)(x / (1.0 + x * x))};
+        points[i].s21 = (struct complex){(float)(0.5 - 0.01 * x), (float)(vna_id * 0.1)};
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef SCANFIXTURES_H_
+#define SCANFIXTURES_H_
+
+#include "VnaScanMultithreaded.h"
+
+#include <stdlib.h>
+#include <inttypes.h>
+#include <stdbool.h>
+
+/**
+ * Made up scans, as the producers put them on the buffer, for the tests of
+ * what the consumer does with them
+ */
+
+/**
+ * Makes scan scan_index of a sweep on plan
+ *
+ * @param values one reading for each of the plan's points
+ * @param s11 true to put the readings in S11, false for S21
+ * @return the scan, to be freed with free_plan_scan
+ */
+struct datapoint_nanoVNA_H *make_plan_scan(const struct sweep_plan *plan, const struct complex *values, bool s11,
+                                           int vna_id, int scan_id, int sweep, int scan_index, uint64_t send_ns);
+
+void free_plan_scan(struct datapoint_nanoVNA_H *data);
+
+/**
+ * Fills in a scan of a resonator, S11 peaking half way through the scan
+ * and S21 sloping across it, with each VNA's S21 a little different.
+ * Each scan's points carry on step_hz apart from the last scan's. The
+ * reply starts 2 ms after send_ns and ends 9 ms after. scan_id and
+ * sweep_ns_per_point are left 0.
+ *
+ * @param points where the scan's pps readings go
+ * @param drift how far the resonance has moved down the scan, in tens of points
+ */
+void make_resonator_scan(struct datapoint_nanoVNA_H *data, struct nanovna_raw_datapoint *points, int pps,
+                         int start_hz, int step_hz, int vna_id, int sweep, int scan_index, uint64_t send_ns,
+                         double drift);
+
+#endif /* SCANFIXTURES_H_ */
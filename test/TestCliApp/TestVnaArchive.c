@@ -0,0 +1,375 @@
+#include "VnaArchive.h"
+#include "ScanFixtures.h"
+#include "unity.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define UNITY_INCLUDE_CONFIG_H
+
+#define POINTS 101
+#define START 50000000
+#define STEP 100000
+#define ARCHIVE_PATH "/tmp/test_vna_archive.vnar"
+
+void setUp(void) {
+    /* This is run before EACH TEST */
+}
+
+void tearDown(void) {
+    /* This is run after EACH TEST */
+}
+
+/**
+ * A made up scan of a resonator whose readings drift a little each sweep
+ */
+static void make_scan(struct datapoint_nanoVNA_H *data, struct nanovna_raw_datapoint *points,
+                      int vna_id, int sweep, int scan_index) {
+    make_resonator_scan(data, points, POINTS, START, STEP, vna_id, sweep, scan_index,
+                        1000000000ULL + sweep * 50000000ULL + scan_index * 10000000ULL, 0.001 * sweep);
+    data->scan_id = 3;
+    data->sweep_ns_per_point = 81.25;
+}
+
+static void assert_same_scan(const struct datapoint_nanoVNA_H *expected, const struct datapoint_nanoVNA_H *actual) {
+    TEST_ASSERT_EQUAL_INT(expected->vna_id, actual->vna_id);
+    TEST_ASSERT_EQUAL_INT(expected->scan_id, actual->scan_id);
+    TEST_ASSERT_EQUAL_INT(expected->sweep, actual->sweep);
+    TEST_ASSERT_EQUAL_INT(expected->scan_index, actual->scan_index);
+    TEST_ASSERT_EQUAL_INT(expected->pps, actual->pps);
+    TEST_ASSERT_EQUAL_UINT64(expected->send_ns, actual->send_ns);
+    TEST_ASSERT_EQUAL_UINT64(expected->header_ns, actual->header_ns);
+    TEST_ASSERT_EQUAL_UINT64(expected->receive_ns, actual->receive_ns);
+    TEST_ASSERT_TRUE(expected->sweep_ns_per_point == actual->sweep_ns_per_point);
+    // bit for bit, so NaNs and negative zeros count too
+    TEST_ASSERT_EQUAL_MEMORY(expected->point, actual->point, expected->pps * sizeof(struct nanovna_raw_datapoint));
+}
+
+void test_round_trip_across_sweeps(void) {
+    struct archive_codec encoder, decoder;
+    init_archive_codec(&encoder);
+    init_archive_codec(&decoder);
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data;
+    uint8_t payload[4096];
+    TEST_ASSERT_TRUE(archive_scan_bound(POINTS) <= sizeof(payload));
+
+    for (int sweep = 0; sweep < 5; sweep++) {
+        for (int scan = 0; scan < 3; scan++) {
+            make_scan(&data, points, 1, sweep, scan);
+            if (sweep == 2 && scan == 1) {
+                points[7].s11.re = NAN;
+                points[8].s21.im = -0.0f;
+            }
+            ssize_t length = encode_archive_scan(&encoder, &data, 1000, payload, sizeof(payload));
+            TEST_ASSERT_TRUE(length > 0);
+
+            struct datapoint_nanoVNA_H out;
+            TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, decode_archive_scan(&decoder, payload, length, 1000, &out));
+            assert_same_scan(&data, &out);
+            free(out.point);
+        }
+    }
+    destroy_archive_codec(&encoder);
+    destroy_archive_codec(&decoder);
+}
+
+void test_later_sweeps_compress_against_the_last(void) {
+    struct archive_codec codec;
+    init_archive_codec(&codec);
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data;
+    uint8_t payload[4096];
+
+    make_scan(&data, points, 0, 1, 0);
+    ssize_t key = encode_archive_scan(&codec, &data, 0, payload, sizeof(payload));
+    TEST_ASSERT_EQUAL_HEX8(ARCHIVE_FLAG_KEY, payload[0]);
+    make_scan(&data, points, 0, 2, 0);
+    ssize_t delta = encode_archive_scan(&codec, &data, 0, payload, sizeof(payload));
+    TEST_ASSERT_EQUAL_HEX8(0, payload[0]);
+    TEST_ASSERT_TRUE(delta < key);
+    TEST_ASSERT_TRUE(delta < POINTS * ARCHIVE_RAW_POINT_SIZE / 2);
+
+    // an unchanged sweep costs a bit per reading
+    ssize_t same = encode_archive_scan(&codec, &data, 0, payload, sizeof(payload));
+    TEST_ASSERT_TRUE(same < 40 + POINTS * 4 / 8);
+
+    // and every ARCHIVE_KEY_SWEEPS sweeps starts afresh
+    make_scan(&data, points, 0, ARCHIVE_KEY_SWEEPS, 0);
+    encode_archive_scan(&codec, &data, 0, payload, sizeof(payload));
+    TEST_ASSERT_EQUAL_HEX8(ARCHIVE_FLAG_KEY, payload[0]);
+    destroy_archive_codec(&codec);
+}
+
+void test_irregular_frequencies(void) {
+    struct archive_codec encoder, decoder;
+    init_archive_codec(&encoder);
+    init_archive_codec(&decoder);
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data;
+    uint8_t payload[4096];
+
+    make_scan(&data, points, 0, 0, 0);
+    points[40].frequency += 7;
+    points[41].frequency -= 3;
+    ssize_t length = encode_archive_scan(&encoder, &data, 0, payload, sizeof(payload));
+    TEST_ASSERT_TRUE(length > 0);
+    TEST_ASSERT_TRUE(payload[0] & ARCHIVE_FLAG_FREQS);
+
+    struct datapoint_nanoVNA_H out;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, decode_archive_scan(&decoder, payload, length, 0, &out));
+    assert_same_scan(&data, &out);
+    free(out.point);
+    destroy_archive_codec(&encoder);
+    destroy_archive_codec(&decoder);
+}
+
+void test_decode_needs_the_reference(void) {
+    struct archive_codec encoder, decoder;
+    init_archive_codec(&encoder);
+    init_archive_codec(&decoder);
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data, out;
+    uint8_t payload[4096];
+
+    make_scan(&data, points, 0, 1, 0);
+    encode_archive_scan(&encoder, &data, 0, payload, sizeof(payload));
+    make_scan(&data, points, 0, 2, 0);
+    ssize_t length = encode_archive_scan(&encoder, &data, 0, payload, sizeof(payload));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, decode_archive_scan(&decoder, payload, length, 0, &out));
+    TEST_ASSERT_NULL(out.point);
+    destroy_archive_codec(&encoder);
+    destroy_archive_codec(&decoder);
+}
+
+void test_decode_rejects_truncated_payload(void) {
+    struct archive_codec encoder, decoder;
+    init_archive_codec(&encoder);
+    init_archive_codec(&decoder);
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data, out;
+    uint8_t payload[4096];
+
+    make_scan(&data, points, 0, 0, 0);
+    ssize_t length = encode_archive_scan(&encoder, &data, 0, payload, sizeof(payload));
+    for (ssize_t cut = 0; cut < length; cut += 7)
+        TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, decode_archive_scan(&decoder, payload, cut, 0, &out));
+    destroy_archive_codec(&encoder);
+    destroy_archive_codec(&decoder);
+}
+
+void test_encode_rejects_bad_scans(void) {
+    struct archive_codec codec;
+    init_archive_codec(&codec);
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data;
+    uint8_t payload[4096];
+
+    make_scan(&data, points, MAXIMUM_VNA_PORTS, 0, 0);
+    TEST_ASSERT_EQUAL_INT(-1, encode_archive_scan(&codec, &data, 0, payload, sizeof(payload)));
+    make_scan(&data, points, 0, 0, 0);
+    TEST_ASSERT_EQUAL_INT(-1, encode_archive_scan(&codec, &data, data.send_ns + 1, payload, sizeof(payload)));
+    TEST_ASSERT_EQUAL_INT(-1, encode_archive_scan(&codec, &data, 0, payload, 16));
+    destroy_archive_codec(&codec);
+}
+
+void test_file_round_trip(void) {
+    struct archive_writer writer;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, open_archive_writer(&writer, ARCHIVE_PATH, "bench", 500));
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data;
+    for (int sweep = 0; sweep < 4; sweep++)
+        for (int vna = 0; vna < 2; vna++)
+            for (int scan = 0; scan < 2; scan++) {
+                make_scan(&data, points, vna, sweep, scan);
+                TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, write_archive_scan(&writer, &data));
+            }
+    TEST_ASSERT_EQUAL_INT(16, writer.scans);
+    TEST_ASSERT_EQUAL_UINT64(16 * POINTS * ARCHIVE_RAW_POINT_SIZE, writer.raw_bytes);
+    TEST_ASSERT_TRUE(writer.archive_bytes < writer.raw_bytes / 2);
+    // a block of a type readers don't know, which they skip
+    uint8_t other[8] = {'X', 3, 0, 0, 0, 1, 2, 3};
+    fwrite(other, sizeof(other), 1, writer.file);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, close_archive_writer(&writer));
+
+    struct archive_reader reader;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, open_archive_reader(&reader, ARCHIVE_PATH));
+    TEST_ASSERT_EQUAL_STRING("bench", reader.label);
+    TEST_ASSERT_TRUE(reader.start_unix_ns > 0);
+    int read = 0;
+    struct datapoint_nanoVNA_H out;
+    while (read_archive_scan(&reader, &out) == 1) {
+        int sweep = read / 4, vna = read / 2 % 2, scan = read % 2;
+        make_scan(&data, points, vna, sweep, scan);
+        data.send_ns -= 500;
+        data.header_ns -= 500;
+        data.receive_ns -= 500;
+        assert_same_scan(&data, &out);
+        free(out.point);
+        read++;
+    }
+    TEST_ASSERT_EQUAL_INT(16, read);
+    TEST_ASSERT_EQUAL_INT(0, read_archive_scan(&reader, &out));
+    close_archive_reader(&reader);
+    remove(ARCHIVE_PATH);
+}
+
+/**
+ * Writes sweeps of several VNAs, enough to span a few key epochs
+ */
+static void write_sweeps(struct archive_writer *writer, int nbr_sweeps, int nbr_vnas) {
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data;
+    for (int sweep = 0; sweep < nbr_sweeps; sweep++)
+        for (int vna = 0; vna < nbr_vnas; vna++)
+            for (int scan = 0; scan < 2; scan++) {
+                make_scan(&data, points, vna, sweep, scan);
+                TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, write_archive_scan(writer, &data));
+            }
+}
+
+void test_key_blocks_start_each_epoch(void) {
+    struct archive_codec encoder, decoder;
+    init_archive_codec(&encoder);
+    init_archive_codec(&decoder);
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data, out;
+    uint8_t payload[4096];
+    ssize_t lengths[ARCHIVE_KEY_SWEEPS + 2];
+    for (int sweep = 0; sweep < ARCHIVE_KEY_SWEEPS + 2; sweep++) {
+        make_scan(&data, points, 0, sweep, 0);
+        lengths[sweep] = encode_archive_scan(&encoder, &data, 0, payload, sizeof(payload));
+        TEST_ASSERT_TRUE(lengths[sweep] > 0);
+        // a decoder that missed every sweep before the epoch can start at it
+        if (sweep >= ARCHIVE_KEY_SWEEPS) {
+            TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, decode_archive_scan(&decoder, payload, lengths[sweep], 0, &out));
+            assert_same_scan(&data, &out);
+            free(out.point);
+        }
+    }
+    TEST_ASSERT_TRUE(lengths[ARCHIVE_KEY_SWEEPS] > lengths[ARCHIVE_KEY_SWEEPS - 1]);
+    TEST_ASSERT_TRUE(lengths[ARCHIVE_KEY_SWEEPS + 1] < lengths[ARCHIVE_KEY_SWEEPS]);
+    destroy_archive_codec(&encoder);
+    destroy_archive_codec(&decoder);
+}
+
+void test_index_finds_sweeps_and_times(void) {
+    struct archive_writer writer;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, open_archive_writer(&writer, ARCHIVE_PATH, "index", 0));
+    write_sweeps(&writer, 150, 3);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, close_archive_writer(&writer));
+
+    struct archive_reader reader;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, open_archive_reader(&reader, ARCHIVE_PATH));
+    TEST_ASSERT_TRUE(reader.index_offset > 0);
+    TEST_ASSERT_EQUAL_INT(450, reader.nbr_index);
+    struct archive_index_entry entry;
+    long i = find_archive_sweep(&reader, 1, 100);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, read_archive_index(&reader, i, &entry));
+    TEST_ASSERT_EQUAL_INT(1, entry.vna_id);
+    TEST_ASSERT_EQUAL_INT(100, entry.sweep);
+    TEST_ASSERT_EQUAL_UINT64(1000000000ULL + 100 * 50000000ULL, entry.time_ns);
+    TEST_ASSERT_EQUAL_INT(-1, find_archive_sweep(&reader, 1, 150));
+    TEST_ASSERT_EQUAL_INT(-1, find_archive_sweep(&reader, 3, 0));
+    TEST_ASSERT_EQUAL_INT(i, find_archive_time(&reader, 1, 1000000000ULL + 99 * 50000000ULL + 1));
+
+    // from the middle of an epoch, only the VNA sought comes back
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data, out;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, seek_archive_sweep(&reader, 2, 130));
+    for (int read = 0; read < 40; read++) {
+        TEST_ASSERT_EQUAL_INT(1, read_archive_scan(&reader, &out));
+        make_scan(&data, points, 2, 130 + read / 2, read % 2);
+        assert_same_scan(&data, &out);
+        free(out.point);
+    }
+
+    // every VNA from a time part way through a sweep
+    uint64_t from = 1000000000ULL + 70 * 50000000ULL + 5000000;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, seek_archive_time(&reader, -1, from));
+    int read = 0;
+    for (int sweep = 70; sweep < 150; sweep++)
+        for (int vna = 0; vna < 3; vna++)
+            for (int scan = sweep == 70 ? 1 : 0; scan < 2; scan++) {
+                TEST_ASSERT_EQUAL_INT(1, read_archive_scan(&reader, &out));
+                make_scan(&data, points, vna, sweep, scan);
+                assert_same_scan(&data, &out);
+                free(out.point);
+                read++;
+            }
+    TEST_ASSERT_EQUAL_INT(80 * 6 - 3, read);
+    TEST_ASSERT_EQUAL_INT(0, read_archive_scan(&reader, &out));
+    // the last sweep may have scans after its start, so it's read, but none are late enough
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, seek_archive_time(&reader, 0, 1000000000ULL + 150 * 50000000ULL));
+    TEST_ASSERT_EQUAL_INT(0, read_archive_scan(&reader, &out));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, seek_archive_time(&reader, 3, 0));
+    close_archive_reader(&reader);
+    remove(ARCHIVE_PATH);
+}
+
+void test_index_archive_that_was_not_closed(void) {
+    struct archive_writer writer;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, open_archive_writer(&writer, ARCHIVE_PATH, "killed", 0));
+    write_sweeps(&writer, 100, 2);
+    // as if the scanner was killed part way through writing a block
+    uint64_t cut = writer.archive_bytes - 10;
+    fclose(writer.file);
+    writer.file = NULL;
+    close_archive_writer(&writer);
+    TEST_ASSERT_EQUAL_INT(0, truncate(ARCHIVE_PATH, cut));
+
+    struct archive_reader reader;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, open_archive_reader(&reader, ARCHIVE_PATH));
+    TEST_ASSERT_EQUAL_UINT64(0, reader.index_offset);
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, seek_archive_sweep(&reader, 0, 10));
+    close_archive_reader(&reader);
+
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, index_archive(ARCHIVE_PATH));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, open_archive_reader(&reader, ARCHIVE_PATH));
+    TEST_ASSERT_EQUAL_INT(200, reader.nbr_index);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, seek_archive_sweep(&reader, 1, 99));
+    struct datapoint_nanoVNA_H out;
+    TEST_ASSERT_EQUAL_INT(1, read_archive_scan(&reader, &out));
+    TEST_ASSERT_EQUAL_INT(1, out.vna_id);
+    TEST_ASSERT_EQUAL_INT(99, out.sweep);
+    TEST_ASSERT_EQUAL_INT(0, out.scan_index);
+    free(out.point);
+    // the last scan was cut off
+    TEST_ASSERT_EQUAL_INT(0, read_archive_scan(&reader, &out));
+    close_archive_reader(&reader);
+
+    // a second time changes nothing
+    struct stat before, after;
+    TEST_ASSERT_EQUAL_INT(0, stat(ARCHIVE_PATH, &before));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, index_archive(ARCHIVE_PATH));
+    TEST_ASSERT_EQUAL_INT(0, stat(ARCHIVE_PATH, &after));
+    TEST_ASSERT_EQUAL_INT(before.st_size, after.st_size);
+    remove(ARCHIVE_PATH);
+}
+
+void test_reader_rejects_other_files(void) {
+    FILE *f = fopen(ARCHIVE_PATH, "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    fprintf(f, "! Touchstone file generated from multi-VNA scan\n");
+    fclose(f);
+    struct archive_reader reader;
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, open_archive_reader(&reader, ARCHIVE_PATH));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, open_archive_reader(&reader, "/tmp/no_such_archive.vnar"));
+    remove(ARCHIVE_PATH);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip_across_sweeps);
+    RUN_TEST(test_later_sweeps_compress_against_the_last);
+    RUN_TEST(test_irregular_frequencies);
+    RUN_TEST(test_decode_needs_the_reference);
+    RUN_TEST(test_decode_rejects_truncated_payload);
+    RUN_TEST(test_encode_rejects_bad_scans);
+    RUN_TEST(test_file_round_trip);
+    RUN_TEST(test_key_blocks_start_each_epoch);
+    RUN_TEST(test_index_finds_sweeps_and_times);
+    RUN_TEST(test_index_archive_that_was_not_closed);
+    RUN_TEST(test_reader_rejects_other_files);
+    return UNITY_END();
+}
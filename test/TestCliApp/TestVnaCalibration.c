@@ -0,0 +1,260 @@
+#include "VnaCalibration.h"
+#include "unity.h"
+
+#define UNITY_INCLUDE_CONFIG_H
+
+#define POINTS 11
+#define START 50000000
+#define STOP 60000000
+
+void setUp(void) {
+    /* This is run before EACH TEST */
+}
+
+void tearDown(void) {
+    /* This is run after EACH TEST */
+}
+
+/**
+ * Made up error terms, different at every point
+ */
+static struct complex term(CalTerm t, int k) {
+    return (struct complex){0.05f * (t + 1) + 0.01f * k, 0.02f * (t + 1) - 0.005f * k};
+}
+
+static struct complex cmulf(struct complex a, struct complex b) {
+    return (struct complex){a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re};
+}
+
+static struct complex cdivf(struct complex a, struct complex b) {
+    float d = b.re * b.re + b.im * b.im;
+    return (struct complex){(a.re * b.re + a.im * b.im) / d, (a.im * b.re - a.re * b.im) / d};
+}
+
+/**
+ * What the VNA would measure at point k for a device with reflection s11 and transmission s21
+ */
+static struct nanovna_raw_datapoint measure(int k, struct complex s11, struct complex s21) {
+    struct complex e00 = term(CAL_E00, k), e11 = term(CAL_E11, k), e10e01 = term(CAL_E10E01, k);
+    struct complex e30 = term(CAL_E30, k), e10e32 = term(CAL_E10E32, k);
+    e10e01.re += 1.0f;
+    e10e32.re += 1.0f;
+    struct complex e11_s11 = cmulf(e11, s11);
+    struct complex mismatch = {1.0f - e11_s11.re, -e11_s11.im};
+    struct complex r = cdivf(cmulf(e10e01, s11), mismatch);
+    struct complex t = cdivf(cmulf(e10e32, s21), mismatch);
+    return (struct nanovna_raw_datapoint){START + k * (STOP - START) / (POINTS - 1),
+        {e00.re + r.re, e00.im + r.im}, {e30.re + t.re, e30.im + t.im}};
+}
+
+static void record(struct cal_capture *cap, CalStandard standard, struct complex s11, struct complex s21) {
+    struct nanovna_raw_datapoint points[POINTS];
+    for (int k = 0; k < POINTS; k++)
+        points[k] = measure(k, s11, s21);
+    struct datapoint_nanoVNA_H data = {0};
+    data.pps = POINTS;
+    data.point = points;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, record_standard(cap, standard, 0, &data));
+    cap->measured[standard] = true;
+}
+
+/**
+ * Measures the standards as seen through the made up error terms and solves them
+ */
+static void solve_standards(struct calibration *cal, bool thru) {
+    struct sweep_plan plan;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_sweep_plan(&plan, START, STOP, 1, POINTS));
+    struct cal_capture cap;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_cal_capture(&cap, &plan));
+    struct complex zero = {0, 0};
+    record(&cap, CAL_SHORT, (struct complex){-1, 0}, zero);
+    record(&cap, CAL_OPEN, (struct complex){1, 0}, zero);
+    record(&cap, CAL_LOAD, zero, zero);
+    if (thru) {
+        // port 1 sees port 2's match through the thru
+        struct nanovna_raw_datapoint points[POINTS];
+        for (int k = 0; k < POINTS; k++)
+            points[k] = measure(k, term(CAL_E22, k), (struct complex){1, 0});
+        struct datapoint_nanoVNA_H data = {0};
+        data.pps = POINTS;
+        data.point = points;
+        TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, record_standard(&cap, CAL_THRU, 0, &data));
+        cap.measured[CAL_THRU] = true;
+    }
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, solve_calibration(&cap, cal));
+    destroy_cal_capture(&cap);
+}
+
+/**
+ * solve_calibration
+ */
+void test_solve_recovers_reflection_terms() {
+    struct calibration cal;
+    solve_standards(&cal, false);
+
+    TEST_ASSERT_EQUAL_INT(POINTS, cal.nbr_points);
+    TEST_ASSERT_FALSE(cal.thru);
+    TEST_ASSERT_EQUAL_UINT64(STOP, cal.freqs[POINTS-1]);
+    for (int k = 0; k < POINTS; k++) {
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, term(CAL_E00, k).re, cal.re[CAL_E00][k]);
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, term(CAL_E11, k).im, cal.im[CAL_E11][k]);
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, term(CAL_E10E01, k).re + 1.0f, cal.re[CAL_E10E01][k]);
+    }
+    destroy_calibration(&cal);
+}
+void test_solve_needs_short_open_and_load() {
+    struct sweep_plan plan;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_sweep_plan(&plan, START, STOP, 1, POINTS));
+    struct cal_capture cap;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_cal_capture(&cap, &plan));
+    record(&cap, CAL_SHORT, (struct complex){-1, 0}, (struct complex){0, 0});
+    record(&cap, CAL_LOAD, (struct complex){0, 0}, (struct complex){0, 0});
+
+    struct calibration cal;
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, solve_calibration(&cap, &cal));
+    // an open that reads the same as the short can't be solved either
+    record(&cap, CAL_OPEN, (struct complex){-1, 0}, (struct complex){0, 0});
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, solve_calibration(&cap, &cal));
+    destroy_cal_capture(&cap);
+}
+
+/**
+ * apply_calibration
+ */
+void test_apply_corrects_device() {
+    struct calibration cal;
+    solve_standards(&cal, true);
+    TEST_ASSERT_TRUE(cal.thru);
+
+    struct complex s11 = {0.3f, -0.2f};
+    struct complex s21 = {0.5f, 0.1f};
+    struct nanovna_raw_datapoint points[POINTS];
+    for (int k = 0; k < POINTS; k++)
+        points[k] = measure(k, s11, s21);
+    apply_calibration(&cal, 0, points, POINTS);
+
+    for (int k = 0; k < POINTS; k++) {
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, s11.re, points[k].s11.re);
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, s11.im, points[k].s11.im);
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, s21.re, points[k].s21.re);
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, s21.im, points[k].s21.im);
+    }
+    destroy_calibration(&cal);
+}
+void test_apply_from_first_bin() {
+    struct calibration cal;
+    solve_standards(&cal, false);
+
+    // a scan covering the second half of the grid
+    struct nanovna_raw_datapoint points[POINTS/2];
+    for (int i = 0; i < POINTS/2; i++)
+        points[i] = measure(POINTS/2 + i, (struct complex){-0.4f, 0.4f}, (struct complex){0, 0});
+    apply_calibration(&cal, POINTS/2, points, POINTS/2);
+
+    for (int i = 0; i < POINTS/2; i++) {
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, -0.4f, points[i].s11.re);
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, 0.4f, points[i].s11.im);
+    }
+    destroy_calibration(&cal);
+}
+
+/**
+ * resample_calibration
+ */
+void test_resample_interpolates_between_points() {
+    struct calibration cal;
+    solve_standards(&cal, true);
+
+    uint64_t step = (STOP - START) / (POINTS - 1);
+    uint64_t freqs[3] = {START, START + step / 2, STOP};
+    struct calibration out;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, resample_calibration(&cal, freqs, 3, &out));
+
+    TEST_ASSERT_TRUE(out.thru);
+    TEST_ASSERT_EQUAL_FLOAT(cal.re[CAL_E00][0], out.re[CAL_E00][0]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, (cal.re[CAL_E00][0] + cal.re[CAL_E00][1]) / 2, out.re[CAL_E00][1]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6, (cal.im[CAL_E10E32][0] + cal.im[CAL_E10E32][1]) / 2, out.im[CAL_E10E32][1]);
+    TEST_ASSERT_EQUAL_FLOAT(cal.re[CAL_E11][POINTS-1], out.re[CAL_E11][2]);
+    destroy_calibration(&out);
+
+    // outside the calibrated band
+    freqs[2] = STOP + 2;
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, resample_calibration(&cal, freqs, 3, &out));
+    destroy_calibration(&cal);
+}
+
+/**
+ * save_calibration and load_calibration
+ */
+void test_save_and_load_round_trip() {
+    struct calibration cal;
+    solve_standards(&cal, true);
+    const char *path = "/tmp/test_vna_calibration.cal";
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, save_calibration(&cal, path));
+
+    struct calibration loaded;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, load_calibration(&loaded, path));
+    TEST_ASSERT_EQUAL_INT(cal.nbr_points, loaded.nbr_points);
+    TEST_ASSERT_TRUE(loaded.thru);
+    for (int k = 0; k < POINTS; k++) {
+        TEST_ASSERT_EQUAL_UINT64(cal.freqs[k], loaded.freqs[k]);
+        for (int t = 0; t < CAL_TERMS; t++) {
+            TEST_ASSERT_EQUAL_FLOAT(cal.re[t][k], loaded.re[t][k]);
+            TEST_ASSERT_EQUAL_FLOAT(cal.im[t][k], loaded.im[t][k]);
+        }
+    }
+    destroy_calibration(&loaded);
+    destroy_calibration(&cal);
+    remove(path);
+}
+void test_load_rejects_other_files() {
+    const char *path = "/tmp/test_vna_calibration.txt";
+    FILE *f = fopen(path, "w");
+    TEST_ASSERT_NOT_NULL(f);
+    fprintf(f, "! Touchstone file generated from multi-VNA scan\n");
+    fclose(f);
+
+    struct calibration cal;
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, load_calibration(&cal, path));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, load_calibration(&cal, "/tmp/no_such_calibration.cal"));
+    remove(path);
+}
+
+/**
+ * set_vna_calibration and plan_vna_calibration
+ */
+void test_vna_calibration_for_plan() {
+    struct calibration *cal = malloc(sizeof(struct calibration));
+    TEST_ASSERT_NOT_NULL(cal);
+    solve_standards(cal, false);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, set_vna_calibration(0, cal));
+
+    struct sweep_plan plan;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_sweep_plan_points(&plan, START, STOP, 21, 10));
+    struct calibration *sweep_cal = plan_vna_calibration(0, &plan);
+    TEST_ASSERT_NOT_NULL(sweep_cal);
+    TEST_ASSERT_EQUAL_INT(21, sweep_cal->nbr_points);
+    TEST_ASSERT_NULL(plan_vna_calibration(1, &plan));
+    destroy_calibration(sweep_cal);
+    free(sweep_cal);
+    destroy_sweep_plan(&plan);
+
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, set_vna_calibration(0, NULL));
+    int nbr_points;
+    uint64_t start, stop;
+    bool thru;
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, get_vna_calibration(0, &nbr_points, &start, &stop, &thru));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_solve_recovers_reflection_terms);
+    RUN_TEST(test_solve_needs_short_open_and_load);
+    RUN_TEST(test_apply_corrects_device);
+    RUN_TEST(test_apply_from_first_bin);
+    RUN_TEST(test_resample_interpolates_between_points);
+    RUN_TEST(test_save_and_load_round_trip);
+    RUN_TEST(test_load_rejects_other_files);
+    RUN_TEST(test_vna_calibration_for_plan);
+    return UNITY_END();
+}
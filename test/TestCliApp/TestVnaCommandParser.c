@@ -6,6 +6,11 @@
 int vnas_mocked = 0;
 char **mock_ports;
 
+/**
+ * externs from VnaCommandParser, for testing
+ */
+extern int pps;
+
 void setUp(void) {
     /* This is run before EACH TEST */
     if (vnas_mocked) {
@@ -45,8 +50,9 @@ void testGetVnaListFromArgs() {
     
     int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
     char args[] = "1 0\n";
-    char* tok = strtok(args, " \n");
-    TEST_ASSERT_EQUAL_INT(2, get_vna_list_from_args(tok,vna_list));
+    struct command cmd;
+    tokenise_command(&cmd, args);
+    TEST_ASSERT_EQUAL_INT(2, get_vna_list_from_args(&cmd,vna_list));
 
     int expected[] = {1, 0};
     TEST_ASSERT_EQUAL_INT_ARRAY(expected,vna_list,2);
@@ -59,8 +65,9 @@ void testGetVnaListFromArgsFailsNonInt() {
     
     int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
     char args[] = "this string is not an integer\n";
-    char* tok = strtok(args, " \n");
-    TEST_ASSERT_EQUAL_INT(-1, get_vna_list_from_args(tok,vna_list));
+    struct command cmd;
+    tokenise_command(&cmd, args);
+    TEST_ASSERT_EQUAL_INT(-1, get_vna_list_from_args(&cmd,vna_list));
 
     free(vna_list);
 }
@@ -69,9 +76,11 @@ void testGetVnaListFromArgsFailsOutOfBoundsHigh() {
         TEST_IGNORE_MESSAGE("cannot test without mocked VNA");
     
     int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
-    char args[] = "0 12 1\n";
-    char* tok = strtok(args, " \n");
-    TEST_ASSERT_EQUAL_INT(-1, get_vna_list_from_args(tok,vna_list));
+    char args[20];
+    snprintf(args, sizeof(args), "0 %d 1\n", MAXIMUM_VNA_PORTS+2);
+    struct command cmd;
+    tokenise_command(&cmd, args);
+    TEST_ASSERT_EQUAL_INT(-1, get_vna_list_from_args(&cmd,vna_list));
 
     free(vna_list);
 }
@@ -81,8 +90,9 @@ void testGetVnaListFromArgsFailsOutOfBoundsLow() {
     
     int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
     char args[] = "-1 1 0\n";
-    char* tok = strtok(args, " \n");
-    TEST_ASSERT_EQUAL_INT(-1, get_vna_list_from_args(tok,vna_list));
+    struct command cmd;
+    tokenise_command(&cmd, args);
+    TEST_ASSERT_EQUAL_INT(-1, get_vna_list_from_args(&cmd,vna_list));
 
     free(vna_list);
 }
@@ -92,8 +102,9 @@ void testGetVnaListFromArgsSkipsNotConnected() {
     
     int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
     char args[] = "1 2 0\n";
-    char* tok = strtok(args, " \n");
-    TEST_ASSERT_EQUAL_INT(2, get_vna_list_from_args(tok,vna_list));
+    struct command cmd;
+    tokenise_command(&cmd, args);
+    TEST_ASSERT_EQUAL_INT(2, get_vna_list_from_args(&cmd,vna_list));
 
     int expected[] = {1, 0};
     TEST_ASSERT_EQUAL_INT_ARRAY(expected,vna_list,2);
@@ -105,13 +116,84 @@ void testGetVnaListFromReturnsNoMoreThanMax() {
         TEST_IGNORE_MESSAGE("cannot test without mocked VNA");
     
     int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
-    char args[] = "1 0 1 0 1 0 1 0 1 0 1 0 1\n";
-    char* tok = strtok(args, " \n");
-    TEST_ASSERT_EQUAL_INT(MAXIMUM_VNA_PORTS, get_vna_list_from_args(tok,vna_list));
+    // a few more ids than the maximum
+    char args[(MAXIMUM_VNA_PORTS+3)*2+1] = "";
+    for (int i = 0; i < MAXIMUM_VNA_PORTS+3; i++)
+        strcat(args, i % 2 ? "0 " : "1 ");
+    struct command cmd;
+    tokenise_command(&cmd, args);
+    TEST_ASSERT_EQUAL_INT(MAXIMUM_VNA_PORTS, get_vna_list_from_args(&cmd,vna_list));
 
     free(vna_list);
 }
 
+/**
+ * tokenise_command
+ */
+void testTokeniseCommandSplitsWords() {
+    struct command cmd;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, tokenise_command(&cmd, "  vna\tadd   memory:0 \r\n"));
+    TEST_ASSERT_EQUAL_INT(3, cmd.nbr_tokens);
+    TEST_ASSERT_EQUAL_STRING("vna", peek_token(&cmd));
+    TEST_ASSERT_EQUAL_STRING("vna", next_token(&cmd));
+    TEST_ASSERT_EQUAL_STRING("add", next_token(&cmd));
+    TEST_ASSERT_EQUAL_STRING("memory:0", next_token(&cmd));
+    TEST_ASSERT_NULL(peek_token(&cmd));
+    TEST_ASSERT_NULL(next_token(&cmd));
+}
+void testTokeniseCommandIgnoresComments() {
+    struct command cmd;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, tokenise_command(&cmd, "set points 11 # fewer points"));
+    TEST_ASSERT_EQUAL_INT(3, cmd.nbr_tokens);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, tokenise_command(&cmd, "# just a comment"));
+    TEST_ASSERT_EQUAL_INT(0, cmd.nbr_tokens);
+}
+void testTokeniseCommandRejectsTooLong() {
+    struct command cmd;
+    char line[MAX_COMMAND_LENGTH+1];
+    memset(line, 'a', MAX_COMMAND_LENGTH);
+    line[MAX_COMMAND_LENGTH] = '\0';
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, tokenise_command(&cmd, line));
+
+    // too many words
+    for (int i = 0; i < MAX_COMMAND_TOKENS+1; i++) {
+        line[2*i] = 'a';
+        line[2*i+1] = ' ';
+    }
+    line[2*(MAX_COMMAND_TOKENS+1)] = '\0';
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, tokenise_command(&cmd, line));
+}
+
+/**
+ * run_commands and background jobs
+ */
+void testRunCommandsStopsAtExit() {
+    pps = 101;
+    TEST_ASSERT_EQUAL_INT(0, run_commands("set points 11;;  # nothing"));
+    TEST_ASSERT_EQUAL_INT(11, pps);
+    TEST_ASSERT_EQUAL_INT(1, run_commands("set points 21; exit; set points 31"));
+    TEST_ASSERT_EQUAL_INT(21, pps);
+    pps = 101;
+}
+void testStartJobRunsInBackground() {
+    TEST_ASSERT_EQUAL_INT(0, execute_command("sleep 0.3 &"));
+    uint64_t started = monotonic_ns();
+    int job = start_job("sleep 0.1");
+    TEST_ASSERT_GREATER_THAN_INT(0, job);
+    // started without waiting for it
+    TEST_ASSERT_LESS_THAN_UINT64(100000000, monotonic_ns() - started);
+
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, wait_jobs(job));
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT64(100000000, monotonic_ns() - started);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, wait_jobs(0));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, wait_jobs(job+100));
+}
+void testStartJobRefusesExit() {
+    TEST_ASSERT_EQUAL_INT(-1, start_job("exit"));
+    TEST_ASSERT_EQUAL_INT(-1, start_job("wait"));
+    TEST_ASSERT_EQUAL_INT(-1, start_job(""));
+}
+
 /**
  * calculate_resolution
  */
@@ -129,6 +211,13 @@ void testCalculateResolutionDouble() {
     TEST_ASSERT_EQUAL_INT(2,scans);
     TEST_ASSERT_EQUAL_INT(101,pps);
 }
+void testCalculateResolutionExact() {
+    int scans;
+    int pps;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,calculate_resolution(250,&scans,&pps));
+    TEST_ASSERT_EQUAL_INT(3,scans);
+    TEST_ASSERT_EQUAL_INT(84,pps);
+}
 void testCalculateResolutionNegative() {
     int scans;
     int pps;
@@ -165,8 +254,17 @@ int main(int argc, char *argv[]) {
     RUN_TEST(testGetVnaListFromArgsSkipsNotConnected);
     RUN_TEST(testGetVnaListFromReturnsNoMoreThanMax);
 
+    RUN_TEST(testTokeniseCommandSplitsWords);
+    RUN_TEST(testTokeniseCommandIgnoresComments);
+    RUN_TEST(testTokeniseCommandRejectsTooLong);
+
+    RUN_TEST(testRunCommandsStopsAtExit);
+    RUN_TEST(testStartJobRunsInBackground);
+    RUN_TEST(testStartJobRefusesExit);
+
     RUN_TEST(testCalculateResolutionStandard);
     RUN_TEST(testCalculateResolutionDouble);
+    RUN_TEST(testCalculateResolutionExact);
     RUN_TEST(testCalculateResolutionNegative);
 
     return UNITY_END();
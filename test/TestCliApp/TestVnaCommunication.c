@@ -1,6 +1,8 @@
 #include "VnaCommunication.h"
 #include "unity.h"
 
+#include <pthread.h>
+
 #define UNITY_INCLUDE_CONFIG_H
 
 int vnas_mocked = 0;
@@ -8,17 +10,12 @@ char **mock_ports;
 
 extern char **vna_names;
 extern int total_vnas;
-extern int * vna_fds;
-extern struct termios* vna_initial_settings;
+extern struct vna_transport *vna_transports;
 
 void init_test_ports() {
     // Reset VNA_COUNT for clean state on subsequent runs
     vna_names = calloc(sizeof(char*),MAXIMUM_VNA_PORTS);
-    vna_fds = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
-    vna_initial_settings = calloc(sizeof(struct termios),MAXIMUM_VNA_PORTS);
-
-    for (int i = 0; i < MAXIMUM_VNA_PORTS; i++)
-        vna_fds[i] = -1;
+    vna_transports = calloc(sizeof(struct vna_transport),MAXIMUM_VNA_PORTS);
     
     total_vnas = 0;
 }
@@ -31,7 +28,8 @@ void open_test_ports() {
 
 void close_test_ports() {
     for (int i = 0; i < total_vnas; i++)
-        tcflush(vna_fds[i],TCIOFLUSH);
+        if (is_connected(i))
+            flush_vna(i);
     if (vna_names)
         teardown_port_array();
 }
@@ -117,8 +115,10 @@ void test_write_command() {
     char buffer[100];
     int numBytes;
     do {
-        numBytes = read(vna_fds[vna_num],&buffer,sizeof(char)*100);
+        struct vna_transport *transport = &vna_transports[vna_num];
+        numBytes = transport->ops->read_some(transport,(uint8_t*)buffer,sizeof(char)*99,1000);
         if (numBytes < 0) {printf("Error reading: %s", strerror(errno));return;}
+        buffer[numBytes] = '\0';
         found_name = strstr(buffer,"NanoVNA");
     } while (!found_name && (numBytes > 0) && (!strstr(buffer,"ch>")));
 
@@ -156,6 +156,153 @@ void test_read_exact_reads_ten_bytes() {
     TEST_ASSERT_EQUAL_INT(10,bytes_read);
 }
 
+/**
+ * monotonic_ns
+ */
+void test_monotonic_ns_never_goes_back() {
+    uint64_t last = monotonic_ns();
+    for (int i = 0; i < 1000; i++) {
+        uint64_t now = monotonic_ns();
+        TEST_ASSERT_TRUE(now >= last);
+        last = now;
+    }
+    uint64_t before = monotonic_ns();
+    usleep(2000);
+    TEST_ASSERT_TRUE(monotonic_ns() - before >= 2000000);
+}
+
+/**
+ * drain_vna
+ */
+void test_drain_vna_discards_pending_output() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking serial connection");
+    open_test_ports();
+    int vna_num = 0;
+    write_command(vna_num,"info\r");
+    sleep(1);
+
+    ssize_t drained = drain_vna(vna_num,50,1000);
+    TEST_ASSERT_GREATER_THAN_INT(0,drained);
+
+    uint8_t byte;
+    struct vna_transport *transport = &vna_transports[vna_num];
+    TEST_ASSERT_EQUAL_INT(0,transport->ops->read_some(transport,&byte,sizeof(byte),0));
+}
+void test_drain_vna_returns_when_quiet() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking serial connection");
+    open_test_ports();
+    int vna_num = 0;
+    flush_vna(vna_num);
+
+    TEST_ASSERT_EQUAL_INT(0,drain_vna(vna_num,50,1000));
+}
+
+/**
+ * capture and replay
+ */
+#define TEST_CAPTURE "/tmp/test_vna_capture.bin"
+#define TEST_RECAPTURE "/tmp/test_vna_recapture.bin"
+
+void write_capture_record(FILE *file, char direction, const char *bytes) {
+    uint32_t length = strlen(bytes);
+    uint8_t header[5] = {direction, length & 0xff, (length >> 8) & 0xff, (length >> 16) & 0xff, length >> 24};
+    fwrite(header,1,sizeof(header),file);
+    fwrite(bytes,1,length,file);
+}
+void write_test_capture() {
+    FILE *file = fopen(TEST_CAPTURE,"wb");
+    fputs(CAPTURE_MAGIC,file);
+    write_capture_record(file,CAPTURE_SENT,"scan\r");
+    write_capture_record(file,CAPTURE_RECEIVED,"hello");
+    write_capture_record(file,CAPTURE_DISCARDED,"junk");
+    write_capture_record(file,CAPTURE_RECEIVED,"world");
+    fclose(file);
+}
+void test_replay_serves_received_bytes() {
+    write_test_capture();
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,add_vna("replay:" TEST_CAPTURE));
+    TEST_ASSERT_TRUE(is_replay(0));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,test_vna(0));
+
+    // nothing is sent until a command is written
+    uint8_t buffer[16] = {0};
+    TEST_ASSERT_EQUAL_INT(0,drain_vna(0,50,1000));
+
+    // then received bytes come back without the discarded ones
+    TEST_ASSERT_EQUAL_INT(5,write_command(0,"scan\r"));
+    TEST_ASSERT_EQUAL_INT(10,read_exact(0,buffer,10));
+    TEST_ASSERT_EQUAL_MEMORY("helloworld",buffer,10);
+    TEST_ASSERT_EQUAL_INT(0,drain_vna(0,50,1000));
+
+    // then starts again from the beginning
+    write_command(0,"scan\r");
+    TEST_ASSERT_EQUAL_INT(7,read_exact(0,buffer,7));
+    TEST_ASSERT_EQUAL_MEMORY("hellowo",buffer,7);
+
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,remove_vna_number(0));
+    TEST_ASSERT_FALSE(is_replay(0));
+    remove(TEST_CAPTURE);
+}
+void test_drain_replay_skips_rest_of_reply() {
+    write_test_capture();
+    add_vna("replay:" TEST_CAPTURE);
+
+    uint8_t buffer[16];
+    write_command(0,"scan\r");
+    read_exact(0,buffer,3);
+    TEST_ASSERT_EQUAL_INT(7,drain_vna(0,50,1000));
+    write_command(0,"scan\r");
+    TEST_ASSERT_EQUAL_INT(5,read_exact(0,buffer,5));
+    TEST_ASSERT_EQUAL_MEMORY("hello",buffer,5);
+    remove(TEST_CAPTURE);
+}
+void test_capture_records_traffic() {
+    write_test_capture();
+    add_vna("replay:" TEST_CAPTURE);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,start_capture(0,TEST_RECAPTURE));
+    TEST_ASSERT_TRUE(is_capturing(0));
+
+    uint8_t buffer[16];
+    write_command(0,"scan\r");
+    read_exact(0,buffer,8);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,stop_capture(0));
+    TEST_ASSERT_FALSE(is_capturing(0));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,stop_capture(0));
+
+    // the new capture replays just what was read from the first
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,add_vna("replay:" TEST_RECAPTURE));
+    write_command(1,"scan\r");
+    TEST_ASSERT_EQUAL_INT(8,read_exact(1,buffer,8));
+    TEST_ASSERT_EQUAL_MEMORY("hellowor",buffer,8);
+    write_command(1,"scan\r");
+    TEST_ASSERT_EQUAL_INT(1,read_exact(1,buffer,1));
+    TEST_ASSERT_EQUAL_MEMORY("h",buffer,1);
+
+    remove(TEST_CAPTURE);
+    remove(TEST_RECAPTURE);
+}
+void test_add_vna_rejects_invalid_capture() {
+    FILE *file = fopen(TEST_CAPTURE,"wb");
+    fputs("not a capture\n",file);
+    fclose(file);
+    TEST_ASSERT_EQUAL_INT(4,add_vna("replay:" TEST_CAPTURE));
+
+    // record running past the end of the file
+    file = fopen(TEST_CAPTURE,"wb");
+    fputs(CAPTURE_MAGIC,file);
+    uint8_t header[5] = {CAPTURE_RECEIVED, 100, 0, 0, 0};
+    fwrite(header,1,sizeof(header),file);
+    fputs("short",file);
+    fclose(file);
+    TEST_ASSERT_EQUAL_INT(4,add_vna("replay:" TEST_CAPTURE));
+    TEST_ASSERT_EQUAL_INT(0,get_vna_count());
+
+    TEST_ASSERT_EQUAL_INT(-1,add_vna("replay:/not_a_real_file_name"));
+    remove(TEST_CAPTURE);
+}
+
 /**
  * test_vna
  */
@@ -267,7 +414,9 @@ void test_add_vna_fails_max_path_length() {
     if (!vnas_mocked)
         TEST_IGNORE_MESSAGE("Cannot test without mocking serial connection");
 
-    char* long_path = "12345678912345678912345678";
+    char long_path[MAXIMUM_VNA_PATH_LENGTH+2];
+    memset(long_path,'1',MAXIMUM_VNA_PATH_LENGTH+1);
+    long_path[MAXIMUM_VNA_PATH_LENGTH+1] = '\0';
     TEST_ASSERT_EQUAL_INT(2,add_vna(long_path));
 }
 void test_add_vna_fails_not_a_file() {
@@ -288,6 +437,56 @@ void test_add_vna_fails_not_a_nanovna() {
     TEST_IGNORE_MESSAGE("Needs new non-vna serial simulator script");
 }
 
+struct concurrent_add {
+    char path[16];
+    int result;
+};
+static void *add_vna_thread(void *arguments) {
+    struct concurrent_add *add = arguments;
+    add->result = add_vna(add->path);
+    return NULL;
+}
+void test_add_vna_concurrent_adds_get_own_ids() {
+    // two threads for each VNA, as 'vna add ... &' jobs might be
+    struct concurrent_add adds[8];
+    pthread_t threads[8];
+    for (int i = 0; i < 8; i++) {
+        snprintf(adds[i].path, sizeof(adds[i].path), "memory:%d", i % 4);
+        pthread_create(&threads[i], NULL, &add_vna_thread, &adds[i]);
+    }
+    int added = 0;
+    int duplicates = 0;
+    for (int i = 0; i < 8; i++) {
+        pthread_join(threads[i], NULL);
+        if (adds[i].result == EXIT_SUCCESS)
+            added++;
+        else if (adds[i].result == 3)
+            duplicates++;
+    }
+    TEST_ASSERT_EQUAL_INT(4, added);
+    TEST_ASSERT_EQUAL_INT(4, duplicates);
+    TEST_ASSERT_EQUAL_INT(4, get_vna_count());
+
+    int vna_list[MAXIMUM_VNA_PORTS];
+    TEST_ASSERT_EQUAL_INT(4, get_connected_vnas(vna_list));
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < i; j++)
+            TEST_ASSERT_NOT_EQUAL(0, strcmp(vna_names[vna_list[i]], vna_names[vna_list[j]]));
+    }
+}
+void test_get_connected_vnas_skips_gaps() {
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, add_vna("memory:0"));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, add_vna("memory:1"));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, remove_vna_number(0));
+
+    int vna_list[MAXIMUM_VNA_PORTS];
+    TEST_ASSERT_EQUAL_INT(1, get_connected_vnas(vna_list));
+    TEST_ASSERT_EQUAL_INT(1, vna_list[0]);
+    TEST_ASSERT_EQUAL_INT(0, in_vna_list("memory:0"));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, remove_vna_name("memory:1"));
+    TEST_ASSERT_EQUAL_INT(0, get_connected_vnas(vna_list));
+}
+
 /**
  * remove_vna_name
  */
@@ -343,8 +542,7 @@ void test_teardown_port_array_targets() {
     TEST_ASSERT_EQUAL_INT(0,total_vnas);
     // could also do with comparing the termios structures etc.
     TEST_ASSERT_NULL(vna_names);
-    TEST_ASSERT_NULL(vna_fds);
-    TEST_ASSERT_NULL(vna_initial_settings);
+    TEST_ASSERT_NULL(vna_transports);
 }
 
 int main(int argc, char *argv[]) {
@@ -364,9 +562,19 @@ int main(int argc, char *argv[]) {
 
     RUN_TEST(test_read_exact_reads_one_byte);
     RUN_TEST(test_read_exact_reads_ten_bytes);
+
+    RUN_TEST(test_monotonic_ns_never_goes_back);
+
+    RUN_TEST(test_drain_vna_discards_pending_output);
+    RUN_TEST(test_drain_vna_returns_when_quiet);
     RUN_TEST(test_open_serial_mac_fallback_success);
     RUN_TEST(test_open_serial_fails_gracefully_on_bad_path);
 
+    RUN_TEST(test_replay_serves_received_bytes);
+    RUN_TEST(test_drain_replay_skips_rest_of_reply);
+    RUN_TEST(test_capture_records_traffic);
+    RUN_TEST(test_add_vna_rejects_invalid_capture);
+
     RUN_TEST(test_test_vna_success);
 
     RUN_TEST(test_in_vna_list_true);
@@ -382,6 +590,8 @@ int main(int argc, char *argv[]) {
     RUN_TEST(test_add_vna_fails_not_a_file);
     RUN_TEST(test_add_vna_fails_already_connected);
     RUN_TEST(test_add_vna_fails_not_a_nanovna);
+    RUN_TEST(test_add_vna_concurrent_adds_get_own_ids);
+    RUN_TEST(test_get_connected_vnas_skips_gaps);
 
     RUN_TEST(test_remove_vna_name_removes);
     RUN_TEST(test_remove_vna_name_no_such_connection);
@@ -0,0 +1,216 @@
+#include "VnaPeak.h"
+#include "ScanFixtures.h"
+#include "unity.h"
+
+#include <math.h>
+
+#define UNITY_INCLUDE_CONFIG_H
+
+#define PPS 101
+#define POINTS 401
+#define START_HZ 90000000
+#define STOP_HZ 110000000
+#define STEP_HZ 50000
+
+struct sweep_plan plan;
+struct complex values[POINTS];
+
+void setUp(void) {
+    /* This is run before EACH TEST */
+    // 401 points 50 kHz apart, in scans of 101 with the last taking 98
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_sweep_plan_points(&plan, START_HZ, STOP_HZ, POINTS, PPS));
+}
+
+void tearDown(void) {
+    /* This is run after EACH TEST */
+    destroy_sweep_plan(&plan);
+}
+
+/**
+ * A resonator's transmission, 1 / (1 + 2jQ (f - f0) / f0), whose 3 dB
+ * bandwidth is f0 / q
+ */
+static void resonance(double f0, double q) {
+    for (int k = 0; k < plan.nbr_points; k++) {
+        double x = 2 * q * (plan.freqs[k] - f0) / f0;
+        values[k] = (struct complex){1 / (1 + x * x), -x / (1 + x * x)};
+    }
+}
+
+/**
+ * A notch, 1 minus a resonance of size d, down 20 log10(1 - d) dB at f0
+ */
+static void notch(double f0, double q, double d) {
+    resonance(f0, q);
+    for (int k = 0; k < plan.nbr_points; k++)
+        values[k] = (struct complex){1 - d * values[k].re, -d * values[k].im};
+}
+
+/**
+ * Makes scan scan_index of a sweep of values, for peak_add_scan
+ */
+static struct datapoint_nanoVNA_H *make_scan(int vna_id, int sweep, int scan_index, uint64_t send_ns, bool s11) {
+    return make_plan_scan(&plan, values, s11, vna_id, 2, sweep, scan_index, send_ns);
+}
+
+/**
+ * find_peak
+ */
+void test_peak_found_between_points() {
+    struct peak_tracker tracker;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, init_peak_tracker(&tracker, &plan, PEAK_S21_PEAK, 0));
+    // 5% of 401 points
+    TEST_ASSERT_EQUAL_INT(20, tracker.window);
+
+    // a third of the way between two points, 10 points wide
+    resonance(100016667, 200);
+    struct peak_record record;
+    find_peak(&tracker, 3, values, &record);
+
+    TEST_ASSERT_EQUAL_INT(3, record.vna_id);
+    TEST_ASSERT_EQUAL_INT(PEAK_S21_PEAK, record.mode);
+    TEST_ASSERT_TRUE(record.full_search);
+    // far closer than the nearest point, 16.667 kHz away
+    TEST_ASSERT_FLOAT_WITHIN(2000, 100016667, record.frequency);
+    TEST_ASSERT_FLOAT_WITHIN(4, 200, record.q);
+    TEST_ASSERT_FLOAT_WITHIN(0.05, 0, record.level);
+    // both ends are 40 half bandwidths away, 32 dB down
+    TEST_ASSERT_FLOAT_WITHIN(0.1, 32.05, record.depth);
+    destroy_peak_tracker(&tracker);
+}
+void test_dip_found() {
+    struct peak_tracker tracker;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, init_peak_tracker(&tracker, &plan, PEAK_S21_DIP, 0));
+    notch(95000000, 100, 0.9);
+    struct peak_record record;
+    find_peak(&tracker, 0, values, &record);
+
+    TEST_ASSERT_FLOAT_WITHIN(2000, 95000000, record.frequency);
+    TEST_ASSERT_FLOAT_WITHIN(0.2, -20, record.level);
+    TEST_ASSERT_FLOAT_WITHIN(0.2, 20, record.depth);
+    // half way up in dB is narrower than the resonance's own bandwidth
+    TEST_ASSERT_TRUE(record.q > 100);
+    TEST_ASSERT_TRUE(record.q < 1000);
+    destroy_peak_tracker(&tracker);
+}
+void test_resonance_off_the_end_has_no_q() {
+    struct peak_tracker tracker;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, init_peak_tracker(&tracker, &plan, PEAK_S21_PEAK, 0));
+    resonance(110000000, 200);
+    struct peak_record record;
+    find_peak(&tracker, 0, values, &record);
+    TEST_ASSERT_FLOAT_WITHIN(1, 110000000, record.frequency);
+    TEST_ASSERT_TRUE(isnan(record.q));
+    destroy_peak_tracker(&tracker);
+}
+
+/**
+ * Searching around the last resonance
+ */
+void test_later_sweeps_search_window() {
+    struct peak_tracker tracker;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, init_peak_tracker(&tracker, &plan, PEAK_S21_PEAK, 10));
+    struct peak_record record;
+    resonance(100000000, 200);
+    find_peak(&tracker, 0, values, &record);
+    TEST_ASSERT_TRUE(record.full_search);
+    long full_points = tracker.points_examined;
+
+    // drifting a few points
+    resonance(100123000, 200);
+    find_peak(&tracker, 0, values, &record);
+    TEST_ASSERT_FALSE(record.full_search);
+    TEST_ASSERT_FLOAT_WITHIN(2000, 100123000, record.frequency);
+    TEST_ASSERT_FLOAT_WITHIN(4, 200, record.q);
+    TEST_ASSERT_TRUE(tracker.points_examined - full_points < full_points / 4);
+
+    // another VNA still needs a full search
+    find_peak(&tracker, 1, values, &record);
+    TEST_ASSERT_TRUE(record.full_search);
+
+    // jumping out of the window
+    resonance(93000000, 200);
+    find_peak(&tracker, 0, values, &record);
+    TEST_ASSERT_TRUE(record.full_search);
+    TEST_ASSERT_FLOAT_WITHIN(2000, 93000000, record.frequency);
+    TEST_ASSERT_EQUAL_INT(4, tracker.records);
+    TEST_ASSERT_EQUAL_INT(3, tracker.full_searches);
+    destroy_peak_tracker(&tracker);
+}
+void test_full_search_every_so_often() {
+    struct peak_tracker tracker;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, init_peak_tracker(&tracker, &plan, PEAK_S21_PEAK, 10));
+    resonance(100000000, 200);
+    struct peak_record record;
+    for (int sweep = 0; sweep <= PEAK_FULL_SEARCH_SWEEPS + 1; sweep++) {
+        find_peak(&tracker, 0, values, &record);
+        TEST_ASSERT_EQUAL(sweep == 0 || sweep == PEAK_FULL_SEARCH_SWEEPS + 1, record.full_search);
+    }
+    destroy_peak_tracker(&tracker);
+}
+
+/**
+ * peak_add_scan
+ */
+void test_scans_gathered_into_sweeps() {
+    struct peak_tracker tracker;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, init_peak_tracker(&tracker, &plan, PEAK_S11_DIP, 0));
+    notch(105000000, 50, 0.99);
+    struct peak_record record;
+    // scans out of order, with another sweep's scan in between
+    int order[4] = {2, 0, 3, 1};
+    for (int i = 0; i < 4; i++) {
+        struct datapoint_nanoVNA_H *data = make_scan(1, 7, order[i], 100 + order[i], true);
+        TEST_ASSERT_EQUAL(i == 3, peak_add_scan(&tracker, data, &record));
+        free_plan_scan(data);
+        if (i == 1) {
+            data = make_scan(1, 8, 0, 200, true);
+            TEST_ASSERT_FALSE(peak_add_scan(&tracker, data, &record));
+            free_plan_scan(data);
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(1, record.vna_id);
+    TEST_ASSERT_EQUAL_INT(2, record.scan_id);
+    TEST_ASSERT_EQUAL_INT(7, record.sweep);
+    TEST_ASSERT_EQUAL_UINT64(100, record.send_ns);
+    TEST_ASSERT_FLOAT_WITHIN(2000, 105000000, record.frequency);
+    TEST_ASSERT_FLOAT_WITHIN(0.5, -40, record.level);
+    TEST_ASSERT_EQUAL_INT(0, tracker.abandoned);
+    destroy_peak_tracker(&tracker);
+}
+
+/**
+ * init_peak_tracker and parse_peak_mode
+ */
+void test_tracker_needs_three_points() {
+    struct sweep_plan small;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_sweep_plan_points(&small, START_HZ, STOP_HZ, 2, PPS));
+    struct peak_tracker tracker;
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, init_peak_tracker(&tracker, &small, PEAK_S21_PEAK, 0));
+    destroy_sweep_plan(&small);
+}
+void test_parse_names() {
+    PeakMode mode;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, parse_peak_mode("s11dip", &mode));
+    TEST_ASSERT_EQUAL_INT(PEAK_S11_DIP, mode);
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, parse_peak_mode("s11peak", &mode));
+    TEST_ASSERT_EQUAL_STRING("s21peak", peak_mode_name(PEAK_S21_PEAK));
+}
+
+int main(int argc, char *argv[]) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_peak_found_between_points);
+    RUN_TEST(test_dip_found);
+    RUN_TEST(test_resonance_off_the_end_has_no_q);
+
+    RUN_TEST(test_later_sweeps_search_window);
+    RUN_TEST(test_full_search_every_so_often);
+
+    RUN_TEST(test_scans_gathered_into_sweeps);
+
+    RUN_TEST(test_tracker_needs_three_points);
+    RUN_TEST(test_parse_names);
+
+    return UNITY_END();
+}
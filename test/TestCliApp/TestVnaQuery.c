@@ -0,0 +1,304 @@
+#include "VnaQuery.h"
+#include "ScanFixtures.h"
+#include "unity.h"
+
+#include <math.h>
+
+#define UNITY_INCLUDE_CONFIG_H
+
+#define POINTS 101
+#define START 50000000
+#define STEP 100000
+#define SWEEP_NS 50000000ULL
+#define ARCHIVE_PATH "/tmp/test_vna_query.vnar"
+
+void setUp(void) {
+    /* This is run before EACH TEST */
+}
+
+void tearDown(void) {
+    /* This is run after EACH TEST */
+}
+
+/**
+ * A made up scan whose readings move a little each sweep
+ */
+static void make_scan(struct datapoint_nanoVNA_H *data, struct nanovna_raw_datapoint *points,
+                      int vna_id, int sweep, int scan_index) {
+    make_resonator_scan(data, points, POINTS, START, STEP, vna_id, sweep, scan_index,
+                        sweep * SWEEP_NS + scan_index * 10000000ULL, 0.01 * (sweep % 7));
+}
+
+/**
+ * Writes an archive of 150 sweeps of 3 VNAs, 2 scans each, indexed unless
+ * the writer is left unclosed
+ */
+static void write_archive(bool indexed) {
+    struct archive_writer writer;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, open_archive_writer(&writer, ARCHIVE_PATH, "query", 0));
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data;
+    for (int sweep = 0; sweep < 150; sweep++)
+        for (int vna = 0; vna < 3; vna++)
+            for (int scan = 0; scan < 2; scan++) {
+                make_scan(&data, points, vna, sweep, scan);
+                TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, write_archive_scan(&writer, &data));
+            }
+    if (!indexed) {
+        fclose(writer.file);
+        writer.file = NULL;
+    }
+    close_archive_writer(&writer);
+}
+
+/**
+ * Runs a query, returning what it printed (to be freed)
+ */
+static char *query_text(const struct query *query) {
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&text, &length);
+    TEST_ASSERT_NOT_NULL(out);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, run_query(ARCHIVE_PATH, query, out));
+    fclose(out);
+    return text;
+}
+
+static int count_lines(const char *text) {
+    int lines = 0;
+    for (; *text; text++)
+        lines += *text == '\n';
+    return lines;
+}
+
+void test_bin_statistics(void) {
+    struct query query;
+    init_query(&query);
+    struct query_result result;
+    init_query_result(&result);
+    struct nanovna_raw_datapoint point = {START, {0, 0}, {0, 0}};
+    struct datapoint_nanoVNA_H data = {.vna_id = 2, .pps = 1, .point = &point};
+    // |S11| of 1, 0.1 and 0.01 is 0, -20 and -40 dB
+    double magnitudes[3] = {1, 0.1, 0.01};
+    for (int i = 0; i < 3; i++) {
+        point.s11 = (struct complex){0, (float)magnitudes[i]};
+        point.s21 = (struct complex){(float)magnitudes[i], 0};
+        TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, add_query_scan(&result, &query, &data));
+    }
+    // an exact zero is counted as -200 dB, and a NaN not at all
+    point.s11 = (struct complex){0, 0};
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, add_query_scan(&result, &query, &data));
+    point.s21.im = NAN;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, add_query_scan(&result, &query, &data));
+
+    TEST_ASSERT_EQUAL_INT(1, result.nbr_bins[2]);
+    TEST_ASSERT_EQUAL_INT(4, result.points);
+    const struct query_bin *bin = &result.bins[2][0];
+    TEST_ASSERT_EQUAL_UINT32(START, bin->key);
+    TEST_ASSERT_EQUAL_INT(4, bin->count);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4, -65.0, bin->s11_db.mean);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4, -200.0, bin->s11_db.min);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4, 0.0, bin->s11_db.max);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4, -25.0, bin->s21_db.mean);
+    // std of 0, -20, -40, -40 around their mean of -25
+    TEST_ASSERT_FLOAT_WITHIN(1e-4, sqrt((625 + 25 + 225 + 225) / 4.0), query_stat_std(&bin->s21_db, bin->count));
+    TEST_ASSERT_FLOAT_WITHIN(1e-4, 0.1 + 0.01 + 0.01 + 1, bin->s21_sum[0]);
+    destroy_query_result(&result);
+}
+
+void test_band_and_bin_width(void) {
+    struct query query;
+    init_query(&query);
+    query.min_hz = START + 10 * STEP;
+    query.max_hz = START + 59 * STEP;
+    query.bin_hz = 10 * STEP;
+    struct query_result result;
+    init_query_result(&result);
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data;
+    make_scan(&data, points, 0, 0, 0);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, add_query_scan(&result, &query, &data));
+    TEST_ASSERT_EQUAL_INT(50, result.points);
+    TEST_ASSERT_EQUAL_INT(5, result.nbr_bins[0]);
+    for (int i = 0; i < 5; i++) {
+        TEST_ASSERT_EQUAL_UINT32(START / (10 * STEP) + 1 + i, result.bins[0][i].key);
+        TEST_ASSERT_EQUAL_INT(10, result.bins[0][i].count);
+    }
+    destroy_query_result(&result);
+}
+
+void test_merge_matches_adding_to_one(void) {
+    struct query query;
+    init_query(&query);
+    struct query_result all, even, odd;
+    init_query_result(&all);
+    init_query_result(&even);
+    init_query_result(&odd);
+    struct nanovna_raw_datapoint points[POINTS];
+    struct datapoint_nanoVNA_H data;
+    for (int sweep = 0; sweep < 20; sweep++)
+        for (int scan = 0; scan < 2; scan++) {
+            // only the even sweeps have the second scan's frequencies
+            if (sweep % 2 == 1 && scan == 1)
+                continue;
+            make_scan(&data, points, 1, sweep, scan);
+            TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, add_query_scan(&all, &query, &data));
+            if (sweep % 2 == 0)
+                TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, add_query_scan(&even, &query, &data));
+            else
+                TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, add_query_scan(&odd, &query, &data));
+        }
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, merge_query_results(&odd, &even));
+    TEST_ASSERT_EQUAL_INT(2 * POINTS, odd.nbr_bins[1]);
+    TEST_ASSERT_EQUAL_INT(all.nbr_bins[1], odd.nbr_bins[1]);
+    for (int i = 0; i < all.nbr_bins[1]; i++) {
+        const struct query_bin *a = &all.bins[1][i], *b = &odd.bins[1][i];
+        TEST_ASSERT_EQUAL_UINT32(a->key, b->key);
+        TEST_ASSERT_EQUAL_INT(i < POINTS ? 20 : 10, b->count);
+        TEST_ASSERT_FLOAT_WITHIN(1e-5, a->s11_db.mean, b->s11_db.mean);
+        TEST_ASSERT_FLOAT_WITHIN(1e-5, query_stat_std(&a->s11_db, a->count), query_stat_std(&b->s11_db, b->count));
+        TEST_ASSERT_TRUE(a->s11_db.min == b->s11_db.min);
+        TEST_ASSERT_TRUE(a->s11_db.max == b->s11_db.max);
+    }
+    destroy_query_result(&all);
+    destroy_query_result(&even);
+    destroy_query_result(&odd);
+}
+
+void test_chunks_follow_epochs_and_times(void) {
+    write_archive(true);
+    struct archive_reader reader;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, open_archive_reader(&reader, ARCHIVE_PATH));
+    struct query query;
+    init_query(&query);
+    memset(query.vnas, 0, sizeof(query.vnas));
+    query.vnas[0] = query.vnas[2] = true;
+    struct query_chunk *chunks;
+    long nbr_chunks;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, plan_query_chunks(&reader, &query, &chunks, &nbr_chunks));
+    // sweeps 0-63, 64-127 and 128-149 of each VNA
+    TEST_ASSERT_EQUAL_INT(6, nbr_chunks);
+    TEST_ASSERT_EQUAL_INT(2, chunks[3].vna_id);
+    TEST_ASSERT_EQUAL_INT(0, chunks[3].first_sweep);
+    TEST_ASSERT_EQUAL_INT(ARCHIVE_KEY_SWEEPS, chunks[3].end_sweep);
+    TEST_ASSERT_EQUAL_INT(2 * ARCHIVE_KEY_SWEEPS, chunks[4].end_sweep);
+    TEST_ASSERT_EQUAL_UINT64(ARCHIVE_KEY_SWEEPS * SWEEP_NS, chunks[4].time_ns);
+    free(chunks);
+
+    // the last scans of sweep 63 are in the first chunk, and sweep 127 ends in the second
+    query.from_ns = 63 * SWEEP_NS + 1;
+    query.to_ns = 127 * SWEEP_NS;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, plan_query_chunks(&reader, &query, &chunks, &nbr_chunks));
+    TEST_ASSERT_EQUAL_INT(4, nbr_chunks);
+    free(chunks);
+    query.from_ns = ARCHIVE_KEY_SWEEPS * SWEEP_NS;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, plan_query_chunks(&reader, &query, &chunks, &nbr_chunks));
+    TEST_ASSERT_EQUAL_INT(2, nbr_chunks);
+    TEST_ASSERT_EQUAL_INT(ARCHIVE_KEY_SWEEPS, chunks[1].first_sweep);
+    free(chunks);
+    close_archive_reader(&reader);
+    remove(ARCHIVE_PATH);
+}
+
+void test_raw_query_filters(void) {
+    write_archive(true);
+    struct query query;
+    init_query(&query);
+    memset(query.vnas, 0, sizeof(query.vnas));
+    query.vnas[1] = true;
+    query.from_ns = 60 * SWEEP_NS + 5000000;
+    query.to_ns = 70 * SWEEP_NS;
+    query.min_hz = START + 100 * STEP;
+    query.max_hz = START + 102 * STEP;
+    query.raw = true;
+    query.nbr_threads = 4;
+    char *text = query_text(&query);
+    // sweeps 60 (only its second scan) to 69; points 100 of the first scan
+    // and 101 and 102 of the second
+    TEST_ASSERT_EQUAL_INT(1 + 2 + 9 * 3, count_lines(text));
+    char *line = strchr(text, '\n') + 1;
+    int vna, sweep, scan;
+    double time;
+    uint32_t frequency;
+    TEST_ASSERT_EQUAL_INT(5, sscanf(line, "%d,%d,%d,%lf,%u", &vna, &sweep, &scan, &time, &frequency));
+    TEST_ASSERT_EQUAL_INT(1, vna);
+    TEST_ASSERT_EQUAL_INT(60, sweep);
+    TEST_ASSERT_EQUAL_INT(1, scan);
+    TEST_ASSERT_EQUAL_UINT32(START + 101 * STEP, frequency);
+    free(text);
+    remove(ARCHIVE_PATH);
+}
+
+void test_parallel_query_matches_one_thread(void) {
+    write_archive(true);
+    struct query query;
+    init_query(&query);
+    query.raw = true;
+    query.format = QUERY_TOUCHSTONE;
+    query.to_ns = 140 * SWEEP_NS;
+    char *one = query_text(&query);
+    query.nbr_threads = 4;
+    char *four = query_text(&query);
+    TEST_ASSERT_EQUAL_STRING(one, four);
+    free(one);
+    free(four);
+
+    query.raw = false;
+    query.format = QUERY_CSV;
+    query.nbr_threads = 1;
+    one = query_text(&query);
+    query.nbr_threads = 4;
+    four = query_text(&query);
+    TEST_ASSERT_EQUAL_INT(1 + 3 * 2 * POINTS, count_lines(one));
+    TEST_ASSERT_EQUAL_INT(count_lines(one), count_lines(four));
+    char *a = one, *b = four;
+    while ((a = strchr(a, '\n') + 1) && *a && (b = strchr(b, '\n') + 1) && *b) {
+        int vna[2];
+        long count[2];
+        uint64_t frequency[2];
+        double mean[2], std[2];
+        TEST_ASSERT_EQUAL_INT(5, sscanf(a, "%d,%" SCNu64 ",%ld,%lf,%*f,%*f,%lf", &vna[0], &frequency[0], &count[0], &mean[0], &std[0]));
+        TEST_ASSERT_EQUAL_INT(5, sscanf(b, "%d,%" SCNu64 ",%ld,%lf,%*f,%*f,%lf", &vna[1], &frequency[1], &count[1], &mean[1], &std[1]));
+        TEST_ASSERT_EQUAL_INT(vna[0], vna[1]);
+        TEST_ASSERT_EQUAL_UINT64(frequency[0], frequency[1]);
+        TEST_ASSERT_EQUAL_INT(140, count[0]);
+        TEST_ASSERT_EQUAL_INT(count[0], count[1]);
+        TEST_ASSERT_FLOAT_WITHIN(2e-4, mean[0], mean[1]);
+        TEST_ASSERT_FLOAT_WITHIN(2e-4, std[0], std[1]);
+    }
+    free(one);
+    free(four);
+    remove(ARCHIVE_PATH);
+}
+
+void test_query_without_index(void) {
+    write_archive(false);
+    struct query query;
+    init_query(&query);
+    query.vnas[0] = false;
+    query.from_ns = 100 * SWEEP_NS;
+    query.nbr_threads = 4;
+    char *text = query_text(&query);
+    TEST_ASSERT_EQUAL_INT(1 + 2 * 2 * POINTS, count_lines(text));
+    int vna;
+    uint64_t frequency;
+    long count;
+    TEST_ASSERT_EQUAL_INT(3, sscanf(strchr(text, '\n') + 1, "%d,%" SCNu64 ",%ld", &vna, &frequency, &count));
+    TEST_ASSERT_EQUAL_INT(1, vna);
+    TEST_ASSERT_EQUAL_UINT64(START, frequency);
+    TEST_ASSERT_EQUAL_INT(50, count);
+    free(text);
+    remove(ARCHIVE_PATH);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_bin_statistics);
+    RUN_TEST(test_band_and_bin_width);
+    RUN_TEST(test_merge_matches_adding_to_one);
+    RUN_TEST(test_chunks_follow_epochs_and_times);
+    RUN_TEST(test_raw_query_filters);
+    RUN_TEST(test_parallel_query_matches_one_thread);
+    RUN_TEST(test_query_without_index);
+    return UNITY_END();
+}
@@ -1,6 +1,9 @@
+#define _GNU_SOURCE // sched_getcpu and pthread_getaffinity_np
 #include "VnaScanMultithreaded.h"
 #include "unity.h"
 
+#include <sched.h>
+
 #define UNITY_INCLUDE_CONFIG_H
 
 #define PPS 101
@@ -14,11 +17,6 @@ char **mock_ports;
 extern int* scan_states;
 extern pthread_t* scan_threads;
 
-/**
- * extern from VnaCommunication, purely for flushing I/O
- */
-extern int* vna_fds;
-
 void setUp(void) {
     /* This is run before EACH TEST */
     if (vnas_mocked) {
@@ -27,7 +25,7 @@ void setUp(void) {
             add_vna(mock_ports[i]);
         }
         for (int i = 0; i < vnas_mocked; i++) {
-            tcflush(vna_fds[i],TCIOFLUSH);
+            flush_vna(i);
         }
     }
 }
@@ -127,6 +125,148 @@ void test_add_buff_escapes_block_after_full() {
     destroy_bounded_buffer(b);
 }
 
+/**
+ * Bounded buffer policies
+ */
+struct datapoint_nanoVNA_H* make_indexed_scan(int index) {
+    struct datapoint_nanoVNA_H *data = calloc(1,sizeof(struct datapoint_nanoVNA_H));
+    data->scan_index = index;
+    data->pps = PPS;
+    data->point = calloc(PPS,sizeof(struct nanovna_raw_datapoint));
+    data->point[PPS-1].frequency = index;
+    return data;
+}
+void take_indexed_scans(struct bounded_buffer *b, int first, int last) {
+    for (int i = first; i <= last; i++) {
+        struct datapoint_nanoVNA_H *data = take_buff(b);
+        TEST_ASSERT_NOT_NULL(data);
+        TEST_ASSERT_EQUAL_INT(i,data->scan_index);
+        TEST_ASSERT_EQUAL_UINT32(i,data->point[PPS-1].frequency);
+        free(data->point);
+        free(data);
+    }
+}
+void test_create_bounded_buffer_with_policy_checks_capacity() {
+    struct bounded_buffer *b = malloc(sizeof(struct bounded_buffer));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,create_bounded_buffer_with_policy(b,PPS,0,BUFFER_BLOCK));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,create_bounded_buffer_with_policy(b,PPS,MAX_BUFFER_CAPACITY+1,BUFFER_BLOCK));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,create_bounded_buffer_with_policy(b,PPS,3,BUFFER_SPILL));
+    TEST_ASSERT_EQUAL_INT(3,b->capacity);
+    TEST_ASSERT_NOT_NULL(b->spill);
+    destroy_bounded_buffer(b);
+}
+void test_add_buff_drop_newest_keeps_oldest() {
+    struct bounded_buffer *b = malloc(sizeof(struct bounded_buffer));
+    create_bounded_buffer_with_policy(b,PPS,3,BUFFER_DROP_NEWEST);
+    for (int i = 0; i < 5; i++)
+        add_buff(b,make_indexed_scan(i));
+    mark_buffer_complete(b);
+
+    take_indexed_scans(b,0,2);
+    TEST_ASSERT_NULL(take_buff(b));
+    struct buffer_stats stats;
+    get_buffer_stats(b,&stats);
+    TEST_ASSERT_EQUAL_INT(5,stats.added);
+    TEST_ASSERT_EQUAL_INT(2,stats.dropped_newest);
+    TEST_ASSERT_EQUAL_INT(0,stats.dropped_oldest);
+    TEST_ASSERT_EQUAL_INT(0,stats.blocked);
+    TEST_ASSERT_EQUAL_INT(3,stats.peak);
+    destroy_bounded_buffer(b);
+}
+void test_add_buff_drop_oldest_keeps_newest() {
+    struct bounded_buffer *b = malloc(sizeof(struct bounded_buffer));
+    create_bounded_buffer_with_policy(b,PPS,3,BUFFER_DROP_OLDEST);
+    for (int i = 0; i < 5; i++)
+        add_buff(b,make_indexed_scan(i));
+    mark_buffer_complete(b);
+
+    take_indexed_scans(b,2,4);
+    TEST_ASSERT_NULL(take_buff(b));
+    struct buffer_stats stats;
+    get_buffer_stats(b,&stats);
+    TEST_ASSERT_EQUAL_INT(2,stats.dropped_oldest);
+    TEST_ASSERT_EQUAL_INT(0,stats.dropped_newest);
+    TEST_ASSERT_EQUAL_INT(0,stats.blocked);
+    destroy_bounded_buffer(b);
+}
+void test_add_buff_spill_keeps_everything_in_order() {
+    struct bounded_buffer *b = malloc(sizeof(struct bounded_buffer));
+    create_bounded_buffer_with_policy(b,PPS,2,BUFFER_SPILL);
+    for (int i = 0; i < 6; i++)
+        add_buff(b,make_indexed_scan(i));
+
+    struct buffer_stats stats;
+    get_buffer_stats(b,&stats);
+    TEST_ASSERT_EQUAL_INT(2,stats.queued);
+    TEST_ASSERT_EQUAL_INT(4,stats.spilled);
+    TEST_ASSERT_EQUAL_INT(4,stats.spill_queued);
+
+    // taking makes room, but later scans must still queue behind the spilled ones
+    take_indexed_scans(b,0,1);
+    add_buff(b,make_indexed_scan(6));
+    mark_buffer_complete(b);
+    take_indexed_scans(b,2,6);
+    TEST_ASSERT_NULL(take_buff(b));
+
+    get_buffer_stats(b,&stats);
+    TEST_ASSERT_EQUAL_INT(5,stats.spilled);
+    TEST_ASSERT_EQUAL_INT(5,stats.unspilled);
+    TEST_ASSERT_EQUAL_INT(0,stats.spill_queued);
+    TEST_ASSERT_EQUAL_INT(0,stats.spill_lost);
+    TEST_ASSERT_EQUAL_INT(0,stats.blocked);
+    // emptied, so the file is reused from the start
+    TEST_ASSERT_EQUAL_INT(0,b->spill_write);
+    destroy_bounded_buffer(b);
+}
+void test_add_buff_block_counts_waits() {
+    struct bounded_buffer *b = malloc(sizeof(struct bounded_buffer));
+    create_bounded_buffer_with_policy(b,PPS,1,BUFFER_BLOCK);
+    add_buff(b,make_indexed_scan(0));
+
+    struct thread_imitator_add_args args = {b,make_indexed_scan(1)};
+    pthread_t thread;
+    pthread_create(&thread, NULL, &thread_imitator_add, &args);
+    usleep(100000);
+    take_indexed_scans(b,0,0);
+    pthread_join(thread,NULL);
+    take_indexed_scans(b,1,1);
+
+    struct buffer_stats stats;
+    get_buffer_stats(b,&stats);
+    TEST_ASSERT_EQUAL_INT(1,stats.blocked);
+    TEST_ASSERT_GREATER_THAN_UINT64(50000000,stats.blocked_ns);
+    TEST_ASSERT_EQUAL_INT(0,stats.dropped_oldest + stats.dropped_newest + stats.spilled);
+    destroy_bounded_buffer(b);
+}
+void test_buffer_capacity_for_budget_scales_with_points() {
+    size_t full = buffer_scan_bytes(101);
+    size_t small = buffer_scan_bytes(11);
+    TEST_ASSERT_EQUAL_INT(90*sizeof(struct nanovna_raw_datapoint),full-small);
+    TEST_ASSERT_EQUAL_INT(50,buffer_capacity_for_budget(50*full,101));
+    TEST_ASSERT_EQUAL_INT(50,buffer_capacity_for_budget(51*full-1,101));
+    TEST_ASSERT_GREATER_THAN_INT(50,buffer_capacity_for_budget(50*full,11));
+    // clamped
+    TEST_ASSERT_EQUAL_INT(1,buffer_capacity_for_budget(0,101));
+    TEST_ASSERT_EQUAL_INT(MAX_BUFFER_CAPACITY,buffer_capacity_for_budget((size_t)1 << 40,101));
+
+    struct bounded_buffer *b = malloc(sizeof(struct bounded_buffer));
+    create_bounded_buffer_with_policy(b,PPS,buffer_capacity_for_budget(1 << 20,PPS),BUFFER_BLOCK);
+    struct buffer_stats stats;
+    get_buffer_stats(b,&stats);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT64(1 << 20,stats.capacity*stats.scan_bytes);
+    TEST_ASSERT_GREATER_THAN_UINT64(1 << 20,(stats.capacity+1)*stats.scan_bytes);
+    destroy_bounded_buffer(b);
+}
+void test_parse_buffer_policy_round_trips() {
+    BufferPolicy policy;
+    const BufferPolicy policies[] = {BUFFER_BLOCK, BUFFER_DROP_OLDEST, BUFFER_DROP_NEWEST, BUFFER_SPILL};
+    for (int i = 0; i < 4; i++) {
+        TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,parse_buffer_policy(buffer_policy_name(policies[i]),&policy));
+        TEST_ASSERT_EQUAL_INT(policies[i],policy);
+    }
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,parse_buffer_policy("sometimes",&policy));
+}
+
 /**
  * Bounded Buffer take
  */
@@ -192,6 +332,393 @@ void test_take_buff_escapes_block_after_full() {
     destroy_bounded_buffer(b);
 }
 
+/**
+ * Task scheduler
+ */
+void test_next_scan_task_gives_every_worker_every_sweep() {
+    struct task_scheduler sched;
+    struct sweep_plan plan;
+    create_sweep_plan(&plan,50000000,50000000+(3*PPS-1)*1000,3,PPS);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_task_scheduler(&sched,2,false,&plan,2));
+
+    struct scan_task task;
+    for (int worker = 0; worker < 2; worker++) {
+        for (int sweep = 0; sweep < 2; sweep++) {
+            for (int scan = 0; scan < 3; scan++) {
+                TEST_ASSERT_TRUE(next_scan_task(&sched,worker,&task,true));
+                TEST_ASSERT_EQUAL_INT(sweep,task.sweep);
+                TEST_ASSERT_EQUAL_INT(scan,task.scan);
+                TEST_ASSERT_EQUAL_INT(50000000+scan*PPS*1000,task.start);
+                TEST_ASSERT_EQUAL_INT(PPS,task.pps);
+            }
+        }
+        TEST_ASSERT_FALSE(next_scan_task(&sched,worker,&task,true));
+    }
+    destroy_task_scheduler(&sched);
+    destroy_sweep_plan(&plan);
+}
+void test_next_scan_task_shares_sweep_between_workers() {
+    struct task_scheduler sched;
+    struct sweep_plan plan;
+    create_sweep_plan(&plan,50000000,50000000+(4*PPS-1)*1000,4,PPS);
+    create_task_scheduler(&sched,2,true,&plan,1);
+
+    struct scan_task task;
+    int seen[4] = {0};
+    TEST_ASSERT_TRUE(next_scan_task(&sched,0,&task,true));
+    seen[task.scan]++;
+    TEST_ASSERT_TRUE(next_scan_task(&sched,1,&task,true));
+    seen[task.scan]++;
+    TEST_ASSERT_TRUE(next_scan_task(&sched,0,&task,true));
+    seen[task.scan]++;
+    TEST_ASSERT_TRUE(next_scan_task(&sched,1,&task,true));
+    seen[task.scan]++;
+    TEST_ASSERT_FALSE(next_scan_task(&sched,0,&task,true));
+    TEST_ASSERT_FALSE(next_scan_task(&sched,1,&task,true));
+
+    int expected[4] = {1,1,1,1};
+    TEST_ASSERT_EQUAL_INT_ARRAY(expected,seen,4);
+    destroy_task_scheduler(&sched);
+    destroy_sweep_plan(&plan);
+}
+void test_next_scan_task_steals_from_busy_worker() {
+    struct task_scheduler sched;
+    struct sweep_plan plan;
+    create_sweep_plan(&plan,50000000,50000000+(4*PPS-1)*1000,4,PPS);
+    create_task_scheduler(&sched,2,true,&plan,1);
+
+    // worker 0 releases the sweep, dealing scans 0 and 2 to itself and 1 and 3 to worker 1
+    struct scan_task task;
+    TEST_ASSERT_TRUE(next_scan_task(&sched,0,&task,true));
+    TEST_ASSERT_EQUAL_INT(0,task.scan);
+    TEST_ASSERT_TRUE(next_scan_task(&sched,0,&task,true));
+    TEST_ASSERT_EQUAL_INT(2,task.scan);
+
+    // worker 1 is stuck, so worker 0 takes its last scan
+    TEST_ASSERT_TRUE(next_scan_task(&sched,0,&task,true));
+    TEST_ASSERT_EQUAL_INT(3,task.scan);
+
+    TEST_ASSERT_TRUE(next_scan_task(&sched,1,&task,true));
+    TEST_ASSERT_EQUAL_INT(1,task.scan);
+    TEST_ASSERT_FALSE(next_scan_task(&sched,0,&task,true));
+    destroy_task_scheduler(&sched);
+    destroy_sweep_plan(&plan);
+}
+void test_next_scan_task_ongoing_stops_releasing() {
+    struct task_scheduler sched;
+    struct sweep_plan plan;
+    create_sweep_plan(&plan,50000000,50000000+(2*PPS-1)*1000,2,PPS);
+    create_task_scheduler(&sched,1,false,&plan,-1);
+
+    struct scan_task task;
+    for (int i = 0; i < 10; i++) {
+        TEST_ASSERT_TRUE(next_scan_task(&sched,0,&task,true));
+        TEST_ASSERT_EQUAL_INT(i/2,task.sweep);
+    }
+    TEST_ASSERT_FALSE(next_scan_task(&sched,0,&task,false));
+    destroy_task_scheduler(&sched);
+    destroy_sweep_plan(&plan);
+}
+
+struct held_back_args {
+    struct task_scheduler *sched;
+    struct scan_task task;
+    atomic_bool fetched;
+};
+static void *fetch_held_back_task(void *arguments) {
+    struct held_back_args *args = arguments;
+    next_scan_task(args->sched,0,&args->task,true);
+    atomic_store(&args->fetched,true);
+    return NULL;
+}
+void test_next_scan_task_shared_holds_back_sweep_until_oldest_finishes() {
+    struct task_scheduler sched;
+    struct sweep_plan plan;
+    create_sweep_plan(&plan,50000000,50000000+(PPS-1)*1000,1,PPS);
+    create_task_scheduler(&sched,1,true,&plan,-1);
+
+    // as many sweeps in progress as the consumer can follow
+    struct scan_task task;
+    for (int sweep = 0; sweep < SWEEP_TRACKER_SLOTS; sweep++) {
+        TEST_ASSERT_TRUE(next_scan_task(&sched,0,&task,true));
+        TEST_ASSERT_EQUAL_INT(sweep,task.sweep);
+    }
+
+    struct held_back_args args = {&sched};
+    atomic_init(&args.fetched,false);
+    pthread_t thread;
+    pthread_create(&thread,NULL,&fetch_held_back_task,&args);
+    usleep(50000);
+    TEST_ASSERT_FALSE(atomic_load(&args.fetched));
+
+    // finishing a later sweep isn't enough, the oldest is still out
+    task.sweep = 1;
+    finish_scan_task(&sched,&task);
+    usleep(50000);
+    TEST_ASSERT_FALSE(atomic_load(&args.fetched));
+
+    task.sweep = 0;
+    finish_scan_task(&sched,&task);
+    pthread_join(thread,NULL);
+    TEST_ASSERT_TRUE(atomic_load(&args.fetched));
+    TEST_ASSERT_EQUAL_INT(SWEEP_TRACKER_SLOTS,args.task.sweep);
+    destroy_task_scheduler(&sched);
+    destroy_sweep_plan(&plan);
+}
+
+void test_next_scan_task_paced_counts_missed_ticks() {
+    struct task_scheduler sched;
+    struct sweep_plan plan;
+    create_sweep_plan(&plan,50000000,50000000+(2*PPS-1)*1000,2,PPS);
+    create_task_scheduler(&sched,1,false,&plan,-1);
+    pace_task_scheduler(&sched,true);
+
+    // three start times pass before the worker gets round to a sweep
+    tick_task_scheduler(&sched);
+    tick_task_scheduler(&sched);
+    tick_task_scheduler(&sched);
+    struct scan_task task;
+    TEST_ASSERT_TRUE(next_scan_task(&sched,0,&task,true));
+    TEST_ASSERT_EQUAL_INT(0,task.sweep);
+    TEST_ASSERT_TRUE(next_scan_task(&sched,0,&task,true));
+    TEST_ASSERT_EQUAL_INT(2,sched.missed);
+
+    // only one sweep for all three, and closing stops the wait for the next
+    close_task_scheduler(&sched);
+    TEST_ASSERT_FALSE(next_scan_task(&sched,0,&task,true));
+    destroy_task_scheduler(&sched);
+    destroy_sweep_plan(&plan);
+}
+void test_sweep_timer_keeps_cadence() {
+    struct task_scheduler sched;
+    struct sweep_plan plan;
+    create_sweep_plan(&plan,50000000,50000000+(2*PPS-1)*1000,2,PPS);
+    create_task_scheduler(&sched,1,false,&plan,5);
+
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, arm_sweep_timer(0,&sched,0,100000000ULL,0));
+    struct scan_task task;
+    uint64_t sweep_starts[5];
+    uint64_t first = monotonic_ns();
+    while (next_scan_task(&sched,0,&task,true)) {
+        if (task.scan == 0)
+            sweep_starts[task.sweep] = monotonic_ns() - first;
+    }
+    disarm_sweep_timer(0);
+
+    // each sweep starts on its own 100 ms mark, not 100 ms after the last
+    for (int i = 0; i < 5; i++) {
+        TEST_ASSERT_GREATER_OR_EQUAL_UINT64(i * 100000000ULL, sweep_starts[i] + 5000000ULL);
+        TEST_ASSERT_LESS_THAN_UINT64(i * 100000000ULL + 50000000ULL, sweep_starts[i]);
+    }
+    TEST_ASSERT_EQUAL_INT(0,sched.missed);
+    destroy_task_scheduler(&sched);
+    destroy_sweep_plan(&plan);
+}
+void test_arm_sweep_timer_rejects_invalid() {
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, arm_sweep_timer(-1,NULL,0,0,1));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, arm_sweep_timer(MAX_ONGOING_SCANS,NULL,0,0,1));
+}
+
+/**
+ * Thread placement
+ */
+void test_parse_cpu_list_reads_lists_and_ranges() {
+    uint64_t cpus;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, parse_cpu_list("2",&cpus));
+    TEST_ASSERT_EQUAL_UINT64(0x4,cpus);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, parse_cpu_list("0-3,6",&cpus));
+    TEST_ASSERT_EQUAL_UINT64(0x4f,cpus);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, parse_cpu_list("any",&cpus));
+    TEST_ASSERT_EQUAL_UINT64(0,cpus);
+
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, parse_cpu_list("",&cpus));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, parse_cpu_list("3-1",&cpus));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, parse_cpu_list("1,",&cpus));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, parse_cpu_list("64",&cpus));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, parse_cpu_list("two",&cpus));
+}
+void test_format_cpu_list_collapses_ranges() {
+    char list[64];
+    format_cpu_list(0x4f,list,sizeof(list));
+    TEST_ASSERT_EQUAL_STRING("0-3,6",list);
+    format_cpu_list(0,list,sizeof(list));
+    TEST_ASSERT_EQUAL_STRING("any",list);
+    format_cpu_list(1ULL << 63,list,sizeof(list));
+    TEST_ASSERT_EQUAL_STRING("63",list);
+}
+struct placement_check {
+    int cpu;
+    struct thread_sched_stats stats;
+};
+static void *check_placement(void *arguments) {
+    struct placement_check *check = arguments;
+    check->cpu = sched_getcpu();
+    get_thread_sched_stats(&check->stats);
+    return NULL;
+}
+void test_create_placed_thread_starts_on_its_cpu() {
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(0,cpu);
+    struct placement_check check = {-1};
+    pthread_t thread;
+    TEST_ASSERT_EQUAL_INT(0, create_placed_thread(&thread,&check_placement,&check,1ULL << cpu,0));
+    pthread_join(thread,NULL);
+    TEST_ASSERT_EQUAL_INT(cpu,check.cpu);
+    TEST_ASSERT_TRUE(check.stats.available);
+    TEST_ASSERT_GREATER_THAN_INT(0,check.stats.timeslices);
+#else
+    TEST_IGNORE_MESSAGE("Thread placement is only supported on Linux");
+#endif
+}
+void test_create_placed_thread_runs_unplaced_if_it_must() {
+    if (sysconf(_SC_NPROCESSORS_CONF) >= MAX_PINNED_CPUS)
+        TEST_IGNORE_MESSAGE("Every CPU a mask can name exists");
+    // a CPU that doesn't exist can't be pinned to, but the thread still runs
+    struct placement_check check = {-1};
+    pthread_t thread;
+    TEST_ASSERT_EQUAL_INT(0, create_placed_thread(&thread,&check_placement,&check,1ULL << (MAX_PINNED_CPUS - 1),0));
+    pthread_join(thread,NULL);
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(0,check.cpu);
+}
+
+/**
+ * Sweep tracker
+ */
+void test_track_sweep_record_completes_sweep() {
+    struct sweep_tracker tracker;
+    init_sweep_tracker(&tracker,3,false);
+    struct sweep_event events[2];
+    struct datapoint_nanoVNA_H data = {0};
+    data.vna_id = 2;
+
+    for (int scan = 0; scan < 2; scan++) {
+        data.scan_index = scan;
+        TEST_ASSERT_EQUAL_INT(0,track_sweep_record(&tracker,&data,events));
+    }
+    data.scan_index = 2;
+    TEST_ASSERT_EQUAL_INT(1,track_sweep_record(&tracker,&data,events));
+    TEST_ASSERT_EQUAL_INT(2,events[0].owner);
+    TEST_ASSERT_EQUAL_INT(0,events[0].sweep);
+    TEST_ASSERT_EQUAL_INT(3,events[0].arrived);
+    TEST_ASSERT_TRUE(events[0].complete);
+}
+void test_track_sweep_record_shared_sweep_across_vnas() {
+    struct sweep_tracker tracker;
+    init_sweep_tracker(&tracker,2,true);
+    struct sweep_event events[2];
+    struct datapoint_nanoVNA_H data = {0};
+
+    data.vna_id = 0;
+    TEST_ASSERT_EQUAL_INT(0,track_sweep_record(&tracker,&data,events));
+    data.vna_id = 1;
+    data.scan_index = 1;
+    TEST_ASSERT_EQUAL_INT(1,track_sweep_record(&tracker,&data,events));
+    TEST_ASSERT_EQUAL_INT(SWEEP_OWNER_SHARED,events[0].owner);
+    TEST_ASSERT_TRUE(events[0].complete);
+}
+void test_track_sweep_record_gives_up_on_oldest() {
+    struct sweep_tracker tracker;
+    init_sweep_tracker(&tracker,2,false);
+    struct sweep_event events[2];
+    struct datapoint_nanoVNA_H data = {0};
+
+    // one sub-band of each sweep arrives, the other is dropped
+    for (int sweep = 0; sweep < SWEEP_TRACKER_SLOTS; sweep++) {
+        data.sweep = sweep;
+        TEST_ASSERT_EQUAL_INT(0,track_sweep_record(&tracker,&data,events));
+    }
+    data.sweep = SWEEP_TRACKER_SLOTS;
+    TEST_ASSERT_EQUAL_INT(1,track_sweep_record(&tracker,&data,events));
+    TEST_ASSERT_EQUAL_INT(0,events[0].sweep);
+    TEST_ASSERT_EQUAL_INT(1,events[0].arrived);
+    TEST_ASSERT_FALSE(events[0].complete);
+}
+void test_flush_sweep_tracker_reports_in_order() {
+    struct sweep_tracker tracker;
+    init_sweep_tracker(&tracker,2,false);
+    struct sweep_event events[MAXIMUM_VNA_PORTS*SWEEP_TRACKER_SLOTS];
+    struct datapoint_nanoVNA_H data = {0};
+
+    data.sweep = 1;
+    track_sweep_record(&tracker,&data,events);
+    data.sweep = 0;
+    track_sweep_record(&tracker,&data,events);
+
+    TEST_ASSERT_EQUAL_INT(2,flush_sweep_tracker(&tracker,events));
+    TEST_ASSERT_EQUAL_INT(0,events[0].sweep);
+    TEST_ASSERT_EQUAL_INT(1,events[1].sweep);
+    TEST_ASSERT_FALSE(events[0].complete);
+    TEST_ASSERT_EQUAL_INT(0,flush_sweep_tracker(&tracker,events));
+}
+
+struct interleaved_worker_args {
+    struct task_scheduler *sched;
+    struct sweep_tracker *tracker;
+    pthread_mutex_t *lock;
+    int worker;
+    int complete;
+    int incomplete;
+};
+static void *interleaved_worker(void *arguments) {
+    struct interleaved_worker_args *args = arguments;
+    unsigned int seed = args->worker;
+    struct scan_task task;
+    struct sweep_event events[2];
+    while (next_scan_task(args->sched,args->worker,&task,true)) {
+        // scans take uneven times, so sweeps overlap
+        usleep(rand_r(&seed) % 300);
+        struct datapoint_nanoVNA_H data = {0};
+        data.vna_id = args->worker;
+        data.sweep = task.sweep;
+        data.scan_index = task.scan;
+        pthread_mutex_lock(args->lock);
+        int nbr_events = track_sweep_record(args->tracker,&data,events);
+        pthread_mutex_unlock(args->lock);
+        for (int i = 0; i < nbr_events; i++) {
+            if (events[i].complete)
+                args->complete++;
+            else
+                args->incomplete++;
+        }
+        finish_scan_task(args->sched,&task);
+    }
+    return NULL;
+}
+void test_shared_sweeps_interleaved_across_workers_all_complete() {
+    const int nbr_workers = 8;
+    const int nbr_sweeps = 200;
+    struct task_scheduler sched;
+    struct sweep_plan plan;
+    create_sweep_plan(&plan,50000000,50000000+(2*PPS-1)*1000,2,PPS);
+    create_task_scheduler(&sched,nbr_workers,true,&plan,nbr_sweeps);
+    struct sweep_tracker tracker;
+    init_sweep_tracker(&tracker,plan.nbr_scans,true);
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    // far more workers than tracker slots, each free to start a sweep
+    pthread_t threads[nbr_workers];
+    struct interleaved_worker_args args[nbr_workers];
+    for (int i = 0; i < nbr_workers; i++) {
+        args[i] = (struct interleaved_worker_args){&sched, &tracker, &lock, i, 0, 0};
+        pthread_create(&threads[i],NULL,&interleaved_worker,&args[i]);
+    }
+    int complete = 0;
+    int incomplete = 0;
+    for (int i = 0; i < nbr_workers; i++) {
+        pthread_join(threads[i],NULL);
+        complete += args[i].complete;
+        incomplete += args[i].incomplete;
+    }
+
+    struct sweep_event events[MAXIMUM_VNA_PORTS*SWEEP_TRACKER_SLOTS];
+    TEST_ASSERT_EQUAL_INT(0,incomplete);
+    TEST_ASSERT_EQUAL_INT(nbr_sweeps,complete);
+    TEST_ASSERT_EQUAL_INT(0,flush_sweep_tracker(&tracker,events));
+    destroy_task_scheduler(&sched);
+    destroy_sweep_plan(&plan);
+}
+
 /**
  * Find Binary Header
  */
@@ -210,7 +737,7 @@ void test_find_binary_header_handles_random_data() {
     sleep(1);
 
     struct nanovna_raw_datapoint fp;
-    int error = find_binary_header(vna_id,&fp,MASK,PPS);
+    int error = find_binary_header(vna_id,&fp,MASK,PPS,NULL);
     TEST_ASSERT_EQUAL_INT(0,error);
 
     uint32_t freq;
@@ -231,7 +758,7 @@ void test_find_binary_header_constructs_correct_first_point() {
     sleep(1);
 
     struct nanovna_raw_datapoint fp;
-    int error = find_binary_header(vna_id,&fp,MASK,PPS);
+    int error = find_binary_header(vna_id,&fp,MASK,PPS,NULL);
     TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,error);
 
     TEST_ASSERT_EQUAL_INT(start,fp.frequency);
@@ -249,9 +776,9 @@ void test_find_binary_header_fails_gracefully() {
     sleep(1);
 
     struct nanovna_raw_datapoint fp;
-    int error = find_binary_header(vna_id,&fp,MASK,PPS);
+    int error = find_binary_header(vna_id,&fp,MASK,PPS,NULL);
     TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,error);
-    error = find_binary_header(vna_id,&fp,MASK,PPS);
+    error = find_binary_header(vna_id,&fp,MASK,PPS,NULL);
     TEST_ASSERT_NOT_EQUAL_INT(EXIT_SUCCESS,error);
 }
 
@@ -276,6 +803,25 @@ void test_pull_scan_constructs_valid_data() {
     free(data->point);
     free(data);
 }
+void test_pull_scan_timestamps_in_order() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking read_exact()");
+    int vna_id = 0;
+    int start = 50000000;
+
+    uint64_t before = monotonic_ns();
+    struct datapoint_nanoVNA_H* data = pull_scan(vna_id,start,start+(PPS*100000),PPS);
+    uint64_t after = monotonic_ns();
+
+    TEST_ASSERT_NOT_NULL(data);
+    TEST_ASSERT_TRUE(before <= data->send_ns);
+    TEST_ASSERT_TRUE(data->send_ns < data->header_ns);
+    TEST_ASSERT_TRUE(data->header_ns <= data->receive_ns);
+    TEST_ASSERT_TRUE(data->receive_ns <= after);
+
+    free(data->point);
+    free(data);
+}
 void test_pull_scan_takes_correct_number_points_low() {
     if (!vnas_mocked)
         TEST_IGNORE_MESSAGE("Cannot test without mocking read_exact()");
@@ -327,6 +873,194 @@ void test_pull_scan_nulls_malformed_data() {
     sleep(2);
 }
 
+void test_pull_scan_from_memory_vna() {
+    // emulated in memory, so needs no serial connection
+    if (!vnas_mocked)
+        initialise_port_array();
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,add_vna(MEMORY_PREFIX "0"));
+    int vna_id = vnas_mocked;
+    int start = 50000000;
+
+    struct datapoint_nanoVNA_H* data = pull_scan(vna_id,start,start+(PPS*100000),PPS);
+
+    TEST_ASSERT_NOT_NULL(data);
+    TEST_ASSERT_EQUAL_INT(vna_id,data->vna_id);
+    for (int i = 0; i < PPS; i++) {
+        TEST_ASSERT_EQUAL_INT(start+(i*PPS*1000),data->point[i].frequency);
+    }
+    free(data->point);
+    free(data);
+
+    if (!vnas_mocked)
+        teardown_port_array();
+}
+
+/**
+ * Pull Scan Retry
+ */
+void test_pull_scan_retry_recovers_malformed_data() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking read_exact()");
+    int vna_id = 0;
+    int start = 50000000;
+    reset_vna_stats(vna_id);
+    write_command(vna_id,"malform\r");
+    sleep(1);
+
+    struct datapoint_nanoVNA_H* data = pull_scan_retry(vna_id,start,start+(PPS*100000),PPS,2,true);
+    TEST_ASSERT_NOT_NULL(data);
+    for (int i = 0; i < PPS; i++) {
+        TEST_ASSERT_EQUAL_INT(start+(i*PPS*1000),data->point[i].frequency);
+    }
+    free(data->point);
+    free(data);
+
+    struct vna_scan_stats stats;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,get_vna_stats(vna_id,&stats));
+    TEST_ASSERT_EQUAL_INT(1,stats.scans);
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(1,stats.failed_pulls);
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(1,stats.retries);
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(1,stats.resyncs);
+    TEST_ASSERT_EQUAL_INT(1,stats.recoveries);
+    TEST_ASSERT_EQUAL_INT(0,stats.dropped_scans);
+    TEST_ASSERT_TRUE(stats.max_recovery_ns > 0);
+}
+void test_pull_scan_retry_drops_without_retries() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking read_exact()");
+    int vna_id = 0;
+    int start = 50000000;
+    reset_vna_stats(vna_id);
+    write_command(vna_id,"malform\r");
+    sleep(1);
+
+    struct datapoint_nanoVNA_H* data = pull_scan_retry(vna_id,start,start+(PPS*100000),PPS,0,true);
+    TEST_ASSERT_NULL(data);
+
+    struct vna_scan_stats stats;
+    get_vna_stats(vna_id,&stats);
+    TEST_ASSERT_EQUAL_INT(0,stats.scans);
+    TEST_ASSERT_EQUAL_INT(1,stats.failed_pulls);
+    TEST_ASSERT_EQUAL_INT(0,stats.retries);
+    TEST_ASSERT_EQUAL_INT(1,stats.dropped_scans);
+}
+/**
+ * Sweep timing
+ */
+void test_update_sweep_time_averages() {
+    int vna_id = 3;
+    reset_vna_stats(vna_id);
+    struct datapoint_nanoVNA_H data = {0};
+    data.vna_id = vna_id;
+    data.send_ns = 1000000;
+
+    // first scan sets the estimate outright
+    data.header_ns = data.send_ns + 100*1000;
+    update_sweep_time(&data,100);
+    TEST_ASSERT_EQUAL_FLOAT(1000.0,data.sweep_ns_per_point);
+
+    // later scans move it part of the way
+    data.header_ns = data.send_ns + 100*2000;
+    update_sweep_time(&data,100);
+    TEST_ASSERT_EQUAL_FLOAT(1000.0 + SWEEP_TIME_EWMA_WEIGHT*1000.0,data.sweep_ns_per_point);
+
+    struct vna_scan_stats stats;
+    get_vna_stats(vna_id,&stats);
+    TEST_ASSERT_EQUAL_FLOAT(data.sweep_ns_per_point,stats.sweep_ns_per_point);
+    reset_vna_stats(vna_id);
+}
+void test_scan_cost_model_fits_command_and_point_cost() {
+    reset_scan_cost_model();
+    struct scan_cost_model model;
+    get_scan_cost_model(2,&model);
+    TEST_ASSERT_EQUAL_FLOAT(DEFAULT_COMMAND_NS,model.command_ns);
+    TEST_ASSERT_EQUAL_FLOAT(0,model.weight);
+
+    // 5ms per command, 1ms per point
+    struct datapoint_nanoVNA_H data = {0};
+    data.vna_id = 2;
+    data.send_ns = 1000000;
+    for (int i = 0; i < 10; i++) {
+        int pps = i % 2 ? 11 : 101;
+        data.receive_ns = data.send_ns + 5000000 + pps*1000000;
+        update_scan_cost(&data,pps);
+    }
+    get_scan_cost_model(2,&model);
+    TEST_ASSERT_FLOAT_WITHIN(1000,5000000,model.command_ns);
+    TEST_ASSERT_FLOAT_WITHIN(10,1000000,model.point_ns);
+    TEST_ASSERT_GREATER_THAN_FLOAT(9,model.weight);
+    // VNAs that haven't scanned get every VNA's fit
+    get_scan_cost_model(4,&model);
+    TEST_ASSERT_FLOAT_WITHIN(10,1000000,model.point_ns);
+
+    // scans of one size can't be told apart, so the default command cost is assumed
+    reset_scan_cost_model();
+    data.receive_ns = data.send_ns + 30000000 + 101*1000000;
+    update_scan_cost(&data,101);
+    get_scan_cost_model(2,&model);
+    TEST_ASSERT_EQUAL_FLOAT(DEFAULT_COMMAND_NS,model.command_ns);
+    TEST_ASSERT_FLOAT_WITHIN(10,(131000000-DEFAULT_COMMAND_NS)/101,model.point_ns);
+    reset_scan_cost_model();
+}
+void test_predict_scans_shared_and_not() {
+    reset_scan_cost_model();
+    // VNA 1 takes 10ms per scan, VNA 2 takes 30ms
+    struct datapoint_nanoVNA_H data = {0};
+    data.send_ns = 1000000;
+    for (int i = 0; i < 10; i++) {
+        int pps = i % 2 ? 11 : 101;
+        data.vna_id = 1;
+        data.receive_ns = data.send_ns + 10000000;
+        update_scan_cost(&data,pps);
+        data.vna_id = 2;
+        data.receive_ns = data.send_ns + 30000000;
+        update_scan_cost(&data,pps);
+    }
+    int vnas[] = {1, 2};
+    // shared: 40 scans at 100 + 33.3 scans a second
+    TEST_ASSERT_FLOAT_WITHIN(1e6,300e6,predict_scans_ns(vnas,2,true,40,50));
+    // not shared: 20 scans each, waiting on the slower VNA
+    TEST_ASSERT_FLOAT_WITHIN(1e6,600e6,predict_scans_ns(vnas,2,false,40,50));
+    TEST_ASSERT_EQUAL_FLOAT(0,predict_scans_ns(vnas,2,true,0,50));
+    reset_scan_cost_model();
+}
+void test_predict_scan_remaining() {
+    reset_scan_cost_model();
+    struct scan_progress progress = {NUM_SWEEPS, 10, 1, {0}, false, 5, 505, 1000000000, 10, 1010};
+    double remaining_ns;
+    // 40 scans left at the default costs
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,predict_scan_remaining(&progress,1000000000,&remaining_ns));
+    TEST_ASSERT_FLOAT_WITHIN(1e3,40*(DEFAULT_COMMAND_NS+101*DEFAULT_POINT_NS),remaining_ns);
+    // 10 scans took 100s, so the rest won't be quicker than that rate
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,predict_scan_remaining(&progress,101000000000,&remaining_ns));
+    TEST_ASSERT_FLOAT_WITHIN(1e3,400e9,remaining_ns);
+
+    progress.mode = TIME;
+    progress.sweeps = 60;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,predict_scan_remaining(&progress,11000000000,&remaining_ns));
+    TEST_ASSERT_FLOAT_WITHIN(1e3,50e9,remaining_ns);
+
+    progress.mode = ONGOING;
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,predict_scan_remaining(&progress,11000000000,&remaining_ns));
+}
+void test_estimate_point_time_counts_back_from_header() {
+    struct datapoint_nanoVNA_H data = {0};
+    data.header_ns = 10000000;
+    data.sweep_ns_per_point = 1000;
+
+    TEST_ASSERT_EQUAL_UINT64(10000000-500,estimate_point_time(&data,PPS-1,PPS));
+    TEST_ASSERT_EQUAL_UINT64(10000000-PPS*1000+500,estimate_point_time(&data,0,PPS));
+
+    // without an estimate every point is placed at the header
+    data.sweep_ns_per_point = 0;
+    TEST_ASSERT_EQUAL_UINT64(10000000,estimate_point_time(&data,0,PPS));
+}
+void test_get_vna_stats_out_of_range() {
+    struct vna_scan_stats stats;
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,get_vna_stats(-1,&stats));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,get_vna_stats(MAXIMUM_VNA_PORTS,&stats));
+}
+
 /**
  * Producers
  */
@@ -347,7 +1081,7 @@ void test_scan_producer_takes_correct_points() {
     int size = ((scans*PPS-1)*100000);
     int step = size / (scans*PPS-1);
 
-    struct scan_producer_args args;
+    struct scan_producer_args args = {0};
     args.scan_id = scan_id;
     args.vna_id = vna_id;
     args.nbr_scans = scans;
@@ -358,6 +1092,9 @@ void test_scan_producer_takes_correct_points() {
     scan_producer(&args);
     for (int scan = 0; scan < scans; scan++) {
         TEST_ASSERT_NOT_NULL_MESSAGE(b->buffer[scan], "Producer failed to cappture scan data");
+        TEST_ASSERT_EQUAL_INT(scan_id,b->buffer[scan]->scan_id);
+        TEST_ASSERT_EQUAL_INT(0,b->buffer[scan]->sweep);
+        TEST_ASSERT_EQUAL_INT(scan,b->buffer[scan]->scan_index);
         for (int i = 0; i < PPS; i++) {
             int expected = start+((scan*PPS + i)*step);
             TEST_ASSERT_EQUAL_INT(expected,b->buffer[scan]->point[i].frequency);
@@ -384,7 +1121,7 @@ void test_timed_sweep_producer_takes_correct_time() {
     int size = ((scans*PPS-1)*100000);
     int time_to_scan = 2;
 
-    struct scan_producer_args scan_args;
+    struct scan_producer_args scan_args = {0};
     scan_args.scan_id = scan_id;
     scan_args.vna_id = vna_id;
     scan_args.nbr_scans = scans;
@@ -393,20 +1130,12 @@ void test_timed_sweep_producer_takes_correct_time() {
     scan_args.nbr_sweeps = time_to_scan; 
     scan_args.bfr = b;
 
-    struct scan_timer_args time_args;
-    time_args.time_to_wait = time_to_scan;
-    time_args.scan_id = scan_id;
-
     struct timeval start_time, end_time;
-    pthread_t thread;
 
     gettimeofday(&start_time, NULL);
-    int error = pthread_create(&thread, NULL, &scan_timer, &time_args);
-    if(error != 0){
-        fprintf(stderr, "Error %i creating timer thread for test_producer_time_takes_correct_time(): %s\n", errno, strerror(errno));
-        return;
-    }
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, arm_sweep_timer(scan_id, NULL, 0, 0, time_to_scan * 1000000000ULL));
     sweep_producer(&scan_args);
+    disarm_sweep_timer(scan_id);
     gettimeofday(&end_time,NULL);
 
     int time_expired = end_time.tv_sec-start_time.tv_sec;
@@ -431,12 +1160,12 @@ void test_consumer_constructs_valid_output() {
     create_bounded_buffer(b,PPS);
 
     struct datapoint_nanoVNA_H *data = calloc(1,sizeof(struct datapoint_nanoVNA_H));
-    struct timeval time;
-    gettimeofday(&time, NULL);
+    uint64_t time = monotonic_ns();
 
     data->vna_id = 1;
-    data->send_time = time;
-    data->receive_time = time;
+    data->send_ns = time;
+    data->header_ns = time;
+    data->receive_ns = time;
     for (int i = 0; i < PPS; i++) {
         data->point[i] = (struct nanovna_raw_datapoint) {0,{0,0},{0,0}};
     }
@@ -446,16 +1175,16 @@ void test_consumer_constructs_valid_output() {
 
     b->complete=0;
 
-    struct timeval program_start_time;
-    gettimeofday(&program_start_time, NULL);
+    uint64_t program_start_ns = monotonic_ns();
 
-    struct scan_consumer_args args;
+    // every stage the test doesn't set up is left off
+    struct scan_consumer_args args = {0};
     args.bfr = b;
     args.touchstone_file = NULL;
     args.id_string = "";
     args.label = "";
     args.verbose = false;
-    args.program_start_time = program_start_time;
+    args.program_start_ns = program_start_ns;
     scan_consumer(&args);
 
     // CHECK OUTPUT CORRECT (I'll figure out how later)
@@ -685,7 +1414,7 @@ void test_stop_sweep_stops() {
     int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
     int nbr_vnas = get_connected_vnas(vna_list);
 
-    int scan_id = start_sweep(nbr_vnas, vna_list,1,50000000,55000000,ONGOING,1,PPS,"TestRun",false);
+    int scan_id = start_sweep(nbr_vnas, vna_list,1,50000000,55000000,ONGOING,1,PPS,"TestRun",false,NULL);
     sleep(1);
     TEST_ASSERT_GREATER_OR_EQUAL(0,scan_states[scan_id]);
     TEST_ASSERT_EQUAL_INT(1,ongoing_scans);
@@ -695,6 +1424,174 @@ void test_stop_sweep_stops() {
     TEST_ASSERT_EQUAL_INT(0,ongoing_scans);
 }
 
+void test_wait_sweep_returns_when_done() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking vnas");
+
+    int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
+    int nbr_vnas = get_connected_vnas(vna_list);
+
+    int scan_id = start_sweep(nbr_vnas, vna_list,1,50000000,55000000,NUM_SWEEPS,2,PPS,"TestRun",false,NULL);
+    TEST_ASSERT_GREATER_OR_EQUAL(0,scan_id);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, wait_sweep(scan_id, 30));
+    // producers have all finished, and the id is held until stopped
+    TEST_ASSERT_EQUAL_INT(0,scan_states[scan_id]);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, wait_sweep(scan_id, 0));
+
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, stop_sweep(scan_id));
+    TEST_ASSERT_EQUAL_INT(-1, wait_sweep(scan_id, 0));
+}
+void test_wait_sweep_times_out() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking vnas");
+
+    int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
+    int nbr_vnas = get_connected_vnas(vna_list);
+
+    int scan_id = start_sweep(nbr_vnas, vna_list,1,50000000,55000000,ONGOING,1,PPS,"TestRun",false,NULL);
+    uint64_t before = monotonic_ns();
+    TEST_ASSERT_EQUAL_INT(ETIMEDOUT, wait_sweep(scan_id, 0.2));
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT64(200000000, monotonic_ns() - before);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, stop_sweep(scan_id));
+}
+void test_stop_sweep_cancels_between_scans() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking vnas");
+
+    int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
+    int nbr_vnas = get_connected_vnas(vna_list);
+
+    // far more sweeps than could finish before the stop
+    int scan_id = start_sweep(nbr_vnas, vna_list,5,50000000,55000000,NUM_SWEEPS,1000,PPS,"TestRun",false,NULL);
+    TEST_ASSERT_GREATER_OR_EQUAL(0,scan_id);
+    TEST_ASSERT_EQUAL_INT(ETIMEDOUT, wait_sweep(scan_id, 0.5));
+    uint64_t before = monotonic_ns();
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, stop_sweep(scan_id));
+    TEST_ASSERT_LESS_THAN_UINT64(5000000000ULL, monotonic_ns() - before);
+    TEST_ASSERT_EQUAL_INT(-1,scan_states[scan_id]);
+}
+void test_stop_sweep_ends_timed_wait() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking vnas");
+
+    int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
+    int nbr_vnas = get_connected_vnas(vna_list);
+
+    int scan_id = start_sweep(nbr_vnas, vna_list,1,50000000,55000000,TIME,60,PPS,"TestRun",false,NULL);
+    TEST_ASSERT_GREATER_OR_EQUAL(0,scan_id);
+    TEST_ASSERT_EQUAL_INT(ETIMEDOUT, wait_sweep(scan_id, 0.2));
+    uint64_t before = monotonic_ns();
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, stop_sweep(scan_id));
+    TEST_ASSERT_LESS_THAN_UINT64(5000000000ULL, monotonic_ns() - before);
+}
+struct collect_args {
+    int scan_id;
+    int result;
+};
+static void* collect_in_background(void *arguments) {
+    struct collect_args *args = arguments;
+    args->result = collect_sweep(args->scan_id, 30);
+    return NULL;
+}
+void test_collect_sweep_frees_id_when_done() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking vnas");
+
+    int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
+    int nbr_vnas = get_connected_vnas(vna_list);
+
+    int scan_id = start_sweep(nbr_vnas, vna_list,1,50000000,55000000,NUM_SWEEPS,2,PPS,"TestRun",false,NULL);
+    TEST_ASSERT_GREATER_OR_EQUAL(0,scan_id);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, collect_sweep(scan_id, 30));
+    TEST_ASSERT_EQUAL_INT(-1,scan_states[scan_id]);
+    TEST_ASSERT_EQUAL_INT(0,ongoing_scans);
+}
+void test_collect_sweep_leaves_a_later_sweep_alone() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking vnas");
+
+    int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
+    int nbr_vnas = get_connected_vnas(vna_list);
+    int scan_id = start_sweep(nbr_vnas, vna_list,1,50000000,55000000,ONGOING,1,PPS,"TestRun",false,NULL);
+    TEST_ASSERT_GREATER_OR_EQUAL(0,scan_id);
+
+    struct collect_args args = {scan_id, -2};
+    pthread_t waiter;
+    pthread_create(&waiter, NULL, &collect_in_background, &args);
+    usleep(200000);
+    // stopped and replaced while collect_sweep is still waiting
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, stop_sweep(scan_id));
+    vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
+    nbr_vnas = get_connected_vnas(vna_list);
+    TEST_ASSERT_EQUAL_INT(scan_id, start_sweep(nbr_vnas, vna_list,1,50000000,55000000,ONGOING,1,PPS,"TestRun",false,NULL));
+    pthread_join(waiter, NULL);
+
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, args.result);
+    TEST_ASSERT_TRUE(is_running(scan_id));
+    TEST_ASSERT_EQUAL_INT(1,ongoing_scans);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, stop_sweep(scan_id));
+    TEST_ASSERT_EQUAL_INT(0,ongoing_scans);
+}
+static void* stop_in_background(void *arguments) {
+    struct collect_args *args = arguments;
+    args->result = stop_sweep(args->scan_id);
+    return NULL;
+}
+void test_stop_sweep_joins_once_when_stopped_together() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking vnas");
+
+    int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
+    int nbr_vnas = get_connected_vnas(vna_list);
+    int scan_id = start_sweep(nbr_vnas, vna_list,1,50000000,55000000,ONGOING,1,PPS,"TestRun",false,NULL);
+    TEST_ASSERT_GREATER_OR_EQUAL(0,scan_id);
+    usleep(200000);
+
+    struct collect_args args[4];
+    pthread_t stoppers[4];
+    for (int i = 0; i < 4; i++) {
+        args[i] = (struct collect_args){scan_id, -2};
+        pthread_create(&stoppers[i], NULL, &stop_in_background, &args[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(stoppers[i], NULL);
+        TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, args[i].result);
+    }
+    TEST_ASSERT_EQUAL_INT(-1,scan_states[scan_id]);
+    TEST_ASSERT_EQUAL_INT(0,ongoing_scans);
+}
+void test_start_sweep_refuses_vna_in_another_sweep() {
+    if (!vnas_mocked)
+        TEST_IGNORE_MESSAGE("Cannot test without mocking vnas");
+
+    int* vna_list = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
+    int nbr_vnas = get_connected_vnas(vna_list);
+    TEST_ASSERT_GREATER_OR_EQUAL(2,nbr_vnas);
+    int second_vna = vna_list[1];
+    int scan_id = start_sweep(1, vna_list,1,50000000,55000000,ONGOING,1,PPS,"TestRun",false,NULL);
+    TEST_ASSERT_GREATER_OR_EQUAL(0,scan_id);
+
+    int *overlapping = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
+    get_connected_vnas(overlapping);
+    TEST_ASSERT_LESS_THAN(0, start_sweep(nbr_vnas, overlapping,1,50000000,55000000,ONGOING,1,PPS,"TestRun",false,NULL));
+    free(overlapping);
+    TEST_ASSERT_EQUAL_INT(1,ongoing_scans);
+
+    // the other VNA is free for a sweep of its own
+    int *other = calloc(sizeof(int),MAXIMUM_VNA_PORTS);
+    other[0] = second_vna;
+    int other_id = start_sweep(1, other,1,50000000,55000000,ONGOING,1,PPS,"TestRun",false,NULL);
+    TEST_ASSERT_GREATER_OR_EQUAL(0,other_id);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, stop_sweep(other_id));
+    TEST_ASSERT_TRUE(is_running(scan_id));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, stop_sweep(scan_id));
+    TEST_ASSERT_EQUAL_INT(0,ongoing_scans);
+}
+void test_wait_sweep_rejects_invalid() {
+    TEST_ASSERT_EQUAL_INT(-1, wait_sweep(-1, 0));
+    TEST_ASSERT_EQUAL_INT(-1, wait_sweep(MAX_ONGOING_SCANS, 0));
+}
+
 int main(int argc, char *argv[]) {
     UNITY_BEGIN();
 
@@ -713,15 +1610,53 @@ int main(int argc, char *argv[]) {
     RUN_TEST(test_take_buff_takes);
     RUN_TEST(test_take_buff_cycles);
     RUN_TEST(test_take_buff_escapes_block_after_full);
+    RUN_TEST(test_create_bounded_buffer_with_policy_checks_capacity);
+    RUN_TEST(test_add_buff_drop_newest_keeps_oldest);
+    RUN_TEST(test_add_buff_drop_oldest_keeps_newest);
+    RUN_TEST(test_add_buff_spill_keeps_everything_in_order);
+    RUN_TEST(test_add_buff_block_counts_waits);
+    RUN_TEST(test_buffer_capacity_for_budget_scales_with_points);
+    RUN_TEST(test_parse_buffer_policy_round_trips);
+
+    // task scheduler tests
+    RUN_TEST(test_next_scan_task_gives_every_worker_every_sweep);
+    RUN_TEST(test_next_scan_task_shares_sweep_between_workers);
+    RUN_TEST(test_next_scan_task_steals_from_busy_worker);
+    RUN_TEST(test_next_scan_task_ongoing_stops_releasing);
+    RUN_TEST(test_next_scan_task_shared_holds_back_sweep_until_oldest_finishes);
+    RUN_TEST(test_next_scan_task_paced_counts_missed_ticks);
+    RUN_TEST(test_sweep_timer_keeps_cadence);
+    RUN_TEST(test_arm_sweep_timer_rejects_invalid);
+    RUN_TEST(test_parse_cpu_list_reads_lists_and_ranges);
+    RUN_TEST(test_format_cpu_list_collapses_ranges);
+    RUN_TEST(test_create_placed_thread_starts_on_its_cpu);
+    RUN_TEST(test_create_placed_thread_runs_unplaced_if_it_must);
+
+    // sweep tracker tests
+    RUN_TEST(test_track_sweep_record_completes_sweep);
+    RUN_TEST(test_track_sweep_record_shared_sweep_across_vnas);
+    RUN_TEST(test_track_sweep_record_gives_up_on_oldest);
+    RUN_TEST(test_flush_sweep_tracker_reports_in_order);
+    RUN_TEST(test_shared_sweeps_interleaved_across_workers_all_complete);
 
     // pull tests
     RUN_TEST(test_find_binary_header_handles_random_data);
     RUN_TEST(test_find_binary_header_constructs_correct_first_point);
     RUN_TEST(test_find_binary_header_fails_gracefully);
     RUN_TEST(test_pull_scan_constructs_valid_data);
+    RUN_TEST(test_pull_scan_timestamps_in_order);
     RUN_TEST(test_pull_scan_takes_correct_number_points_low);
     RUN_TEST(test_pull_scan_takes_correct_number_points_high);
     RUN_TEST(test_pull_scan_nulls_malformed_data);
+    RUN_TEST(test_pull_scan_from_memory_vna);
+    RUN_TEST(test_pull_scan_retry_recovers_malformed_data);
+    RUN_TEST(test_pull_scan_retry_drops_without_retries);
+    RUN_TEST(test_get_vna_stats_out_of_range);
+    RUN_TEST(test_update_sweep_time_averages);
+    RUN_TEST(test_scan_cost_model_fits_command_and_point_cost);
+    RUN_TEST(test_predict_scans_shared_and_not);
+    RUN_TEST(test_predict_scan_remaining);
+    RUN_TEST(test_estimate_point_time_counts_back_from_header);
 
     // producer/consumer tests
     RUN_TEST(test_scan_producer_takes_correct_points);
@@ -751,6 +1686,15 @@ int main(int argc, char *argv[]) {
 
     // scan logic tests
     RUN_TEST(test_stop_sweep_stops);
+    RUN_TEST(test_wait_sweep_returns_when_done);
+    RUN_TEST(test_wait_sweep_times_out);
+    RUN_TEST(test_wait_sweep_rejects_invalid);
+    RUN_TEST(test_collect_sweep_frees_id_when_done);
+    RUN_TEST(test_collect_sweep_leaves_a_later_sweep_alone);
+    RUN_TEST(test_stop_sweep_joins_once_when_stopped_together);
+    RUN_TEST(test_start_sweep_refuses_vna_in_another_sweep);
+    RUN_TEST(test_stop_sweep_cancels_between_scans);
+    RUN_TEST(test_stop_sweep_ends_timed_wait);
 
     return UNITY_END();
 }
\ No newline at end of file
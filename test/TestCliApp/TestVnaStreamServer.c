@@ -0,0 +1,316 @@
+#include "VnaStreamServer.h"
+#include "unity.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define UNITY_INCLUDE_CONFIG_H
+
+#define PPS 101
+
+struct nanovna_raw_datapoint test_points[PPS];
+struct datapoint_nanoVNA_H test_scan;
+
+void setUp(void) {
+    /* This is run before EACH TEST */
+    for (int i = 0; i < PPS; i++) {
+        test_points[i].frequency = 50000000 + i * 1000;
+        test_points[i].s11.re = i;
+        test_points[i].s11.im = -i;
+        test_points[i].s21.re = 0.5f;
+        test_points[i].s21.im = -0.5f;
+    }
+    struct datapoint_nanoVNA_H scan = {3, 1, 7, 2, 1000, 2000, 3000, 12.5, PPS, test_points};
+    test_scan = scan;
+}
+
+void tearDown(void) {
+    /* This is run after EACH TEST */
+    stop_stream_server();
+}
+
+uint32_t get_u32(const uint8_t *bytes) {
+    return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+uint64_t get_u64(const uint8_t *bytes) {
+    return get_u32(bytes) | (uint64_t)get_u32(bytes + 4) << 32;
+}
+
+/**
+ * Connects to a port of the server on loopback, waiting until the
+ * server has accepted the connection
+ */
+int connect_client(uint16_t port, int receive_buffer) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (receive_buffer > 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    TEST_ASSERT_EQUAL_INT(0, connect(fd, (struct sockaddr*)&address, sizeof(address)));
+
+    struct stream_client_info clients[STREAM_MAX_CLIENTS];
+    int before = get_stream_clients(clients);
+    for (int i = 0; i < 1000 && get_stream_clients(clients) == before; i++)
+        usleep(1000);
+    return fd;
+}
+
+/**
+ * Reads exactly length bytes from a socket, giving up after a second of silence
+ */
+ssize_t read_all(int fd, uint8_t *buffer, size_t length) {
+    size_t got = 0;
+    while (got < length) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0)
+            break;
+        ssize_t n = recv(fd, buffer + got, length - got, 0);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    return got;
+}
+
+/**
+ * Framing
+ */
+void test_stream_encode_scan_layout() {
+    uint8_t frame[STREAM_FRAME_HEADER_SIZE + STREAM_SCAN_HEADER_SIZE + PPS*STREAM_POINT_SIZE];
+    TEST_ASSERT_EQUAL_INT(sizeof(frame), stream_encode_scan(frame, sizeof(frame), 42, &test_scan, PPS));
+
+    TEST_ASSERT_EQUAL_MEMORY(STREAM_FRAME_MAGIC, frame, 4);
+    TEST_ASSERT_EQUAL_UINT16(STREAM_FRAME_VERSION, frame[4] | frame[5] << 8);
+    TEST_ASSERT_EQUAL_UINT16(STREAM_FRAME_SCAN, frame[6] | frame[7] << 8);
+    TEST_ASSERT_EQUAL_UINT32(42, get_u32(frame + 8));
+    TEST_ASSERT_EQUAL_UINT32(sizeof(frame) - STREAM_FRAME_HEADER_SIZE, get_u32(frame + 12));
+
+    const uint8_t *payload = frame + STREAM_FRAME_HEADER_SIZE;
+    TEST_ASSERT_EQUAL_UINT32(3, get_u32(payload));
+    TEST_ASSERT_EQUAL_UINT32(1, get_u32(payload + 4));
+    TEST_ASSERT_EQUAL_UINT32(7, get_u32(payload + 8));
+    TEST_ASSERT_EQUAL_UINT32(2, get_u32(payload + 12));
+    TEST_ASSERT_EQUAL_UINT64(1000, get_u64(payload + 16));
+    TEST_ASSERT_EQUAL_UINT64(3000, get_u64(payload + 32));
+    TEST_ASSERT_EQUAL_UINT32(PPS, get_u32(payload + 48));
+
+    // points are as the NanoVNA sends them
+    const uint8_t *point = payload + STREAM_SCAN_HEADER_SIZE + 10*STREAM_POINT_SIZE;
+    TEST_ASSERT_EQUAL_UINT32(50010000, get_u32(point));
+    float s11_im;
+    memcpy(&s11_im, point + 8, sizeof(float));
+    TEST_ASSERT_EQUAL_FLOAT(-10, s11_im);
+}
+void test_stream_encode_rejects_small_buffer() {
+    uint8_t frame[64];
+    TEST_ASSERT_EQUAL_INT(0, stream_encode_scan(frame, sizeof(frame), 0, &test_scan, PPS));
+
+    struct sweep_event event = {SWEEP_OWNER_SHARED, 4, 5, true};
+    TEST_ASSERT_EQUAL_INT(0, stream_encode_sweep(frame, 20, 0, 1, &event, 5));
+    TEST_ASSERT_EQUAL_INT(STREAM_FRAME_HEADER_SIZE + STREAM_SWEEP_SIZE, stream_encode_sweep(frame, sizeof(frame), 0, 1, &event, 5));
+    TEST_ASSERT_EQUAL_UINT16(STREAM_FRAME_SWEEP, frame[6] | frame[7] << 8);
+    TEST_ASSERT_EQUAL_INT32(SWEEP_OWNER_SHARED, (int32_t)get_u32(frame + STREAM_FRAME_HEADER_SIZE + 4));
+    TEST_ASSERT_EQUAL_UINT8(1, frame[STREAM_FRAME_HEADER_SIZE + 20]);
+}
+void test_stream_encode_tdr_layout() {
+    struct complex response[4] = {{0.5f, 0}, {0.25f, -0.125f}, {0, 0}, {-1, 2}};
+    struct tdr_record record = {3, 1, 7, TDR_STEP, 1000, 1.25e-9, 4, response};
+    uint8_t frame[STREAM_FRAME_HEADER_SIZE + STREAM_TDR_HEADER_SIZE + 4*STREAM_TDR_POINT_SIZE];
+    TEST_ASSERT_EQUAL_INT(0, stream_encode_tdr(frame, sizeof(frame) - 1, 0, &record));
+    TEST_ASSERT_EQUAL_INT(sizeof(frame), stream_encode_tdr(frame, sizeof(frame), 9, &record));
+
+    TEST_ASSERT_EQUAL_UINT16(STREAM_FRAME_TDR, frame[6] | frame[7] << 8);
+    TEST_ASSERT_EQUAL_UINT32(9, get_u32(frame + 8));
+    TEST_ASSERT_EQUAL_UINT32(sizeof(frame) - STREAM_FRAME_HEADER_SIZE, get_u32(frame + 12));
+
+    const uint8_t *payload = frame + STREAM_FRAME_HEADER_SIZE;
+    TEST_ASSERT_EQUAL_UINT32(3, get_u32(payload));
+    TEST_ASSERT_EQUAL_UINT32(7, get_u32(payload + 8));
+    TEST_ASSERT_EQUAL_UINT32(TDR_STEP, get_u32(payload + 12));
+    TEST_ASSERT_EQUAL_UINT64(1000, get_u64(payload + 16));
+    uint64_t bits = get_u64(payload + 24);
+    double time_step;
+    memcpy(&time_step, &bits, sizeof(double));
+    TEST_ASSERT_TRUE(time_step == 1.25e-9);
+    TEST_ASSERT_EQUAL_UINT32(4, get_u32(payload + 32));
+
+    float im;
+    memcpy(&im, payload + STREAM_TDR_HEADER_SIZE + 3*STREAM_TDR_POINT_SIZE + 4, sizeof(float));
+    TEST_ASSERT_EQUAL_FLOAT(2, im);
+}
+void test_stream_encode_peak_layout() {
+    struct peak_record record = {3, 1, 7, PEAK_S21_DIP, 1000, 100016667.5, 212.5, 31.5, -20.25, true};
+    uint8_t frame[STREAM_FRAME_HEADER_SIZE + STREAM_PEAK_SIZE];
+    TEST_ASSERT_EQUAL_INT(0, stream_encode_peak(frame, sizeof(frame) - 1, 0, &record));
+    TEST_ASSERT_EQUAL_INT(sizeof(frame), stream_encode_peak(frame, sizeof(frame), 9, &record));
+
+    TEST_ASSERT_EQUAL_UINT16(STREAM_FRAME_PEAK, frame[6] | frame[7] << 8);
+    TEST_ASSERT_EQUAL_UINT32(STREAM_PEAK_SIZE, get_u32(frame + 12));
+
+    const uint8_t *payload = frame + STREAM_FRAME_HEADER_SIZE;
+    TEST_ASSERT_EQUAL_UINT32(PEAK_S21_DIP, get_u32(payload + 12));
+    TEST_ASSERT_EQUAL_UINT64(1000, get_u64(payload + 16));
+    double fields[4];
+    for (int i = 0; i < 4; i++) {
+        uint64_t bits = get_u64(payload + 24 + 8*i);
+        memcpy(&fields[i], &bits, sizeof(double));
+    }
+    TEST_ASSERT_TRUE(fields[0] == 100016667.5);
+    TEST_ASSERT_TRUE(fields[1] == 212.5);
+    TEST_ASSERT_TRUE(fields[2] == 31.5);
+    TEST_ASSERT_TRUE(fields[3] == -20.25);
+    TEST_ASSERT_EQUAL_UINT8(1, payload[56]);
+}
+
+/**
+ * Starting and stopping
+ */
+void test_stream_server_not_running() {
+    uint16_t data_port, control_port;
+    TEST_ASSERT_FALSE(is_streaming());
+    TEST_ASSERT_EQUAL_INT(-1, stream_command_fd());
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, get_stream_ports(&data_port, &control_port));
+    // publishing with no server is harmless
+    stream_publish_scan(&test_scan, PPS);
+}
+void test_stream_server_starts_once() {
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, start_stream_server(0, 0, STREAM_DROP));
+    TEST_ASSERT_TRUE(is_streaming());
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, start_stream_server(0, 0, STREAM_DROP));
+    stop_stream_server();
+    TEST_ASSERT_FALSE(is_streaming());
+    // and can be started again
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, start_stream_server(0, 0, STREAM_DROP));
+}
+
+/**
+ * Data subscribers
+ */
+void test_subscriber_receives_scans() {
+    uint16_t data_port, control_port;
+    start_stream_server(0, 0, STREAM_DROP);
+    get_stream_ports(&data_port, &control_port);
+    int fd = connect_client(data_port, 0);
+
+    stream_publish_scan(&test_scan, PPS);
+    stream_publish_scan(&test_scan, PPS);
+
+    uint8_t frame[STREAM_FRAME_HEADER_SIZE + STREAM_SCAN_HEADER_SIZE + PPS*STREAM_POINT_SIZE];
+    TEST_ASSERT_EQUAL_INT(sizeof(frame), read_all(fd, frame, sizeof(frame)));
+    uint32_t first = get_u32(frame + 8);
+    TEST_ASSERT_EQUAL_UINT32(PPS, get_u32(frame + STREAM_FRAME_HEADER_SIZE + 48));
+    TEST_ASSERT_EQUAL_INT(sizeof(frame), read_all(fd, frame, sizeof(frame)));
+    TEST_ASSERT_EQUAL_UINT32(first + 1, get_u32(frame + 8));
+    close(fd);
+}
+void test_slow_subscriber_drops_without_blocking() {
+    uint16_t data_port, control_port;
+    start_stream_server(0, 0, STREAM_DROP);
+    get_stream_ports(&data_port, &control_port);
+    int slow = connect_client(data_port, 4096);
+
+    // several times the queue, never read
+    time_t before = time(NULL);
+    for (int i = 0; i < 5000; i++)
+        stream_publish_scan(&test_scan, PPS);
+    TEST_ASSERT_TRUE(time(NULL) - before <= 1);
+
+    struct stream_client_info clients[STREAM_MAX_CLIENTS];
+    TEST_ASSERT_EQUAL_INT(1, get_stream_clients(clients));
+    TEST_ASSERT_FALSE(clients[0].control);
+    TEST_ASSERT_GREATER_THAN_INT(0, clients[0].dropped);
+    TEST_ASSERT_TRUE(clients[0].queued <= STREAM_QUEUE_SIZE);
+
+    // still connected, and frames still arrive whole
+    uint8_t header[STREAM_FRAME_HEADER_SIZE];
+    TEST_ASSERT_EQUAL_INT(sizeof(header), read_all(slow, header, sizeof(header)));
+    TEST_ASSERT_EQUAL_MEMORY(STREAM_FRAME_MAGIC, header, 4);
+    close(slow);
+}
+void test_slow_subscriber_disconnected() {
+    uint16_t data_port, control_port;
+    start_stream_server(0, 0, STREAM_DISCONNECT);
+    get_stream_ports(&data_port, &control_port);
+    int slow = connect_client(data_port, 4096);
+
+    for (int i = 0; i < 5000; i++)
+        stream_publish_scan(&test_scan, PPS);
+
+    struct stream_client_info clients[STREAM_MAX_CLIENTS];
+    for (int i = 0; i < 1000 && get_stream_clients(clients) > 0; i++)
+        usleep(1000);
+    TEST_ASSERT_EQUAL_INT(0, get_stream_clients(clients));
+    close(slow);
+}
+
+/**
+ * Control clients
+ */
+void test_control_client_sends_commands() {
+    uint16_t data_port, control_port;
+    start_stream_server(0, 0, STREAM_DROP);
+    get_stream_ports(&data_port, &control_port);
+    int fd = connect_client(control_port, 0);
+
+    char line[STREAM_COMMAND_LENGTH];
+    TEST_ASSERT_EQUAL_INT(-1, take_stream_command(line, sizeof(line)));
+    send(fd, "sweep ", 6, 0);
+    send(fd, "list\r\nvna list\n", 15, 0);
+
+    struct pollfd pfd = {stream_command_fd(), POLLIN, 0};
+    TEST_ASSERT_EQUAL_INT(1, poll(&pfd, 1, 1000));
+    usleep(10000);
+    int client = take_stream_command(line, sizeof(line));
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(0, client);
+    TEST_ASSERT_EQUAL_STRING("sweep list", line);
+    TEST_ASSERT_EQUAL_INT(client, take_stream_command(line, sizeof(line)));
+    TEST_ASSERT_EQUAL_STRING("vna list", line);
+    TEST_ASSERT_EQUAL_INT(-1, take_stream_command(line, sizeof(line)));
+    close(fd);
+}
+void test_control_client_receives_output() {
+    uint16_t data_port, control_port;
+    start_stream_server(0, 0, STREAM_DROP);
+    get_stream_ports(&data_port, &control_port);
+    int fd = connect_client(control_port, 0);
+
+    printf("to every control client\n");
+    fflush(stdout);
+    char received[32] = {0};
+    TEST_ASSERT_EQUAL_INT(24, read_all(fd, (uint8_t*)received, 24));
+    TEST_ASSERT_EQUAL_STRING("to every control client\n", received);
+
+    send(fd, "exit\n", 5, 0);
+    struct pollfd pfd = {stream_command_fd(), POLLIN, 0};
+    poll(&pfd, 1, 1000);
+    usleep(10000);
+    int client = take_stream_command(received, sizeof(received));
+    close_stream_client(client);
+    TEST_ASSERT_EQUAL_INT(0, read_all(fd, (uint8_t*)received, 1));
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_stream_encode_scan_layout);
+    RUN_TEST(test_stream_encode_rejects_small_buffer);
+    RUN_TEST(test_stream_encode_tdr_layout);
+    RUN_TEST(test_stream_encode_peak_layout);
+
+    RUN_TEST(test_stream_server_not_running);
+    RUN_TEST(test_stream_server_starts_once);
+
+    RUN_TEST(test_subscriber_receives_scans);
+    RUN_TEST(test_slow_subscriber_drops_without_blocking);
+    RUN_TEST(test_slow_subscriber_disconnected);
+
+    RUN_TEST(test_control_client_sends_commands);
+    RUN_TEST(test_control_client_receives_output);
+
+    return UNITY_END();
+}
@@ -0,0 +1,297 @@
+#include "VnaSweepPlan.h"
+#include "unity.h"
+
+#define UNITY_INCLUDE_CONFIG_H
+
+#define PPS 101
+
+void setUp(void) {
+    /* This is run before EACH TEST */
+}
+
+void tearDown(void) {
+    /* This is run after EACH TEST */
+}
+
+/**
+ * create_sweep_plan
+ */
+void test_create_sweep_plan_matches_even_step() {
+    struct sweep_plan plan;
+    int scans = 2;
+    uint64_t start = 50000000;
+    uint64_t step = 100000;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_sweep_plan(&plan,start,start+(scans*PPS-1)*step,scans,PPS));
+
+    TEST_ASSERT_EQUAL_INT(scans*PPS,plan.nbr_points);
+    for (int k = 0; k < plan.nbr_points; k++) {
+        TEST_ASSERT_EQUAL_UINT64(start+k*step,plan.freqs[k]);
+    }
+    destroy_sweep_plan(&plan);
+}
+void test_create_sweep_plan_ends_on_stop() {
+    // 850 MHz does not divide evenly into 504 steps
+    struct sweep_plan plan;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_sweep_plan(&plan,50000000,900000000,5,PPS));
+
+    TEST_ASSERT_EQUAL_UINT64(50000000,plan.freqs[0]);
+    TEST_ASSERT_EQUAL_UINT64(900000000,plan.freqs[plan.nbr_points-1]);
+    TEST_ASSERT_EQUAL_UINT64(900000000,plan.scans[4].stop);
+    for (int k = 1; k < plan.nbr_points; k++) {
+        TEST_ASSERT_TRUE(plan.freqs[k] > plan.freqs[k-1]);
+        // steps never differ by more than a hertz
+        uint64_t gap = plan.freqs[k] - plan.freqs[k-1];
+        TEST_ASSERT_TRUE(gap == 1686507 || gap == 1686508);
+    }
+    destroy_sweep_plan(&plan);
+}
+void test_create_sweep_plan_scans_tile_grid() {
+    struct sweep_plan plan;
+    create_sweep_plan(&plan,50000000,900000000,5,PPS);
+
+    for (int s = 0; s < plan.nbr_scans; s++) {
+        const struct scan_range *range = sweep_plan_scan(&plan,s);
+        TEST_ASSERT_NOT_NULL(range);
+        TEST_ASSERT_EQUAL_INT(s*PPS,range->first_bin);
+        TEST_ASSERT_EQUAL_INT(PPS,range->pps);
+        TEST_ASSERT_EQUAL_UINT64(plan.freqs[s*PPS],range->start);
+        TEST_ASSERT_EQUAL_UINT64(plan.freqs[s*PPS+PPS-1],range->stop);
+    }
+    TEST_ASSERT_NULL(sweep_plan_scan(&plan,-1));
+    TEST_ASSERT_NULL(sweep_plan_scan(&plan,5));
+    destroy_sweep_plan(&plan);
+}
+void test_create_sweep_plan_handles_wide_band() {
+    // frequencies above 2^32 Hz must not wrap
+    struct sweep_plan plan;
+    uint64_t start = 1000000000ULL;
+    uint64_t stop = 6000000000ULL;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_sweep_plan(&plan,start,stop,1000,PPS));
+    TEST_ASSERT_EQUAL_UINT64(stop,plan.freqs[plan.nbr_points-1]);
+    TEST_ASSERT_TRUE(plan.freqs[plan.nbr_points/2] > UINT32_MAX / 2);
+    destroy_sweep_plan(&plan);
+}
+void test_create_sweep_plan_rejects_invalid() {
+    struct sweep_plan plan;
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, create_sweep_plan(&plan,900000000,50000000,5,PPS));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, create_sweep_plan(&plan,50000000,50000000,5,PPS));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, create_sweep_plan(&plan,50000000,900000000,0,PPS));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, create_sweep_plan(&plan,50000000,900000000,1,1));
+    // more points than hertz
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, create_sweep_plan(&plan,50000000,50000100,2,PPS));
+}
+
+/**
+ * Bin lookup
+ */
+void test_sweep_plan_bin_finds_every_point() {
+    struct sweep_plan plan;
+    create_sweep_plan(&plan,50000000,900000000,5,PPS);
+
+    for (int k = 0; k < plan.nbr_points; k++) {
+        TEST_ASSERT_EQUAL_INT(k,sweep_plan_bin(&plan,plan.freqs[k]));
+    }
+    destroy_sweep_plan(&plan);
+}
+void test_sweep_plan_bin_rejects_off_grid() {
+    struct sweep_plan plan;
+    create_sweep_plan(&plan,50000000,900000000,5,PPS);
+
+    TEST_ASSERT_EQUAL_INT(-1,sweep_plan_bin(&plan,plan.freqs[10]+1));
+    TEST_ASSERT_EQUAL_INT(-1,sweep_plan_bin(&plan,plan.freqs[10]-1));
+    TEST_ASSERT_EQUAL_INT(-1,sweep_plan_bin(&plan,49999999));
+    TEST_ASSERT_EQUAL_INT(-1,sweep_plan_bin(&plan,900000001));
+    destroy_sweep_plan(&plan);
+}
+void test_sweep_plan_nearest_bin_snaps() {
+    struct sweep_plan plan;
+    create_sweep_plan(&plan,50000000,900000000,5,PPS);
+
+    TEST_ASSERT_EQUAL_INT(10,sweep_plan_nearest_bin(&plan,plan.freqs[10]+1));
+    TEST_ASSERT_EQUAL_INT(10,sweep_plan_nearest_bin(&plan,plan.freqs[10]-1));
+    TEST_ASSERT_EQUAL_INT(11,sweep_plan_nearest_bin(&plan,plan.freqs[11]-100));
+    TEST_ASSERT_EQUAL_INT(0,sweep_plan_nearest_bin(&plan,49999000));
+    TEST_ASSERT_EQUAL_INT(plan.nbr_points-1,sweep_plan_nearest_bin(&plan,900001000));
+    TEST_ASSERT_EQUAL_INT(-1,sweep_plan_nearest_bin(&plan,40000000));
+    TEST_ASSERT_EQUAL_INT(-1,sweep_plan_nearest_bin(&plan,910000000));
+    destroy_sweep_plan(&plan);
+}
+
+/**
+ * create_segmented_sweep_plan
+ */
+void assert_scans_evenly_spaced(const struct sweep_plan *plan) {
+    int covered = 0;
+    for (int i = 0; i < plan->nbr_scans; i++) {
+        const struct scan_range *scan = sweep_plan_scan(plan,i);
+        TEST_ASSERT_EQUAL_INT(covered,scan->first_bin);
+        TEST_ASSERT_LESS_OR_EQUAL_INT(PPS,scan->pps);
+        // the firmware spaces a scan's points evenly, so the plan must have too
+        for (int k = 0; k < scan->pps && scan->pps > 1; k++) {
+            uint64_t expected = scan->start + (scan->stop - scan->start) * k / (scan->pps - 1);
+            uint64_t actual = plan->freqs[scan->first_bin + k];
+            TEST_ASSERT_TRUE(actual + 1 >= expected && actual <= expected + 1);
+        }
+        covered += scan->pps;
+    }
+    TEST_ASSERT_EQUAL_INT(plan->nbr_points,covered);
+}
+void test_segmented_plan_merges_matching_segments() {
+    struct sweep_plan plan;
+    struct sweep_segment segments[] = {
+        {50000000, 60000000, 11, SPACING_LINEAR},
+        {60000000, 70000000, 11, SPACING_LINEAR}
+    };
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,create_segmented_sweep_plan(&plan,segments,2,PPS));
+
+    // the shared point at 60MHz is only scanned once, and the same step means one scan
+    TEST_ASSERT_EQUAL_INT(21,plan.nbr_points);
+    TEST_ASSERT_EQUAL_INT(1,plan.nbr_scans);
+    TEST_ASSERT_EQUAL_INT(21,plan.pps);
+    TEST_ASSERT_EQUAL_UINT64(50000000,plan.start);
+    TEST_ASSERT_EQUAL_UINT64(70000000,plan.stop);
+    assert_scans_evenly_spaced(&plan);
+    destroy_sweep_plan(&plan);
+}
+void test_segmented_plan_beats_uniform_grid() {
+    struct sweep_plan plan;
+    struct sweep_segment segments[] = {
+        {50000000, 100000000, 11, SPACING_LINEAR},
+        {100000000, 110000000, 1001, SPACING_LINEAR},
+        {120000000, 900000000, 157, SPACING_LINEAR}
+    };
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,create_segmented_sweep_plan(&plan,segments,3,PPS));
+
+    TEST_ASSERT_EQUAL_INT(11+1000+157,plan.nbr_points);
+    assert_scans_evenly_spaced(&plan);
+    // 10 scans for the dense segment, 1 for the one before and 2 after
+    TEST_ASSERT_LESS_OR_EQUAL_INT(14,plan.nbr_scans);
+    TEST_ASSERT_GREATER_THAN_UINT64(800,sweep_plan_uniform_scans(&plan,PPS));
+    destroy_sweep_plan(&plan);
+}
+void test_segmented_plan_log_spacing() {
+    struct sweep_plan plan;
+    struct sweep_segment segment = {10000000, 1000000000, 201, SPACING_LOG};
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,create_segmented_sweep_plan(&plan,&segment,1,PPS));
+
+    TEST_ASSERT_EQUAL_INT(201,plan.nbr_points);
+    TEST_ASSERT_EQUAL_UINT64(10000000,plan.freqs[0]);
+    TEST_ASSERT_EQUAL_UINT64(1000000000,plan.freqs[200]);
+    // each scan's ends are on the log curve, half way is a decade up
+    TEST_ASSERT_EQUAL_UINT64(100000000,plan.freqs[100]);
+    for (int k = 1; k < plan.nbr_points; k++)
+        TEST_ASSERT_GREATER_THAN_UINT64(plan.freqs[k-1],plan.freqs[k]);
+    assert_scans_evenly_spaced(&plan);
+    destroy_sweep_plan(&plan);
+}
+void test_segmented_plan_rejects_invalid() {
+    struct sweep_plan plan;
+    struct sweep_segment overlapping[] = {
+        {50000000, 60000000, 11, SPACING_LINEAR},
+        {55000000, 70000000, 11, SPACING_LINEAR}
+    };
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,create_segmented_sweep_plan(&plan,overlapping,2,PPS));
+    struct sweep_segment too_few = {50000000, 60000000, 1, SPACING_LINEAR};
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,create_segmented_sweep_plan(&plan,&too_few,1,PPS));
+    struct sweep_segment too_dense = {50000000, 50000010, 101, SPACING_LINEAR};
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,create_segmented_sweep_plan(&plan,&too_dense,1,PPS));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,create_segmented_sweep_plan(&plan,overlapping,0,PPS));
+}
+void test_segmented_plan_bin_lookup() {
+    struct sweep_plan plan;
+    struct sweep_segment segments[] = {
+        {50000000, 100000000, 11, SPACING_LINEAR},
+        {100000000, 110000000, 1001, SPACING_LINEAR}
+    };
+    create_segmented_sweep_plan(&plan,segments,2,PPS);
+
+    for (int k = 0; k < plan.nbr_points; k++)
+        TEST_ASSERT_EQUAL_INT(k,sweep_plan_bin(&plan,plan.freqs[k]));
+    TEST_ASSERT_EQUAL_INT(-1,sweep_plan_bin(&plan,plan.freqs[3]+1));
+    TEST_ASSERT_EQUAL_INT(3,sweep_plan_nearest_bin(&plan,plan.freqs[3]+1000));
+    TEST_ASSERT_EQUAL_INT(20,sweep_plan_nearest_bin(&plan,plan.freqs[20]-1000));
+    TEST_ASSERT_EQUAL_INT(-1,sweep_plan_nearest_bin(&plan,40000000));
+    destroy_sweep_plan(&plan);
+}
+
+void test_create_sweep_plan_points_exact_count() {
+    struct sweep_plan plan;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,create_sweep_plan_points(&plan,50000000,900000000,250,84));
+
+    TEST_ASSERT_EQUAL_INT(250,plan.nbr_points);
+    TEST_ASSERT_EQUAL_INT(3,plan.nbr_scans);
+    TEST_ASSERT_EQUAL_INT(82,sweep_plan_scan(&plan,2)->pps);
+    TEST_ASSERT_EQUAL_UINT64(900000000,sweep_plan_scan(&plan,2)->stop);
+    TEST_ASSERT_TRUE(plan.uniform);
+    assert_scans_evenly_spaced(&plan);
+    destroy_sweep_plan(&plan);
+}
+
+/**
+ * plan_resolution
+ */
+void test_plan_resolution_hits_count_exactly() {
+    int scans, pps;
+    for (int res = 1; res <= 1000; res++) {
+        TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,plan_resolution(res,PPS,1,1,20e6,1.5e6,&scans,&pps));
+        TEST_ASSERT_LESS_OR_EQUAL_INT(PPS,pps);
+        // fewest scans, with only the last short, by less than the number of scans
+        TEST_ASSERT_EQUAL_INT((res + PPS - 1) / PPS,scans);
+        TEST_ASSERT_TRUE(scans * pps >= res && (scans - 1) * pps < res);
+        TEST_ASSERT_LESS_THAN_INT(scans,scans * pps - res);
+    }
+    plan_resolution(250,PPS,1,1,20e6,1.5e6,&scans,&pps);
+    TEST_ASSERT_EQUAL_INT(3,scans);
+    TEST_ASSERT_EQUAL_INT(84,pps);
+}
+void test_plan_resolution_splits_for_shared_sweeps() {
+    int scans, pps;
+    // one sweep: give each of 4 VNAs a scan
+    plan_resolution(202,PPS,4,1,20e6,1.5e6,&scans,&pps);
+    TEST_ASSERT_EQUAL_INT(4,scans);
+    TEST_ASSERT_EQUAL_INT(51,pps);
+    // two sweeps already keep 4 VNAs busy
+    plan_resolution(202,PPS,4,2,20e6,1.5e6,&scans,&pps);
+    TEST_ASSERT_EQUAL_INT(2,scans);
+    // three sweeps: 4 scans each is 3 rounds rather than 2, worth it if commands are cheap
+    plan_resolution(202,PPS,4,3,20e6,1.5e6,&scans,&pps);
+    TEST_ASSERT_EQUAL_INT(4,scans);
+    plan_resolution(202,PPS,4,3,200e6,0.1e6,&scans,&pps);
+    TEST_ASSERT_EQUAL_INT(2,scans);
+    // sweeps until stopped: extra commands are only extra work
+    plan_resolution(202,PPS,4,0,20e6,1.5e6,&scans,&pps);
+    TEST_ASSERT_EQUAL_INT(2,scans);
+    TEST_ASSERT_EQUAL_INT(101,pps);
+}
+void test_plan_resolution_rejects_invalid() {
+    int scans, pps;
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,plan_resolution(0,PPS,1,1,20e6,1.5e6,&scans,&pps));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,plan_resolution(100,0,1,1,20e6,1.5e6,&scans,&pps));
+}
+
+int main(int argc, char *argv[]) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_create_sweep_plan_matches_even_step);
+    RUN_TEST(test_create_sweep_plan_ends_on_stop);
+    RUN_TEST(test_create_sweep_plan_scans_tile_grid);
+    RUN_TEST(test_create_sweep_plan_handles_wide_band);
+    RUN_TEST(test_create_sweep_plan_rejects_invalid);
+
+    RUN_TEST(test_sweep_plan_bin_finds_every_point);
+    RUN_TEST(test_sweep_plan_bin_rejects_off_grid);
+    RUN_TEST(test_sweep_plan_nearest_bin_snaps);
+
+    RUN_TEST(test_segmented_plan_merges_matching_segments);
+    RUN_TEST(test_segmented_plan_beats_uniform_grid);
+    RUN_TEST(test_segmented_plan_log_spacing);
+    RUN_TEST(test_segmented_plan_rejects_invalid);
+    RUN_TEST(test_segmented_plan_bin_lookup);
+
+    RUN_TEST(test_create_sweep_plan_points_exact_count);
+    RUN_TEST(test_plan_resolution_hits_count_exactly);
+    RUN_TEST(test_plan_resolution_splits_for_shared_sweeps);
+    RUN_TEST(test_plan_resolution_rejects_invalid);
+
+    return UNITY_END();
+}
@@ -0,0 +1,287 @@
+#include "VnaTdr.h"
+#include "ScanFixtures.h"
+#include "unity.h"
+
+#include <math.h>
+
+#define UNITY_INCLUDE_CONFIG_H
+
+#define PPS 101
+#define POINTS 201
+#define STEP_HZ 1000000
+
+struct sweep_plan plan;
+
+void setUp(void) {
+    /* This is run before EACH TEST */
+    // 201 points 1 MHz apart, starting at 1 MHz, in scans of 101 and 100
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_sweep_plan_points(&plan, STEP_HZ, POINTS * STEP_HZ, POINTS, PPS));
+}
+
+void tearDown(void) {
+    /* This is run after EACH TEST */
+    destroy_sweep_plan(&plan);
+}
+
+/**
+ * S11 of a single reflection of gain g, delay seconds away
+ */
+static void reflection(double g, double delay, double *re, double *im) {
+    for (int k = 0; k < plan.nbr_points; k++) {
+        double phase = -2 * M_PI * plan.freqs[k] * delay;
+        re[k] = g * cos(phase);
+        im[k] = g * sin(phase);
+    }
+}
+
+/**
+ * Makes scan scan_index of a sweep of the reflection, for tdr_add_scan
+ */
+static struct datapoint_nanoVNA_H *make_scan(int vna_id, int sweep, int scan_index, uint64_t send_ns,
+                                             const double *re, const double *im) {
+    struct complex values[POINTS];
+    for (int k = 0; k < plan.nbr_points; k++)
+        values[k] = (struct complex){re[k], im[k]};
+    return make_plan_scan(&plan, values, true, vna_id, 1, sweep, scan_index, send_ns);
+}
+
+/**
+ * fft
+ */
+void test_fft_matches_dft() {
+    struct fft_plan fp;
+    int n = 16;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_fft_plan(&fp, n));
+    double re[16], im[16];
+    for (int i = 0; i < n; i++) {
+        re[i] = sin(i * 0.7) + (i % 3);
+        im[i] = cos(i * 1.3) - 0.5 * i;
+    }
+    for (int inverse = 0; inverse <= 1; inverse++) {
+        double out_re[16], out_im[16];
+        memcpy(out_re, re, sizeof(re));
+        memcpy(out_im, im, sizeof(im));
+        fft(&fp, out_re, out_im, inverse);
+        double sign = inverse ? 1 : -1;
+        for (int k = 0; k < n; k++) {
+            double dft_re = 0, dft_im = 0;
+            for (int j = 0; j < n; j++) {
+                double a = sign * 2 * M_PI * j * k / n;
+                dft_re += re[j] * cos(a) - im[j] * sin(a);
+                dft_im += re[j] * sin(a) + im[j] * cos(a);
+            }
+            TEST_ASSERT_FLOAT_WITHIN(1e-4, dft_re, out_re[k]);
+            TEST_ASSERT_FLOAT_WITHIN(1e-4, dft_im, out_im[k]);
+        }
+    }
+    destroy_fft_plan(&fp);
+}
+void test_fft_inverse_undoes_forward() {
+    struct fft_plan fp;
+    int n = 1024;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_fft_plan(&fp, n));
+    double re[1024], im[1024];
+    for (int i = 0; i < n; i++) {
+        re[i] = (i * 37 % 101) / 101.0;
+        im[i] = -(i * 53 % 97) / 97.0;
+    }
+    double out_re[1024], out_im[1024];
+    memcpy(out_re, re, sizeof(re));
+    memcpy(out_im, im, sizeof(im));
+    fft(&fp, out_re, out_im, false);
+    fft(&fp, out_re, out_im, true);
+    for (int i = 0; i < n; i++) {
+        TEST_ASSERT_FLOAT_WITHIN(1e-6, re[i], out_re[i] / n);
+        TEST_ASSERT_FLOAT_WITHIN(1e-6, im[i], out_im[i] / n);
+    }
+    destroy_fft_plan(&fp);
+}
+void test_fft_plan_needs_power_of_two() {
+    struct fft_plan fp;
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, create_fft_plan(&fp, 0));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, create_fft_plan(&fp, 12));
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, create_fft_plan(&fp, 2 * TDR_MAX_SIZE));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_fft_plan(&fp, 2));
+    destroy_fft_plan(&fp);
+}
+
+/**
+ * tdr_transform
+ */
+void test_reflection_peaks_at_its_delay() {
+    const TdrWindow windows[] = {TDR_RECTANGULAR, TDR_HANN, TDR_BLACKMAN};
+    for (int w = 0; w < 3; w++) {
+        struct tdr_stage stage;
+        TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, init_tdr_stage(&stage, &plan, TDR_IMPULSE, windows[w]));
+        TEST_ASSERT_EQUAL_INT(512, stage.fft.size);
+
+        double re[POINTS], im[POINTS];
+        double time_step = 1.0 / (512.0 * STEP_HZ);
+        reflection(0.5, 40 * time_step, re, im);
+        struct tdr_record record;
+        tdr_transform(&stage, re, im, &record);
+
+        TEST_ASSERT_EQUAL_INT(TDR_IMPULSE, record.mode);
+        TEST_ASSERT_EQUAL_INT(512, record.nbr_points);
+        TEST_ASSERT_FLOAT_WITHIN(1e-15, time_step, record.time_step);
+        int peak = 0;
+        for (int i = 1; i < record.nbr_points; i++) {
+            if (hypotf(record.response[i].re, record.response[i].im) > hypotf(record.response[peak].re, record.response[peak].im))
+                peak = i;
+        }
+        TEST_ASSERT_EQUAL_INT(40, peak);
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, 0.5, hypotf(record.response[peak].re, record.response[peak].im));
+        // far from the peak is close to nothing, once windowed
+        if (windows[w] != TDR_RECTANGULAR)
+            TEST_ASSERT_FLOAT_WITHIN(1e-2, 0, hypotf(record.response[300].re, record.response[300].im));
+        TEST_ASSERT_EQUAL_INT(1, stage.transforms);
+        destroy_tdr_stage(&stage);
+    }
+}
+void test_step_is_running_sum_of_impulse() {
+    double re[POINTS], im[POINTS];
+    reflection(-0.25, 3e-9, re, im);
+    struct tdr_stage impulse, step;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, init_tdr_stage(&impulse, &plan, TDR_IMPULSE, TDR_HANN));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, init_tdr_stage(&step, &plan, TDR_STEP, TDR_HANN));
+    struct tdr_record impulse_record, step_record;
+    tdr_transform(&impulse, re, im, &impulse_record);
+    tdr_transform(&step, re, im, &step_record);
+
+    TEST_ASSERT_EQUAL_INT(TDR_STEP, step_record.mode);
+    double sum_re = 0, sum_im = 0;
+    for (int i = 0; i < impulse_record.nbr_points; i++) {
+        sum_re += impulse_record.response[i].re;
+        sum_im += impulse_record.response[i].im;
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, sum_re, step_record.response[i].re);
+        TEST_ASSERT_FLOAT_WITHIN(1e-4, sum_im, step_record.response[i].im);
+    }
+    destroy_tdr_stage(&impulse);
+    destroy_tdr_stage(&step);
+}
+
+/**
+ * tdr_add_scan
+ */
+void test_scans_gathered_into_sweeps() {
+    struct tdr_stage stage;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, init_tdr_stage(&stage, &plan, TDR_IMPULSE, TDR_HANN));
+    double re[POINTS], im[POINTS];
+    reflection(0.8, 10e-9, re, im);
+    struct tdr_record expected;
+    tdr_transform(&stage, re, im, &expected);
+    struct complex direct[512];
+    memcpy(direct, expected.response, sizeof(direct));
+
+    // two VNAs' sweeps interleaved, scans out of order
+    struct datapoint_nanoVNA_H *scans[4] = {
+        make_scan(0, 5, 1, 2000, re, im),
+        make_scan(2, 5, 0, 1500, re, im),
+        make_scan(0, 5, 0, 1000, re, im),
+        make_scan(2, 5, 1, 2500, re, im)
+    };
+    struct tdr_record record;
+    TEST_ASSERT_FALSE(tdr_add_scan(&stage, scans[0], &record));
+    TEST_ASSERT_FALSE(tdr_add_scan(&stage, scans[1], &record));
+    TEST_ASSERT_TRUE(tdr_add_scan(&stage, scans[2], &record));
+    TEST_ASSERT_EQUAL_INT(0, record.vna_id);
+    TEST_ASSERT_EQUAL_INT(1, record.scan_id);
+    TEST_ASSERT_EQUAL_INT(5, record.sweep);
+    TEST_ASSERT_EQUAL_UINT64(1000, record.send_ns);
+    for (int i = 0; i < record.nbr_points; i++) {
+        // scans carry S11 as floats
+        TEST_ASSERT_FLOAT_WITHIN(1e-5, direct[i].re, record.response[i].re);
+        TEST_ASSERT_FLOAT_WITHIN(1e-5, direct[i].im, record.response[i].im);
+    }
+    TEST_ASSERT_TRUE(tdr_add_scan(&stage, scans[3], &record));
+    TEST_ASSERT_EQUAL_INT(2, record.vna_id);
+    TEST_ASSERT_EQUAL_UINT64(1500, record.send_ns);
+    TEST_ASSERT_EQUAL_INT(0, stage.abandoned);
+
+    for (int i = 0; i < 4; i++)
+        free_plan_scan(scans[i]);
+    destroy_tdr_stage(&stage);
+}
+void test_incomplete_sweeps_abandoned() {
+    struct tdr_stage stage;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, init_tdr_stage(&stage, &plan, TDR_IMPULSE, TDR_HANN));
+    double re[POINTS], im[POINTS];
+    reflection(0.8, 10e-9, re, im);
+    struct tdr_record record;
+
+    // the first scan of one more sweep than there are slots
+    for (int sweep = 0; sweep <= SWEEP_TRACKER_SLOTS; sweep++) {
+        struct datapoint_nanoVNA_H *data = make_scan(0, sweep, 0, sweep, re, im);
+        TEST_ASSERT_FALSE(tdr_add_scan(&stage, data, &record));
+        free_plan_scan(data);
+    }
+    TEST_ASSERT_EQUAL_INT(1, stage.abandoned);
+
+    // sweep 0 was given up on, so its last scan starts it again
+    struct datapoint_nanoVNA_H *data = make_scan(0, 0, 1, 0, re, im);
+    TEST_ASSERT_FALSE(tdr_add_scan(&stage, data, &record));
+    free_plan_scan(data);
+    TEST_ASSERT_EQUAL_INT(2, stage.abandoned);
+
+    data = make_scan(0, SWEEP_TRACKER_SLOTS, 1, 0, re, im);
+    TEST_ASSERT_TRUE(tdr_add_scan(&stage, data, &record));
+    TEST_ASSERT_EQUAL_INT(SWEEP_TRACKER_SLOTS, record.sweep);
+    free_plan_scan(data);
+    TEST_ASSERT_EQUAL_INT(1, stage.transforms);
+    destroy_tdr_stage(&stage);
+}
+
+/**
+ * init_tdr_stage
+ */
+void test_stage_needs_even_spacing() {
+    struct sweep_plan log_plan;
+    struct sweep_segment segment = {1000000, 100000000, 201, SPACING_LOG};
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_segmented_sweep_plan(&log_plan, &segment, 1, PPS));
+    struct tdr_stage stage;
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, init_tdr_stage(&stage, &log_plan, TDR_IMPULSE, TDR_HANN));
+    destroy_sweep_plan(&log_plan);
+
+    // an even split that doesn't land on whole Hz is close enough
+    struct sweep_plan odd_plan;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, create_sweep_plan(&odd_plan, 50000000, 900000000, 5, PPS));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, init_tdr_stage(&stage, &odd_plan, TDR_STEP, TDR_BLACKMAN));
+    TEST_ASSERT_EQUAL_INT(1024, stage.fft.size);
+    destroy_tdr_stage(&stage);
+    destroy_sweep_plan(&odd_plan);
+}
+
+/**
+ * parse_tdr_mode and parse_tdr_window
+ */
+void test_parse_names() {
+    TdrMode mode;
+    TdrWindow window;
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, parse_tdr_mode("step", &mode));
+    TEST_ASSERT_EQUAL_INT(TDR_STEP, mode);
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, parse_tdr_mode("lowpass", &mode));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS, parse_tdr_window("blackman", &window));
+    TEST_ASSERT_EQUAL_INT(TDR_BLACKMAN, window);
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE, parse_tdr_window("kaiser", &window));
+    TEST_ASSERT_EQUAL_STRING("impulse", tdr_mode_name(TDR_IMPULSE));
+    TEST_ASSERT_EQUAL_STRING("hann", tdr_window_name(TDR_HANN));
+}
+
+int main(int argc, char *argv[]) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_fft_matches_dft);
+    RUN_TEST(test_fft_inverse_undoes_forward);
+    RUN_TEST(test_fft_plan_needs_power_of_two);
+
+    RUN_TEST(test_reflection_peaks_at_its_delay);
+    RUN_TEST(test_step_is_running_sum_of_impulse);
+
+    RUN_TEST(test_scans_gathered_into_sweeps);
+    RUN_TEST(test_incomplete_sweeps_abandoned);
+
+    RUN_TEST(test_stage_needs_even_spacing);
+    RUN_TEST(test_parse_names);
+
+    return UNITY_END();
+}
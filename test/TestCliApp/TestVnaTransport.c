@@ -0,0 +1,307 @@
+#include "VnaTransport.h"
+#include "unity.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define UNITY_INCLUDE_CONFIG_H
+
+#define TEST_CAPTURE "/tmp/test_vna_transport_capture.bin"
+
+struct vna_transport transport;
+
+void setUp(void) {
+    /* This is run before EACH TEST */
+    transport.ops = NULL;
+}
+
+void tearDown(void) {
+    /* This is run after EACH TEST */
+    close_transport(&transport);
+}
+
+void send_text(const char *text) {
+    transport.ops->write_all(&transport,(const uint8_t*)text,strlen(text));
+}
+
+/**
+ * transport_for_path
+ */
+void test_transport_for_path_picks_by_prefix() {
+    const char *rest;
+    TEST_ASSERT_EQUAL_PTR(&memory_transport,transport_for_path("memory:3",&rest));
+    TEST_ASSERT_EQUAL_STRING("3",rest);
+    TEST_ASSERT_EQUAL_PTR(&replay_transport,transport_for_path("replay:/tmp/a.bin",&rest));
+    TEST_ASSERT_EQUAL_STRING("/tmp/a.bin",rest);
+    TEST_ASSERT_EQUAL_PTR(&tcp_transport,transport_for_path("tcp:localhost:2000",&rest));
+    TEST_ASSERT_EQUAL_STRING("localhost:2000",rest);
+    TEST_ASSERT_EQUAL_PTR(&termios_transport,transport_for_path("/dev/ttyACM0",&rest));
+    TEST_ASSERT_EQUAL_STRING("/dev/ttyACM0",rest);
+}
+
+/**
+ * open_transport
+ */
+void test_open_transport_fails_gracefully() {
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,open_transport(&transport,"/not_a_real_file_name"));
+    TEST_ASSERT_NULL(transport.ops);
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,open_transport(&transport,"replay:/not_a_real_file_name"));
+    TEST_ASSERT_NULL(transport.ops);
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,open_transport(&transport,"tcp:no_port"));
+    TEST_ASSERT_NULL(transport.ops);
+}
+
+/**
+ * memory transport
+ */
+void test_memory_answers_scan_like_firmware() {
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,open_transport(&transport,"memory:0"));
+    send_text("scan 50000000 50000200 3 135\r");
+
+    uint8_t reply[4+3*20];
+    TEST_ASSERT_EQUAL_INT(sizeof(reply),transport.ops->read_some(&transport,reply,sizeof(reply),0));
+    // header is the mask then the number of points
+    TEST_ASSERT_EQUAL_UINT16(135,reply[0] | reply[1] << 8);
+    TEST_ASSERT_EQUAL_UINT16(3,reply[2] | reply[3] << 8);
+    for (int i = 0; i < 3; i++) {
+        uint8_t *pkt = reply + 4 + i*20;
+        uint32_t freq = pkt[0] | pkt[1] << 8 | pkt[2] << 16 | (uint32_t)pkt[3] << 24;
+        TEST_ASSERT_EQUAL_UINT32(50000000+i*100,freq);
+    }
+    // and nothing else
+    TEST_ASSERT_EQUAL_INT(0,transport.ops->read_some(&transport,reply,1,0));
+}
+void test_memory_answers_info() {
+    open_transport(&transport,"memory:0");
+    send_text("info\r");
+
+    char buffer[512] = {0};
+    ssize_t n = transport.ops->read_some(&transport,(uint8_t*)buffer,sizeof(buffer)-1,0);
+    TEST_ASSERT_GREATER_THAN_INT(0,n);
+    TEST_ASSERT_NOT_NULL(strstr(buffer,"NanoVNA-H"));
+}
+void test_memory_same_name_same_data() {
+    struct vna_transport other;
+    open_transport(&transport,"memory:a");
+    open_transport(&other,"memory:a");
+    send_text("scan 50000000 60000000 11 135\r");
+    other.ops->write_all(&other,(const uint8_t*)"scan 50000000 60000000 11 135\r",30);
+
+    uint8_t first[4+11*20], second[4+11*20];
+    transport.ops->read_some(&transport,first,sizeof(first),0);
+    other.ops->read_some(&other,second,sizeof(second),0);
+    TEST_ASSERT_EQUAL_MEMORY(first,second,sizeof(first));
+    close_transport(&other);
+}
+void test_memory_feed_and_flush() {
+    open_transport(&transport,"memory:0");
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,memory_transport_feed(&transport,"abc",3));
+
+    uint8_t buffer[8];
+    TEST_ASSERT_EQUAL_INT(2,transport.ops->read_some(&transport,buffer,2,0));
+    TEST_ASSERT_EQUAL_MEMORY("ab",buffer,2);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,transport.ops->flush(&transport));
+    TEST_ASSERT_EQUAL_INT(0,transport.ops->read_some(&transport,buffer,1,0));
+}
+void test_memory_feed_rejects_other_transports() {
+    struct vna_transport other = {&termios_transport,-1,NULL,{-1,-1}};
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,memory_transport_feed(&other,"abc",3));
+}
+
+/**
+ * termios transport
+ */
+static void ignore_alarm(int sig) {
+    (void)sig;
+}
+void test_termios_write_all_finishes_interrupted_writes() {
+    int fds[2];
+    TEST_ASSERT_EQUAL_INT(0,pipe(fds));
+    int counted[2];
+    TEST_ASSERT_EQUAL_INT(0,pipe(counted));
+    pid_t child = fork();
+    if (child == 0) {
+        // drains the pipe slowly, so the writer keeps blocking
+        close(fds[1]);
+        long total = 0;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(fds[0],buffer,sizeof(buffer))) > 0) {
+            total += n;
+            usleep(100);
+        }
+        write(counted[1],&total,sizeof(total));
+        _exit(0);
+    }
+    close(fds[0]);
+
+    // alarms without SA_RESTART cut blocked writes short
+    struct sigaction action = {0};
+    action.sa_handler = ignore_alarm;
+    struct sigaction previous;
+    sigaction(SIGALRM,&action,&previous);
+    struct itimerval every_ms = {{0,1000},{0,1000}};
+    setitimer(ITIMER_REAL,&every_ms,NULL);
+
+    size_t length = 1 << 20;
+    uint8_t *bytes = calloc(length,1);
+    struct vna_transport serial = {&termios_transport,fds[1],NULL,{-1,-1}};
+    ssize_t written = serial.ops->write_all(&serial,bytes,length);
+
+    struct itimerval off = {{0,0},{0,0}};
+    setitimer(ITIMER_REAL,&off,NULL);
+    sigaction(SIGALRM,&previous,NULL);
+    close(fds[1]);
+    long total = 0;
+    read(counted[0],&total,sizeof(total));
+    waitpid(child,NULL,0);
+    close(counted[0]);
+    close(counted[1]);
+    free(bytes);
+
+    TEST_ASSERT_EQUAL_INT((int)length,(int)written);
+    TEST_ASSERT_EQUAL_INT((int)length,(int)total);
+}
+
+/**
+ * replay transport
+ */
+void write_capture_record(FILE *file, char direction, const char *bytes) {
+    uint32_t length = strlen(bytes);
+    uint8_t header[5] = {direction, length & 0xff, (length >> 8) & 0xff, (length >> 16) & 0xff, length >> 24};
+    fwrite(header,1,sizeof(header),file);
+    fwrite(bytes,1,length,file);
+}
+void test_replay_waits_for_each_command() {
+    FILE *file = fopen(TEST_CAPTURE,"wb");
+    fputs(CAPTURE_MAGIC,file);
+    write_capture_record(file,CAPTURE_SENT,"info\r");
+    write_capture_record(file,CAPTURE_RECEIVED,"one");
+    write_capture_record(file,CAPTURE_SENT,"scan\r");
+    write_capture_record(file,CAPTURE_RECEIVED,"two");
+    fclose(file);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,open_transport(&transport,"replay:" TEST_CAPTURE));
+
+    uint8_t buffer[8];
+    TEST_ASSERT_EQUAL_INT(0,transport.ops->read_some(&transport,buffer,sizeof(buffer),0));
+    send_text("info\r");
+    // stops at the end of the reply, even though more was asked for
+    TEST_ASSERT_EQUAL_INT(3,transport.ops->read_some(&transport,buffer,sizeof(buffer),0));
+    TEST_ASSERT_EQUAL_MEMORY("one",buffer,3);
+    TEST_ASSERT_EQUAL_INT(0,transport.ops->read_some(&transport,buffer,sizeof(buffer),0));
+    send_text("scan\r");
+    TEST_ASSERT_EQUAL_INT(3,transport.ops->read_some(&transport,buffer,sizeof(buffer),0));
+    TEST_ASSERT_EQUAL_MEMORY("two",buffer,3);
+
+    // back to the start
+    send_text("info\r");
+    TEST_ASSERT_EQUAL_INT(3,transport.ops->read_some(&transport,buffer,sizeof(buffer),0));
+    TEST_ASSERT_EQUAL_MEMORY("one",buffer,3);
+    remove(TEST_CAPTURE);
+}
+
+/**
+ * tcp transport
+ */
+void test_tcp_round_trip() {
+    int listener = socket(AF_INET,SOCK_STREAM,0);
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t length = sizeof(address);
+    TEST_ASSERT_EQUAL_INT(0,bind(listener,(struct sockaddr*)&address,sizeof(address)));
+    TEST_ASSERT_EQUAL_INT(0,listen(listener,1));
+    getsockname(listener,(struct sockaddr*)&address,&length);
+
+    // the connection is queued by the kernel, so can be accepted afterwards
+    char path[64];
+    snprintf(path,sizeof(path),"tcp:127.0.0.1:%d",ntohs(address.sin_port));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,open_transport(&transport,path));
+    int peer = accept(listener,NULL,NULL);
+    TEST_ASSERT_GREATER_OR_EQUAL_INT(0,peer);
+
+    send_text("info\r");
+    char received[8] = {0};
+    TEST_ASSERT_EQUAL_INT(5,recv(peer,received,sizeof(received),0));
+    TEST_ASSERT_EQUAL_STRING("info\r",received);
+
+    uint8_t buffer[8];
+    TEST_ASSERT_EQUAL_INT(0,transport.ops->read_some(&transport,buffer,sizeof(buffer),10));
+    send(peer,"ch> ",4,0);
+    TEST_ASSERT_EQUAL_INT(4,transport.ops->read_some(&transport,buffer,sizeof(buffer),1000));
+    TEST_ASSERT_EQUAL_MEMORY("ch> ",buffer,4);
+
+    // a closed connection is an error, not a timeout
+    close(peer);
+    TEST_ASSERT_EQUAL_INT(-1,transport.ops->read_some(&transport,buffer,sizeof(buffer),1000));
+    close(listener);
+}
+
+void test_interrupt_cuts_read_short() {
+    int listener = socket(AF_INET,SOCK_STREAM,0);
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t length = sizeof(address);
+    TEST_ASSERT_EQUAL_INT(0,bind(listener,(struct sockaddr*)&address,sizeof(address)));
+    TEST_ASSERT_EQUAL_INT(0,listen(listener,1));
+    getsockname(listener,(struct sockaddr*)&address,&length);
+
+    char path[64];
+    snprintf(path,sizeof(path),"tcp:127.0.0.1:%d",ntohs(address.sin_port));
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,open_transport(&transport,path));
+    int peer = accept(listener,NULL,NULL);
+    TEST_ASSERT_FALSE(transport_interrupted(&transport));
+
+    // gives up at once rather than waiting out the timeout, even with data waiting
+    send(peer,"ch> ",4,0);
+    TEST_ASSERT_EQUAL_INT(EXIT_SUCCESS,interrupt_transport(&transport));
+    TEST_ASSERT_TRUE(transport_interrupted(&transport));
+    uint8_t buffer[8];
+    errno = 0;
+    TEST_ASSERT_EQUAL_INT(-1,transport.ops->read_some(&transport,buffer,sizeof(buffer),60000));
+    TEST_ASSERT_EQUAL_INT(ECANCELED,errno);
+
+    // stays interrupted until cleared, then reads carry on where they left off
+    TEST_ASSERT_EQUAL_INT(-1,transport.ops->read_some(&transport,buffer,sizeof(buffer),60000));
+    clear_transport_interrupt(&transport);
+    TEST_ASSERT_FALSE(transport_interrupted(&transport));
+    TEST_ASSERT_EQUAL_INT(4,transport.ops->read_some(&transport,buffer,sizeof(buffer),1000));
+    TEST_ASSERT_EQUAL_MEMORY("ch> ",buffer,4);
+
+    close(peer);
+    close(listener);
+}
+void test_interrupt_needs_open_transport() {
+    TEST_ASSERT_EQUAL_INT(EXIT_FAILURE,interrupt_transport(&transport));
+    TEST_ASSERT_FALSE(transport_interrupted(&transport));
+}
+
+int main(int argc, char *argv[]) {
+    UNITY_BEGIN();
+
+    RUN_TEST(test_transport_for_path_picks_by_prefix);
+    RUN_TEST(test_open_transport_fails_gracefully);
+
+    RUN_TEST(test_memory_answers_scan_like_firmware);
+    RUN_TEST(test_memory_answers_info);
+    RUN_TEST(test_memory_same_name_same_data);
+    RUN_TEST(test_memory_feed_and_flush);
+    RUN_TEST(test_memory_feed_rejects_other_transports);
+
+    RUN_TEST(test_termios_write_all_finishes_interrupted_writes);
+
+    RUN_TEST(test_replay_waits_for_each_command);
+
+    RUN_TEST(test_tcp_round_trip);
+    RUN_TEST(test_interrupt_cuts_read_short);
+    RUN_TEST(test_interrupt_needs_open_transport);
+
+    return UNITY_END();
+}
@@ -11,6 +11,7 @@ sys.path.insert(0, str(Path(__file__).parent.parent.parent / "src" / "VnaScanGUI
 import pytest
 import customtkinter as ctk
 from vna_scan_gui import VNAScannerGUI
+from vna_scanner import VNAScanner, VNADataPoint, SweepEvent
 
 
 class TestGUIBasics:
@@ -478,5 +479,47 @@ class TestPlotTypeSelector:
         app.plot_type.set("LogMag (S11)")
 
 
+class TestSweepBoundaries:
+    """Test sweep boundaries are taken from the scanner's sweep numbers"""
+
+    @pytest.fixture(scope="class")
+    def app(self):
+        """Create a GUI instance shared across all tests in this class"""
+        app = VNAScannerGUI()
+        yield app
+        if app.root:
+            app.root.destroy()
+
+    @staticmethod
+    def point(freq, sweep, vna_id=0):
+        return VNADataPoint(frequency=freq, s11_re=0.5, s11_im=0.0, s21_re=0.5, s21_im=0.0,
+                            vna_id=vna_id, time_sent=0.0, time_recv=0.0,
+                            scan_id=0, sweep=sweep, sub_band=0)
+
+    def test_new_sweep_number_archives_sweep(self, app):
+        """A point from a higher sweep archives the current one, even at a new frequency"""
+        app.clear_data()
+        app.on_data_point(self.point(1000, 0))
+        app.on_data_point(self.point(2000, 0))
+        assert len(app.sweep_history) == 0
+        app.on_data_point(self.point(3000, 1))
+        assert len(app.sweep_history) == 1
+        assert set(app.sweep_history[0][0].keys()) == {1000, 2000}
+
+    def test_repeated_frequency_same_sweep_does_not_archive(self, app):
+        """Two VNAs covering the same frequency in one sweep stay in that sweep"""
+        app.clear_data()
+        app.on_data_point(self.point(1000, 0, vna_id=0))
+        app.on_data_point(self.point(1000, 0, vna_id=1))
+        app.on_data_point(self.point(1000, 0, vna_id=0))
+        assert len(app.sweep_history) == 0
+
+    def test_parse_sweep_event(self):
+        """SWEEP lines from the parser become SweepEvents"""
+        event = VNAScanner.parse_sweep_event("SWEEP 20260127_143052 InteractiveMode 0 -1 3 4 5 INCOMPLETE")
+        assert event == SweepEvent(scan_id=0, vna_id=-1, sweep=3, arrived=4, expected=5, complete=False)
+        assert VNAScanner.parse_sweep_event("SWEEP garbage") is None
+
+
 if __name__ == "__main__":
     pytest.main([__file__, "-v"])
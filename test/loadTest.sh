@@ -0,0 +1,30 @@
+#!/bin/bash
+# Runs the scanner against many emulated VNAs to check it keeps up.
+# Build first with: cd ../src/CliApp && make VnaScanMultithreaded NanoVnaEmulator
+#
+# Usage: bash loadTest.sh [nbr_vnas] [sweeps] [emulator options...]
+# e.g.   bash loadTest.sh 24 20 -t 50,80 -j 2000 -d 0.01 -g 0.01 -s 7
+
+NBR_VNAS=${1:-24}
+SWEEPS=${2:-10}
+shift 2 2>/dev/null
+
+echo "____ Starting $NBR_VNAS Emulated VNAs ____"
+./NanoVnaEmulator -n "$NBR_VNAS" -p /tmp/vna%d_load "$@" > /tmp/vna_load_ports.txt &
+EMULATOR_PID=$!
+sleep 1
+
+echo "____ Running Scanner ____"
+cd ../src/CliApp
+START=$(date +%s%N)
+timeout 300s ./VnaScanMultithreaded 50000000 900000000 "$NBR_VNAS" -s "$SWEEPS" 101 "$NBR_VNAS" $(cat /tmp/vna_load_ports.txt) > /dev/null
+STATUS=$?
+END=$(date +%s%N)
+rm -f vna_scan_at_*.s2p
+
+kill $EMULATOR_PID
+wait $EMULATOR_PID 2>/dev/null
+rm -f /tmp/vna_load_ports.txt
+
+echo "Scanner exited with $STATUS after $(( (END - START) / 1000000 )) ms"
+exit $STATUS
@@ -23,4 +23,16 @@ timeout 120s ./TestVnaCommandParser /tmp/vna0_slave /tmp/vna1_slave < testin.txt
 
 chmod +x TestVnaCommunication
 timeout 120s ./TestVnaCommunication /tmp/vna0_slave /tmp/vna1_slave 
-#gdb -ex 'run /tmp/vna0_slave /tmp/vna1_slave' ./TestVnaCommunication
\ No newline at end of file
+#gdb -ex 'run /tmp/vna0_slave /tmp/vna1_slave' ./TestVnaCommunication
+
+chmod +x TestVnaSweepPlan
+timeout 120s ./TestVnaSweepPlan
+
+chmod +x TestVnaTransport
+timeout 120s ./TestVnaTransport
+
+chmod +x TestVnaStreamServer
+timeout 120s ./TestVnaStreamServer
+
+chmod +x TestVnaCalibration
+timeout 120s ./TestVnaCalibration